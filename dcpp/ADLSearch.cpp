@@ -30,12 +30,193 @@
 #include "File.h"
 #include "SimpleXML.h"
 #include "StringTokenizer.h"
+#include "MultiStringSearch.h"
+#include "Thread.h"
 
 #ifdef USE_PCRE
 #include "pcrecpp.h"
 #endif
 
 namespace dcpp {
+
+class ADLSearchManager::RuleSet {
+public:
+    /** The search has to be prepared and active */
+    void add(uint32_t aIndex, const ADLSearch& aSearch) {
+    #ifdef USE_PCRE
+        if(aSearch.bUseRegexp) {
+            pcrecpp::RE_Options options;
+            options.set_utf8(true);
+            options.set_caseless(true);
+            std::shared_ptr<pcrecpp::RE> re(new pcrecpp::RE(aSearch.regexpstring, options));
+            // A broken expression never matches
+            if(re->error().empty())
+                regexps.push_back(make_pair(aIndex, re));
+            return;
+        }
+    #endif
+        if(aSearch.stringSearchList.empty())
+            return;
+
+        Rule r;
+        r.index = aIndex;
+        for(auto i = aSearch.stringSearchList.begin(); i != aSearch.stringSearchList.end(); ++i)
+            r.patterns.push_back(strings.add(i->getPattern()));
+        sort(r.patterns.begin(), r.patterns.end());
+        r.patterns.erase(unique(r.patterns.begin(), r.patterns.end()), r.patterns.end());
+        rules.push_back(r);
+    }
+
+    void compile() {
+        strings.compile();
+        byPattern.assign(strings.size(), vector<uint32_t>());
+        for(uint32_t i = 0; i < rules.size(); ++i) {
+            for(auto j = rules[i].patterns.begin(); j != rules[i].patterns.end(); ++j)
+                byPattern[*j].push_back(i);
+        }
+    }
+
+    bool empty() const {
+    #ifdef USE_PCRE
+        if(!regexps.empty())
+            return false;
+    #endif
+        return rules.empty();
+    }
+
+    /** Adds the searches that match the text to aSearches */
+    void match(const string& aText, vector<uint32_t>& aSearches) const {
+        if(!rules.empty()) {
+            vector<size_t> found;
+            strings.match(aText, found);
+
+            // Only the searches with one of their substrings in the text can match
+            vector<uint32_t> candidates;
+            for(auto i = found.begin(); i != found.end(); ++i)
+                candidates.insert(candidates.end(), byPattern[*i].begin(), byPattern[*i].end());
+            sort(candidates.begin(), candidates.end());
+            candidates.erase(unique(candidates.begin(), candidates.end()), candidates.end());
+
+            for(auto i = candidates.begin(); i != candidates.end(); ++i) {
+                const Rule& r = rules[*i];
+                if(includes(found.begin(), found.end(), r.patterns.begin(), r.patterns.end()))
+                    aSearches.push_back(r.index);
+            }
+        }
+    #ifdef USE_PCRE
+        for(auto i = regexps.begin(); i != regexps.end(); ++i) {
+            if(i->second->FullMatch(aText))
+                aSearches.push_back(i->first);
+        }
+    #endif
+    }
+
+private:
+    struct Rule {
+        uint32_t index;
+        /** All of these have to be found */
+        vector<size_t> patterns;
+    };
+
+    MultiStringSearch strings;
+    vector<Rule> rules;
+    /** The rules each substring is a part of */
+    vector<vector<uint32_t> > byPattern;
+#ifdef USE_PCRE
+    vector<pair<uint32_t, std::shared_ptr<pcrecpp::RE> > > regexps;
+#endif
+};
+
+struct ADLSearchManager::DirMatches {
+    /** (position among the children, search) pairs, ordered by both */
+    vector<pair<uint32_t, uint32_t> > dirs;
+    vector<pair<uint32_t, uint32_t> > files;
+};
+
+/** Finds matches in a part of the listing; several of these share the work of big ones */
+class ADLSearchManager::MatchThread : public Thread {
+public:
+    struct Job {
+        Job(const vector<ADLSearch>& aCollection, const vector<pair<DirectoryListing::Directory*, string> >& aDirs, vector<DirMatches>& aMatches) :
+            collection(aCollection), dirs(aDirs), matches(aMatches), nextDir(0) { }
+
+        RuleSet fileRules;
+        RuleSet pathRules;
+        RuleSet dirRules;
+
+        const vector<ADLSearch>& collection;
+        const vector<pair<DirectoryListing::Directory*, string> >& dirs;
+        vector<DirMatches>& matches;
+
+        CriticalSection cs;
+        size_t nextDir;
+    };
+
+    MatchThread(Job& aJob) : job(aJob) { }
+
+    int run() {
+        setThreadName("ADLSearch");
+        work();
+        return 0;
+    }
+
+    /** Takes batches of directories until none are left; also called inline by the caller */
+    void work() {
+        static const size_t BATCH = 16;
+        while(true) {
+            size_t first;
+            {
+                Lock l(job.cs);
+                first = job.nextDir;
+                job.nextDir = min(first + BATCH, job.dirs.size());
+            }
+            if(first >= job.dirs.size())
+                break;
+            for(size_t i = first; i < min(first + BATCH, job.dirs.size()); ++i)
+                matchDirectory(job.dirs[i].first, job.dirs[i].second, job.matches[i]);
+        }
+    }
+
+private:
+    Job& job;
+
+    void matchDirectory(DirectoryListing::Directory* aDir, const string& aPath, DirMatches& aMatches) {
+        vector<uint32_t> found;
+        if(!job.dirRules.empty()) {
+            for(uint32_t i = 0; i < aDir->directories.size(); ++i) {
+                const string& name = aDir->directories[i]->getName();
+                if(name.empty())
+                    continue;
+                found.clear();
+                job.dirRules.match(name, found);
+                sort(found.begin(), found.end());
+                for(auto j = found.begin(); j != found.end(); ++j)
+                    aMatches.dirs.push_back(make_pair(i, *j));
+            }
+        }
+
+        if(!job.fileRules.empty() || !job.pathRules.empty()) {
+            for(uint32_t i = 0; i < aDir->files.size(); ++i) {
+                const DirectoryListing::File* f = aDir->files[i];
+                if(f->getName().empty())
+                    continue;
+                found.clear();
+                job.fileRules.match(f->getName(), found);
+                if(!job.pathRules.empty())
+                    job.pathRules.match(aPath + "\\" + f->getName(), found);
+                sort(found.begin(), found.end());
+                for(auto j = found.begin(); j != found.end(); ++j) {
+                    const ADLSearch& s = job.collection[*j];
+                    if(s.minFileSize >= 0 && f->getSize() < s.minFileSize * s.GetSizeBase())
+                        continue;
+                    if(s.maxFileSize >= 0 && f->getSize() > s.maxFileSize * s.GetSizeBase())
+                        continue;
+                    aMatches.files.push_back(make_pair(i, *j));
+                }
+            }
+        }
+    }
+};
 ADLSearch::ADLSearch() :
 searchString(_("<Enter string>")),
 isActive(true),
@@ -118,7 +299,7 @@ string ADLSearch::SizeTypeToString(ADLSearch::SizeType t) {
     case SizeGibiBytes: return "GiB";
     }
 }
-int64_t ADLSearch::GetSizeBase() {
+int64_t ADLSearch::GetSizeBase() const {
     switch(typeFileSize) {
     default:
     case SizeBytes:     return (int64_t)1;
@@ -323,7 +504,7 @@ void ADLSearchManager::Save()
     }
 }
 
-void ADLSearchManager::MatchesFile(DestDirList& destDirVector, DirectoryListing::File *currentFile, string& fullPath) {
+void ADLSearchManager::MatchesFile(DestDirList& destDirVector, DirectoryListing::File *currentFile, string& /*fullPath*/, const vector<uint32_t>& searches) {
     // Add to any substructure being stored
     for(auto id = destDirVector.begin(); id != destDirVector.end(); ++id) {
         if(id->subdir != NULL) {
@@ -340,33 +521,31 @@ void ADLSearchManager::MatchesFile(DestDirList& destDirVector, DirectoryListing:
         return;
     }
 
-    string filePath = fullPath + "\\" + currentFile->getName();
-    // Match searches
-    for(auto is = collection.begin(); is != collection.end(); ++is) {
+    // Go through the searches that matched
+    for(auto i = searches.begin(); i != searches.end(); ++i) {
+        auto is = collection.begin() + *i;
         if(destDirVector[is->ddIndex].fileAdded) {
             continue;
         }
-        if(is->MatchesFile(currentFile->getName(), filePath, currentFile->getSize())) {
-            DirectoryListing::File *copyFile = new DirectoryListing::File(*currentFile, true);
-            destDirVector[is->ddIndex].dir->files.push_back(copyFile);
-            destDirVector[is->ddIndex].fileAdded = true;
-
-            if(is->isAutoQueue){
-                try {
-                    QueueManager::getInstance()->add(SETTING(DOWNLOAD_DIRECTORY) + currentFile->getName(),
-                        currentFile->getSize(), currentFile->getTTH(), getUser());
-                } catch(const Exception&) { }
-            }
+        DirectoryListing::File *copyFile = new DirectoryListing::File(*currentFile, true);
+        destDirVector[is->ddIndex].dir->files.push_back(copyFile);
+        destDirVector[is->ddIndex].fileAdded = true;
+
+        if(is->isAutoQueue){
+            try {
+                QueueManager::getInstance()->add(SETTING(DOWNLOAD_DIRECTORY) + currentFile->getName(),
+                    currentFile->getSize(), currentFile->getTTH(), getUser());
+            } catch(const Exception&) { }
+        }
 
-            if(breakOnFirst) {
-                // Found a match, search no more
-                break;
-            }
+        if(breakOnFirst) {
+            // Found a match, search no more
+            break;
         }
     }
 }
 
-void ADLSearchManager::MatchesDirectory(DestDirList& destDirVector, DirectoryListing::Directory* currentDir, string& fullPath) {
+void ADLSearchManager::MatchesDirectory(DestDirList& destDirVector, DirectoryListing::Directory* currentDir, string& fullPath, const vector<uint32_t>& searches) {
     // Add to any substructure being stored
     for(auto id = destDirVector.begin(); id != destDirVector.end(); ++id) {
         if(id->subdir != NULL) {
@@ -382,19 +561,18 @@ void ADLSearchManager::MatchesDirectory(DestDirList& destDirVector, DirectoryLis
         return;
     }
 
-    // Match searches
-    for(auto is = collection.begin(); is != collection.end(); ++is) {
+    // Go through the searches that matched
+    for(auto i = searches.begin(); i != searches.end(); ++i) {
+        auto is = collection.begin() + *i;
         if(destDirVector[is->ddIndex].subdir != NULL) {
             continue;
         }
-        if(is->MatchesDirectory(currentDir->getName())) {
-            destDirVector[is->ddIndex].subdir =
-                new DirectoryListing::AdlDirectory(fullPath, destDirVector[is->ddIndex].dir, currentDir->getName());
-            destDirVector[is->ddIndex].dir->directories.push_back(destDirVector[is->ddIndex].subdir);
-            if(breakOnFirst) {
-                // Found a match, search no more
-                break;
-            }
+        destDirVector[is->ddIndex].subdir =
+            new DirectoryListing::AdlDirectory(fullPath, destDirVector[is->ddIndex].dir, currentDir->getName());
+        destDirVector[is->ddIndex].dir->directories.push_back(destDirVector[is->ddIndex].subdir);
+        if(breakOnFirst) {
+            // Found a match, search no more
+            break;
         }
     }
 }
@@ -455,20 +633,96 @@ void ADLSearchManager::matchListing(DirectoryListing& aDirList) noexcept {
     PrepareDestinationDirectories(destDirs, aDirList.getRoot(), params);
     setBreakOnFirst(BOOLSETTING(ADLS_BREAK_ON_FIRST));
 
+    vector<DirMatches> matches;
+    findMatches(aDirList.getRoot(), matches);
+
     string path(aDirList.getRoot()->getName());
-    matchRecurse(destDirs, aDirList.getRoot(), path);
+    const DirMatches* m = matches.empty() ? NULL : &matches[0];
+    matchRecurse(destDirs, aDirList.getRoot(), path, m);
 
     FinalizeDestinationDirectories(destDirs, aDirList.getRoot());
 }
 
-void ADLSearchManager::matchRecurse(DestDirList &aDestList, DirectoryListing::Directory* aDir, string &aPath) {
-    for(DirectoryListing::Directory::Iter dirIt = aDir->directories.begin(); dirIt != aDir->directories.end(); ++dirIt) {
-        string tmpPath = aPath + "\\" + (*dirIt)->getName();
-        MatchesDirectory(aDestList, *dirIt, tmpPath);
-        matchRecurse(aDestList, *dirIt, tmpPath);
+static void listDirectories(DirectoryListing::Directory* aDir, const string& aPath, vector<pair<DirectoryListing::Directory*, string> >& aDirs) {
+    aDirs.push_back(make_pair(aDir, aPath));
+    for(auto i = aDir->directories.begin(); i != aDir->directories.end(); ++i)
+        listDirectories(*i, aPath + "\\" + (*i)->getName(), aDirs);
+}
+
+void ADLSearchManager::findMatches(DirectoryListing::Directory* root, vector<DirMatches>& aMatches) {
+    vector<pair<DirectoryListing::Directory*, string> > dirs;
+    listDirectories(root, root->getName(), dirs);
+    aMatches.assign(dirs.size(), DirMatches());
+
+    MatchThread::Job job(collection, dirs, aMatches);
+    for(uint32_t i = 0; i < collection.size(); ++i) {
+        const ADLSearch& s = collection[i];
+        if(!s.isActive)
+            continue;
+        switch(s.sourceType) {
+        default:
+        case ADLSearch::OnlyFile:      job.fileRules.add(i, s); break;
+        case ADLSearch::OnlyDirectory: job.dirRules.add(i, s); break;
+        case ADLSearch::FullPath:      job.pathRules.add(i, s); break;
+        }
+    }
+    job.fileRules.compile();
+    job.pathRules.compile();
+    job.dirRules.compile();
+
+    if(job.fileRules.empty() && job.pathRules.empty() && job.dirRules.empty())
+        return;
+
+    // Small lists aren't worth the threads
+    static const size_t THREADS = 4;
+    static const size_t MIN_DIRS = 64;
+
+    vector<MatchThread*> threads;
+    if(dirs.size() >= MIN_DIRS) {
+        for(size_t i = 0; i < THREADS - 1; ++i) {
+            MatchThread* t = new MatchThread(job);
+            try {
+                t->start();
+                threads.push_back(t);
+            } catch(const ThreadException&) {
+                delete t;
+                break;
+            }
+        }
+    }
+
+    // This thread does its share too
+    MatchThread(job).work();
+
+    for(auto i = threads.begin(); i != threads.end(); ++i) {
+        (*i)->join();
+        delete *i;
+    }
+}
+
+void ADLSearchManager::matchRecurse(DestDirList &aDestList, DirectoryListing::Directory* aDir, string &aPath, const DirMatches*& aMatches) {
+    const DirMatches* m = aMatches ? aMatches++ : NULL;
+    vector<uint32_t> searches;
+
+    auto dm = m ? m->dirs.begin() : vector<pair<uint32_t, uint32_t> >::const_iterator();
+    for(uint32_t i = 0; i < aDir->directories.size(); ++i) {
+        DirectoryListing::Directory* d = aDir->directories[i];
+        searches.clear();
+        for(; m && dm != m->dirs.end() && dm->first == i; ++dm)
+            searches.push_back(dm->second);
+
+        string tmpPath = aPath + "\\" + d->getName();
+        MatchesDirectory(aDestList, d, tmpPath, searches);
+        matchRecurse(aDestList, d, tmpPath, aMatches);
     }
-    for(DirectoryListing::File::Iter fileIt = aDir->files.begin(); fileIt != aDir->files.end(); ++fileIt) {
-        MatchesFile(aDestList, *fileIt, aPath);
+
+    auto fm = m ? m->files.begin() : vector<pair<uint32_t, uint32_t> >::const_iterator();
+    for(uint32_t i = 0; i < aDir->files.size(); ++i) {
+        searches.clear();
+        for(; m && fm != m->files.end() && fm->first == i; ++fm)
+            searches.push_back(fm->second);
+
+        MatchesFile(aDestList, aDir->files[i], aPath, searches);
     }
     StepUpDirectory(aDestList);
 }
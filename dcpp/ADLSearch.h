@@ -74,7 +74,7 @@ public:
     SizeType typeFileSize;
     SizeType StringToSizeType(const string& s);
     string SizeTypeToString(SizeType t);
-    int64_t GetSizeBase();
+    int64_t GetSizeBase() const;
 
     // Name of the destination directory (empty = 'ADLSearch') and its index
     string destDir;
@@ -128,12 +128,20 @@ public:
     void matchListing(DirectoryListing& /*aDirList*/) noexcept;
 
 private:
+    // The searches of one source type, compiled to be tried all at once
+    class RuleSet;
+    class MatchThread;
+    // What matched the children of a directory
+    struct DirMatches;
+
     // @internal
-    void matchRecurse(DestDirList& /*aDestList*/, DirectoryListing::Directory* /*aDir*/, string& /*aPath*/);
-    // Search for file match
-    void MatchesFile(DestDirList& destDirVector, DirectoryListing::File *currentFile, string& fullPath);
-    // Search for directory match
-    void MatchesDirectory(DestDirList& destDirVector, DirectoryListing::Directory* currentDir, string& fullPath);
+    void matchRecurse(DestDirList& /*aDestList*/, DirectoryListing::Directory* /*aDir*/, string& /*aPath*/, const DirMatches*& /*aMatches*/);
+    // Find the searches matching every file and directory, the list is in the order matchRecurse visits the directories
+    void findMatches(DirectoryListing::Directory* root, vector<DirMatches>& aMatches);
+    // Add a file the searches matched
+    void MatchesFile(DestDirList& destDirVector, DirectoryListing::File *currentFile, string& fullPath, const vector<uint32_t>& searches);
+    // Add a directory the searches matched
+    void MatchesDirectory(DestDirList& destDirVector, DirectoryListing::Directory* currentDir, string& fullPath, const vector<uint32_t>& searches);
     // Step up directory
     void StepUpDirectory(DestDirList& destDirVector);
     // Prepare destination directory indexing
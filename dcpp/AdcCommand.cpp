@@ -23,14 +23,14 @@
 
 namespace dcpp {
 
-AdcCommand::AdcCommand(uint32_t aCmd, char aType /* = TYPE_CLIENT */) : cmdInt(aCmd), from(0), type(aType) { }
-AdcCommand::AdcCommand(uint32_t aCmd, const uint32_t aTarget, char aType) : cmdInt(aCmd), from(0), to(aTarget), type(aType) { }
-AdcCommand::AdcCommand(Severity sev, Error err, const string& desc, char aType /* = TYPE_CLIENT */) : cmdInt(CMD_STA), from(0), type(aType) {
+AdcCommand::AdcCommand(uint32_t aCmd, char aType /* = TYPE_CLIENT */) : packed(false), cmdInt(aCmd), from(0), type(aType) { }
+AdcCommand::AdcCommand(uint32_t aCmd, const uint32_t aTarget, char aType) : packed(false), cmdInt(aCmd), from(0), to(aTarget), type(aType) { }
+AdcCommand::AdcCommand(Severity sev, Error err, const string& desc, char aType /* = TYPE_CLIENT */) : packed(false), cmdInt(CMD_STA), from(0), type(aType) {
     addParam((sev == SEV_SUCCESS) ? "000" : Util::toString(sev * 100 + err));
     addParam(desc);
 }
 
-AdcCommand::AdcCommand(const string& aLine, bool nmdc /* = false */) : cmdInt(0), type(TYPE_CLIENT) {
+AdcCommand::AdcCommand(const string& aLine, bool nmdc /* = false */) : packed(false), cmdInt(0), type(TYPE_CLIENT) {
     parse(aLine, nmdc);
 }
 
@@ -60,90 +60,46 @@ void AdcCommand::parse(const string& aLine, bool nmdc /* = false */) {
         throw ParseException("Invalid type");
     }
 
-    if(type == TYPE_INFO) {
-        from = HUB_SID;
-    }
+    from = (type == TYPE_INFO) ? HUB_SID : 0;
+    to = 0;
+    features.clear();
+    parameters.clear();
+    tokens.clear();
+    packed = true;
 
-    string::size_type len = aLine.length();
-    const char* buf = aLine.c_str();
-    string cur;
-    cur.reserve(128);
+    // Parameters only point into the line, they're unescaped when somebody asks for them
+    line = aLine;
+    string::size_type len = line.length();
+    const char* buf = line.c_str();
 
     bool toSet = false;
     bool featureSet = false;
     bool fromSet = nmdc; // $ADCxxx never have a from CID...
 
+    Token cur = { i, 0, false };
     while(i < len) {
         switch(buf[i]) {
         case '\\':
             ++i;
             if(i == len)
                 throw ParseException("Escape at eol");
-            if(buf[i] == 's')
-                cur += ' ';
-            else if(buf[i] == 'n')
-                cur += '\n';
-            else if(buf[i] == '\\')
-                cur += '\\';
-            else if(buf[i] == ' ' && nmdc)  // $ADCGET escaping, leftover from old specs
-                cur += ' ';
-            else
+            if(buf[i] != 's' && buf[i] != 'n' && buf[i] != '\\' && !(buf[i] == ' ' && nmdc))  // "\ " is $ADCGET escaping, leftover from old specs
                 throw ParseException("Unknown escape");
+            cur.escaped = true;
             break;
         case ' ':
             // New parameter...
-            {
-                if((type == TYPE_BROADCAST || type == TYPE_DIRECT || type == TYPE_ECHO || type == TYPE_FEATURE) && !fromSet) {
-                    if(cur.length() != 4) {
-                        throw ParseException("Invalid SID length");
-                    }
-                    from = toSID(cur);
-                    fromSet = true;
-                } else if((type == TYPE_DIRECT || type == TYPE_ECHO) && !toSet) {
-                    if(cur.length() != 4) {
-                        throw ParseException("Invalid SID length");
-                    }
-                    to = toSID(cur);
-                    toSet = true;
-                } else if(type == TYPE_FEATURE && !featureSet) {
-                    if(cur.length() % 5 != 0) {
-                        throw ParseException("Invalid feature length");
-                    }
-                    // Skip...
-                    featureSet = true;
-                } else {
-                    parameters.push_back(cur);
-                }
-                cur.clear();
-            }
+            cur.len = i - cur.pos;
+            addToken(cur, fromSet, toSet, featureSet);
+            cur.pos = i + 1;
+            cur.escaped = false;
             break;
-        default:
-            cur += buf[i];
         }
         ++i;
     }
-    if(!cur.empty()) {
-        if((type == TYPE_BROADCAST || type == TYPE_DIRECT || type == TYPE_ECHO || type == TYPE_FEATURE) && !fromSet) {
-            if(cur.length() != 4) {
-                throw ParseException("Invalid SID length");
-            }
-            from = toSID(cur);
-            fromSet = true;
-        } else if((type == TYPE_DIRECT || type == TYPE_ECHO) && !toSet) {
-            if(cur.length() != 4) {
-                throw ParseException("Invalid SID length");
-            }
-            to = toSID(cur);
-            toSet = true;
-        } else if(type == TYPE_FEATURE && !featureSet) {
-            if(cur.length() % 5 != 0) {
-                throw ParseException("Invalid feature length");
-            }
-            // Skip...
-            featureSet = true;
-        } else {
-            parameters.push_back(cur);
-        }
+    if(len > cur.pos) {
+        cur.len = len - cur.pos;
+        addToken(cur, fromSet, toSet, featureSet);
     }
 
     if((type == TYPE_BROADCAST || type == TYPE_DIRECT || type == TYPE_ECHO || type == TYPE_FEATURE) && !fromSet) {
@@ -159,6 +115,65 @@ void AdcCommand::parse(const string& aLine, bool nmdc /* = false */) {
     }
 }
 
+void AdcCommand::addToken(const Token& t, bool& fromSet, bool& toSet, bool& featureSet) {
+    if((type == TYPE_BROADCAST || type == TYPE_DIRECT || type == TYPE_ECHO || type == TYPE_FEATURE) && !fromSet) {
+        string sid;
+        unescape(t, sid);
+        if(sid.length() != 4) {
+            throw ParseException("Invalid SID length");
+        }
+        from = toSID(sid);
+        fromSet = true;
+    } else if((type == TYPE_DIRECT || type == TYPE_ECHO) && !toSet) {
+        string sid;
+        unescape(t, sid);
+        if(sid.length() != 4) {
+            throw ParseException("Invalid SID length");
+        }
+        to = toSID(sid);
+        toSet = true;
+    } else if(type == TYPE_FEATURE && !featureSet) {
+        string feat;
+        unescape(t, feat);
+        if(feat.length() % 5 != 0) {
+            throw ParseException("Invalid feature length");
+        }
+        // Skip...
+        featureSet = true;
+    } else {
+        tokens.push_back(t);
+    }
+}
+
+void AdcCommand::unescape(const Token& t, string& ret) const {
+    const char* p = line.data() + t.pos;
+    if(!t.escaped) {
+        ret.assign(p, t.len);
+        return;
+    }
+
+    // The escapes were checked by parse()
+    ret.clear();
+    for(const char* end = p + t.len; p < end; ++p) {
+        if(*p == '\\') {
+            ++p;
+            ret += (*p == 's') ? ' ' : (*p == 'n') ? '\n' : *p;
+        } else {
+            ret += *p;
+        }
+    }
+}
+
+void AdcCommand::unpack() const {
+    if(!packed)
+        return;
+
+    parameters.resize(tokens.size());
+    for(size_t i = 0; i < tokens.size(); ++i)
+        unescape(tokens[i], parameters[i]);
+    packed = false;
+}
+
 string AdcCommand::toString(const CID& aCID) const {
     return getHeaderString(aCID) + getParamString(false);
 }
@@ -241,7 +256,31 @@ const string& AdcCommand::getParam(size_t n) const {
     return getParameters().size() > n ? getParameters()[n] : Util::emptyString;
 }
 
+void AdcCommand::getParam(size_t n, string& ret) const {
+    if(packed) {
+        if(n < tokens.size())
+            unescape(tokens[n], ret);
+        else
+            ret.clear();
+    } else {
+        ret = getParam(n);
+    }
+}
+
 bool AdcCommand::getParam(const char* name, size_t start, string& ret) const {
+    if(packed) {
+        // Names are never escaped
+        for(auto i = start; i < tokens.size(); ++i) {
+            const Token& t = tokens[i];
+            if(t.len >= 2 && line.compare(t.pos, 2, name, 2) == 0) {
+                Token value = { t.pos + 2, t.len - 2, t.escaped };
+                unescape(value, ret);
+                return true;
+            }
+        }
+        return false;
+    }
+
     for(auto i = start; i < getParameters().size(); ++i) {
         if(toCode(name) == toCode(getParameters()[i].c_str())) {
             ret = getParameters()[i].substr(2);
@@ -252,6 +291,15 @@ bool AdcCommand::getParam(const char* name, size_t start, string& ret) const {
 }
 
 bool AdcCommand::hasFlag(const char* name, size_t start) const {
+    if(packed) {
+        for(auto i = start; i < tokens.size(); ++i) {
+            const Token& t = tokens[i];
+            if(t.len == 3 && line.compare(t.pos, 2, name, 2) == 0 && line[t.pos + 2] == '1')
+                return true;
+        }
+        return false;
+    }
+
     for(auto i = start; i < getParameters().size(); ++i) {
         if(toCode(name) == toCode(getParameters()[i].c_str()) &&
             getParameters()[i].size() == 3 &&
@@ -18,6 +18,8 @@
 
 #pragma once
 
+#include <atomic>
+
 #include "typedefs.h"
 #include "Exception.h"
 #include "Util.h"
@@ -130,22 +132,28 @@ public:
     const string& getFeatures() const { return features; }
     AdcCommand& setFeatures(const string& feat) { features = feat; return *this; }
 
-    StringList& getParameters() { return parameters; }
-    const StringList& getParameters() const { return parameters; }
+    /** The parameters of a parsed command are unescaped when first asked for */
+    StringList& getParameters() { unpack(); return parameters; }
+    const StringList& getParameters() const { unpack(); return parameters; }
+    size_t getParamCount() const { return packed ? tokens.size() : parameters.size(); }
 
     string toString(const CID& aCID) const;
     string toString(uint32_t sid, bool nmdc = false) const;
 
     AdcCommand& addParam(const string& name, const string& value) {
+        unpack();
         parameters.push_back(name);
         parameters.back() += value;
         return *this;
     }
     AdcCommand& addParam(const string& str) {
+        unpack();
         parameters.push_back(str);
         return *this;
     }
     const string& getParam(size_t n) const;
+    /** Unescapes parameter n into ret without building the whole parameter list */
+    void getParam(size_t n, string& ret) const;
     /** Return a named parameter where the name is a two-letter code */
     bool getParam(const char* name, size_t start, string& ret) const;
     bool hasFlag(const char* name, size_t start) const;
@@ -164,7 +172,20 @@ private:
     string getHeaderString(const CID& cid) const;
     string getHeaderString(uint32_t sid, bool nmdc) const;
     string getParamString(bool nmdc) const;
-    StringList parameters;
+
+    /** A parameter of a parsed command, still escaped in line */
+    struct Token {
+        string::size_type pos;
+        string::size_type len;
+        bool escaped;
+    };
+
+    /** The parsed line; kept so that parsing again reuses its buffer */
+    string line;
+    vector<Token> tokens;
+    /** Whether the parameters are only in tokens yet */
+    mutable bool packed;
+    mutable StringList parameters;
     string features;
     union {
         char cmdChar[4];
@@ -175,14 +196,36 @@ private:
     uint32_t to;
     char type;
 
+    void addToken(const Token& t, bool& fromSet, bool& toSet, bool& featureSet);
+    void unescape(const Token& t, string& ret) const;
+    void unpack() const;
 };
 
 template<class T>
 class CommandHandler {
 public:
+    CommandHandler() : cmd(0), busy(false) { }
+
     void dispatch(const string& aLine, bool nmdc = false) {
+        if(busy.exchange(true)) {
+            // From another thread or one of the handlers
+            AdcCommand c(0);
+            dispatch(c, aLine, nmdc);
+            return;
+        }
+
+        dispatch(cmd, aLine, nmdc);
+        busy = false;
+    }
+
+private:
+    /** Parsed into for every line, so that its buffers are reused */
+    AdcCommand cmd;
+    std::atomic<bool> busy;
+
+    void dispatch(AdcCommand& c, const string& aLine, bool nmdc) {
         try {
-            AdcCommand c(aLine, nmdc);
+            c.parse(aLine, nmdc);
 
 #define C(n) case AdcCommand::CMD_##n: ((T*)this)->handle(AdcCommand::n(), c); break;
             switch(c.getCommand()) {
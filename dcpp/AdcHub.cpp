@@ -138,7 +138,7 @@ void AdcHub::clearUsers() {
 }
 
 void AdcHub::handle(AdcCommand::INF, AdcCommand& c) noexcept {
-    if(c.getParameters().empty())
+    if(c.getParamCount() == 0)
         return;
 
     string cid;
@@ -172,11 +172,13 @@ void AdcHub::handle(AdcCommand::INF, AdcCommand& c) noexcept {
         return;
     }
 
-    for(auto i = c.getParameters().begin(); i != c.getParameters().end(); ++i) {
-        if(i->length() < 2)
+    string param;
+    for(size_t i = 0, n = c.getParamCount(); i < n; ++i) {
+        c.getParam(i, param);
+        if(param.length() < 2)
             continue;
 
-        u->getIdentity().set(i->c_str(), i->substr(2));
+        u->getIdentity().set(param.c_str(), param.substr(2));
     }
 
     if(u->getIdentity().isBot()) {
@@ -193,7 +195,8 @@ void AdcHub::handle(AdcCommand::INF, AdcCommand& c) noexcept {
         u->getIdentity().setConnection(str(F_("%1%/s") % Util::formatBytes(u->getIdentity().get("US"))));
     }
 
-    if(u->getUser() == getMyIdentity().getUser()) {
+    bool self = u->getUser() == getMyIdentity().getUser();
+    if(self) {
         state = STATE_NORMAL;
         setAutoReconnect(true);
         setMyIdentity(u->getIdentity());
@@ -204,7 +207,13 @@ void AdcHub::handle(AdcCommand::INF, AdcCommand& c) noexcept {
         setHubIdentity(u->getIdentity());
         fire(ClientListener::HubUpdated(), this);
     } else {
-        fire(ClientListener::UserUpdated(), this, *u);
+        userUpdated(*u);
+    }
+
+    if(self && batchUpdates) {
+        // Our own INF comes last after the user list
+        flushUpdates();
+        batchUpdates = false;
     }
 }
 
@@ -241,7 +250,7 @@ void AdcHub::handle(AdcCommand::SID, AdcCommand& c) noexcept {
         return;
     }
 
-    if(c.getParameters().empty())
+    if(c.getParamCount() == 0)
         return;
 
     sid = AdcCommand::toSID(c.getParam(0));
@@ -251,7 +260,7 @@ void AdcHub::handle(AdcCommand::SID, AdcCommand& c) noexcept {
 }
 
 void AdcHub::handle(AdcCommand::MSG, AdcCommand& c) noexcept {
-    if(c.getParameters().empty())
+    if(c.getParamCount() == 0)
         return;
 
         ChatMessage message = { c.getParam(0), findUser(c.getFrom()) };
@@ -279,7 +288,7 @@ void AdcHub::handle(AdcCommand::MSG, AdcCommand& c) noexcept {
 }
 
 void AdcHub::handle(AdcCommand::GPA, AdcCommand& c) noexcept {
-    if(c.getParameters().empty())
+    if(c.getParamCount() == 0)
         return;
     salt = c.getParam(0);
     state = STATE_VERIFY;
@@ -338,7 +347,7 @@ void AdcHub::handle(AdcCommand::CTM, AdcCommand& c) noexcept {
     OnlineUser* u = findUser(c.getFrom());
     if(!u || u->getUser() == ClientManager::getInstance()->getMe())
         return;
-    if(c.getParameters().size() < 3)
+    if(c.getParamCount() < 3)
         return;
 
     const string& protocol = c.getParam(0);
@@ -364,7 +373,7 @@ void AdcHub::handle(AdcCommand::CTM, AdcCommand& c) noexcept {
 }
 
 void AdcHub::handle(AdcCommand::RCM, AdcCommand& c) noexcept {
-    if(c.getParameters().size() < 2) {
+    if(c.getParamCount() < 2) {
         return;
     }
 
@@ -402,7 +411,7 @@ void AdcHub::handle(AdcCommand::RCM, AdcCommand& c) noexcept {
 }
 
 void AdcHub::handle(AdcCommand::CMD, AdcCommand& c) noexcept {
-    if(c.getParameters().empty())
+    if(c.getParamCount() == 0)
         return;
     const string& name = c.getParam(0);
     bool rem = c.hasFlag("RM", 1);
@@ -456,7 +465,7 @@ void AdcHub::sendUDP(const AdcCommand& cmd) noexcept {
 }
 
 void AdcHub::handle(AdcCommand::STA, AdcCommand& c) noexcept {
-    if(c.getParameters().size() < 2)
+    if(c.getParamCount() < 2)
         return;
 
     OnlineUser* u = c.getFrom() == AdcCommand::HUB_SID ? &getUser(c.getFrom(), CID()) : findUser(c.getFrom());
@@ -533,8 +542,8 @@ void AdcHub::handle(AdcCommand::PSR, AdcCommand& c) noexcept {
 }
 
 void AdcHub::handle(AdcCommand::GET, AdcCommand& c) noexcept {
-    if(c.getParameters().size() < 5) {
-        if(c.getParameters().size() > 0) {
+    if(c.getParamCount() < 5) {
+        if(c.getParamCount() > 0) {
             if(c.getParam(0) == "blom") {
                 send(AdcCommand(AdcCommand::SEV_FATAL, AdcCommand::ERROR_PROTOCOL_GENERIC,
                         "Too few parameters for blom", AdcCommand::TYPE_HUB));
@@ -594,7 +603,7 @@ void AdcHub::handle(AdcCommand::NAT, AdcCommand& c) noexcept {
         return;
 
     OnlineUser* u = findUser(c.getFrom());
-    if(!u || u->getUser() == ClientManager::getInstance()->getMe() || c.getParameters().size() < 3)
+    if(!u || u->getUser() == ClientManager::getInstance()->getMe() || c.getParamCount() < 3)
         return;
 
     const string& protocol = c.getParam(0);
@@ -628,7 +637,7 @@ void AdcHub::handle(AdcCommand::RNT, AdcCommand& c) noexcept {
         return;
 
     OnlineUser* u = findUser(c.getFrom());
-    if(!u || u->getUser() == ClientManager::getInstance()->getMe() || c.getParameters().size() < 3)
+    if(!u || u->getUser() == ClientManager::getInstance()->getMe() || c.getParamCount() < 3)
         return;
 
     const string& protocol = c.getParam(0);
@@ -1044,7 +1053,7 @@ void AdcHub::info(bool /*alwaysSend*/) {
 
     addParam(lastInfoMap, c, "SU", su);
 
-    if(!c.getParameters().empty()) {
+    if(c.getParamCount() > 0) {
         send(c);
     }
 }
@@ -1128,6 +1137,9 @@ void AdcHub::on(Line l, const string& aLine) noexcept {
     if (onClientMessage(this, aLine))
         return;
 #endif
+    // Whatever else comes may refer to the users of the batch
+    if(aLine.compare(0, 4, "BINF") != 0)
+        flushUpdates();
     dispatch(aLine);
 }
 
@@ -20,87 +20,844 @@
 
 #include "BZUtils.h"
 #include "Exception.h"
+#include "Streams.h"
 #include "format.h"
+#include "CriticalSection.h"
+#include "Semaphore.h"
+#include "Thread.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 namespace dcpp {
 
 using std::max;
 
-BZFilter::BZFilter() {
-    memset(&zs, 0, sizeof(zs));
+namespace {
 
-    if(BZ2_bzCompressInit(&zs, 9, 0, 30) != BZ_OK) {
-        throw Exception(_("Error during compression"));
+const uint64_t BLOCK_MAGIC = 0x314159265359ULL;
+const uint64_t END_MAGIC = 0x177245385090ULL;
+const uint64_t MAGIC_MASK = 0xffffffffffffULL;
+/** "BZh9", the level of the streams made here */
+const size_t HEADER_BITS = 32;
+const size_t END_BITS = 48 + 32;
+
+/**
+ * Threads working on the blocks of a stream, no more than there are cores:
+ * the decompressor of each wants a few MiB of cache to itself.
+ */
+size_t maxThreads() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    long cores = info.dwNumberOfProcessors;
+#else
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return (size_t)max(1L, min(cores, 4L));
+}
+
+const size_t THREADS = maxThreads();
+/** Blocks on their way at most, so memory stays bounded while the other end is slow */
+const size_t MAX_JOBS = THREADS * 3;
+
+/** @return n <= 64 bits starting at bit start, most significant first */
+uint64_t getBits(const uint8_t* p, uint64_t start, size_t n) {
+    uint64_t v = 0;
+    for(size_t i = 0; i < n; ++i) {
+        uint64_t bit = start + i;
+        v = (v << 1) | ((p[bit / 8] >> (7 - bit % 8)) & 1);
+    }
+    return v;
+}
+
+/** @return 8 bits starting at bit start, zero filled past the end */
+inline uint8_t getByte(const uint8_t* p, size_t size, uint64_t start) {
+    size_t i = start / 8;
+    unsigned s = start % 8;
+    uint8_t v = (uint8_t)(p[i] << s);
+    if(s > 0 && i + 1 < size)
+        v |= p[i + 1] >> (8 - s);
+    return v;
+}
+
+inline uint32_t rotateCrc(uint32_t crc, uint32_t n) {
+    n %= 32;
+    return n == 0 ? crc : (crc << n) | (crc >> (32 - n));
+}
+
+/** Append bits [start, start + n) of src after the bits already in dst */
+void appendBits(ByteVector& dst, uint64_t& bits, const uint8_t* src, size_t srcSize, uint64_t start, uint64_t n) {
+    dst.resize((bits + n + 7) / 8);
+    uint8_t* d = &dst[0];
+
+    if(bits % 8 == 0 && start % 8 == 0) {
+        memcpy(d + bits / 8, src + start / 8, (n + 7) / 8);
+        // Bits past the end of the source range have to stay zero
+        if(n % 8 != 0)
+            d[(bits + n) / 8] &= (uint8_t)(0xff << (8 - n % 8));
+        bits += n;
+        return;
+    }
+
+    while(n > 0) {
+        unsigned take = (unsigned)min(n, (uint64_t)8);
+        uint8_t v = getByte(src, srcSize, start) & (uint8_t)(0xff << (8 - take));
+        unsigned o = bits % 8;
+        d[bits / 8] |= v >> o;
+        if(o + take > 8)
+            d[bits / 8 + 1] |= (uint8_t)(v << (8 - o));
+
+        bits += take;
+        start += take;
+        n -= take;
+    }
+}
+
+void appendHeader(ByteVector& dst, uint64_t& bits) {
+    const uint8_t header[] = { 'B', 'Z', 'h', '9' };
+    appendBits(dst, bits, header, sizeof(header), 0, HEADER_BITS);
+}
+
+void appendTrailer(ByteVector& dst, uint64_t& bits, uint32_t crc) {
+    uint8_t trailer[10];
+    for(int i = 0; i < 6; ++i)
+        trailer[i] = (uint8_t)(END_MAGIC >> (40 - i * 8));
+    for(int i = 0; i < 4; ++i)
+        trailer[6 + i] = (uint8_t)(crc >> (24 - i * 8));
+    appendBits(dst, bits, trailer, sizeof(trailer), 0, END_BITS);
+}
+
+/**
+ * For each byte value, the bit offsets at which a signature starting in the
+ * byte before would put that value into this byte. Most bytes can't be
+ * part of one at all, which saves looking at them any closer.
+ */
+struct SignatureTable {
+    SignatureTable() {
+        memset(shifts, 0, sizeof(shifts));
+        for(unsigned s = 0; s < 8; ++s) {
+            shifts[(BLOCK_MAGIC >> (32 + s)) & 0xff] |= (uint8_t)(1 << s);
+            shifts[(END_MAGIC >> (32 + s)) & 0xff] |= (uint8_t)(1 << s);
+        }
+    }
+    uint8_t shifts[256];
+};
+
+const SignatureTable signatures;
+
+/** A block's worth of work for BZThreads */
+class BZJob {
+public:
+    BZJob() : finished(false) { }
+    virtual ~BZJob() { }
+
+    virtual void run() = 0;
+
+    /** Set when run() failed */
+    string error;
+
+private:
+    friend class BZThreads;
+    Semaphore done;
+    bool finished;
+};
+
+/**
+ * A few threads for the blocks of a stream, started as the blocks come. Jobs
+ * are handed out in the order they're added and taken back in the same order
+ * by the one thread that added them.
+ */
+class BZThreads : boost::noncopyable {
+public:
+    BZThreads() : stop(false) { }
+
+    ~BZThreads() {
+        {
+            Lock l(cs);
+            stop = true;
+            todo.clear();
+        }
+        for(auto i = threads.begin(); i != threads.end(); ++i)
+            work.signal();
+        for(auto i = threads.begin(); i != threads.end(); ++i) {
+            (*i)->join();
+            delete *i;
+        }
+        for(auto i = jobs.begin(); i != jobs.end(); ++i)
+            delete *i;
+    }
+
+    void add(BZJob* aJob) {
+        jobs.push_back(aJob);
+        {
+            Lock l(cs);
+            todo.push_back(aJob);
+        }
+
+        if(threads.size() < THREADS && threads.size() < jobs.size()) {
+            Worker* w = new Worker(*this);
+            try {
+                w->start();
+                threads.push_back(w);
+            } catch(const ThreadException&) {
+                delete w;
+            }
+        }
+
+        if(threads.empty()) {
+            // No threads to be had, so the job is done right away
+            {
+                Lock l(cs);
+                todo.pop_back();
+            }
+            run(aJob);
+        } else {
+            work.signal();
+        }
+    }
+
+    bool empty() const { return jobs.empty(); }
+    size_t size() const { return jobs.size(); }
+    BZJob* get(size_t i) const { return jobs[i]; }
+    BZJob* front() const { return jobs.front(); }
+
+    bool isDone(BZJob* aJob) {
+        if(!aJob->finished && aJob->done.wait(0))
+            aJob->finished = true;
+        return aJob->finished;
     }
+
+    void wait(BZJob* aJob) {
+        if(!aJob->finished) {
+            aJob->done.wait();
+            aJob->finished = true;
+        }
+    }
+
+    /** Remove a job that is done */
+    void erase(size_t i) {
+        dcassert(jobs[i]->finished);
+        delete jobs[i];
+        jobs.erase(jobs.begin() + i);
+    }
+    void pop() { erase(0); }
+
+    static void run(BZJob* aJob) {
+        try {
+            aJob->run();
+        } catch(const Exception& e) {
+            aJob->error = e.getError();
+        }
+        aJob->done.signal();
+    }
+
+private:
+    class Worker : public Thread {
+    public:
+        Worker(BZThreads& aOwner) : owner(aOwner) { }
+
+        int run() {
+            setThreadName("BZip2");
+            while(true) {
+                owner.work.wait();
+
+                BZJob* job;
+                {
+                    Lock l(owner.cs);
+                    if(owner.todo.empty()) {
+                        if(owner.stop)
+                            break;
+                        continue;
+                    }
+                    job = owner.todo.front();
+                    owner.todo.pop_front();
+                }
+                BZThreads::run(job);
+            }
+            return 0;
+        }
+
+    private:
+        BZThreads& owner;
+    };
+
+    /** Everything not taken back yet, only touched by the owning thread */
+    deque<BZJob*> jobs;
+    vector<Worker*> threads;
+
+    CriticalSection cs;
+    deque<BZJob*> todo;
+    Semaphore work;
+    bool stop;
+};
+
+class CompressJob : public BZJob {
+public:
+    CompressJob(const void* aData, size_t aLen) : data(aData), len(aLen) { }
+    /** Takes the data over */
+    CompressJob(string& aData) : len(aData.size()) { own.swap(aData); data = own.data(); }
+
+    void run() { blocks.compress(data, len); }
+
+    BZBlocks blocks;
+
+private:
+    string own;
+    const void* data;
+    size_t len;
+};
+
+class DecompressJob : public BZJob {
+public:
+    /** Output held at once; a block of long runs can expand to some 45 MiB */
+    enum { SLICE = 1024 * 1024 };
+
+    DecompressJob() : bits(0), crc(0), end(false), more(false), decoding(false) {
+        memset(&zs, 0, sizeof(zs));
+    }
+    ~DecompressJob() { stop(); }
+
+    /** Give the block a stream of its own and decompress the first slice of it */
+    void run() {
+        if(end)
+            return;
+
+        stop();
+        in.clear();
+        uint64_t inBits = 0;
+        in.reserve(raw.size() + 16);
+        appendHeader(in, inBits);
+        appendBits(in, inBits, &raw[0], raw.size(), 0, bits);
+        // A single block stream, so the combined CRC is the block's
+        appendTrailer(in, inBits, crc);
+
+        if(BZ2_bzDecompressInit(&zs, 0, 0) != BZ_OK)
+            throw Exception(_("Error during decompression"));
+        decoding = true;
+
+        zs.next_in = (char*)&in[0];
+        zs.avail_in = in.size();
+        next();
+    }
+
+    /** Decompress the next slice into out, in place of the one before */
+    void next() {
+        out.resize(SLICE);
+        zs.next_out = (char*)&out[0];
+        zs.avail_out = out.size();
+        int err = BZ2_bzDecompress(&zs);
+        out.resize(out.size() - zs.avail_out);
+
+        more = err == BZ_OK && zs.avail_out == 0;
+        if(!more) {
+            stop();
+            // All the input is there, so anything but the end means trouble
+            if(err != BZ_STREAM_END)
+                throw Exception(_("Error during decompression"));
+        }
+    }
+
+    /** The block, starting with its signature */
+    ByteVector raw;
+    uint64_t bits;
+    /** The block CRC, or the stream CRC for an end of stream */
+    uint32_t crc;
+    /** Marks the end of a stream instead of a block */
+    bool end;
+
+    ByteVector out;
+    /** The block goes on past out */
+    bool more;
+
+private:
+    ByteVector in;
+    bz_stream zs;
+    bool decoding;
+
+    void stop() {
+        if(decoding) {
+            BZ2_bzDecompressEnd(&zs);
+            decoding = false;
+        }
+    }
+};
+
+}
+
+struct BZFilter::Stream {
+    Stream() : pos(0), finishing(false), finished(false), totalIn(0), totalOut(0) {
+        uint64_t bits = 0;
+        appendHeader(out, bits);
+    }
+
+    BZThreads threads;
+    /** Input that doesn't make a whole block yet */
+    string pending;
+    /** Compressed blocks whose last bits don't make a whole byte yet */
+    BZBlocks blocks;
+
+    ByteVector out;
+    size_t pos;
+
+    bool finishing;
+    bool finished;
+    uint64_t totalIn;
+    uint64_t totalOut;
+};
+
+BZFilter::BZFilter() : stream(new Stream) {
 }
 
 BZFilter::~BZFilter() {
-    dcdebug("BZFilter end, %u/%u = %.04f\n", zs.total_out_lo32, zs.total_in_lo32, (float)zs.total_out_lo32 / max((float)zs.total_in_lo32, (float)1));
-    BZ2_bzCompressEnd(&zs);
+    dcdebug("BZFilter end, " U64_FMT "/" U64_FMT " = %.04f\n", (long long)stream->totalOut, (long long)stream->totalIn, (float)stream->totalOut / max((float)stream->totalIn, (float)1));
 }
 
 bool BZFilter::operator()(const void* in, size_t& insize, void* out, size_t& outsize) {
     if(outsize == 0)
         return 0;
 
-    zs.avail_in = insize;
-    zs.next_in = (char*)in;
-    zs.avail_out = outsize;
-    zs.next_out = (char*)out;
+    Stream& s = *stream;
+    size_t consumed = 0;
+    if(insize > 0) {
+        // With enough blocks on their way, the input has to wait for them
+        if(s.threads.size() < MAX_JOBS) {
+            s.pending.append((const char*)in, insize);
+            consumed = insize;
 
-    if(insize == 0) {
-        int err = ::BZ2_bzCompress(&zs, BZ_FINISH);
-        if(err != BZ_FINISH_OK && err != BZ_STREAM_END)
-            throw Exception(_("Error during compression"));
+            while(s.pending.size() >= BZBlocks::BLOCK_INPUT) {
+                string rest = s.pending.substr(BZBlocks::BLOCK_INPUT);
+                s.pending.resize(BZBlocks::BLOCK_INPUT);
+                s.threads.add(new CompressJob(s.pending));
+                s.pending.swap(rest);
+            }
+        }
+    } else if(!s.finishing) {
+        if(!s.pending.empty())
+            s.threads.add(new CompressJob(s.pending));
+        s.finishing = true;
+    }
 
-        outsize = outsize - zs.avail_out;
-        insize = insize - zs.avail_in;
-        return err == BZ_FINISH_OK;
-    } else {
-        int err = ::BZ2_bzCompress(&zs, BZ_RUN);
-        if(err != BZ_RUN_OK)
-            throw Exception(_("Error during compression"));
+    if(s.pos == s.out.size()) {
+        s.out.clear();
+        s.pos = 0;
+    }
+
+    // Blocks come out in order; without new input there's nothing better to do than wait for them
+    while(!s.threads.empty() && s.out.size() - s.pos < outsize) {
+        CompressJob* job = static_cast<CompressJob*>(s.threads.front());
+        if(!s.threads.isDone(job)) {
+            if(consumed > 0 || s.pos < s.out.size())
+                break;
+            s.threads.wait(job);
+        }
+        if(!job->error.empty())
+            throw Exception(job->error);
+
+        s.blocks.append(job->blocks);
+        s.threads.pop();
+        s.blocks.takeBytes(s.out);
+    }
+
+    if(s.finishing && s.threads.empty() && !s.finished) {
+        s.blocks.finish(s.out);
+        s.finished = true;
+    }
+
+    size_t n = min(outsize, s.out.size() - s.pos);
+    if(n > 0)
+        memcpy(out, &s.out[s.pos], n);
+    s.pos += n;
+
+    s.totalIn += consumed;
+    s.totalOut += n;
+    insize = consumed;
+    outsize = n;
+    return !s.finished || s.pos < s.out.size();
+}
+
+void BZBlocks::compress(const void* in, size_t len) {
+    const uint8_t* p = (const uint8_t*)in;
+    if(len <= BLOCK_INPUT) {
+        if(len > 0)
+            compressBlock(p, len);
+        return;
+    }
+
+    // The blocks don't depend on each other, so they take turns on a few threads
+    BZThreads threads;
+    for(size_t pos = 0; pos < len; pos += BLOCK_INPUT)
+        threads.add(new CompressJob(p + pos, min(len - pos, (size_t)BLOCK_INPUT)));
+
+    for(; !threads.empty(); threads.pop()) {
+        CompressJob* job = static_cast<CompressJob*>(threads.front());
+        threads.wait(job);
+        if(!job->error.empty())
+            throw Exception(job->error);
+        append(job->blocks);
+    }
+}
+
+void BZBlocks::compressBlock(const void* in, size_t n) {
+    // Compressed data may grow a little beyond the input
+    ByteVector out(n + n / 100 + 600);
+    unsigned int outLen = out.size();
+    if(BZ2_bzBuffToBuffCompress((char*)&out[0], &outLen, (char*)in, n, 9, 0, 30) != BZ_OK)
+        throw Exception(_("Error during compression"));
+
+    // Find the stream trailer, the last byte is padded with up to 7 zero bits
+    uint64_t total = (uint64_t)outLen * 8;
+    uint64_t end = 0;
+    for(unsigned pad = 0; pad < 8; ++pad) {
+        uint64_t e = total - pad - END_BITS;
+        if(getBits(&out[0], e, 48) == END_MAGIC) {
+            end = e;
+            break;
+        }
+    }
+
+    // BLOCK_INPUT keeps each piece to a single block, whose CRC is the combined one as well
+    uint32_t blockCrc = (uint32_t)getBits(&out[0], end + 48, 32);
+    if(end <= HEADER_BITS || getBits(&out[0], HEADER_BITS, 48) != BLOCK_MAGIC ||
+        getBits(&out[0], HEADER_BITS + 48, 32) != blockCrc)
+    {
+        throw Exception(_("Error during compression"));
+    }
+
+    appendBits(data, bits, &out[0], outLen, HEADER_BITS, end - HEADER_BITS);
+    crc = rotateCrc(crc, 1) ^ blockCrc;
+    blocks++;
+}
+
+void BZBlocks::append(const BZBlocks& rhs) {
+    if(rhs.empty())
+        return;
+
+    appendBits(data, bits, &rhs.data[0], rhs.data.size(), 0, rhs.bits);
+    crc = rotateCrc(crc, rhs.blocks) ^ rhs.crc;
+    blocks += rhs.blocks;
+}
+
+void BZBlocks::clear() {
+    data.clear();
+    bits = 0;
+    crc = 0;
+    blocks = 0;
+}
+
+void BZBlocks::takeBytes(ByteVector& aOut) {
+    size_t n = bits / 8;
+    aOut.insert(aOut.end(), data.begin(), data.begin() + n);
+    data.erase(data.begin(), data.begin() + n);
+    bits %= 8;
+}
+
+void BZBlocks::finish(ByteVector& aOut) {
+    appendTrailer(data, bits, crc);
+    aOut.insert(aOut.end(), data.begin(), data.end());
+    clear();
+}
+
+void BZBlocks::write(OutputStream& os) const {
+    ByteVector stream;
+    uint64_t streamBits = 0;
+    stream.reserve(4 + data.size() + 10);
+
+    appendHeader(stream, streamBits);
+    if(bits > 0)
+        appendBits(stream, streamBits, &data[0], data.size(), 0, bits);
+    appendTrailer(stream, streamBits, crc);
+
+    os.write(&stream[0], stream.size());
+}
+
+struct UnBZFilter::Stream {
+    Stream() : scanned(0), blockStart(0), looseEnd(0), blockCrc(0), streamCrc(0), scanCrc(0), inBlock(false), hasLooseEnd(false),
+        started(false), ended(false), trailing(false), eof(false), scanDone(false), pos(0), totalIn(0), totalOut(0) { }
+
+    /** Bytes needed past a signature to tell whether it's a real one */
+    enum { LOOKAHEAD = 16 };
+    /** No compressed block comes near this, even with a false signature splitting it */
+    enum { MAX_BLOCK_BITS = 2 * 1024 * 1024 * 8 };
+
+    BZThreads threads;
+
+    /** Compressed data, from the start of the current block on */
+    ByteVector input;
+    /** Bytes of input looked through for signatures */
+    size_t scanned;
+    /** Bit positions in input */
+    uint64_t blockStart;
+    uint64_t looseEnd;
+
+    uint32_t blockCrc;
+    /** The block CRCs of the current stream, combined as the blocks come out */
+    uint32_t streamCrc;
+    /** The same for the blocks found so far, to tell the real end of a stream by */
+    uint32_t scanCrc;
 
-        outsize = outsize - zs.avail_out;
-        insize = insize - zs.avail_in;
+    bool inBlock;
+    /** An end of stream inside the block that isn't followed by another stream */
+    bool hasLooseEnd;
+    bool started;
+    /** A stream has been seen to end */
+    bool ended;
+    /** The last stream has ended; what follows it is ignored, like bzip2 does */
+    bool trailing;
+    bool eof;
+    /** Everything up to the end of the input has been looked through */
+    bool scanDone;
+
+    /** Position in the output of the oldest job */
+    size_t pos;
+
+    uint64_t totalIn;
+    uint64_t totalOut;
+
+    bool scan(bool aLast);
+    void found(uint64_t aPos, bool aEnd, size_t aSize, bool aLast);
+    void endBlock(uint64_t aPos);
+    void endStream(uint64_t aPos);
+    bool retry();
+};
+
+/** @return Whether everything there is has been looked through, otherwise the blocks on their way have to be taken first */
+bool UnBZFilter::Stream::scan(bool aLast) {
+    if(scanDone || threads.size() >= MAX_JOBS)
+        return scanDone;
+
+    if(trailing) {
+        input.clear();
+        scanned = 0;
+        scanDone = aLast;
         return true;
     }
+
+    if(!started) {
+        if(input.size() < 4 && !aLast)
+            return true;
+        if(input.size() < 4 || input[0] != 'B' || input[1] != 'Z' || input[2] != 'h' || input[3] < '1' || input[3] > '9')
+            throw Exception(_("Error during decompression"));
+        started = true;
+    }
+
+    // Every bit position can start a signature; each byte covers eight of them at once
+    size_t size = input.size();
+    size_t end = aLast ? size : (size > LOOKAHEAD ? size - LOOKAHEAD : 0);
+    if(aLast)
+        input.resize(size + LOOKAHEAD, 0);
+
+    size_t b = scanned;
+    while(b < end && threads.size() < MAX_JOBS && !trailing) {
+        const uint8_t* p = &input[b++];
+        uint8_t shifts = signatures.shifts[p[1]];
+        if(shifts == 0)
+            continue;
+
+        uint64_t w = 0;
+        for(int i = 0; i < 8; ++i)
+            w = (w << 8) | p[i];
+
+        for(unsigned s = 0; s < 8; ++s) {
+            if(!(shifts & (1 << s)))
+                continue;
+            uint64_t v = (w >> (16 - s)) & MAGIC_MASK;
+            if(v == BLOCK_MAGIC || v == END_MAGIC)
+                found((uint64_t)(p - &input[0]) * 8 + s, v == END_MAGIC, size, aLast);
+        }
+    }
+    if(trailing)
+        b = max(b, end);
+    scanned = max(scanned, b);
+
+    if(aLast) {
+        input.resize(size);
+        if(b < end)
+            return false;
+
+        scanDone = true;
+        if(inBlock && hasLooseEnd) {
+            // Whatever follows the last stream is ignored, like bzip2 does
+            endStream(looseEnd);
+        }
+        if(inBlock || !ended)
+            throw Exception(_("Error during decompression"));
+        return true;
+    }
+
+    // What's been looked through and isn't part of a block is done with
+    size_t done = inBlock ? (size_t)(blockStart / 8) : scanned;
+    if(done > 256 * 1024 || done > input.size() / 2) {
+        input.erase(input.begin(), input.begin() + done);
+        scanned -= done;
+        blockStart -= (uint64_t)done * 8;
+        looseEnd -= (uint64_t)done * 8;
+    }
+    return b >= end;
 }
 
-UnBZFilter::UnBZFilter() {
-    memset(&zs, 0, sizeof(zs));
+void UnBZFilter::Stream::found(uint64_t aPos, bool aEnd, size_t aSize, bool aLast) {
+    const uint8_t* p = &input[0];
+
+    if(trailing)
+        return;
 
-    if(BZ2_bzDecompressInit(&zs, 0, 0) != BZ_OK)
-        throw Exception(_("Error during decompression"));
+    if(aEnd) {
+        // A real one is followed by the CRC, zero bits up to a whole byte and then nothing or the next stream
+        uint64_t next = (aPos + END_BITS + 7) / 8;
+        if(next > aSize || getBits(p, aPos + END_BITS, next * 8 - aPos - END_BITS) != 0)
+            return;
+
+        if(next < aSize || !aLast) {
+            if(p[next] != 'B' || p[next + 1] != 'Z' || p[next + 2] != 'h' || p[next + 3] < '1' || p[next + 3] > '9') {
+                // Either a signature inside the block or the end of the last stream with something after it;
+                // unless a false block signature got in the way, the stream CRC tells which
+                if(getBits(p, aPos + 48, 32) == (inBlock ? rotateCrc(scanCrc, 1) ^ blockCrc : scanCrc)) {
+                    endStream(aPos);
+                    trailing = true;
+                    return;
+                }
+                if(inBlock && !hasLooseEnd) {
+                    looseEnd = aPos;
+                    hasLooseEnd = true;
+                }
+                return;
+            }
+        }
+        endStream(aPos);
+    } else {
+        // The block CRC follows, then a randomization bit and where the BWT starts, which is inside the block
+        if(getBits(p, aPos + 48 + 33, 24) >= 900000)
+            return;
 
+        if(inBlock)
+            endBlock(aPos);
+        inBlock = true;
+        hasLooseEnd = false;
+        blockStart = aPos;
+        blockCrc = (uint32_t)getBits(p, aPos + 48, 32);
+    }
+}
+
+void UnBZFilter::Stream::endBlock(uint64_t aPos) {
+    DecompressJob* job = new DecompressJob;
+    appendBits(job->raw, job->bits, &input[0], input.size(), blockStart, aPos - blockStart);
+    job->crc = blockCrc;
+    threads.add(job);
+    scanCrc = rotateCrc(scanCrc, 1) ^ blockCrc;
+}
+
+void UnBZFilter::Stream::endStream(uint64_t aPos) {
+    if(inBlock)
+        endBlock(aPos);
+    inBlock = false;
+    hasLooseEnd = false;
+    ended = true;
+    scanCrc = 0;
+
+    DecompressJob* job = new DecompressJob;
+    job->crc = (uint32_t)getBits(&input[0], aPos + 48, 32);
+    job->end = true;
+    threads.add(job);
+}
+
+bool UnBZFilter::Stream::retry() {
+    // A false signature inside a block cuts it in two; the halves together make the block again
+    DecompressJob* job = static_cast<DecompressJob*>(threads.front());
+    if(threads.size() < 2) {
+        if(!scanDone)
+            return false;
+        throw Exception(job->error);
+    }
+
+    DecompressJob* next = static_cast<DecompressJob*>(threads.get(1));
+    if(next->end || job->bits + next->bits > MAX_BLOCK_BITS)
+        throw Exception(job->error);
+
+    threads.wait(next);
+    appendBits(job->raw, job->bits, &next->raw[0], next->raw.size(), 0, next->bits);
+    threads.erase(1);
+
+    job->error.clear();
+    try {
+        job->run();
+    } catch(const Exception& e) {
+        job->error = e.getError();
+    }
+    return true;
+}
+
+UnBZFilter::UnBZFilter() : stream(new Stream) {
 }
 
 UnBZFilter::~UnBZFilter() {
-    dcdebug("UnBZFilter end, %u/%u = %.04f\n", zs.total_out_lo32, zs.total_in_lo32, (float)zs.total_out_lo32 / max((float)zs.total_in_lo32, (float)1));
-    BZ2_bzDecompressEnd(&zs);
+    dcdebug("UnBZFilter end, " U64_FMT "/" U64_FMT " = %.04f\n", (long long)stream->totalOut, (long long)stream->totalIn, (float)stream->totalOut / max((float)stream->totalIn, (float)1));
 }
 
 bool UnBZFilter::operator()(const void* in, size_t& insize, void* out, size_t& outsize) {
     if(outsize == 0)
         return 0;
 
-    zs.avail_in = insize;
-    zs.next_in = (char*)in;
-    zs.avail_out = outsize;
-    zs.next_out = (char*)out;
+    Stream& s = *stream;
+    if(insize == 0)
+        s.eof = true;
 
-    int err = ::BZ2_bzDecompress(&zs);
+    // With enough blocks on their way, both the rest of the input and any new one have to wait for them
+    size_t consumed = 0;
+    if(s.scan(s.eof) && insize > 0) {
+        const uint8_t* p = (const uint8_t*)in;
+        s.input.insert(s.input.end(), p, p + insize);
+        consumed = insize;
+        s.scan(false);
+    }
+
+    // Blocks come out in order; without new input there's nothing better to do than wait for them
+    size_t produced = 0;
+    while(produced < outsize && !s.threads.empty()) {
+        DecompressJob* job = static_cast<DecompressJob*>(s.threads.front());
+        if(!s.threads.isDone(job)) {
+            if(consumed > 0 || produced > 0)
+                break;
+            s.threads.wait(job);
+        }
+
+        if(!job->error.empty()) {
+            if(!s.retry())
+                break;
+            continue;
+        }
 
-    // No more input data, and inflate didn't think it has reached the end...
-    if(insize == 0 && zs.avail_out != 0 && err != BZ_STREAM_END)
-        throw Exception(_("Error during decompression"));
+        if(job->end) {
+            if(job->crc != s.streamCrc)
+                throw Exception(_("Error during decompression"));
+            s.streamCrc = 0;
+            s.threads.pop();
+            continue;
+        }
 
-    if(err != BZ_OK && err != BZ_STREAM_END)
-        throw Exception(_("Error during decompression"));
+        size_t n = min(outsize - produced, job->out.size() - s.pos);
+        if(n > 0)
+            memcpy((uint8_t*)out + produced, &job->out[s.pos], n);
+        produced += n;
+        s.pos += n;
+
+        if(s.pos == job->out.size() && job->more) {
+            // The rest of a long block is decompressed here, a slice at a time
+            s.pos = 0;
+            job->next();
+        } else if(s.pos == job->out.size()) {
+            s.streamCrc = rotateCrc(s.streamCrc, 1) ^ job->crc;
+            s.pos = 0;
+            s.threads.pop();
+        }
+    }
 
-    outsize = outsize - zs.avail_out;
-    insize = insize - zs.avail_in;
-    return err == BZ_OK;
+    s.totalIn += consumed;
+    s.totalOut += produced;
+    insize = consumed;
+    outsize = produced;
+    return !s.eof || !s.scanDone || !s.threads.empty();
 }
 
 } // namespace dcpp
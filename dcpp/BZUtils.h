@@ -20,8 +20,16 @@
 
 #include <bzlib.h>
 
+#include "typedefs.h"
+
 namespace dcpp {
 
+class OutputStream;
+
+/**
+ * Compresses into a single bzip2 stream, with the blocks compressed on a few
+ * threads at once.
+ */
 class BZFilter {
 public:
     BZFilter();
@@ -36,9 +44,58 @@ public:
     */
     bool operator()(const void* in, size_t& insize, void* out, size_t& outsize);
 private:
-    bz_stream zs;
+    struct Stream;
+    std::unique_ptr<Stream> stream;
+};
+
+/**
+ * Compressed bzip2 blocks that can be put together into a single stream.
+ * Each piece of data is compressed into blocks of its own and spliced bit by
+ * bit after the blocks already there, so a stream can be built from parts
+ * that were compressed at different times. The result is a plain single
+ * stream bzip2 file any decompressor reads.
+ */
+class BZBlocks {
+public:
+    /** Input that surely fits a single block, even if run length encoding expands it */
+    enum { BLOCK_INPUT = 700 * 1024 };
+
+    BZBlocks() : bits(0), crc(0), blocks(0) { }
+
+    /** Compress data into new blocks, a block for each BLOCK_INPUT bytes; several blocks are compressed at once */
+    void compress(const void* data, size_t len);
+    /** Append the blocks of another instance */
+    void append(const BZBlocks& rhs);
+    void clear();
+
+    /** Move the complete bytes to aOut, for streaming the blocks out as they come; a partial byte stays */
+    void takeBytes(ByteVector& aOut);
+    /** Move the rest to aOut, followed by the stream trailer */
+    void finish(ByteVector& aOut);
+
+    bool empty() const { return blocks == 0; }
+    /** @return compressed size in bytes, without stream header and trailer */
+    size_t size() const { return data.size(); }
+
+    /** Write the blocks as a complete stream, in a single write so hashing streams see it in one piece */
+    void write(OutputStream& os) const;
+
+private:
+    ByteVector data;
+    uint64_t bits;
+    /** Combined CRC of the blocks, as kept in the stream trailer */
+    uint32_t crc;
+    uint32_t blocks;
+
+    void compressBlock(const void* data, size_t len);
 };
 
+/**
+ * Decompresses bzip2 data, several blocks at once. The blocks are found by
+ * looking for their signatures in the compressed bits, each is then given a
+ * stream of its own to be decompressed on a thread. Streams put one after
+ * another are read as a whole.
+ */
 class UnBZFilter {
 public:
     UnBZFilter();
@@ -53,7 +110,8 @@ public:
     */
     bool operator()(const void* in, size_t& insize, void* out, size_t& outsize);
 private:
-    bz_stream zs;
+    struct Stream;
+    std::unique_ptr<Stream> stream;
 };
 
 } // namespace dcpp
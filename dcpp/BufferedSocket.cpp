@@ -24,22 +24,29 @@
 #include "SettingsManager.h"
 
 #include "Streams.h"
+#include "File.h"
 #include "SSLSocket.h"
 #include "CryptoManager.h"
 #include "ZUtils.h"
 
 #include "ThrottleManager.h"
+#include "SocketReactor.h"
 
 namespace dcpp {
 
-// Polling is used for tasks...should be fixed...
+// How often connects and handshakes are checked on when nothing happens
 #define POLL_TIMEOUT 250
+// When to ask for more tokens after running out of them
+#define THROTTLE_RETRY 100
+// Data moved in one go before the other sockets get a turn
+#define PROCESS_BUDGET (1024*1024)
 
 BufferedSocket::BufferedSocket(char aSeparator) :
-separator(aSeparator), mode(MODE_LINE), dataBytes(0), rollback(0), state(STARTING),
-disconnecting(false)
+separator(aSeparator), working(false), deadline(0), connecting(false), handshaking(false), resolving(false), readRetry(0), sendPos(0),
+mode(MODE_LINE), dataBytes(0), rollback(0), state(STARTING), disconnecting(false),
+pendingEvents(0), scheduled(false), dead(false), pollFd(-1), waitEvents(0), waitTimer(0), budget(0)
 {
-    start();
+    SocketReactor::getInstance()->add(this);
 
     sockets.inc();
 }
@@ -113,72 +120,126 @@ void BufferedSocket::connect(const string& aAddress, uint16_t aPort, uint16_t lo
 
 #define LONG_TIMEOUT 30000
 #define SHORT_TIMEOUT 1000
-void BufferedSocket::threadConnect(const string& aAddr, uint16_t aPort, uint16_t localPort, NatRoles natRole, bool proxy) {
-    dcassert(state == STARTING);
-
-    dcdebug("threadConnect %s:%d/%d\n", aAddr.c_str(), (int)localPort, (int)aPort);
-    fire(BufferedSocketListener::Connecting());
+bool BufferedSocket::threadConnect(ConnectInfo& ci, int events) {
+    while(true) {
+        if(disconnecting)
+            return true;
 
-    const uint64_t endTime = GET_TICK() + LONG_TIMEOUT;
-    state = RUNNING;
+        uint64_t now = GET_TICK();
+        if(now >= deadline)
+            throw SocketException(_("Connection timeout"));
 
-    while (GET_TICK() < endTime) {
-        dcdebug("threadConnect attempt to addr \"%s\"\n", aAddr.c_str());
         try {
-            if(proxy) {
-                sock->socksConnect(aAddr, aPort, LONG_TIMEOUT);
-            } else {
-                sock->connect(aAddr, aPort);
-            }
+            if(!connecting) {
+                if(now < ci.retryTime) {
+                    wait(0, ci.retryTime);
+                    return false;
+                }
+
+                if(!ci.resolved) {
+                    // Lookups and the SOCKS5 negotiation block; the connector wakes us up when it's done
+                    dcdebug("threadConnect attempt to addr \"%s\"\n", ci.addr.c_str());
+                    {
+                        Lock l(cs);
+                        resolving = true;
+                    }
+                    SocketReactor::getInstance()->resolve(this);
+                    return false;
+                }
+
+                if(!ci.error.empty()) {
+                    string error;
+                    error.swap(ci.error);
+                    ci.resolved = false;
+                    if(ci.sslError)
+                        throw SSLSocketException(error);
+                    throw SocketException(error);
+                }
 
-            bool connSucceeded;
-            while(!(connSucceeded = sock->waitConnected(POLL_TIMEOUT)) && endTime >= GET_TICK()) {
-                if(disconnecting) return;
+                if(!ci.proxy) {
+                    sock->connect(ci.ip, ci.port);
+                } else {
+                    // The next attempt needs a new negotiation
+                    ci.resolved = false;
+                }
+                connecting = true;
+                handshaking = false;
             }
 
-            if (connSucceeded) {
+            if(sock->waitConnected(0)) {
                 fire(BufferedSocketListener::Connected());
-                return;
+                return true;
             }
+
+            // Writable but not connected yet, so the TLS handshake is under way
+            if(events & SocketReactor::EV_WRITE)
+                handshaking = true;
+
+            wait(handshaking ? SocketReactor::EV_READ : SocketReactor::EV_READ | SocketReactor::EV_WRITE, min(now + POLL_TIMEOUT, deadline));
+            return false;
         }
         catch (const SSLSocketException&) {
             throw;
         } catch (const SocketException&) {
-            if (natRole == NAT_NONE)
+            if (ci.natRole == NAT_NONE)
                 throw;
-            Thread::sleep(SHORT_TIMEOUT);
+            connecting = false;
+            ci.retryTime = now + SHORT_TIMEOUT;
         }
     }
-
-    throw SocketException(_("Connection timeout"));
 }
 
-void BufferedSocket::threadAccept() {
-    dcassert(state == STARTING);
+void BufferedSocket::threadResolve() {
+    ConnectInfo& ci = *static_cast<ConnectInfo*>(currentData.get());
+    try {
+        if(ci.proxy) {
+            sock->socksConnect(ci.addr, ci.port, LONG_TIMEOUT);
+        } else {
+            ci.ip = Socket::resolve(ci.addr);
+        }
+    } catch(const SSLSocketException& e) {
+        ci.error = e.getError();
+        ci.sslError = true;
+    } catch(const SocketException& e) {
+        ci.error = e.getError();
+        ci.sslError = false;
+    }
+    ci.resolved = true;
 
-    dcdebug("threadAccept\n");
+    // Under the lock, so that the socket can't be processed and deleted before it's woken up
+    Lock l(cs);
+    resolving = false;
+    SocketReactor::getInstance()->wake(this);
+}
 
-    state = RUNNING;
+bool BufferedSocket::threadAccept() {
+    if(disconnecting)
+        return true;
 
-    uint64_t startTime = GET_TICK();
-    while(!sock->waitAccepted(POLL_TIMEOUT)) {
-        if(disconnecting)
-            return;
+    if(sock->waitAccepted(0))
+        return true;
 
-        if((startTime + 30000) < GET_TICK()) {
-            throw SocketException(_("Connection timeout"));
-        }
+    uint64_t now = GET_TICK();
+    if(now > deadline) {
+        throw SocketException(_("Connection timeout"));
     }
+
+    wait(SocketReactor::EV_READ, min(now + POLL_TIMEOUT, deadline));
+    return false;
 }
 
-void BufferedSocket::threadRead() {
+int BufferedSocket::threadRead() {
     if(state != RUNNING)
-        return;
+        return -1;
 
-    int left = (mode == MODE_DATA) ? ThrottleManager::getInstance()->read(sock.get(), &inbuf[0], (int)inbuf.size()) : sock->read(&inbuf[0], (int)inbuf.size());
+    int left = (mode == MODE_DATA) ? ThrottleManager::getInstance()->read(sock.get(), &inbuf[0], (int)inbuf.size(), throttleFlow) : sock->read(&inbuf[0], (int)inbuf.size());
     if(left == -1) {
         // EWOULDBLOCK, no data received...
-        return;
+        return -1;
+    } else if(left == -2) {
+        // Out of download tokens
+        readRetry = GET_TICK() + THROTTLE_RETRY;
+        return -1;
     } else if(left == 0) {
         // This socket has been closed...
         throw SocketException(_("Connection closed"));
@@ -274,105 +335,157 @@ void BufferedSocket::threadRead() {
     if(mode == MODE_LINE && line.size() > static_cast<size_t>(SETTING(MAX_COMMAND_LENGTH))) {
         throw SocketException(_("Maximum command length exceeded"));
     }
+    return total;
 }
 
-void BufferedSocket::threadSendFile(InputStream* file) {
-    if(state != RUNNING)
-        return;
-
-    if(disconnecting)
-        return;
-    dcassert(file != NULL);
-    size_t sockSize = (size_t)sock->getSocketOptInt(SO_SNDBUF);
-    size_t bufSize = max(sockSize, (size_t)64*1024);
-
-    ByteVector readBuf(bufSize);
-    ByteVector writeBuf(bufSize);
+bool BufferedSocket::threadSendFile(SendFileInfo& sfi) {
+    if(sfi.source) {
+        int ret = threadSendFileDirect(sfi);
+        if(ret != -1)
+            return ret == 1;
+        // Nothing sent yet, go through the buffers instead
+        sfi.source = 0;
+    }
 
-    size_t readPos = 0;
+    if(sfi.sockSize == 0) {
+        sfi.sockSize = (size_t)sock->getSocketOptInt(SO_SNDBUF);
+        size_t bufSize = max(sfi.sockSize, (size_t)64*1024);
+        sfi.readBuf.resize(bufSize);
+        sfi.writeBuf.reserve(bufSize);
+        dcdebug("Starting threadSend\n");
+    }
 
-    bool readDone = false;
-    dcdebug("Starting threadSend\n");
+    InputStream* file = sfi.stream;
     while(!disconnecting) {
-        if(!readDone && readBuf.size() > readPos) {
-            // Fill read buffer
-            size_t bytesRead = readBuf.size() - readPos;
-            size_t actual = file->read(&readBuf[readPos], bytesRead);
+        if(sfi.writePos == sfi.writeBuf.size()) {
+            if(!sfi.readDone && sfi.readBuf.size() > sfi.readPos) {
+                // Fill read buffer
+                size_t bytesRead = sfi.readBuf.size() - sfi.readPos;
+                size_t actual = file->read(&sfi.readBuf[sfi.readPos], bytesRead);
+
+                if(bytesRead > 0) {
+                    fire(BufferedSocketListener::BytesSent(), bytesRead, 0);
+                }
 
-            if(bytesRead > 0) {
-                fire(BufferedSocketListener::BytesSent(), bytesRead, 0);
+                if(actual == 0) {
+                    sfi.readDone = true;
+                } else {
+                    sfi.readPos += actual;
+                }
             }
 
-            if(actual == 0) {
-                readDone = true;
-            } else {
-                readPos += actual;
+            if(sfi.readDone && sfi.readPos == 0) {
+                fire(BufferedSocketListener::TransmitDone());
+                return true;
             }
+
+            size_t bufSize = sfi.readBuf.size();
+            sfi.readBuf.swap(sfi.writeBuf);
+            sfi.readBuf.resize(bufSize);
+            sfi.writeBuf.resize(sfi.readPos);
+            sfi.readPos = 0;
+            sfi.writePos = 0;
+        }
+
+        if(budget >= PROCESS_BUDGET) {
+            wait(SocketReactor::EV_WRITE);
+            return false;
         }
 
-        if(readDone && readPos == 0) {
-            fire(BufferedSocketListener::TransmitDone());
-            return;
+        int written = -1;
+        if(sfi.retryWrite) {
+            // workaround for OpenSSL (crashes when previous write failed and now retrying with different writeSize)
+            try {
+                written = sock->write(&sfi.writeBuf[sfi.writePos], sfi.writeSize);
+            } catch(const Exception&) {
+                // ...
+            }
+        } else {
+            sfi.writeSize = min(sfi.sockSize / 2, sfi.writeBuf.size() - sfi.writePos);
+            written = ThrottleManager::getInstance()->write(sock.get(), &sfi.writeBuf[sfi.writePos], sfi.writeSize, throttleFlow);
         }
 
-        readBuf.swap(writeBuf);
-        readBuf.resize(bufSize);
-        writeBuf.resize(readPos);
-        readPos = 0;
+        if(written > 0) {
+            sfi.retryWrite = false;
+            sfi.writePos += written;
+            budget += written;
 
-        size_t writePos = 0, writeSize = 0;
-        int written = 0;
+            fire(BufferedSocketListener::BytesSent(), 0, written);
 
-        while(writePos < writeBuf.size()) {
-            if(disconnecting)
-                return;
-
-            if(written == -1) {
-                // workaround for OpenSSL (crashes when previous write failed and now retrying with different writeSize)
-                try {
-                    written = sock->write(&writeBuf[writePos], writeSize);
-                } catch(const Exception&) {
-                    // ...
+        } else if(written == -1) {
+            sfi.retryWrite = true;
+            if(!sfi.readDone && sfi.readPos < sfi.readBuf.size()) {
+                // Read a little since we're blocking anyway...
+                size_t bytesRead = min(sfi.readBuf.size() - sfi.readPos, sfi.readBuf.size() / 2);
+                size_t actual = file->read(&sfi.readBuf[sfi.readPos], bytesRead);
+
+                if(bytesRead > 0) {
+                    fire(BufferedSocketListener::BytesSent(), bytesRead, 0);
+                }
+
+                if(actual == 0) {
+                    sfi.readDone = true;
+                } else {
+                    sfi.readPos += actual;
                 }
             } else {
-                writeSize = min(sockSize / 2, writeBuf.size() - writePos);
-                written = ThrottleManager::getInstance()->write(sock.get(), &writeBuf[writePos], writeSize);
+                wait(SocketReactor::EV_WRITE);
+                return false;
             }
+        } else {
+            // Out of upload tokens
+            sfi.retryWrite = false;
+            wait(0, GET_TICK() + THROTTLE_RETRY);
+            return false;
+        }
+    }
+    return true;
+}
 
-            if(written > 0) {
-                writePos += written;
-
-                fire(BufferedSocketListener::BytesSent(), 0, written);
+int BufferedSocket::threadSendFileDirect(SendFileInfo& sfi) {
+    if(sfi.sockSize == 0) {
+        sfi.sockSize = (size_t)sock->getSocketOptInt(SO_SNDBUF);
+        dcdebug("Starting threadSendFileDirect\n");
+    }
+    size_t chunkSize = max(sfi.sockSize, (size_t)64*1024);
 
-            } else if(written == -1) {
-                if(!readDone && readPos < readBuf.size()) {
-                    // Read a little since we're blocking anyway...
-                    size_t bytesRead = min(readBuf.size() - readPos, readBuf.size() / 2);
-                    size_t actual = file->read(&readBuf[readPos], bytesRead);
+    while(sfi.sourceBytes > 0) {
+        if(disconnecting)
+            return 1;
 
-                    if(bytesRead > 0) {
-                        fire(BufferedSocketListener::BytesSent(), bytesRead, 0);
-                    }
+        if(budget >= PROCESS_BUDGET) {
+            wait(SocketReactor::EV_WRITE);
+            return 0;
+        }
 
-                    if(actual == 0) {
-                        readDone = true;
-                    } else {
-                        readPos += actual;
-                    }
-                } else {
-                    while(!disconnecting) {
-                        int w = sock->wait(POLL_TIMEOUT, Socket::WAIT_WRITE | Socket::WAIT_READ);
-                        if(w & Socket::WAIT_READ) {
-                            threadRead();
-                        }
-                        if(w & Socket::WAIT_WRITE) {
-                            break;
-                        }
-                    }
-                }
+        size_t len = (size_t)min(sfi.sourceBytes, (int64_t)chunkSize);
+        int written = ThrottleManager::getInstance()->sendFile(sock.get(), *sfi.source, len, throttleFlow);
+
+        if(written > 0) {
+            sfi.sourceBytes -= written;
+            sfi.sourceStarted = true;
+            budget += written;
+            // Read and sent at once
+            fire(BufferedSocketListener::BytesSent(), written, written);
+        } else if(written == -2) {
+            if(!sfi.sourceStarted) {
+                sfi.sockSize = 0;
+                return -1;
             }
+            // The file got shorter, the same as when reading it runs out early
+            break;
+        } else if(written == -1) {
+            wait(SocketReactor::EV_WRITE);
+            return 0;
+        } else {
+            // Out of upload tokens
+            wait(0, GET_TICK() + THROTTLE_RETRY);
+            return 0;
         }
     }
+
+    fire(BufferedSocketListener::TransmitDone());
+    return 1;
 }
 
 void BufferedSocket::write(const char* aBuf, size_t aLen) noexcept {
@@ -385,50 +498,107 @@ void BufferedSocket::write(const char* aBuf, size_t aLen) noexcept {
     writeBuf.insert(writeBuf.end(), aBuf, aBuf+aLen);
 }
 
-void BufferedSocket::threadSendData() {
-    if(state != RUNNING)
-        return;
-
-    {
-        Lock l(cs);
-        if(writeBuf.empty())
-            return;
-
-        writeBuf.swap(sendBuf);
-    }
-
-    size_t left = sendBuf.size();
-    size_t done = 0;
-    while(left > 0) {
+bool BufferedSocket::threadSendData() {
+    while(sendPos < sendBuf.size()) {
         if(disconnecting) {
-            return;
+            return true;
         }
 
-        int w = sock->wait(POLL_TIMEOUT, Socket::WAIT_READ | Socket::WAIT_WRITE);
-
-        if(w & Socket::WAIT_READ) {
-            threadRead();
+        // The same data has to be offered again after a failed write (OpenSSL)
+        int n = sock->write(&sendBuf[sendPos], sendBuf.size() - sendPos);
+        if(n > 0) {
+            sendPos += n;
+        } else {
+            wait(SocketReactor::EV_WRITE);
+            return false;
         }
+    }
+    sendBuf.clear();
+    return true;
+}
 
-        if(w & Socket::WAIT_WRITE) {
-            int n = sock->write(&sendBuf[done], left);
-            if(n > 0) {
-                left -= n;
-                done += n;
+bool BufferedSocket::startTask(Tasks task, unique_ptr<TaskData>& data) {
+    if(state == STARTING) {
+        if(task == CONNECT) {
+            dcdebug("threadConnect %s:%d/%d\n", static_cast<ConnectInfo*>(data.get())->addr.c_str(),
+                (int)static_cast<ConnectInfo*>(data.get())->localPort, (int)static_cast<ConnectInfo*>(data.get())->port);
+            fire(BufferedSocketListener::Connecting());
+
+            deadline = GET_TICK() + LONG_TIMEOUT;
+            connecting = false;
+            state = RUNNING;
+        } else if(task == ACCEPTED) {
+            dcdebug("threadAccept\n");
+
+            deadline = GET_TICK() + LONG_TIMEOUT;
+            state = RUNNING;
+        } else {
+            dcdebug("%d unexpected in STARTING state\n", task);
+            return false;
+        }
+    } else if(state == RUNNING) {
+        if(task == SEND_DATA) {
+            {
+                Lock l(cs);
+                if(writeBuf.empty())
+                    return false;
+
+                writeBuf.swap(sendBuf);
             }
+            sendPos = 0;
+        } else if(task == SEND_FILE) {
+            if(disconnecting)
+                return false;
+
+            // Plain file data doesn't have to go through our buffers at all
+            SendFileInfo* sfi = static_cast<SendFileInfo*>(data.get());
+            dcassert(sfi->stream != NULL);
+            sfi->source = sfi->stream->getSourceFile(sfi->sourceBytes);
+            if(sfi->sourceBytes <= 0)
+                sfi->source = 0;
+        } else if(task == DISCONNECT) {
+            fail(_("Disconnected"));
+            return false;
+        } else {
+            dcdebug("%d unexpected in RUNNING state\n", task);
+            return false;
         }
+    } else {
+        return false;
     }
-    sendBuf.clear();
+
+    current = task;
+    currentData = move(data);
+    working = true;
+    return true;
 }
 
-bool BufferedSocket::checkEvents() {
-    while(state == RUNNING ? taskSem.wait(0) : taskSem.wait()) {
+bool BufferedSocket::checkEvents(int events) {
+    while(true) {
+        if(working) {
+            bool done = false;
+            switch(current) {
+            case CONNECT: done = threadConnect(*static_cast<ConnectInfo*>(currentData.get()), events); break;
+            case ACCEPTED: done = threadAccept(); break;
+            case SEND_DATA: done = threadSendData(); break;
+            case SEND_FILE: done = threadSendFile(*static_cast<SendFileInfo*>(currentData.get())); break;
+            default: dcassert(0); done = true; break;
+            }
+
+            if(!done)
+                return true;
+
+            working = false;
+            currentData.reset();
+        }
+
         pair<Tasks, unique_ptr<TaskData> > p;
         {
             Lock l(cs);
-            dcassert(!tasks.empty());
+            if(tasks.empty())
+                return true;
             p = move(tasks.front());
-            tasks.erase(tasks.begin());
+            tasks.pop_front();
         }
 
         if(p.first == SHUTDOWN) {
@@ -438,64 +608,76 @@ bool BufferedSocket::checkEvents() {
             continue;
         }
 
-        if(state == STARTING) {
-            if(p.first == CONNECT) {
-                ConnectInfo* ci = static_cast<ConnectInfo*>(p.second.get());
-                threadConnect(ci->addr, ci->port, ci->localPort, ci->natRole, ci->proxy);
-            } else if(p.first == ACCEPTED) {
-                threadAccept();
-            } else {
-                dcdebug("%d unexpected in STARTING state\n", p.first);
-            }
-        } else if(state == RUNNING) {
-            if(p.first == SEND_DATA) {
-                threadSendData();
-            } else if(p.first == SEND_FILE) {
-                threadSendFile(static_cast<SendFileInfo*>(p.second.get())->stream); break;
-            } else if(p.first == DISCONNECT) {
-                fail(_("Disconnected"));
-            } else {
-                dcdebug("%d unexpected in RUNNING state\n", p.first);
-            }
-        }
+        startTask(p.first, p.second);
     }
-    return true;
 }
 
-void BufferedSocket::checkSocket() {
-    int waitFor = sock->wait(POLL_TIMEOUT, Socket::WAIT_READ);
+void BufferedSocket::wait(int events, uint64_t timer) {
+    waitEvents |= events;
+    if(timer != 0 && (waitTimer == 0 || timer < waitTimer))
+        waitTimer = timer;
+}
+
+int BufferedSocket::process(int events) {
+    waitEvents = 0;
+    waitTimer = 0;
+    budget = 0;
 
-    if(waitFor & Socket::WAIT_READ) {
-        threadRead();
+    {
+        Lock l(cs);
+        if(resolving)
+            return 0;
     }
-}
 
-/**
- * Main task dispatcher for the buffered socket abstraction.
- * @todo Fix the polling...
- */
-int BufferedSocket::run() {
-    dcdebug("BufferedSocket::run() start %p\n", (void*)this);
-    setThreadName("BufferedSocket");
-    while(true) {
-        try {
-            if(!checkEvents()) {
-                break;
+    int again = 0;
+    try {
+        if(!checkEvents(events)) {
+            SocketReactor::getInstance()->remove(this);
+            return 0;
+        }
+
+        if(state == RUNNING && (!working || current == SEND_DATA || current == SEND_FILE)) {
+            if(readRetry != 0 && GET_TICK() >= readRetry) {
+                readRetry = 0;
+                events |= SocketReactor::EV_READ;
             }
+
+            if(events & SocketReactor::EV_READ) {
+                size_t total = 0;
+                int n;
+                while(readRetry == 0 && (n = threadRead()) > 0) {
+                    total += n;
+                    if(total >= PROCESS_BUDGET) {
+                        // There may be more in the TLS buffers than the socket tells about
+                        again |= SocketReactor::EV_READ;
+                        break;
+                    }
+                }
+            }
+
             if(state == RUNNING) {
-                checkSocket();
+                if(readRetry != 0)
+                    wait(0, readRetry);
+                else
+                    wait(SocketReactor::EV_READ);
             }
-        } catch(const Exception& e) {
-            fail(e.getError());
         }
+    } catch(const Exception& e) {
+        fail(e.getError());
     }
-    dcdebug("BufferedSocket::run() end %p\n", (void*)this);
-    delete this;
-    return 0;
+
+    Lock l(cs);
+    if(!tasks.empty() && !working)
+        again |= SocketReactor::EV_WAKE;
+    return again;
 }
 
 void BufferedSocket::fail(const string& aError) {
+    working = false;
+    currentData.reset();
+
     if(sock.get()) {
+        SocketReactor::getInstance()->unwatch(this);
         sock->disconnect();
     }
 
@@ -513,7 +695,8 @@ void BufferedSocket::shutdown() {
 
 void BufferedSocket::addTask(Tasks task, TaskData* data) {
     dcassert(task == DISCONNECT || task == SHUTDOWN || task == UPDATED || sock.get());
-    tasks.push_back(make_pair(task, unique_ptr<TaskData>(data))); taskSem.signal();
+    tasks.push_back(make_pair(task, unique_ptr<TaskData>(data)));
+    SocketReactor::getInstance()->wake(this);
 }
 
 } // namespace dcpp
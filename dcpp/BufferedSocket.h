@@ -20,16 +20,22 @@
 
 #include "typedefs.h"
 #include "BufferedSocketListener.h"
-#include "Semaphore.h"
 #include "Thread.h"
 #include "Speaker.h"
 #include "Util.h"
 #include "Socket.h"
 #include "Atomic.h"
+#include "ThrottleManager.h"
 
 namespace dcpp {
 
-class BufferedSocket : public Speaker<BufferedSocketListener>, private Thread {
+/**
+ * Socket with line and data modes, driven by the SocketReactor. Everything
+ * that might block (connecting, TLS handshakes, sending) is done in steps
+ * whenever the socket is ready for it, listeners are called from the
+ * reactor's threads.
+ */
+class BufferedSocket : public Speaker<BufferedSocketListener> {
 public:
     enum Modes {
         MODE_LINE,
@@ -96,6 +102,9 @@ public:
 
     void disconnect(bool graceless = false) noexcept { Lock l(cs); if(graceless) disconnecting = true; addTask(DISCONNECT, 0); }
 
+    /** Which of the ThrottleManager classes the traffic counts against */
+    void setThrottleClass(int aClass) { throttleFlow.setClass(aClass); }
+
     string getLocalIp() const { return sock->getLocalIp(); }
     uint16_t getLocalPort() const { return sock->getLocalPort(); }
 
@@ -121,26 +130,66 @@ private:
         virtual ~TaskData() { }
     };
     struct ConnectInfo : public TaskData {
-        ConnectInfo(string addr_, uint16_t port_, uint16_t localPort_, NatRoles natRole_, bool proxy_) : addr(addr_), port(port_), localPort(localPort_), natRole(natRole_), proxy(proxy_) { }
+        ConnectInfo(string addr_, uint16_t port_, uint16_t localPort_, NatRoles natRole_, bool proxy_) : addr(addr_), port(port_), localPort(localPort_), natRole(natRole_), proxy(proxy_), retryTime(0), resolved(false), sslError(false) { }
         string addr;
         uint16_t port;
         uint16_t localPort;
         NatRoles natRole;
         bool proxy;
+        /** Next attempt of a NAT traversal connection */
+        uint64_t retryTime;
+
+        // Outcome of the connector thread's work
+        bool resolved;
+        string ip;
+        string error;
+        bool sslError;
     };
     struct SendFileInfo : public TaskData {
-        SendFileInfo(InputStream* stream_) : stream(stream_) { }
+        SendFileInfo(InputStream* stream_) : stream(stream_), source(0), sourceBytes(0), sourceStarted(false),
+            sockSize(0), readPos(0), writePos(0), writeSize(0), readDone(false), retryWrite(false) { }
         InputStream* stream;
+
+        /** File sent straight from the disk, if any */
+        File* source;
+        int64_t sourceBytes;
+        bool sourceStarted;
+
+        size_t sockSize;
+        ByteVector readBuf;
+        ByteVector writeBuf;
+        size_t readPos;
+        size_t writePos;
+        size_t writeSize;
+        bool readDone;
+        /** The last write would have blocked; OpenSSL wants it repeated as it was */
+        bool retryWrite;
     };
 
+    friend class SocketReactor;
+
     BufferedSocket(char aSeparator);
 
     virtual ~BufferedSocket();
 
     CriticalSection cs;
 
-    Semaphore taskSem;
     deque<pair<Tasks, unique_ptr<TaskData> > > tasks;
+    /** The task being worked on; the queue waits until it's done */
+    Tasks current;
+    unique_ptr<TaskData> currentData;
+    bool working;
+    /** Connection or handshake timeout */
+    uint64_t deadline;
+    /** Connect attempt made, waiting for it to succeed */
+    bool connecting;
+    /** The TCP connection is up, the TLS handshake goes on with input */
+    bool handshaking;
+    /** A connector thread has the socket; nothing else may touch it until it's done */
+    bool resolving;
+    /** Throttled reading resumes at this time */
+    uint64_t readRetry;
+    size_t sendPos;
 
     Modes mode;
     std::unique_ptr<UnZFilter> filterIn;
@@ -154,20 +203,46 @@ private:
     std::unique_ptr<Socket> sock;
     State state;
     bool disconnecting;
+    ThrottleManager::Flow throttleFlow;
+
+    /** Reactor bookkeeping, guarded by its lock */
+    int pendingEvents;
+    bool scheduled;
+    bool dead;
+    int pollFd;
+    /** What to wait for once process() returns */
+    int waitEvents;
+    uint64_t waitTimer;
+    /** Amount of data a socket may move before the others get a turn */
+    size_t budget;
 
-    virtual int run();
-
-    void threadConnect(const string& aAddr, uint16_t aPort, uint16_t localPort, NatRoles natRole, bool proxy);
-    void threadAccept();
-    void threadRead();
-    void threadSendFile(InputStream* is);
-    void threadSendData();
+    /**
+     * Runs the socket as far as it can go without blocking. Called by the
+     * reactor, never by two threads at once.
+     * @return Events to be processed again right away
+     */
+    int process(int events);
+
+    // Steps of the current task; they return false when they have to wait
+    bool threadConnect(ConnectInfo& ci, int events);
+    /** The blocking part of threadConnect, run by a connector thread */
+    void threadResolve();
+    bool threadAccept();
+    bool threadSendFile(SendFileInfo& sfi);
+    /** @return -1 if the file can't be sent straight from the disk; nothing was sent then */
+    int threadSendFileDirect(SendFileInfo& sfi);
+    bool threadSendData();
+    /** @return bytes read, -1 if there was nothing to read */
+    int threadRead();
+
+    void wait(int events, uint64_t timer = 0);
 
     void fail(const string& aError);
     static Atomic<long,memory_ordering_strong> sockets;
 
-    bool checkEvents();
-    void checkSocket();
+    /** @return false once the socket has been shut down */
+    bool checkEvents(int events);
+    bool startTask(Tasks task, unique_ptr<TaskData>& data);
 
     void setSocket(std::unique_ptr<Socket> s);
     void shutdown();
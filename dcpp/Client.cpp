@@ -31,10 +31,13 @@ namespace dcpp {
 
 Client::Counts Client::counts;
 
+/** How long after connecting user updates are batched at most, busy hubs never go quiet */
+static const uint64_t UPDATE_BATCH_TIME = 5 * 1000;
+
 Client::Client(const string& hubURL, char separator_, bool secure_) :
     myIdentity(ClientManager::getInstance()->getMe(), 0),
     reconnDelay(120), lastActivity(GET_TICK()), registered(false), autoReconnect(false),
-    encoding(Text::hubDefaultCharset), state(STATE_DISCONNECTED), sock(0),
+    encoding(Text::hubDefaultCharset), state(STATE_DISCONNECTED), sock(0), batchUpdates(false), batchEnd(0),
     hubUrl(hubURL), port(0), separator(separator_),
     secure(secure_), countType(COUNT_UNCOUNTED)
 {
@@ -129,6 +132,8 @@ void Client::connect() {
     setHubIdentity(Identity());
 
     state = STATE_CONNECTING;
+    pendingUpdates.clear();
+    batchUpdates = true;
 
     try {
         sock = BufferedSocket::getSocket(separator);
@@ -169,12 +174,14 @@ void Client::on(Connected) noexcept {
             }
         }
     }
+    batchEnd = GET_TICK() + UPDATE_BATCH_TIME;
     fire(ClientListener::Connected(), this);
     state = STATE_PROTOCOL;
 }
 
 void Client::on(Failed, const string& aLine) noexcept {
     state = STATE_DISCONNECTED;
+    pendingUpdates.clear();
     FavoriteManager::getInstance()->removeUserCommand(getHubUrl());
     sock->removeListener(this);
     fire(ClientListener::Failed(), this, aLine);
@@ -273,11 +280,42 @@ void Client::on(Line, const string& aLine) noexcept {
     COMMAND_DEBUG(aLine, DebugManager::HUB_IN, getIpPort())
 }
 
+void Client::userUpdated(OnlineUser& aUser) {
+    if(!batchUpdates) {
+        fire(ClientListener::UserUpdated(), this, aUser);
+        return;
+    }
+
+    pendingUpdates.push_back(&aUser);
+    if(pendingUpdates.size() >= 1000)
+        flushUpdates();
+}
+
+void Client::flushUpdates() {
+    if(pendingUpdates.empty())
+        return;
+
+    OnlineUserList l;
+    l.swap(pendingUpdates);
+    fire(ClientListener::UsersUpdated(), this, l);
+}
+
+void Client::on(Updated) noexcept {
+    // Sent by the timer, so the batch is flushed on the socket's thread
+    bool done = pendingUpdates.empty() || GET_TICK() >= batchEnd;
+    flushUpdates();
+    if(done)
+        batchUpdates = false;
+}
+
 void Client::on(Second, uint64_t aTick) noexcept {
     if(state == STATE_DISCONNECTED && getAutoReconnect() && (aTick > (getLastActivity() + getReconnDelay() * 1000)) ) {
         // Try to reconnect...
         connect();
     }
+    if(batchUpdates && isReady()) {
+        sock->updated();
+    }
     if(!searchQueue.interval) return;
 
     if(isConnected()) {
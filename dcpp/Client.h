@@ -184,12 +184,23 @@ protected:
     SearchQueue searchQueue;
     BufferedSocket* sock;
 
+    /** User updates collected while the user list comes in */
+    OnlineUserList pendingUpdates;
+    /** Updates are batched until a second passes without any, or batchEnd comes */
+    bool batchUpdates;
+    uint64_t batchEnd;
+
     static Counts counts;
     Counts lastCounts;
 
     void updateCounts(bool aRemove);
     void updateActivity() { lastActivity = GET_TICK(); }
 
+    /** Reports an updated user, during the login burst as part of a batch */
+    void userUpdated(OnlineUser& aUser);
+    /** Fires the batched updates; to be done before anything else about the users is */
+    void flushUpdates();
+
     virtual string checkNick(const string& nick) = 0;
     virtual void search(int aSizeMode, int64_t aSize, int aFileType, const string& aString, const string& aToken, const StringList& aExtList) = 0;
 
@@ -200,6 +211,7 @@ protected:
     virtual void on(Connected) noexcept;
     virtual void on(Line, const string& aLine) noexcept;
     virtual void on(Failed, const string&) noexcept;
+    virtual void on(Updated) noexcept;
 
 private:
 
@@ -74,8 +74,12 @@ void ClientManager::putClient(Client* aClient) {
 }
 
 size_t ClientManager::getUserCount() const {
-    Lock l(cs);
-    return onlineUsers.size();
+    size_t count = 0;
+    for(size_t i = 0; i < SHARDS; ++i) {
+        RLock l(shards[i].cs);
+        count += shards[i].onlineUsers.size();
+    }
+    return count;
 }
 
 StringList ClientManager::getHubs(const CID& cid, const string& hintUrl) {
@@ -91,10 +95,11 @@ StringList ClientManager::getNicks(const CID& cid, const string& hintUrl) {
 }
 
 StringList ClientManager::getHubs(const CID& cid, const string& hintUrl, bool priv) {
-    Lock l(cs);
+    const Shard& s = getShard(cid);
+    RLock l(s.cs);
     StringList lst;
     if(!priv) {
-        OnlinePairC op = onlineUsers.equal_range(cid);
+        OnlinePairC op = s.onlineUsers.equal_range(cid);
         for(auto i = op.first; i != op.second; ++i) {
             lst.push_back(i->second->getClient().getHubUrl());
         }
@@ -107,10 +112,11 @@ StringList ClientManager::getHubs(const CID& cid, const string& hintUrl, bool pr
 }
 
 StringList ClientManager::getHubNames(const CID& cid, const string& hintUrl, bool priv) {
-    Lock l(cs);
+    const Shard& s = getShard(cid);
+    RLock l(s.cs);
     StringList lst;
     if(!priv) {
-        OnlinePairC op = onlineUsers.equal_range(cid);
+        OnlinePairC op = s.onlineUsers.equal_range(cid);
         for(auto i = op.first; i != op.second; ++i) {
             lst.push_back(i->second->getClient().getHubName());
         }
@@ -123,10 +129,11 @@ StringList ClientManager::getHubNames(const CID& cid, const string& hintUrl, boo
 }
 
 StringList ClientManager::getNicks(const CID& cid, const string& hintUrl, bool priv) {
-    Lock l(cs);
+    const Shard& s = getShard(cid);
+    RLock l(s.cs);
     StringSet ret;
     if(!priv) {
-        OnlinePairC op = onlineUsers.equal_range(cid);
+        OnlinePairC op = s.onlineUsers.equal_range(cid);
         for(auto i = op.first; i != op.second; ++i) {
             ret.insert(i->second->getIdentity().getNick());
         }
@@ -136,8 +143,8 @@ StringList ClientManager::getNicks(const CID& cid, const string& hintUrl, bool p
             ret.insert(u->getIdentity().getNick());
     }
     if(ret.empty()) {
-        auto i = nicks.find(cid);
-        if(i != nicks.end()) {
+        auto i = s.nicks.find(cid);
+        if(i != s.nicks.end()) {
             ret.insert(i->second.first);
         } else {
             // Offline perhaps?
@@ -148,7 +155,7 @@ StringList ClientManager::getNicks(const CID& cid, const string& hintUrl, bool p
 }
 
 string ClientManager::getField(const CID& cid, const string& hint, const char* field) const {
-    Lock l(cs);
+    RLock l(getShard(cid).cs);
 
     OnlinePairC p;
     auto u = findOnlineUserHint(cid, hint, p);
@@ -170,28 +177,33 @@ string ClientManager::getField(const CID& cid, const string& hint, const char* f
 }
 
 string ClientManager::getConnection(const CID& cid) const {
-    Lock l(cs);
-    auto i = onlineUsers.find(cid);
-    if(i != onlineUsers.end()) {
+    const Shard& s = getShard(cid);
+    RLock l(s.cs);
+    auto i = s.onlineUsers.find(cid);
+    if(i != s.onlineUsers.end()) {
         return i->second->getIdentity().getConnection();
     }
     return _("Offline");
 }
 
 int64_t ClientManager::getAvailable() const {
-    Lock l(cs);
     int64_t bytes = 0;
-    for(auto i = onlineUsers.begin(); i != onlineUsers.end(); ++i) {
-        bytes += i->second->getIdentity().getBytesShared();
+    for(size_t j = 0; j < SHARDS; ++j) {
+        const Shard& s = shards[j];
+        RLock l(s.cs);
+        for(auto i = s.onlineUsers.begin(); i != s.onlineUsers.end(); ++i) {
+            bytes += i->second->getIdentity().getBytesShared();
+        }
     }
 
     return bytes;
 }
 
 uint8_t ClientManager::getSlots(const CID& cid) const {
-    Lock l(cs);
-    OnlineIterC i = onlineUsers.find(cid);
-    if(i != onlineUsers.end()) {
+    const Shard& s = getShard(cid);
+    RLock l(s.cs);
+    OnlineIterC i = s.onlineUsers.find(cid);
+    if(i != s.onlineUsers.end()) {
         return static_cast<uint8_t>(Util::toInt(i->second->getIdentity().get("SL")));
     }
     return 0;
@@ -251,54 +263,69 @@ string ClientManager::findHubEncoding(const string& aUrl) const {
 UserPtr ClientManager::findLegacyUser(const string& aNick) const noexcept {
     if (aNick.empty())
         return UserPtr();
-    Lock l(cs);
 
-    for(auto i = onlineUsers.begin(); i != onlineUsers.end(); ++i) {
-        const OnlineUser* ou = i->second;
-        if(ou->getUser()->isSet(User::NMDC) && Util::stricmp(ou->getIdentity().getNick(), aNick) == 0)
-            return ou->getUser();
+    for(size_t j = 0; j < SHARDS; ++j) {
+        const Shard& s = shards[j];
+        RLock l(s.cs);
+        for(auto i = s.onlineUsers.begin(); i != s.onlineUsers.end(); ++i) {
+            const OnlineUser* ou = i->second;
+            if(ou->getUser()->isSet(User::NMDC) && Util::stricmp(ou->getIdentity().getNick(), aNick) == 0)
+                return ou->getUser();
+        }
     }
     return UserPtr();
 }
 
 UserPtr ClientManager::getUser(const string& aNick, const string& aHubUrl) noexcept {
     CID cid = makeCid(aNick, aHubUrl);
-    Lock l(cs);
+    Shard& s = getShard(cid);
+    WLock l(s.cs);
 
-    auto ui = users.find(cid);
-    if(ui != users.end()) {
+    auto ui = s.users.find(cid);
+    if(ui != s.users.end()) {
         ui->second->setFlag(User::NMDC);
         return ui->second;
     }
 
     UserPtr p(new User(cid));
     p->setFlag(User::NMDC);
-    users.insert(make_pair(cid, p));
+    s.users.insert(make_pair(cid, p));
 
     return p;
 }
 
 UserPtr ClientManager::getUser(const CID& cid) noexcept {
-    Lock l(cs);
-    auto ui = users.find(cid);
-    if(ui != users.end()) {
+    Shard& s = getShard(cid);
+    {
+        RLock l(s.cs);
+        auto ui = s.users.find(cid);
+        if(ui != s.users.end()) {
+            return ui->second;
+        }
+    }
+
+    WLock l(s.cs);
+    auto ui = s.users.find(cid);
+    if(ui != s.users.end()) {
         return ui->second;
     }
 
     UserPtr p(new User(cid));
-    users.insert(make_pair(cid, p));
+    s.users.insert(make_pair(cid, p));
     return p;
 }
 
 UserPtr ClientManager::findUser(const CID& cid) const noexcept {
-    Lock l(cs);
-    auto ui = users.find(cid);
-    return ui == users.end() ? 0 : ui->second;
+    const Shard& s = getShard(cid);
+    RLock l(s.cs);
+    auto ui = s.users.find(cid);
+    return ui == s.users.end() ? 0 : ui->second;
 }
 
 bool ClientManager::isOp(const UserPtr& user, const string& aHubUrl) const {
-    Lock l(cs);
-    OnlinePairC p = onlineUsers.equal_range(user->getCID());
+    const Shard& s = getShard(user->getCID());
+    RLock l(s.cs);
+    OnlinePairC p = s.onlineUsers.equal_range(user->getCID());
     for(auto i = p.first; i != p.second; ++i) {
         if(i->second->getClient().getHubUrl() == aHubUrl) {
             return i->second->getIdentity().isOp();
@@ -319,8 +346,9 @@ CID ClientManager::makeCid(const string& aNick, const string& aHubUrl) const noe
 
 void ClientManager::putOnline(OnlineUser* ou) noexcept {
     {
-        Lock l(cs);
-        onlineUsers.insert(make_pair(ou->getUser()->getCID(), ou));
+        Shard& s = getShard(ou->getUser()->getCID());
+        WLock l(s.cs);
+        s.onlineUsers.insert(make_pair(ou->getUser()->getCID(), ou));
     }
 
     if(!ou->getUser()->isOnline()) {
@@ -332,14 +360,15 @@ void ClientManager::putOnline(OnlineUser* ou) noexcept {
 void ClientManager::putOffline(OnlineUser* ou, bool disconnect) noexcept {
     bool lastUser = false;
     {
-        Lock l(cs);
-        OnlinePair op = onlineUsers.equal_range(ou->getUser()->getCID());
+        Shard& s = getShard(ou->getUser()->getCID());
+        WLock l(s.cs);
+        OnlinePair op = s.onlineUsers.equal_range(ou->getUser()->getCID());
         dcassert(op.first != op.second);
         for(OnlineIter i = op.first; i != op.second; ++i) {
             OnlineUser* ou2 = i->second;
             if(ou == ou2) {
                 lastUser = (distance(op.first, op.second) == 1);
-                onlineUsers.erase(i);
+                s.onlineUsers.erase(i);
                 break;
             }
         }
@@ -355,7 +384,7 @@ void ClientManager::putOffline(OnlineUser* ou, bool disconnect) noexcept {
 }
 
 OnlineUser* ClientManager::findOnlineUserHint(const CID& cid, const string& hintUrl, OnlinePairC& p) const {
-        p = onlineUsers.equal_range(cid);
+        p = getShard(cid).onlineUsers.equal_range(cid);
         if(p.first == p.second) // no user found with the given CID.
         return 0;
 
@@ -376,6 +405,7 @@ OnlineUser* ClientManager::findOnlineUser(const HintedUser& user, bool priv) {
 }
 
 OnlineUser* ClientManager::findOnlineUser(const CID& cid, const string& hintUrl, bool priv) {
+    RLock l(getShard(cid).cs);
     OnlinePairC p;
     OnlineUser* u = findOnlineUserHint(cid, hintUrl, p);
     if(u) // found an exact match (CID + hint).
@@ -392,43 +422,67 @@ OnlineUser* ClientManager::findOnlineUser(const CID& cid, const string& hintUrl,
     return p.first->second;
 }
 
+OnlineUser* ClientManager::copyOnlineUser(const CID& cid, const string& hintUrl, bool priv) {
+    RLock l(getShard(cid).cs);
+    OnlineUser* ou = findOnlineUser(cid, hintUrl, priv);
+    if(!ou)
+        return 0;
+
+    OnlineUser* u = new OnlineUser(ou->getUser(), ou->getClientBase(), ou->getIdentity().getSID());
+    u->setIdentity(ou->getIdentity());
+    return u;
+}
+
+bool ClientManager::isAlive(const ClientBase& c) const {
+    if(c.getType() != ClientBase::DIRECT_CONNECT)
+        return true;
+    return find(clients.begin(), clients.end(), &static_cast<const Client&>(c)) != clients.end();
+}
+
 void ClientManager::connect(const HintedUser& user, const string& token) {
     bool priv = FavoriteManager::getInstance()->isPrivate(user.hint);
 
-    Lock l(cs);
-    OnlineUser* u = findOnlineUser(user, priv);
+    // The hub gets a copy, so that it may call back into us while the shard is free;
+    // the hub list lock keeps it from going away meanwhile
+    unique_ptr<OnlineUser> u(copyOnlineUser(user.user->getCID(), user.hint, priv));
 
-    if(u) {
-        u->getClient().connect(*u, token);
+    if(u.get()) {
+        Lock l(cs);
+        if(isAlive(u->getClientBase()))
+            u->getClientBase().connect(*u, token);
     }
 }
 
 void ClientManager::privateMessage(const HintedUser& user, const string& msg, bool thirdPerson) {
     bool priv = FavoriteManager::getInstance()->isPrivate(user.hint);
 
-    Lock l(cs);
-    OnlineUser* u = findOnlineUser(user, priv);
+    unique_ptr<OnlineUser> u(copyOnlineUser(user.user->getCID(), user.hint, priv));
 
-    if(u) {
-        u->getClient().privateMessage(*u, msg, thirdPerson);
+    if(u.get()) {
+        Lock l(cs);
+        if(isAlive(u->getClientBase()))
+            u->getClientBase().privateMessage(*u, msg, thirdPerson);
     }
 }
 
 void ClientManager::userCommand(const HintedUser& user, const UserCommand& uc, StringMap& params, bool compatibility) {
-    Lock l(cs);
     /** @todo we allow wrong hints for now ("false" param of findOnlineUser) because users
      * extracted from search results don't always have a correct hint; see
      * SearchManager::onRES(const AdcCommand& cmd, ...). when that is done, and SearchResults are
      * switched to storing only reliable HintedUsers (found with the token of the ADC command),
      * change this call to findOnlineUserHint. */
-    OnlineUser* ou = findOnlineUser(user.user->getCID(), user.hint.empty() ? uc.getHub() : user.hint, false);
-    if(!ou
+    unique_ptr<OnlineUser> ou(copyOnlineUser(user.user->getCID(), user.hint.empty() ? uc.getHub() : user.hint, false));
+    if(!ou.get()
 #ifdef WITH_DHT
        || ou->getClientBase().type == ClientBase::DHT
 #endif
                                                              )
         return;
 
+    Lock l(cs);
+    if(!isAlive(ou->getClientBase()))
+        return;
+
     ou->getIdentity().getParams(params, "user", compatibility);
     ou->getClient().getHubIdentity().getParams(params, "hub", false);
     ou->getClient().getMyIdentity().getParams(params, "my", compatibility);
@@ -437,27 +491,41 @@ void ClientManager::userCommand(const HintedUser& user, const UserCommand& uc, S
 }
 
 void ClientManager::send(AdcCommand& cmd, const CID& cid) {
-    Lock l(cs);
-    auto i = onlineUsers.find(cid);
-    if(i != onlineUsers.end()) {
+    ClientBase* c;
+    bool udpActive, nmdc;
+    uint32_t sid;
+    string ip, port;
+    {
+        const Shard& s = getShard(cid);
+        RLock l(s.cs);
+        auto i = s.onlineUsers.find(cid);
+        if(i == s.onlineUsers.end())
+            return;
+
         OnlineUser& u = *i->second;
-        if(cmd.getType() == AdcCommand::TYPE_UDP && !u.getIdentity().isUdpActive()) {
-            if(u.getUser()->isNMDC()
+        c = &u.getClientBase();
+        udpActive = u.getIdentity().isUdpActive();
+        nmdc = u.getUser()->isNMDC();
+        sid = u.getIdentity().getSID();
+        ip = u.getIdentity().getIp();
+        port = u.getIdentity().getUdpPort();
+    }
+
+    if(cmd.getType() == AdcCommand::TYPE_UDP && !udpActive) {
+        if(nmdc
 #ifdef WITH_DHT
-                || u.getClientBase().getType() == Client::DHT
+            || c->getType() == Client::DHT
 #endif
-                                                              )
-                return;
-            cmd.setType(AdcCommand::TYPE_DIRECT);
-            cmd.setTo(u.getIdentity().getSID());
-            u.getClient().send(cmd);
-        } else {
-            try {
-                udp.writeTo(u.getIdentity().getIp(), static_cast<uint16_t>(Util::toInt(u.getIdentity().getUdpPort())), cmd.toString(getMe()->getCID()));
-            } catch(const SocketException&) {
-                dcdebug("Socket exception sending ADC UDP command\n");
-            }
-        }
+                                           )
+            return;
+        cmd.setType(AdcCommand::TYPE_DIRECT);
+        cmd.setTo(sid);
+
+        Lock l(cs);
+        if(isAlive(*c))
+            static_cast<Client*>(c)->send(cmd);
+    } else {
+        SearchManager::getInstance()->sendUdp(ip, static_cast<uint16_t>(Util::toInt(port)), cmd.toString(getMe()->getCID()));
     }
 }
 
@@ -483,6 +551,13 @@ void ClientManager::on(NmdcSearch, Client* aClient, const string& aSeeker, int a
         return;
     }
 
+    // An active seeker asking through several hubs only needs one set of results
+    if(!isPassive && SearchManager::getInstance()->isRepeatedSearch(aSeeker, Util::toString(aSearchType) + '?' + Util::toString(aSize) +
+        '?' + Util::toString(aFileType) + '?' + aString))
+    {
+        return;
+    }
+
     SearchResultList l;
     ShareManager::getInstance()->search(l, aString, aSearchType, aSize, aFileType, aClient, isPassive ? 5 : 10);
 //      dcdebug("Found %d items (%s)\n", l.size(), aString.c_str());
@@ -514,7 +589,7 @@ void ClientManager::on(NmdcSearch, Client* aClient, const string& aSeeker, int a
                     port = 412;
                 for(auto i = l.begin(); i != l.end(); ++i) {
                     const SearchResultPtr& sr = *i;
-                    udp.writeTo(ip, port, sr->toSR(*aClient));
+                    SearchManager::getInstance()->sendUdp(ip, port, sr->toSR(*aClient));
                 }
             } catch(const SocketException& /* e */) {
                 dcdebug("Search caught error\n");
@@ -536,8 +611,7 @@ void ClientManager::on(NmdcSearch, Client* aClient, const string& aSeeker, int a
 
         try {
             AdcCommand cmd = SearchManager::getInstance()->toPSR(true, aClient->getMyNick(), aClient->getIpPort(), aTTH.toBase32(), partialInfo);
-            Socket s;
-            s.writeTo(Socket::resolve(ip), port, cmd.toString(ClientManager::getInstance()->getMe()->getCID()));
+            SearchManager::getInstance()->sendUdp(Socket::resolve(ip), port, cmd.toString(ClientManager::getInstance()->getMe()->getCID()));
         } catch(...) {
             dcdebug("Partial search caught error\n");
         }
@@ -547,10 +621,11 @@ void ClientManager::on(NmdcSearch, Client* aClient, const string& aSeeker, int a
 void ClientManager::on(AdcSearch, Client* c, const AdcCommand& adc, const CID& from) noexcept {
     bool isUdpActive = false;
     {
-        Lock l(cs);
+        const Shard& s = getShard(from);
+        RLock l(s.cs);
 
-        auto i = onlineUsers.find(from);
-        if(i != onlineUsers.end()) {
+        auto i = s.onlineUsers.find(from);
+        if(i != s.onlineUsers.end()) {
             OnlineUser& u = *i->second;
             isUdpActive = u.getIdentity().isUdpActive();
         }
@@ -615,18 +690,21 @@ uint64_t ClientManager::search(StringList& who, int aSizeMode, int64_t aSize, in
 }
 
 void ClientManager::on(TimerManagerListener::Minute, uint64_t /* aTick */) noexcept {
-    Lock l(cs);
-
     // Collect some garbage...
-    auto i = users.begin();
-    while(i != users.end()) {
-        if(i->second->unique()) {
-            users.erase(i++);
-        } else {
-            ++i;
+    for(size_t j = 0; j < SHARDS; ++j) {
+        Shard& s = shards[j];
+        WLock l(s.cs);
+        auto i = s.users.begin();
+        while(i != s.users.end()) {
+            if(i->second->unique()) {
+                s.users.erase(i++);
+            } else {
+                ++i;
+            }
         }
     }
 
+    Lock l(cs);
     for(auto j = clients.begin(); j != clients.end(); ++j) {
         (*j)->info(false);
     }
@@ -634,10 +712,12 @@ void ClientManager::on(TimerManagerListener::Minute, uint64_t /* aTick */) noexc
 
 UserPtr& ClientManager::getMe() {
     if(!me) {
-        Lock l(cs);
+        CID cid = getMyCID();
+        Shard& s = getShard(cid);
+        WLock l(s.cs);
         if(!me) {
-            me = new User(getMyCID());
-            users.insert(make_pair(me->getCID(), me));
+            me = new User(cid);
+            s.users.insert(make_pair(me->getCID(), me));
         }
     }
     return me;
@@ -657,10 +737,11 @@ CID ClientManager::getMyCID() {
 
 void ClientManager::updateNick(const OnlineUser& user) noexcept {
     if(!user.getIdentity().getNick().empty()) {
-        Lock l(cs);
-        auto i = nicks.find(user.getUser()->getCID());
-        if(i == nicks.end()) {
-                nicks[user.getUser()->getCID()] = std::make_pair(user.getIdentity().getNick(), false);
+        Shard& s = getShard(user.getUser()->getCID());
+        WLock l(s.cs);
+        auto i = s.nicks.find(user.getUser()->getCID());
+        if(i == s.nicks.end()) {
+                s.nicks[user.getUser()->getCID()] = std::make_pair(user.getIdentity().getNick(), false);
         } else {
                 i->second.first = user.getIdentity().getNick();
         }
@@ -675,11 +756,11 @@ void ClientManager::loadUsers() {
         if(xml.findChild("Users")) {
             xml.stepIn();
 
-            {
-                Lock l(cs);
-                while(xml.findChild("User")) {
-                    nicks[CID(xml.getChildAttrib("CID"))] = std::make_pair(xml.getChildAttrib("Nick"), false);
-                }
+            while(xml.findChild("User")) {
+                CID cid(xml.getChildAttrib("CID"));
+                Shard& s = getShard(cid);
+                WLock l(s.cs);
+                s.nicks[cid] = std::make_pair(xml.getChildAttrib("Nick"), false);
             }
 
             xml.stepOut();
@@ -693,9 +774,10 @@ void ClientManager::saveUsers() const {
         xml.addTag("Users");
         xml.stepIn();
 
-        {
-            Lock l(cs);
-            for(auto i = nicks.begin(), iend = nicks.end(); i != iend; ++i) {
+        for(size_t j = 0; j < SHARDS; ++j) {
+            const Shard& s = shards[j];
+            RLock l(s.cs);
+            for(auto i = s.nicks.begin(), iend = s.nicks.end(); i != iend; ++i) {
                 if(i->second.second) {
                     xml.addTag("User");
                     xml.addChildAttrib("CID", i->first.toBase32());
@@ -719,9 +801,10 @@ void ClientManager::saveUsers() const {
 }
 
 void ClientManager::saveUser(const CID& cid) {
-    Lock l(cs);
-    auto i = nicks.find(cid);
-    if(i != nicks.end())
+    Shard& s = getShard(cid);
+    WLock l(s.cs);
+    auto i = s.nicks.find(cid);
+    if(i != s.nicks.end())
         i->second.second = true;
 }
 
@@ -736,7 +819,16 @@ void ClientManager::on(UserUpdated, Client*, const OnlineUser& user) noexcept {
 
 void ClientManager::on(UsersUpdated, Client* c, const OnlineUserList& l) noexcept {
     for(auto i = l.cbegin(), iend = l.cend(); i != iend; ++i) {
-        updateNick(*(*i));
+        const string& nick = (*i)->getIdentity().getNick();
+        if(!nick.empty()) {
+            const CID& cid = (*i)->getUser()->getCID();
+            Shard& s = getShard(cid);
+            WLock l2(s.cs);
+            s.nicks[cid].first = nick;
+        }
+    }
+
+    for(auto i = l.cbegin(), iend = l.cend(); i != iend; ++i) {
         fire(ClientManagerListener::UserUpdated(), *(*i));
     }
 }
@@ -796,9 +888,10 @@ void ClientManager::cancelSearch(void* aOwner) {
 
 #ifdef WITH_DHT
 OnlineUserPtr ClientManager::findDHTNode(const CID& cid) const {
-    Lock l(cs);
+    const Shard& s = getShard(cid);
+    RLock l(s.cs);
 
-    OnlinePairC op = onlineUsers.equal_range(cid);
+    OnlinePairC op = s.onlineUsers.equal_range(cid);
     for(auto i = op.first; i != op.second; ++i) {
         OnlineUser* ou = i->second;
 
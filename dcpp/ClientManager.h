@@ -83,15 +83,17 @@ public:
     UserPtr findLegacyUser(const string& aNick) const noexcept;
 
     bool isOnline(const UserPtr& aUser) const {
-        Lock l(cs);
-        return onlineUsers.find(aUser->getCID()) != onlineUsers.end();
+        const Shard& s = getShard(aUser->getCID());
+        RLock l(s.cs);
+        return s.onlineUsers.find(aUser->getCID()) != s.onlineUsers.end();
     }
 
     Identity getOnlineUserIdentity(const UserPtr& aUser) const {
-        Lock l(cs);
+        const Shard& s = getShard(aUser->getCID());
+        RLock l(s.cs);
         OnlineMap::const_iterator i;
-        i=onlineUsers.find(aUser->getCID());
-        if ( i != onlineUsers.end() )
+        i=s.onlineUsers.find(aUser->getCID());
+        if ( i != s.onlineUsers.end() )
         {
             return i->second->getIdentity();
         }
@@ -101,9 +103,10 @@ public:
     int64_t getBytesShared(const UserPtr& p) const{
         int64_t l_share = 0;
         {
-            Lock l ( cs );
-            OnlineIterC i = onlineUsers.find ( *const_cast<CID*> ( &p->getCID() ) );
-            if ( i != onlineUsers.end() )
+            const Shard& s = getShard(p->getCID());
+            RLock l ( s.cs );
+            OnlineIterC i = s.onlineUsers.find ( p->getCID() );
+            if ( i != s.onlineUsers.end() )
                 l_share = i->second->getIdentity().getBytesShared();
         }
         return l_share;
@@ -113,9 +116,10 @@ public:
         if(IP.empty())
             return;
 
-        Lock l(cs);
-        OnlineMap::const_iterator i = onlineUsers.find(user->getCID());
-        if ( i != onlineUsers.end() ) {
+        const Shard& s = getShard(user->getCID());
+        RLock l(s.cs);
+        OnlineMap::const_iterator i = s.onlineUsers.find(user->getCID());
+        if ( i != s.onlineUsers.end() ) {
             i->second->getIdentity().setIp(IP);
             if(udpPort > 0)
                 i->second->getIdentity().setUdpPort(Util::toString(udpPort));
@@ -175,17 +179,26 @@ private:
     typedef pair<OnlineIter, OnlineIter> OnlinePair;
     typedef pair<OnlineIterC, OnlineIterC> OnlinePairC;
 
+    /**
+     * Users are split by CID into shards with a lock of their own, so hubs
+     * rarely wait for each other and lookups don't wait for unrelated updates.
+     */
+    struct Shard {
+        mutable SharedCriticalSection cs;
+        UserMap users;
+        OnlineMap onlineUsers;
+        NickMap nicks;
+    };
+    enum { SHARDS = 16 };
+
+    /** Guards the hub list */
     Client::List clients;
     mutable CriticalSection cs;
 
-    UserMap users;
-    OnlineMap onlineUsers;
-    NickMap nicks;
+    Shard shards[SHARDS];
 
     UserPtr me;
 
-    Socket udp;
-
     CID pid;
 
     friend class Singleton<ClientManager>;
@@ -198,8 +211,18 @@ private:
         TimerManager::getInstance()->removeListener(this);
     }
 
+    // CIDs are hashes, so any byte will do; the first ones already pick the hash table buckets
+    Shard& getShard(const CID& cid) { return shards[cid.data()[CID::SIZE - 1] % SHARDS]; }
+    const Shard& getShard(const CID& cid) const { return shards[cid.data()[CID::SIZE - 1] % SHARDS]; }
+
     void updateNick(const OnlineUser& user) noexcept;
 
+    /// @return a copy of the user findOnlineUser finds, to call the hub with once the shard is unlocked
+    OnlineUser* copyOnlineUser(const CID& cid, const string& hintUrl, bool priv);
+    /// cs has to be locked; the hub can't go away as long as it is.
+    bool isAlive(const ClientBase& c) const;
+
+    /// The shard of cid has to be locked.
     /// @return OnlineUser* found by CID and hint; discard any user that doesn't match the hint.
     OnlineUser* findOnlineUserHint(const CID& cid, const string& hintUrl) const {
         OnlinePairC p;
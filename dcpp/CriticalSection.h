@@ -155,3 +155,150 @@ typedef LockBase<FastCriticalSection> FastLock;
 
 #endif // DO_NOT_USE_MUTEX
 
+#if defined (_WIN32)
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#else
+#include <condition_variable>
+#include <mutex>
+#endif
+#include <atomic>
+
+#include "compiler.h"
+
+namespace dcpp {
+
+/**
+ * Reader/writer lock. Both sides may be taken again by a thread that
+ * already holds them, and a thread holding it exclusively may also take it
+ * shared - but never the other way around.
+ *
+ * Readers only touch an atomic counter as long as no writer is around. A
+ * waiting writer keeps new readers out so that it can't be starved; only
+ * threads that already hold some shared lock are still let in, as they
+ * might otherwise deadlock with the writer waiting for them.
+ */
+class SharedCriticalSection {
+public:
+    SharedCriticalSection() : readers(0), writers(0), owner(0), depth(0), writing(false) { }
+
+    void lock() {
+        const void* self = getThread();
+        if(owner.load() == self) {
+            ++depth;
+            return;
+        }
+
+        UniqueLock l(mtx);
+        // From here on new readers wait
+        ++writers;
+        while(writing || readers.load() != 0)
+            cond.wait(l);
+        writing = true;
+        owner = self;
+        depth = 1;
+    }
+
+    void unlock() {
+        dcassert(owner.load() == getThread() && depth > 0);
+        if(--depth > 0)
+            return;
+
+        UniqueLock l(mtx);
+        owner = 0;
+        writing = false;
+        --writers;
+        cond.notify_all();
+    }
+
+    void lockShared() {
+        if(owner.load() == getThread()) {
+            ++depth;
+            return;
+        }
+
+        // Pairs with the writer's check of the readers: one of the two sees the other
+        readers++;
+        if(writers.load() != 0) {
+            readers--;
+
+            UniqueLock l(mtx);
+            cond.notify_all();
+            while(writing || (writers.load() != 0 && getShared() == 0))
+                cond.wait(l);
+            readers++;
+        }
+        getShared()++;
+    }
+
+    void unlockShared() {
+        if(owner.load() == getThread()) {
+            // Only the writer itself can hold it shared at the same time
+            dcassert(depth > 1);
+            --depth;
+            return;
+        }
+
+        getShared()--;
+        if(--readers == 0 && writers.load() != 0) {
+            UniqueLock l(mtx);
+            cond.notify_all();
+        }
+    }
+
+private:
+#if defined (_WIN32)
+    typedef boost::mutex Mutex;
+    typedef boost::unique_lock<boost::mutex> UniqueLock;
+    boost::condition_variable cond;
+#else
+    typedef std::mutex Mutex;
+    typedef std::unique_lock<std::mutex> UniqueLock;
+    std::condition_variable cond;
+#endif
+
+    /** Shared locks the current thread holds, of any SharedCriticalSection */
+    static int& getShared() {
+        static DCPP_THREAD_LOCAL int shared = 0;
+        return shared;
+    }
+    /** Tells the threads apart; it's the address of their own counter */
+    static const void* getThread() { return &getShared(); }
+
+    Mutex mtx;
+    std::atomic<int> readers;
+    /** Writers holding the lock or waiting for it */
+    std::atomic<int> writers;
+    std::atomic<const void*> owner;
+    /** Recursion of the owner; only touched by the owner */
+    int depth;
+    /** Guarded by mtx */
+    bool writing;
+
+    SharedCriticalSection(const SharedCriticalSection&);
+    SharedCriticalSection& operator=(const SharedCriticalSection&);
+};
+
+/** Holds a SharedCriticalSection shared */
+class RLock {
+public:
+    RLock(SharedCriticalSection& aCs) : cs(aCs) { cs.lockShared(); }
+    ~RLock() { cs.unlockShared(); }
+private:
+    RLock(const RLock&);
+    RLock& operator=(const RLock&);
+    SharedCriticalSection& cs;
+};
+
+/** Holds a SharedCriticalSection exclusively */
+class WLock {
+public:
+    WLock(SharedCriticalSection& aCs) : cs(aCs) { cs.lock(); }
+    ~WLock() { cs.unlock(); }
+private:
+    WLock(const WLock&);
+    WLock& operator=(const WLock&);
+    SharedCriticalSection& cs;
+};
+
+} // namespace dcpp
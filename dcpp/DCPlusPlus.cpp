@@ -35,6 +35,7 @@
 #include "FinishedManager.h"
 #include "ResourceManager.h"
 #include "ThrottleManager.h"
+#include "SocketReactor.h"
 #include "ADLSearch.h"
 //#include "WindowManager.h"
 #include "StringTokenizer.h"
@@ -87,6 +88,7 @@ void startup(void (*f)(void*, const string&), void* p) {
     DownloadManager::newInstance();
     UploadManager::newInstance();
     ThrottleManager::newInstance();
+    SocketReactor::newInstance();
     QueueManager::newInstance();
     ShareManager::newInstance();
     FavoriteManager::newInstance();
@@ -173,6 +175,7 @@ void shutdown() {
     UploadManager::deleteInstance();
     QueueManager::deleteInstance();
     ConnectionManager::deleteInstance();
+    SocketReactor::deleteInstance();
     SearchManager::deleteInstance();
     FavoriteManager::deleteInstance();
     ClientManager::deleteInstance();
@@ -31,6 +31,8 @@
 #include "ShareManager.h"
 #include "SimpleXMLReader.h"
 #include "File.h"
+#include "Thread.h"
+#include "Semaphore.h"
 
 #ifdef ff
 #undef ff
@@ -38,6 +40,8 @@
 
 namespace dcpp {
 
+const MediaInfo DirectoryListing::File::noMediaInfo = MediaInfo();
+
 DirectoryListing::DirectoryListing(const HintedUser& aUser) :
 user(aUser),
 root(new Directory(NULL, Util::emptyString, false, false))
@@ -80,6 +84,123 @@ UserPtr DirectoryListing::getUserFromFilename(const string& fileName) {
     return ClientManager::getInstance()->getUser(cid);
 }
 
+/**
+ * Decompresses a file list on a thread of its own, so that bzip2 and the XML
+ * parser don't have to wait for each other.
+ */
+class UnBZPipe : public InputStream, private Thread {
+public:
+    UnBZPipe(InputStream* aSource) : source(aSource), pos(0), done(false), stop(false), threaded(false) {
+        for(int i = 0; i < CHUNKS; ++i)
+            freeChunks.signal();
+        try {
+            start();
+            threaded = true;
+        } catch(const ThreadException&) {
+            // Decompress as the parser goes then
+        }
+    }
+
+    virtual ~UnBZPipe() {
+        stop = true;
+        freeChunks.signal();
+        join();
+    }
+
+    size_t read(void* buf, size_t& len) {
+        if(!threaded)
+            return source.read(buf, len);
+
+        if(pos == cur.size()) {
+            if(done) {
+                len = 0;
+                return 0;
+            }
+
+            readyChunks.wait();
+            string err;
+            {
+                Lock l(cs);
+                cur.swap(ready.front());
+                ready.pop_front();
+                err = error;
+            }
+            freeChunks.signal();
+            pos = 0;
+
+            if(cur.empty()) {
+                done = true;
+                if(!err.empty())
+                    throw Exception(err);
+                len = 0;
+                return 0;
+            }
+        }
+
+        len = min(len, cur.size() - pos);
+        memcpy(buf, &cur[pos], len);
+        pos += len;
+        return len;
+    }
+
+private:
+    static const int CHUNKS = 4;
+    static const size_t CHUNK_SIZE = 1024*1024;
+
+    FilteredInputStream<UnBZFilter, false> source;
+
+    CriticalSection cs;
+    /** Decompressed data; an empty chunk ends the stream */
+    deque<ByteVector> ready;
+    string error;
+    Semaphore readyChunks;
+    Semaphore freeChunks;
+
+    ByteVector cur;
+    size_t pos;
+    bool done;
+
+    volatile bool stop;
+    bool threaded;
+
+    int run() {
+        setThreadName("UnBZPipe");
+
+        ByteVector chunk;
+        try {
+            bool more = true;
+            while(more) {
+                freeChunks.wait();
+                if(stop)
+                    return 0;
+
+                chunk.resize(CHUNK_SIZE);
+                size_t n = chunk.size();
+                chunk.resize(source.read(&chunk[0], n));
+                more = !chunk.empty();
+                push(chunk);
+            }
+        } catch(const Exception& e) {
+            {
+                Lock l(cs);
+                error = e.getError();
+            }
+            chunk.clear();
+            push(chunk);
+        }
+        return 0;
+    }
+
+    void push(ByteVector& aChunk) {
+        {
+            Lock l(cs);
+            ready.push_back(ByteVector());
+            ready.back().swap(aChunk);
+        }
+        readyChunks.signal();
+    }
+};
+
 void DirectoryListing::loadFile(const string& name) {
     string txt;
 
@@ -88,7 +209,7 @@ void DirectoryListing::loadFile(const string& name) {
 
     dcpp::File ff(name, dcpp::File::READ, dcpp::File::OPEN);
     if(Util::stricmp(ext, ".bz2") == 0) {
-        FilteredInputStream<UnBZFilter, false> f(&ff);
+        UnBZPipe f(&ff);
         loadXML(f, false);
     } else if(Util::stricmp(ext, ".xml") == 0) {
         loadXML(ff, false);
@@ -168,15 +289,12 @@ void ListLoader::startTag(const string& name, StringPairList& attribs, bool simp
 
             if(updating) {
                 // just update the current file if it is already there.
-                for(auto i = cur->files.cbegin(), iend = cur->files.cend(); i != iend; ++i) {
-                    auto& file = **i;
-                    /// @todo comparisons should be case-insensitive but it takes too long - add a cache
-                    if(file.getTTH() == tth || file.getName() == n) {
-                        file.setName(n);
-                        file.setSize(size);
-                        file.setTTH(tth);
-                        return;
-                    }
+                DirectoryListing::File* file = cur->findFile(n, tth);
+                if(file) {
+                    file->setName(n);
+                    file->setSize(size);
+                    file->setTTH(tth);
+                    return;
                 }
             }
 
@@ -196,10 +314,13 @@ void ListLoader::startTag(const string& name, StringPairList& attribs, bool simp
             if (!l_ts.empty()){
                 f->setTS(atol(l_ts.c_str()));
                 f->setHit(atol(getAttrib(attribs, sHIT, 3).c_str()));
-                f->mediaInfo.video_info = getAttrib(attribs, sMVideo, 3);
-                f->mediaInfo.audio_info = getAttrib(attribs, sMAudio, 3);
-                f->mediaInfo.resolution = getAttrib(attribs, sWH, 3);
-                f->mediaInfo.bitrate    = atoi(getAttrib(attribs, sBR, 4).c_str());
+
+                MediaInfo mi;
+                mi.video_info = getAttrib(attribs, sMVideo, 3);
+                mi.audio_info = getAttrib(attribs, sMAudio, 3);
+                mi.resolution = getAttrib(attribs, sWH, 3);
+                mi.bitrate    = atoi(getAttrib(attribs, sBR, 4).c_str());
+                f->setMediaInfo(mi);
             }
 
             cur->files.push_back(f);
@@ -211,15 +332,9 @@ void ListLoader::startTag(const string& name, StringPairList& attribs, bool simp
             bool incomp = getAttrib(attribs, sIncomplete, 1) == "1";
             DirectoryListing::Directory* d = NULL;
             if(updating) {
-                for(auto i = cur->directories.begin(); i != cur->directories.end(); ++i) {
-                    /// @todo comparisons should be case-insensitive but it takes too long - add a cache
-                    if((*i)->getName() == n) {
-                        d = *i;
-                        if(!d->getComplete())
-                            d->setComplete(!incomp);
-                        break;
-                    }
-                }
+                d = cur->findDirectory(n);
+                if(d && !d->getComplete())
+                    d->setComplete(!incomp);
             }
             if(d == NULL) {
                 d = new DirectoryListing::Directory(cur, n, false, !incomp);
@@ -239,13 +354,7 @@ void ListLoader::startTag(const string& name, StringPairList& attribs, bool simp
         }
         StringList sl = StringTokenizer<string>(base.substr(1), '/').getTokens();
         for(auto i = sl.begin(); i != sl.end(); ++i) {
-            DirectoryListing::Directory* d = NULL;
-            for(auto j = cur->directories.begin(); j != cur->directories.end(); ++j) {
-                if((*j)->getName() == *i) {
-                    d = *j;
-                    break;
-                }
-            }
+            DirectoryListing::Directory* d = cur->findDirectory(*i);
             if(d == NULL) {
                 d = new DirectoryListing::Directory(cur, *i, false, false);
                 cur->directories.push_back(d);
@@ -352,12 +461,12 @@ DirectoryListing::Directory* DirectoryListing::find(const string& aName, Directo
     dcassert(end != string::npos);
     auto name = aName.substr(0, end);
 
-    auto i = std::find(current->directories.begin(), current->directories.end(), name);
-    if(i != current->directories.end()) {
+    Directory* d = current->findDirectory(name);
+    if(d) {
         if(end == (aName.size() - 1))
-            return *i;
+            return d;
         else
-            return find(aName.substr(end + 1), *i);
+            return find(aName.substr(end + 1), d);
     }
     return NULL;
 }
@@ -392,6 +501,108 @@ void DirectoryListing::Directory::filterList(DirectoryListing::Directory::TTHSet
     for(auto i = directories.begin(); i != directories.end(); ++i) (*i)->filterList(l);
     directories.erase(std::remove_if(directories.begin(),directories.end(),DirectoryEmpty()),directories.end());
     files.erase(std::remove_if(files.begin(),files.end(),HashContained(l)),files.end());
+    childrenChanged();
+}
+
+/** Fewer children than this are simply gone through */
+static const size_t INDEX_THRESHOLD = 32;
+
+void DirectoryListing::Directory::ChildIndex::add(const Directory* d, size_t pos) {
+    string tmp;
+    names.insert(make_pair(Text::toLower(d->getName(), tmp), pos));
+}
+
+void DirectoryListing::Directory::ChildIndex::add(const File* f, size_t pos) {
+    string tmp;
+    names.insert(make_pair(Text::toLower(f->getName(), tmp), pos));
+    tths.insert(make_pair(f->getTTH(), pos));
+}
+
+size_t DirectoryListing::Directory::ChildIndex::find(const string& aName, const TTHValue* aTTH) const {
+    string tmp;
+    auto i = names.find(Text::toLower(aName, tmp));
+    size_t pos = (i == names.end()) ? string::npos : i->second;
+    if(aTTH) {
+        auto j = tths.find(*aTTH);
+        if(j != tths.end())
+            pos = min(pos, j->second);
+    }
+    return pos;
+}
+
+static inline bool matches(const DirectoryListing::Directory* d, const string& aName, const TTHValue*) {
+    return Util::stricmp(d->getName(), aName) == 0;
+}
+
+static inline bool matches(const DirectoryListing::File* f, const string& aName, const TTHValue* aTTH) {
+    return (aTTH && f->getTTH() == *aTTH) || Util::stricmp(f->getName(), aName) == 0;
+}
+
+DirectoryListing::Directory::~Directory() {
+    for_each(directories.begin(), directories.end(), DeleteFunction());
+    for_each(files.begin(), files.end(), DeleteFunction());
+}
+
+void DirectoryListing::File::setName(const string& aName) {
+    if(aName != name) {
+        name = aName;
+        if(parent)
+            parent->childrenChanged();
+    }
+}
+
+void DirectoryListing::File::setTTH(const TTHValue& aTTH) {
+    if(aTTH != tthRoot) {
+        tthRoot = aTTH;
+        if(parent)
+            parent->childrenChanged();
+    }
+}
+
+void DirectoryListing::Directory::setName(const string& aName) {
+    if(aName != name) {
+        name = aName;
+        if(parent)
+            parent->childrenChanged();
+    }
+}
+
+DirectoryListing::Directory* DirectoryListing::Directory::findDirectory(const string& aName) {
+    return findChild(directories, dirIndex, aName, NULL);
+}
+
+DirectoryListing::File* DirectoryListing::Directory::findFile(const string& aName, const TTHValue& aTTH) {
+    return findChild(files, fileIndex, aName, &aTTH);
+}
+
+template<typename T>
+T* DirectoryListing::Directory::findChild(vector<T*>& aChildren, std::unique_ptr<ChildIndex>& aIndex, const string& aName, const TTHValue* aTTH) {
+    if(aChildren.size() < INDEX_THRESHOLD) {
+        aIndex.reset();
+        for(auto i = aChildren.begin(); i != aChildren.end(); ++i) {
+            if(matches(*i, aName, aTTH))
+                return *i;
+        }
+        return NULL;
+    }
+
+    // New children are picked up from the end. Renames and removals bump the generation; anything
+    // else done to the public lists (sorting) shows up as a position that doesn't match
+    for(int tries = 0; tries < 2; ++tries) {
+        if(!aIndex.get() || aIndex->generation != generation || aIndex->count > aChildren.size())
+            aIndex.reset(new ChildIndex(generation));
+        for(; aIndex->count < aChildren.size(); ++aIndex->count)
+            aIndex->add(aChildren[aIndex->count], aIndex->count);
+
+        size_t pos = aIndex->find(aName, aTTH);
+        if(pos == string::npos)
+            return NULL;
+        if(matches(aChildren[pos], aName, aTTH))
+            return aChildren[pos];
+
+        aIndex.reset();
+    }
+    return NULL;
 }
 
 void DirectoryListing::Directory::getHashList(DirectoryListing::Directory::TTHSet& l) {
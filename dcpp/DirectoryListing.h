@@ -50,25 +50,58 @@ public:
         {
         }
 
-        File(const File& rhs, bool _adls = false) : name(rhs.name), size(rhs.size), parent(rhs.parent), tthRoot(rhs.tthRoot), adls(_adls)
+        File(const File& rhs, bool _adls = false) : name(rhs.name), size(rhs.size), parent(rhs.parent), tthRoot(rhs.tthRoot), adls(_adls),
+            extra(rhs.extra.get() ? new Extra(*rhs.extra) : 0)
         {
         }
 
         File& operator=(const File& rhs) {
             name = rhs.name; size = rhs.size; parent = rhs.parent; tthRoot = rhs.tthRoot;
+            extra.reset(rhs.extra.get() ? new Extra(*rhs.extra) : 0);
             return *this;
         }
 
         ~File() { }
 
-        GETSET(string, name, Name);
+    private:
+        string name;
+    public:
+        const string& getName() const { return name; }
+        /** Tells the parent, so that it doesn't look the file up by the old name */
+        void setName(const string& aName);
         GETSET(int64_t, size, Size);
         GETSET(Directory*, parent, Parent);
-        GETSET(TTHValue, tthRoot, TTH);
+    private:
+        TTHValue tthRoot;
+    public:
+        const TTHValue& getTTH() const { return tthRoot; }
+        void setTTH(const TTHValue& aTTH);
         GETSET(bool, adls, Adls);
-        GETSET(uint64_t, ts, TS);
-        GETSET(uint64_t, hit, Hit);
-        MediaInfo mediaInfo;
+
+        uint64_t getTS() const { return extra.get() ? extra->ts : 0; }
+        void setTS(uint64_t aTS) { getExtra().ts = aTS; }
+        uint64_t getHit() const { return extra.get() ? extra->hit : 0; }
+        void setHit(uint64_t aHit) { getExtra().hit = aHit; }
+        const MediaInfo& getMediaInfo() const { return extra.get() ? extra->mediaInfo : noMediaInfo; }
+        void setMediaInfo(const MediaInfo& aInfo) { getExtra().mediaInfo = aInfo; }
+
+    private:
+        /** Only lists with media info have these, so they are kept apart to keep files small */
+        struct Extra {
+            Extra() : ts(0), hit(0) { mediaInfo.bitrate = 0; }
+            uint64_t ts;
+            uint64_t hit;
+            MediaInfo mediaInfo;
+        };
+        std::unique_ptr<Extra> extra;
+
+        static const MediaInfo noMediaInfo;
+
+        Extra& getExtra() {
+            if(!extra.get())
+                extra.reset(new Extra);
+            return *extra;
+        }
     };
 
     class Directory : public FastAlloc<Directory>, boost::noncopyable {
@@ -88,12 +121,14 @@ public:
         File::List files;
 
         Directory(Directory* aParent, const string& aName, bool _adls, bool aComplete)
-            : name(aName), parent(aParent), adls(_adls), complete(aComplete) { }
+            : name(aName), parent(aParent), adls(_adls), complete(aComplete), generation(0) { }
 
-        virtual ~Directory() {
-            for_each(directories.begin(), directories.end(), DeleteFunction());
-            for_each(files.begin(), files.end(), DeleteFunction());
-        }
+        virtual ~Directory();
+
+        /** The first subdirectory with the name, compared case-insensitively; NULL if there's none */
+        Directory* findDirectory(const string& aName);
+        /** The first file with the TTH or the name; NULL if there's none */
+        File* findFile(const string& aName, const TTHValue& aTTH);
 
         size_t getTotalFileCount(bool adls = false);
         int64_t getTotalSize(bool adls = false);
@@ -111,11 +146,45 @@ public:
             return x;
         }
 
-        GETSET(string, name, Name);
+        /**
+         * Has to be called after children were taken out of the lists, so that they aren't
+         * looked up where they used to be. Renaming a child calls it by itself.
+         */
+        void childrenChanged() { ++generation; }
+
+    private:
+        string name;
+    public:
+        const string& getName() const { return name; }
+        /** Tells the parent, so that it doesn't look the directory up by the old name */
+        void setName(const string& aName);
         GETSET(Directory*, parent, Parent);
         GETSET(bool, adls, Adls);
         GETSET(bool, complete, Complete);
 
+    private:
+        /** Positions of the children by name, made once there are too many to go through */
+        struct ChildIndex {
+            ChildIndex(uint32_t aGeneration) : count(0), generation(aGeneration) { }
+
+            unordered_map<string, size_t> names;
+            unordered_map<TTHValue, size_t> tths;
+            /** How many of the children have been indexed */
+            size_t count;
+            /** The directory's generation the index was made at; it's no good for any other */
+            uint32_t generation;
+
+            void add(const Directory* d, size_t pos);
+            void add(const File* f, size_t pos);
+            size_t find(const string& aName, const TTHValue* aTTH) const;
+        };
+        std::unique_ptr<ChildIndex> dirIndex;
+        std::unique_ptr<ChildIndex> fileIndex;
+        /** Bumped whenever children are renamed or taken out */
+        uint32_t generation;
+
+        template<typename T>
+        T* findChild(vector<T*>& aChildren, std::unique_ptr<ChildIndex>& aIndex, const string& aName, const TTHValue* aTTH);
     };
 
     class AdlDirectory : public Directory {
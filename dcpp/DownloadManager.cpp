@@ -445,7 +445,7 @@ void DownloadManager::on(UserConnectionListener::FileNotAvailable, UserConnectio
 
 /** @todo Handle errors better */
 void DownloadManager::on(AdcCommand::STA, UserConnection* aSource, const AdcCommand& cmd) noexcept {
-    if(cmd.getParameters().size() < 2) {
+    if(cmd.getParamCount() < 2) {
         aSource->disconnect();
         return;
     }
@@ -20,6 +20,10 @@
 
 #include "File.h"
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
 namespace dcpp {
 
 #ifdef _WIN32
@@ -197,6 +201,43 @@ bool File::isAbsolute(const string& path) noexcept {
     return path.size() > 2 && (path[1] == ':' || path[0] == '/' || path[0] == '\\');
 }
 
+MappedFile::MappedFile(const string& aFileName) : data(NULL), size(0), h(INVALID_HANDLE_VALUE), mapping(NULL) {
+    h = ::CreateFileW(Text::utf8ToWide(aFileName).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+    if(h == INVALID_HANDLE_VALUE) {
+        throw FileException(Util::translateError(GetLastError()));
+    }
+
+    LARGE_INTEGER x;
+    if(!::GetFileSizeEx(h, &x)) {
+        DWORD err = GetLastError();
+        ::CloseHandle(h);
+        throw FileException(Util::translateError(err));
+    }
+    size = x.QuadPart;
+    if(size == 0)
+        return;
+
+    mapping = ::CreateFileMappingW(h, NULL, PAGE_READONLY, 0, 0, NULL);
+    if(mapping != NULL)
+        data = static_cast<const uint8_t*>(::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+
+    if(data == NULL) {
+        DWORD err = GetLastError();
+        if(mapping != NULL)
+            ::CloseHandle(mapping);
+        ::CloseHandle(h);
+        throw FileException(Util::translateError(err));
+    }
+}
+
+MappedFile::~MappedFile() {
+    if(data != NULL)
+        ::UnmapViewOfFile(data);
+    if(mapping != NULL)
+        ::CloseHandle(mapping);
+    ::CloseHandle(h);
+}
+
 #else // !_WIN32
 
 File::File(const string& aFileName, int access, int mode) {
@@ -403,6 +444,38 @@ bool File::isAbsolute(const string& path) noexcept {
     return path.size() > 1 && path[0] == '/';
 }
 
+MappedFile::MappedFile(const string& aFileName) : data(NULL), size(0) {
+    int fd = open(Text::fromUtf8(aFileName).c_str(), O_RDONLY);
+    if(fd == -1)
+        throw FileException(Util::translateError(errno));
+
+    struct stat s;
+    if(::fstat(fd, &s) == -1) {
+        int err = errno;
+        ::close(fd);
+        throw FileException(Util::translateError(err));
+    }
+    size = s.st_size;
+
+    if(size > 0) {
+        void* p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if(p == MAP_FAILED) {
+            int err = errno;
+            ::close(fd);
+            throw FileException(Util::translateError(err));
+        }
+        data = static_cast<const uint8_t*>(p);
+    }
+
+    // The mapping stays valid after the descriptor is closed
+    ::close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if(data != NULL)
+        munmap(const_cast<uint8_t*>(data), size);
+}
+
 #endif // !_WIN32
 
 string File::read(size_t len) {
@@ -63,6 +63,8 @@ public:
     // not sure if the client code needs this...
     int extendFile(int64_t len) noexcept;
 
+    int getHandle() const { return h; }
+
 #endif // !_WIN32
 
     File(const string& aFileName, int access, int mode);
@@ -82,6 +84,8 @@ public:
     virtual size_t write(const void* buf, size_t len);
     virtual size_t flush();
 
+    virtual File* getSourceFile(int64_t& aBytes) { aBytes = getSize() - getPos(); return this; }
+
     uint32_t getLastModified() noexcept;
 
     static void copyFile(const string& src, const string& target);
@@ -111,6 +115,25 @@ private:
     File& operator=(const File&);
 };
 
+/** Read-only view of a whole file mapped into memory; the file can still be renamed while it is mapped */
+class MappedFile : private boost::noncopyable {
+public:
+    /** @throw FileException if the file can't be opened or mapped */
+    MappedFile(const string& aFileName);
+    ~MappedFile();
+
+    const uint8_t* getData() const { return data; }
+    int64_t getSize() const { return size; }
+
+private:
+    const uint8_t* data;
+    int64_t size;
+#ifdef _WIN32
+    HANDLE h;
+    HANDLE mapping;
+#endif
+};
+
 class FileFindIter {
 public:
         /** End iterator constructor */
@@ -28,10 +28,22 @@
 
 #ifndef _WIN32
 #include <sys/mman.h> // mmap, munmap, madvise
+#include <sys/stat.h> // stat for the device id
 #include <signal.h>  // for handling read errors from previous trio
 #include <setjmp.h>
 #endif
 
+#ifdef __linux__
+#include <fcntl.h>   // O_DIRECT, posix_fadvise
+#include <sys/syscall.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+#ifdef HAVE_AIO_H
+#include <aio.h>
+#endif
+#endif
+
 #include <memory>
 
 #ifdef USE_XATTR
@@ -43,8 +55,12 @@
 
 namespace dcpp {
 
-#define HASH_FILE_VERSION_STRING "2"
 static const uint32_t HASH_FILE_VERSION = 2;
+static const uint32_t HASH_INDEX_MAGIC = 0x58444948; // "HIDX"
+static const uint32_t HASH_JOURNAL_MAGIC = 0x4c444948; // "HIDL"
+static const uint32_t HASH_INDEX_VERSION = 2;
+/** Journal entries tolerated before the index image is rewritten */
+static const size_t JOURNAL_MIN_RECORDS = 16384;
 const int64_t HashManager::MIN_BLOCK_SIZE = 64 * 1024;
 const string HashManager::StreamStore::g_streamName(".gltth");
 
@@ -178,17 +194,22 @@ bool HashManager::checkTTH(const string& aFileName, int64_t aSize, uint32_t aTim
         return true;
     }
     else if (!store.checkTTH(aFileName, aSize, aTimeStamp)) {
-        hasher.hashFile(aFileName, aSize);
+        getHasher(aFileName)->hashFile(aFileName, aSize);
         return false;
     }
     return true;
 }
 
+void HashManager::renameFile(const string& aOldName, const string& aNewName) {
+    Lock l(cs);
+    store.renameFile(aOldName, aNewName);
+}
+
 TTHValue HashManager::getTTH(const string& aFileName, int64_t aSize) {
     Lock l(cs);
     const TTHValue* tth = store.getTTH(aFileName);
     if (tth == NULL) {
-        hasher.hashFile(aFileName, aSize);
+        getHasher(aFileName)->hashFile(aFileName, aSize);
         throw HashException();
     }
     return *tth;
@@ -209,16 +230,180 @@ size_t HashManager::getBlockSize(const TTHValue& root) {
     return store.getBlockSize(root);
 }
 
+/**
+ * Files are grouped by the device they live on, so that each disk is read by
+ * a single hasher in sequential order instead of several threads seeking over it.
+ */
+static string getDeviceId(const string& aFileName) {
+#ifdef _WIN32
+    string::size_type i = aFileName.find(PATH_SEPARATOR);
+    return Text::toLower(i == string::npos ? aFileName : aFileName.substr(0, i));
+#else
+    struct stat st;
+    if (::stat(Text::fromUtf8(Util::getFilePath(aFileName)).c_str(), &st) == 0)
+        return Util::toString(static_cast<uint64_t>(st.st_dev));
+    return Util::emptyString;
+#endif
+}
+
+HashManager::Hasher* HashManager::addHasher() {
+    Hasher* h = new Hasher(paused);
+    hashers.push_back(h);
+    try {
+        h->start();
+    } catch (const ThreadException& e) {
+        LogManager::getInstance()->message(str(F_("Hashing failed: %1%") % e.getError()));
+    }
+    return h;
+}
+
+HashManager::Hasher* HashManager::getHasher(const string& aFileName) {
+    Lock l(cs);
+    if (hashers.empty())
+        addHasher();
+
+    const string dev = getDeviceId(aFileName);
+    DeviceMap::const_iterator i = devices.find(dev);
+    if (i != devices.end())
+        return i->second;
+
+    // The first device found reuses the startup hasher, the following ones get their own thread
+    // until the limit is reached, after which the least loaded hasher takes over the new device
+    Hasher* h = hashers.front();
+    if (h->getDevices() > 0) {
+        const size_t maxHashers = static_cast<size_t>(max(SETTING(HASH_THREADS), 0));
+        if (maxHashers == 0 || hashers.size() < maxHashers) {
+            h = addHasher();
+        } else {
+            for (HasherList::const_iterator j = hashers.begin(); j != hashers.end(); ++j) {
+                if ((*j)->getDevices() < h->getDevices())
+                    h = *j;
+            }
+        }
+    }
+
+    h->addDevice();
+    devices.insert(make_pair(dev, h));
+    return h;
+}
+
+void HashManager::clearHashers() {
+    HasherList tmp;
+    {
+        // Hashers call back into hashDone, so don't hold the lock while joining them
+        Lock l(cs);
+        tmp.swap(hashers);
+        devices.clear();
+    }
+    for (HasherList::const_iterator i = tmp.begin(); i != tmp.end(); ++i) {
+        (*i)->shutdown();
+    }
+    for (HasherList::const_iterator i = tmp.begin(); i != tmp.end(); ++i) {
+        (*i)->join();
+        delete *i;
+    }
+}
+
+void HashManager::startup() {
+    {
+        Lock l(cs);
+        addHasher();
+    }
+    store.load();
+}
+
+void HashManager::shutdown() {
+    clearHashers();
+    saveStore(true);
+}
+
+void HashManager::saveStore(bool force) {
+    Lock s(saveCs);
+    HashStore::ImageJob job;
+    {
+        Lock l(cs);
+        if (!store.prepareImage(job, force))
+            return;
+
+        if (!job.hasJournal()) {
+            if (store.writeImage(job))
+                store.commitImage(job);
+            return;
+        }
+    }
+
+    // The image may take a while to write; hashing and lookups go on meanwhile
+    bool written = store.writeImage(job);
+
+    Lock l(cs);
+    if (written)
+        store.commitImage(job);
+}
+
+void HashManager::rebuild() {
+    Lock l(cs);
+    if (hashers.empty())
+        addHasher();
+    hashers.front()->scheduleRebuild();
+}
+
+bool HashManager::stopHashing(const string& baseDir) {
+    Lock l(cs);
+    bool stopped = false;
+    for (HasherList::const_iterator i = hashers.begin(); i != hashers.end(); ++i) {
+        if ((*i)->stopHashing(baseDir))
+            stopped = true;
+    }
+    return stopped;
+}
+
+void HashManager::setPriority(Thread::Priority p) {
+    Lock l(cs);
+    for (HasherList::const_iterator i = hashers.begin(); i != hashers.end(); ++i) {
+        (*i)->setThreadPriority(p);
+    }
+}
+
+void HashManager::getStats(string& curFile, int64_t& bytesLeft, size_t& filesLeft) {
+    int64_t bytesRead, readSpeed;
+    getStats(curFile, bytesLeft, filesLeft, bytesRead, readSpeed);
+}
+
+void HashManager::getStats(string& curFile, int64_t& bytesLeft, size_t& filesLeft, int64_t& bytesRead, int64_t& readSpeed) {
+    Lock l(cs);
+    curFile.clear();
+    bytesLeft = 0;
+    filesLeft = 0;
+    bytesRead = 0;
+    readSpeed = 0;
+    for (HasherList::const_iterator i = hashers.begin(); i != hashers.end(); ++i) {
+        string file;
+        int64_t bytes = 0;
+        size_t files = 0;
+        int64_t read = 0;
+        int64_t speed = 0;
+        (*i)->getStats(file, bytes, files, read, speed);
+        if (curFile.empty())
+            curFile = file;
+        bytesLeft += bytes;
+        filesLeft += files;
+        bytesRead += read;
+        readSpeed += speed;
+    }
+}
+
 void HashManager::hashDone(const string& aFileName, uint32_t aTimeStamp, const TigerTree& tth, int64_t speed, int64_t size) {
     try {
         Lock l(cs);
         store.addFile(aFileName, aTimeStamp, tth, true);
-        m_streamstore.saveTree(aFileName, tth);
     } catch (const Exception& e) {
         LogManager::getInstance()->message(str(F_("Hashing failed: %1%") % e.getError()));
         return;
     }
 
+    // The extended attribute lives with the file itself, no need to keep other hashers waiting
+    m_streamstore.saveTree(aFileName, tth);
+
     fire(HashManagerListener::TTHDone(), aFileName, tth.getRoot());
 
     if (speed > 0) {
@@ -232,9 +417,41 @@ void HashManager::hashDone(const string& aFileName, uint32_t aTimeStamp, const T
     }
 }
 
+struct FirstLess {
+    template<typename T>
+    bool operator()(const T& a, const T& b) const { return a.first < b.first; }
+};
+
+static int comparePath(const char* path, size_t len, const string& aFileName) {
+    int c = memcmp(path, aFileName.data(), min(len, aFileName.size()));
+    if (c != 0)
+        return c;
+    return len < aFileName.size() ? -1 : (len > aFileName.size() ? 1 : 0);
+}
+
 void HashManager::HashStore::addFile(const string& aFileName, uint32_t aTimeStamp, const TigerTree& tth, bool aUsed) {
     addTree(tth);
 
+    insertFile(aFileName, tth.getRoot(), aTimeStamp, aUsed);
+
+    JournalRecord jr;
+    memset(&jr, 0, sizeof(jr));
+    jr.type = JournalRecord::FILE;
+    memcpy(jr.root, tth.getRoot().data, TTHValue::BYTES);
+    jr.timeStamp = aTimeStamp;
+    jr.flags = aUsed ? FLAG_USED : 0;
+    appendJournal(jr, aFileName);
+
+    dirty = true;
+}
+
+void HashManager::HashStore::insertFile(const string& aFileName, const TTHValue& aRoot, uint32_t aTimeStamp, bool aUsed) {
+    // The journal entry supersedes whatever the image has for this file
+    int64_t i = findImageFile(aFileName);
+    if (i != -1) {
+        imageFlags[i] |= FLAG_REMOVED;
+    }
+
     string fname = Util::getFileName(aFileName);
     string fpath = Util::getFilePath(aFileName);
 
@@ -245,16 +462,49 @@ void HashManager::HashStore::addFile(const string& aFileName, uint32_t aTimeStam
         fileList.erase(j);
     }
 
-    fileList.push_back(FileInfo(fname, tth.getRoot(), aTimeStamp, aUsed));
-    dirty = true;
+    fileList.push_back(FileInfo(fname, aRoot, aTimeStamp, aUsed));
+}
+
+bool HashManager::HashStore::removeFile(const string& aFileName) {
+    bool removed = false;
+
+    DirIter i = fileIndex.find(Util::getFilePath(aFileName));
+    if (i != fileIndex.end()) {
+        FileInfoIter j = find(i->second.begin(), i->second.end(), Util::getFileName(aFileName));
+        if (j != i->second.end()) {
+            i->second.erase(j);
+            if (i->second.empty())
+                fileIndex.erase(i);
+            removed = true;
+        }
+    }
+
+    int64_t k = findImageFile(aFileName);
+    if (k != -1) {
+        imageFlags[k] |= FLAG_REMOVED;
+        removed = true;
+    }
+
+    return removed;
 }
 
 void HashManager::HashStore::addTree(const TigerTree& tt) noexcept {
-    if (treeIndex.find(tt.getRoot()) == treeIndex.end()) {
+    TreeInfo ti;
+    if (!findTree(tt.getRoot(), ti)) {
         try {
             File f(getDataFile(), File::READ | File::WRITE, File::OPEN);
             int64_t index = saveTree(f, tt);
             treeIndex.insert(make_pair(tt.getRoot(), TreeInfo(tt.getFileSize(), index, tt.getBlockSize())));
+
+            JournalRecord jr;
+            memset(&jr, 0, sizeof(jr));
+            jr.type = JournalRecord::TREE;
+            memcpy(jr.root, tt.getRoot().data, TTHValue::BYTES);
+            jr.size = tt.getFileSize();
+            jr.index = index;
+            jr.blockSize = tt.getBlockSize();
+            appendJournal(jr, Util::emptyString);
+
             dirty = true;
         } catch (const FileException& e) {
             LogManager::getInstance()->message(str(F_("Error saving hash data: %1%") % e.getError()));
@@ -306,44 +556,153 @@ bool HashManager::HashStore::loadTree(File& f, const TreeInfo& ti, const TTHValu
     return true;
 }
 
+const HashManager::HashStore::TreeRecord* HashManager::HashStore::findImageTree(const TTHValue& root) const {
+    size_t lo = 0, hi = imageTreeCount;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int c = memcmp(imageTrees[mid].root, root.data, TTHValue::BYTES);
+        if (c < 0) {
+            lo = mid + 1;
+        } else if (c > 0) {
+            hi = mid;
+        } else {
+            return &imageTrees[mid];
+        }
+    }
+    return NULL;
+}
+
+int64_t HashManager::HashStore::findImageFile(const string& aFileName) const {
+    size_t lo = 0, hi = imageFileCount;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const FileRecord& fr = imageFiles[mid];
+        int c = comparePath(imagePaths + fr.pathOffset, fr.pathLength, aFileName);
+        if (c < 0) {
+            lo = mid + 1;
+        } else if (c > 0) {
+            hi = mid;
+        } else {
+            return (imageFlags[mid] & FLAG_REMOVED) ? -1 : static_cast<int64_t>(mid);
+        }
+    }
+    return -1;
+}
+
+bool HashManager::HashStore::findTree(const TTHValue& root, TreeInfo& ti) const {
+    TreeMap::const_iterator i = treeIndex.find(root);
+    if (i != treeIndex.end()) {
+        ti = i->second;
+        return true;
+    }
+
+    const TreeRecord* tr = findImageTree(root);
+    if (tr != NULL) {
+        ti = TreeInfo(tr->size, tr->index, tr->blockSize);
+        return true;
+    }
+    return false;
+}
+
 bool HashManager::HashStore::getTree(const TTHValue& root, TigerTree& tt) {
-    TreeIter i = treeIndex.find(root);
-    if (i == treeIndex.end())
+    TreeInfo ti;
+    if (!findTree(root, ti))
         return false;
     try {
         File f(getDataFile(), File::READ, File::OPEN);
-        return loadTree(f, i->second, root, tt);
+        return loadTree(f, ti, root, tt);
     } catch (const Exception&) {
         return false;
     }
 }
 
 size_t HashManager::HashStore::getBlockSize(const TTHValue& root) const {
-    TreeMap::const_iterator i = treeIndex.find(root);
-    return i == treeIndex.end() ? 0 : i->second.getBlockSize();
+    TreeInfo ti;
+    return findTree(root, ti) ? ti.getBlockSize() : 0;
 }
 
-bool HashManager::HashStore::checkTTH(const string& aFileName, int64_t aSize, uint32_t aTimeStamp) {
-    string fname = Util::getFileName(aFileName);
-    string fpath = Util::getFilePath(aFileName);
-    DirIter i = fileIndex.find(fpath);
+bool HashManager::HashStore::findFile(const string& aFileName, TTHValue& aRoot, uint32_t& aTimeStamp) const {
+    auto i = fileIndex.find(Util::getFilePath(aFileName));
     if (i != fileIndex.end()) {
-        FileInfoIter j = find(i->second.begin(), i->second.end(), fname);
-        if (j != i->second.end()) {
-            FileInfo& fi = *j;
-            TreeIter ti = treeIndex.find(fi.getRoot());
-            if (ti == treeIndex.end() || ti->second.getSize() != aSize || fi.getTimeStamp() != aTimeStamp) {
-                i->second.erase(j);
-                dirty = true;
-                return false;
+        string fname = Util::getFileName(aFileName);
+        for (auto j = i->second.begin(); j != i->second.end(); ++j) {
+            if (j->getFileName() == fname) {
+                aRoot = j->getRoot();
+                aTimeStamp = j->getTimeStamp();
+                return true;
             }
-            return true;
         }
     }
-    return false;
+
+    int64_t k = findImageFile(aFileName);
+    if (k == -1)
+        return false;
+    aRoot = TTHValue(imageFiles[k].root);
+    aTimeStamp = imageFiles[k].timeStamp;
+    return true;
+}
+
+bool HashManager::HashStore::checkTTH(const string& aFileName, int64_t aSize, uint32_t aTimeStamp) {
+    TTHValue root;
+    uint32_t timeStamp = 0;
+    if (!findFile(aFileName, root, timeStamp))
+        return false;
+
+    TreeInfo ti;
+    if (!findTree(root, ti) || ti.getSize() != aSize || timeStamp != aTimeStamp) {
+        removeFile(aFileName);
+
+        JournalRecord jr;
+        memset(&jr, 0, sizeof(jr));
+        jr.type = JournalRecord::REMOVE;
+        appendJournal(jr, aFileName);
+
+        dirty = true;
+        return false;
+    }
+    return true;
+}
+
+void HashManager::HashStore::renameFile(const string& aOldName, const string& aNewName) {
+    TTHValue root;
+    uint32_t timeStamp = 0;
+    if (!findFile(aOldName, root, timeStamp))
+        return;
+
+    insertFile(aNewName, root, timeStamp, true);
+    removeFile(aOldName);
+
+    JournalRecord jr;
+    memset(&jr, 0, sizeof(jr));
+    jr.type = JournalRecord::FILE;
+    memcpy(jr.root, root.data, TTHValue::BYTES);
+    jr.timeStamp = timeStamp;
+    jr.flags = FLAG_USED;
+    appendJournal(jr, aNewName);
+
+    memset(&jr, 0, sizeof(jr));
+    jr.type = JournalRecord::REMOVE;
+    appendJournal(jr, aOldName);
+
+    dirty = true;
 }
 
 const TTHValue* HashManager::HashStore::getTTH(const string& aFileName) {
+    bool wasUsed = true;
+    const TTHValue* root = setUsed(aFileName, wasUsed);
+    if (root && !wasUsed) {
+        // Only the first use is journaled
+        JournalRecord jr;
+        memset(&jr, 0, sizeof(jr));
+        jr.type = JournalRecord::USED;
+        appendJournal(jr, aFileName);
+
+        dirty = true;
+    }
+    return root;
+}
+
+const TTHValue* HashManager::HashStore::setUsed(const string& aFileName, bool& wasUsed) {
     string fname = Util::getFileName(aFileName);
     string fpath = Util::getFilePath(aFileName);
 
@@ -351,30 +710,45 @@ const TTHValue* HashManager::HashStore::getTTH(const string& aFileName) {
     if (i != fileIndex.end()) {
         FileInfoIter j = find(i->second.begin(), i->second.end(), fname);
         if (j != i->second.end()) {
+            wasUsed = j->getUsed();
             j->setUsed(true);
             return &(j->getRoot());
         }
     }
+
+    int64_t k = findImageFile(aFileName);
+    if (k != -1) {
+        wasUsed = (imageFlags[k] & FLAG_USED) != 0;
+        imageFlags[k] |= FLAG_USED;
+        return reinterpret_cast<const TTHValue*>(imageFiles[k].root);
+    }
     return NULL;
 }
 
 void HashManager::HashStore::rebuild() {
     try {
-        DirMap newFileIndex;
         TreeMap newTreeIndex;
 
         for (DirIter i = fileIndex.begin(); i != fileIndex.end(); ++i) {
             for (FileInfoIter j = i->second.begin(); j != i->second.end(); ++j) {
-                if (!j->getUsed())
-                    continue;
-
-                TreeIter k = treeIndex.find(j->getRoot());
-                if (k != treeIndex.end()) {
-                    newTreeIndex[j->getRoot()] = k->second;
+                TreeInfo ti;
+                if (j->getUsed() && findTree(j->getRoot(), ti)) {
+                    newTreeIndex[j->getRoot()] = ti;
                 }
             }
         }
 
+        for (size_t i = 0; i < imageFileCount; ++i) {
+            if ((imageFlags[i] & (FLAG_USED | FLAG_REMOVED)) != FLAG_USED)
+                continue;
+
+            TTHValue root(imageFiles[i].root);
+            TreeInfo ti;
+            if (findTree(root, ti)) {
+                newTreeIndex[root] = ti;
+            }
+        }
+
         string tmpName = getDataFile() + ".tmp";
         string origName = getDataFile();
 
@@ -395,85 +769,375 @@ void HashManager::HashStore::rebuild() {
             }
         }
 
-        for (DirIter i = fileIndex.begin(); i != fileIndex.end(); ++i) {
-            DirIter fi = newFileIndex.insert(make_pair(i->first, FileInfoList())).first;
-
-            for (FileInfoIter j = i->second.begin(); j != i->second.end(); ++j) {
-                if (newTreeIndex.find(j->getRoot()) != newTreeIndex.end()) {
-                    fi->second.push_back(*j);
-                }
-            }
-
-            if (fi->second.empty())
-                newFileIndex.erase(fi);
-        }
-
         File::deleteFile(origName);
         File::renameFile(tmpName, origName);
-        treeIndex = newTreeIndex;
-        fileIndex = newFileIndex;
-        dirty = true;
-        save();
+
+        save(&newTreeIndex);
     } catch (const Exception& e) {
         LogManager::getInstance()->message(str(F_("Hashing failed: %1%") % e.getError()));
     }
 }
 
-void HashManager::HashStore::save() {
-    if (dirty) {
-        try {
-            File ff(getIndexFile() + ".tmp", File::WRITE, File::CREATE | File::TRUNCATE);
-            BufferedOutputStream<false> f(&ff);
-
-            string tmp;
-            string b32tmp;
-
-            f.write(SimpleXML::utf8Header);
-            f.write(LIT("<HashStore Version=\"" HASH_FILE_VERSION_STRING "\">\r\n"));
-
-            f.write(LIT("\t<Trees>\r\n"));
-
-            for (TreeIter i = treeIndex.begin(); i != treeIndex.end(); ++i) {
-                const TreeInfo& ti = i->second;
-                f.write(LIT("\t\t<Hash Type=\"TTH\" Index=\""));
-                f.write(Util::toString(ti.getIndex()));
-                f.write(LIT("\" BlockSize=\""));
-                f.write(Util::toString(ti.getBlockSize()));
-                f.write(LIT("\" Size=\""));
-                f.write(Util::toString(ti.getSize()));
-                f.write(LIT("\" Root=\""));
-                b32tmp.clear();
-                f.write(i->first.toBase32(b32tmp));
-                f.write(LIT("\"/>\r\n"));
+void HashManager::HashStore::save(const TreeMap* newTrees) {
+    ImageJob job;
+    if (prepareImage(job, true, newTrees) && writeImage(job))
+        commitImage(job);
+}
+
+bool HashManager::HashStore::prepareImage(ImageJob& job, bool force, const TreeMap* newTrees) {
+    // Without a working journal the image is the only copy of our changes
+    if (!newTrees && !(dirty && (force || !journal || journalRecords >= max(JOURNAL_MIN_RECORDS, imageFileCount / 4))))
+        return false;
+
+    const TreeMap& addedTrees = newTrees ? *newTrees : treeIndex;
+    job.trees.reserve(addedTrees.size());
+    for (TreeMap::const_iterator i = addedTrees.begin(); i != addedTrees.end(); ++i) {
+        job.trees.push_back(*i);
+    }
+    sort(job.trees.begin(), job.trees.end(), FirstLess());
+
+    for (DirIter i = fileIndex.begin(); i != fileIndex.end(); ++i) {
+        for (FileInfoIter j = i->second.begin(); j != i->second.end(); ++j) {
+            if (!newTrees || newTrees->find(j->getRoot()) != newTrees->end()) {
+                job.files.push_back(make_pair(i->first + j->getFileName(), *j));
             }
+        }
+    }
+    sort(job.files.begin(), job.files.end(), FirstLess());
+
+    job.newTrees = newTrees;
+    job.imageFlags = imageFlags;
+    job.journalSize = journal ? journal->getSize() : -1;
+    job.tmpName = getIndexFile() + ".tmp";
+    return true;
+}
+
+bool HashManager::HashStore::writeImage(ImageJob& job) {
+    const vector<pair<TTHValue, TreeInfo> >& trees = job.trees;
+    const vector<pair<string, FileInfo> >& files = job.files;
+    const TreeMap* newTrees = job.newTrees;
+    const vector<uint8_t>& flags = job.imageFlags;
+
+    // A rebuild replaces the tree index, otherwise the trees of the image are kept as well
+    const size_t oldTrees = newTrees ? 0 : imageTreeCount;
 
-            f.write(LIT("\t</Trees>\r\n\t<Files>\r\n"));
-
-            for (DirIter i = fileIndex.begin(); i != fileIndex.end(); ++i) {
-                const string& dir = i->first;
-                for (FileInfoIter j = i->second.begin(); j != i->second.end(); ++j) {
-                    const FileInfo& fi = *j;
-                    f.write(LIT("\t\t<File Name=\""));
-                    f.write(SimpleXML::escape(dir + fi.getFileName(), tmp, true));
-                    f.write(LIT("\" TimeStamp=\""));
-                    f.write(Util::toString(fi.getTimeStamp()));
-                    f.write(LIT("\" Root=\""));
-                    b32tmp.clear();
-                    f.write(fi.getRoot().toBase32(b32tmp));
-                    f.write(LIT("\"/>\r\n"));
+    try {
+        File ff(job.tmpName, File::WRITE, File::CREATE | File::TRUNCATE);
+        BufferedOutputStream<false> f(&ff);
+
+        IndexHeader h;
+        memset(&h, 0, sizeof(h));
+        h.magic = HASH_INDEX_MAGIC;
+        h.version = HASH_INDEX_VERSION;
+
+        // Pass 0 counts the records, 1 writes the file records and 2 the path table
+        for (int pass = 0; pass < 3; ++pass) {
+            if (pass == 1) {
+                f.write(&h, sizeof(h));
+
+                size_t i = 0, j = 0;
+                while (i < oldTrees || j < trees.size()) {
+                    TreeRecord tr;
+                    if (j == trees.size() || (i < oldTrees && memcmp(imageTrees[i].root, trees[j].first.data, TTHValue::BYTES) < 0)) {
+                        tr = imageTrees[i++];
+                    } else {
+                        memcpy(tr.root, trees[j].first.data, TTHValue::BYTES);
+                        tr.size = trees[j].second.getSize();
+                        tr.index = trees[j].second.getIndex();
+                        tr.blockSize = trees[j].second.getBlockSize();
+                        ++j;
+                    }
+                    f.write(&tr, sizeof(tr));
                 }
             }
-            f.write(LIT("\t</Files>\r\n</HashStore>"));
-            f.flush();
-            ff.close();
-            File::deleteFile( getIndexFile());
-            File::renameFile(getIndexFile() + ".tmp", getIndexFile());
 
-            dirty = false;
+            uint64_t pathOffset = 0;
+            size_t i = 0, j = 0;
+            for (;;) {
+                // Skip image files that are gone or pointing to a tree that didn't survive the rebuild
+                while (i < imageFileCount && ((flags[i] & FLAG_REMOVED) ||
+                    (newTrees && newTrees->find(TTHValue(imageFiles[i].root)) == newTrees->end())))
+                {
+                    ++i;
+                }
+                if (i == imageFileCount && j == files.size())
+                    break;
+
+                FileRecord fr;
+                const char* path;
+                if (j == files.size() || (i < imageFileCount &&
+                    comparePath(imagePaths + imageFiles[i].pathOffset, imageFiles[i].pathLength, files[j].first) < 0))
+                {
+                    fr = imageFiles[i];
+                    path = imagePaths + fr.pathOffset;
+                    fr.flags = flags[i] & FLAG_USED;
+                    ++i;
+                } else {
+                    memset(&fr, 0, sizeof(fr));
+                    memcpy(fr.root, files[j].second.getRoot().data, TTHValue::BYTES);
+                    fr.pathLength = files[j].first.size();
+                    fr.timeStamp = files[j].second.getTimeStamp();
+                    fr.flags = files[j].second.getUsed() ? FLAG_USED : 0;
+                    path = files[j].first.data();
+                    ++j;
+                }
+                fr.pathOffset = pathOffset;
+                pathOffset += fr.pathLength;
+
+                if (pass == 0) {
+                    h.files++;
+                    h.pathBytes += fr.pathLength;
+                } else if (pass == 1) {
+                    f.write(&fr, sizeof(fr));
+                } else {
+                    f.write(path, fr.pathLength);
+                }
+            }
+
+            if (pass == 0) {
+                h.trees = oldTrees + trees.size();
+            }
+        }
+
+        f.flush();
+    } catch (const FileException& e) {
+        LogManager::getInstance()->message(str(F_("Error saving hash data: %1%") % e.getError()));
+        File::deleteFile(job.tmpName);
+        return false;
+    }
+    return true;
+}
+
+void HashManager::HashStore::commitImage(ImageJob& job) {
+    // What was journaled while the image was written has to be carried over to it
+    string records;
+    if (job.hasJournal()) {
+        try {
+            if (!journal)
+                throw FileException(_("The journal was lost while the index was written"));
+            journal->setPos(job.journalSize);
+            records = journal->read(static_cast<size_t>(journal->getSize() - job.journalSize));
+            journal->setPos(journal->getSize());
         } catch (const FileException& e) {
+            // The old image stays; without a journal the next image is written in one go
             LogManager::getInstance()->message(str(F_("Error saving hash data: %1%") % e.getError()));
+            File::deleteFile(job.tmpName);
+            return;
+        }
+    }
+
+    // Until the new image is mapped the old one, the indices and the journal are the only copy of the changes
+    if (!mapImage(job.tmpName)) {
+        LogManager::getInstance()->message(str(F_("Error saving hash data: %1%") % _("The new index is invalid")));
+        File::deleteFile(job.tmpName);
+        return;
+    }
+
+    try {
+#ifdef _WIN32
+        // Windows won't rename over an existing file
+        File::deleteFile(getIndexFile());
+#endif
+        File::renameFile(job.tmpName, getIndexFile());
+    } catch (const FileException& e) {
+        LogManager::getInstance()->message(str(F_("Error saving hash data: %1%") % e.getError()));
+
+        // Back to what's on the disk: the old image and the whole journal
+        mapImage(getIndexFile());
+        fileIndex.clear();
+        treeIndex.clear();
+        journal.reset();
+        journalRecords = 0;
+        openJournal(replayJournal());
+        File::deleteFile(job.tmpName);
+        return;
+    }
+
+    fileIndex.clear();
+    treeIndex.clear();
+    journalRecords = 0;
+    size_t valid = replayRecords(records, 0);
+    records.resize(valid);
+    rewriteJournal(records);
+    dirty = journalRecords > 0;
+}
+
+void HashManager::HashStore::closeImage() {
+    image.reset();
+    imageTrees = NULL;
+    imageTreeCount = 0;
+    imageFiles = NULL;
+    imageFileCount = 0;
+    imagePaths = NULL;
+    imageFlags.clear();
+}
+
+bool HashManager::HashStore::mapImage(const string& aFileName) {
+    std::unique_ptr<MappedFile> newImage;
+    try {
+        newImage.reset(new MappedFile(aFileName));
+    } catch (const FileException&) {
+        return false;
+    }
+
+    const uint8_t* data = newImage->getData();
+    uint64_t size = newImage->getSize();
+
+    IndexHeader h;
+    if (size < sizeof(h)) {
+        return false;
+    }
+    memcpy(&h, data, sizeof(h));
+
+    uint64_t left = size - sizeof(h);
+    if (h.magic != HASH_INDEX_MAGIC || h.version != HASH_INDEX_VERSION ||
+        h.trees > left / sizeof(TreeRecord) || h.files > (left - h.trees * sizeof(TreeRecord)) / sizeof(FileRecord) ||
+        h.pathBytes != left - h.trees * sizeof(TreeRecord) - h.files * sizeof(FileRecord))
+    {
+        dcdebug("Invalid hash index image\n");
+        return false;
+    }
+
+    const FileRecord* files = reinterpret_cast<const FileRecord*>(data + sizeof(h) + h.trees * sizeof(TreeRecord));
+    for (uint64_t i = 0; i < h.files; ++i) {
+        if (files[i].pathOffset > h.pathBytes || files[i].pathLength > h.pathBytes - files[i].pathOffset) {
+            dcdebug("Invalid path in hash index image\n");
+            return false;
         }
     }
+
+    closeImage();
+    image = move(newImage);
+    imageTrees = reinterpret_cast<const TreeRecord*>(data + sizeof(h));
+    imageTreeCount = h.trees;
+    imageFiles = files;
+    imageFileCount = h.files;
+    imagePaths = reinterpret_cast<const char*>(files + h.files);
+    imageFlags.resize(imageFileCount);
+    for (size_t i = 0; i < imageFileCount; ++i) {
+        imageFlags[i] = files[i].flags & FLAG_USED;
+    }
+    return true;
+}
+
+int64_t HashManager::HashStore::replayJournal() {
+    string data;
+    try {
+        File f(getJournalFile(), File::READ, File::OPEN);
+        data = f.read();
+    } catch (const FileException&) {
+        return -1;
+    }
+
+    uint32_t header[2];
+    if (data.size() < sizeof(header))
+        return -1;
+    memcpy(header, data.data(), sizeof(header));
+    if (header[0] != HASH_JOURNAL_MAGIC || header[1] != HASH_INDEX_VERSION)
+        return -1;
+
+    // A crash may have left a partial record at the end, everything before it is good
+    size_t pos = sizeof(header) + replayRecords(data, sizeof(header));
+
+    if (journalRecords > 0)
+        dirty = true;
+
+    return pos;
+}
+
+size_t HashManager::HashStore::replayRecords(const string& data, size_t start) {
+    size_t pos = start;
+    while (data.size() - pos >= sizeof(JournalRecord)) {
+        JournalRecord jr;
+        memcpy(&jr, data.data() + pos, sizeof(jr));
+        if (jr.type > JournalRecord::USED || jr.pathLength > data.size() - pos - sizeof(jr))
+            break;
+
+        string path = data.substr(pos + sizeof(jr), jr.pathLength);
+        TTHValue root(jr.root);
+        TreeInfo ti;
+        bool wasUsed;
+        switch (jr.type) {
+        case JournalRecord::TREE:
+            if (!findTree(root, ti))
+                treeIndex.insert(make_pair(root, TreeInfo(jr.size, jr.index, jr.blockSize)));
+            break;
+        case JournalRecord::FILE:
+            if (!path.empty())
+                insertFile(path, root, jr.timeStamp, (jr.flags & FLAG_USED) != 0);
+            break;
+        case JournalRecord::REMOVE:
+            removeFile(path);
+            break;
+        case JournalRecord::USED:
+            setUsed(path, wasUsed);
+            break;
+        }
+
+        pos += sizeof(jr) + jr.pathLength;
+        journalRecords++;
+    }
+    return pos - start;
+}
+
+void HashManager::HashStore::openJournal(int64_t validSize) {
+    try {
+        journal.reset(new File(getJournalFile(), File::READ | File::WRITE, File::OPEN | File::CREATE));
+        if (validSize > 0) {
+            journal->setPos(validSize);
+            journal->setEOF();
+        } else {
+            journal->setPos(0);
+            journal->setEOF();
+            uint32_t header[2] = { HASH_JOURNAL_MAGIC, HASH_INDEX_VERSION };
+            journal->write(header, sizeof(header));
+            journalRecords = 0;
+        }
+    } catch (const FileException& e) {
+        journal.reset();
+        LogManager::getInstance()->message(str(F_("Error saving hash data: %1%") % e.getError()));
+    }
+}
+
+void HashManager::HashStore::rewriteJournal(const string& aRecords) {
+    // Written aside first, so that a crash leaves either the old or the new journal
+    string tmpName = getJournalFile() + ".tmp";
+    uint32_t header[2] = { HASH_JOURNAL_MAGIC, HASH_INDEX_VERSION };
+    journal.reset();
+    try {
+        {
+            File f(tmpName, File::WRITE, File::CREATE | File::TRUNCATE);
+            f.write(header, sizeof(header));
+            f.write(aRecords);
+        }
+#ifdef _WIN32
+        File::deleteFile(getJournalFile());
+#endif
+        File::renameFile(tmpName, getJournalFile());
+    } catch (const FileException& e) {
+        LogManager::getInstance()->message(str(F_("Error saving hash data: %1%") % e.getError()));
+        return;
+    }
+    openJournal(sizeof(header) + aRecords.size());
+}
+
+void HashManager::HashStore::appendJournal(const JournalRecord& jr, const string& aFileName) {
+    if (!journal)
+        return;
+
+    try {
+        JournalRecord r = jr;
+        r.pathLength = aFileName.size();
+
+        string buf(reinterpret_cast<const char*>(&r), sizeof(r));
+        buf += aFileName;
+        journal->write(buf);
+        journalRecords++;
+    } catch (const FileException& e) {
+        // Falls back to writing the whole image on the next save
+        journal.reset();
+        LogManager::getInstance()->message(str(F_("Error saving hash data: %1%") % e.getError()));
+    }
 }
 
 class HashLoader: public SimpleXMLReader::CallBack {
@@ -498,14 +1162,29 @@ private:
 };
 
 void HashManager::HashStore::load() {
-    try {
-        Util::migrate(getIndexFile());
+    Util::migrate(getIndexFile());
+    Util::migrate(getJournalFile());
 
-        HashLoader l(*this);
-        File f(getIndexFile(), File::READ, File::OPEN);
-        SimpleXMLReader(&l).parse(f);
-    } catch (const Exception&) {
-        // ...
+    bool imported = false;
+    if (!mapImage(getIndexFile())) {
+        // First start after an upgrade, import the old xml index once
+        try {
+            Util::migrate(getXmlIndexFile());
+
+            HashLoader l(*this);
+            File f(getXmlIndexFile(), File::READ, File::OPEN);
+            SimpleXMLReader(&l).parse(f);
+            imported = !fileIndex.empty() || !treeIndex.empty();
+        } catch (const Exception&) {
+            // ...
+        }
+    }
+
+    openJournal(replayJournal());
+
+    if (imported) {
+        dirty = true;
+        save(NULL);
     }
 }
 
@@ -570,7 +1249,8 @@ void HashLoader::endTag(const string& name, const string&) {
 }
 
 HashManager::HashStore::HashStore() :
-    dirty(false) {
+    imageTrees(NULL), imageTreeCount(0), imageFiles(NULL), imageFileCount(0), imagePaths(NULL),
+    journalRecords(0), dirty(false) {
 
     Util::migrate(getDataFile());
 
@@ -619,9 +1299,10 @@ void HashManager::Hasher::hashFile(const string& fileName, int64_t size) {
 
 bool HashManager::Hasher::pause() {
     Lock l(cs);
+    bool wasPaused = paused > 0;
     paused = 1;
 //    printf("pause::paused: %d\n", paused);fflush(stdout);
-    return true;
+    return wasPaused;
 }
 
 void HashManager::Hasher::resume() {
@@ -638,19 +1319,30 @@ bool HashManager::Hasher::isPaused() const {
     return paused > 0;
 }
 
-void HashManager::Hasher::stopHashing(const string& baseDir) {
+bool HashManager::Hasher::stopHashing(const string& baseDir) {
     Lock l(cs);
+    // The current file is finished nevertheless
+    bool stopped = running && Util::strnicmp(baseDir, currentFile, baseDir.length()) == 0;
     for (WorkIter i = w.begin(); i != w.end();) {
         if (Util::strnicmp(baseDir, i->first, baseDir.length()) == 0) {
             w.erase(i++);
+            stopped = true;
         } else {
             ++i;
         }
     }
+    return stopped;
 }
 
-void HashManager::Hasher::getStats(string& curFile, int64_t& bytesLeft, size_t& filesLeft) {
+void HashManager::Hasher::getStats(string& curFile, int64_t& bytesLeft, size_t& filesLeft, int64_t& aBytesRead, int64_t& readSpeed) {
     Lock l(cs);
+    aBytesRead = bytesRead;
+    readSpeed = 0;
+    if (running) {
+        uint64_t elapsed = GET_TICK() - fileStart;
+        if (elapsed > 0)
+            readSpeed = fileRead * _LL(1000) / elapsed;
+    }
     curFile = currentFile;
     filesLeft = w.size();
     if (running)
@@ -662,6 +1354,13 @@ void HashManager::Hasher::getStats(string& curFile, int64_t& bytesLeft, size_t&
     bytesLeft += currentSize;
 }
 
+void HashManager::Hasher::addRead(int64_t n) {
+    Lock l(cs);
+    currentSize = max(currentSize - n, (int64_t)0);
+    bytesRead += n;
+    fileRead += n;
+}
+
 void HashManager::Hasher::instantPause() {
     bool wait = false;
     {
@@ -748,10 +1447,7 @@ bool HashManager::Hasher::fastHash(const string& fname, uint8_t* buf, TigerTree&
         if (xcrc32)
             (*xcrc32)(hbuf, hn);
 
-        {
-            Lock l(cs);
-            currentSize = max(currentSize - hn, _LL(0));
-        }
+        addRead(hn);
 
         if (size == 0) {
             ok = true;
@@ -790,7 +1486,13 @@ bool HashManager::Hasher::fastHash(const string& fname, uint8_t* buf, TigerTree&
 
 #else // !_WIN32
 
-static sigjmp_buf sb_env;
+// Several hashers may be inside fastHash at once; each one jumps back to its own context
+static __thread sigjmp_buf sb_env;
+static __thread bool sb_active = false;
+
+static CriticalSection sbCs;
+static int sbUsers = 0;
+static struct sigaction sbOldAct;
 
 static void sigbus_handler(int signum
 #ifndef __HAIKU__
@@ -800,11 +1502,365 @@ static void sigbus_handler(int signum
     // Jump back to the fastHash which will return error. Apparently truncating
     // a file in Solaris sets si_code to BUS_OBJERR
 #ifndef __HAIKU__
-       if (signum == SIGBUS && (info->si_code == BUS_ADRERR || info->si_code == BUS_OBJERR))
+    if (sb_active && signum == SIGBUS && (info->si_code == BUS_ADRERR || info->si_code == BUS_OBJERR))
         siglongjmp(sb_env, 1);
+
+    // Not ours; hand it on to whoever had the signal before, ours stays in place for the hashers
+    if ((sbOldAct.sa_flags & SA_SIGINFO) && sbOldAct.sa_sigaction) {
+        sbOldAct.sa_sigaction(signum, info, context);
+        return;
+    }
 #endif
+    if (sbOldAct.sa_handler == SIG_IGN)
+        return;
+    if (sbOldAct.sa_handler != SIG_DFL && sbOldAct.sa_handler) {
+        sbOldAct.sa_handler(signum);
+        return;
+    }
+
+    // The default action ends the process anyway: a fault comes back and does so when the
+    // faulting instruction is run again, a signal sent by someone else has to be raised again
+    signal(SIGBUS, SIG_DFL);
+#ifndef __HAIKU__
+    if (info->si_code <= 0)
+#endif
+        raise(signum);
+}
+
+// Prepare and setup a signal handler in case of SIGBUS during mmapped file reads.
+// SIGBUS can be sent when the file is truncated or in case of read errors.
+// The handler is process wide, so it stays installed while any hasher needs it.
+static bool installSigbusHandler() {
+    Lock l(sbCs);
+    if (sbUsers == 0) {
+        struct sigaction act;
+        sigset_t signalset;
+
+        sigemptyset(&signalset);
+
+        act.sa_handler = NULL;
+#ifndef __HAIKU__
+        act.sa_sigaction = sigbus_handler;
+#endif
+        act.sa_mask = signalset;
+#ifdef SA_SIGINFO
+        act.sa_flags = SA_SIGINFO;
+#else
+        act.sa_flags = 0;
+#endif
+        if (sigaction(SIGBUS, &act, &sbOldAct) == -1)
+            return false;
+    }
+    ++sbUsers;
+    return true;
+}
+
+static void removeSigbusHandler() {
+    Lock l(sbCs);
+    if (--sbUsers == 0 && sigaction(SIGBUS, &sbOldAct, NULL) == -1) {
+        dcdebug("Failed to reset old signal handler for SIGBUS\n");
+    }
 }
 
+#ifdef __linux__
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HASH_IO_URING
+#endif
+
+/**
+ * Sequential reader used by the hashers on Linux. Data is read around the page
+ * cache (O_DIRECT, or POSIX_FADV_DONTNEED on consumed ranges where the file
+ * system refuses direct I/O) so hashing a large share doesn't push the files
+ * being uploaded out of memory. One read is kept in flight while the previous
+ * buffer is hashed; it is queued through io_uring, POSIX AIO or, when neither
+ * works, done synchronously with pread.
+ */
+class StreamReader : boost::noncopyable {
+public:
+    /** Alignment of buffers, offsets and lengths for O_DIRECT */
+    static const size_t ALIGNMENT = 4096;
+
+    StreamReader() : fd(-1), direct(false), backend(SYNC), pending(false), syncResult(-1), syncError(0),
+        pendingBuf(NULL), pendingLen(0), pendingPos(0)
+    {
+#ifdef HASH_IO_URING
+        ringFd = -1;
+        ringFailed = false;
+        sqRing = cqRing = MAP_FAILED;
+        sqes = (io_uring_sqe*)MAP_FAILED;
+#endif
+    }
+
+    ~StreamReader() {
+        close();
+#ifdef HASH_IO_URING
+        closeRing();
+#endif
+    }
+
+    bool open(const string& aFileName) {
+        string path = Text::fromUtf8(aFileName);
+        fd = ::open(path.c_str(), O_RDONLY | O_DIRECT);
+        direct = fd != -1;
+        if (fd == -1)
+            fd = ::open(path.c_str(), O_RDONLY);
+        if (fd == -1)
+            return false;
+
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#ifdef HASH_IO_URING
+        // The ring serves one file after another, it's only set up once
+        if (ringFd == -1 && !ringFailed)
+            ringFailed = !setupRing();
+        if (ringFd != -1) {
+            backend = URING;
+            return true;
+        }
+#endif
+#ifdef HAVE_AIO_H
+        backend = AIO;
+#else
+        backend = SYNC;
+#endif
+        return true;
+    }
+
+    /** Close the file; the reader can open another one afterwards */
+    void close() {
+        if (pending)
+            complete();
+        if (fd != -1) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    /** Queue a read of aLen bytes at aPos into aBuf, everything aligned to ALIGNMENT */
+    bool submit(uint8_t* aBuf, size_t aLen, int64_t aPos) {
+        dcassert(!pending);
+        pendingBuf = aBuf;
+        pendingLen = aLen;
+        pendingPos = aPos;
+        pending = true;
+
+        switch (backend) {
+#ifdef HASH_IO_URING
+        case URING:
+            if (submitRing())
+                return true;
+            break;
+#endif
+#ifdef HAVE_AIO_H
+        case AIO:
+            memset(&cb, 0, sizeof(cb));
+            cb.aio_fildes = fd;
+            cb.aio_buf = aBuf;
+            cb.aio_nbytes = aLen;
+            cb.aio_offset = aPos;
+            if (aio_read(&cb) == 0)
+                return true;
+            if (errno != ENOSYS && errno != EAGAIN) {
+                pending = false;
+                return false;
+            }
+            break;
+#endif
+        default:
+            break;
+        }
+
+        // Queueing isn't available here, read synchronously from now on
+        backend = SYNC;
+        syncResult = readSync();
+        return true;
+    }
+
+    /** Wait for the queued read. @return number of bytes read or -1 on error */
+    ssize_t complete() {
+        if (!pending)
+            return -1;
+        pending = false;
+
+        ssize_t n = -1;
+        int err = 0;
+        switch (backend) {
+#ifdef HASH_IO_URING
+        case URING:
+            n = completeRing();
+            if (n < 0) {
+                err = -n;
+                n = -1;
+            }
+            break;
+#endif
+#ifdef HAVE_AIO_H
+        case AIO: {
+            const struct aiocb* list[1] = { &cb };
+            while ((err = aio_error(&cb)) == EINPROGRESS) {
+                aio_suspend(list, 1, NULL);
+            }
+            n = aio_return(&cb);
+            break;
+        }
+#endif
+        default:
+            n = syncResult;
+            err = syncError;
+            break;
+        }
+
+        if (n < 0 && err == EINVAL && direct) {
+            // The file system accepted O_DIRECT on open but not for this read
+            int flags = fcntl(fd, F_GETFL);
+            if (flags == -1 || fcntl(fd, F_SETFL, flags & ~O_DIRECT) == -1)
+                return -1;
+            direct = false;
+            n = readSync();
+        }
+        return n;
+    }
+
+    /** Drop the pages of a consumed range, a no-op when reading directly */
+    void release(int64_t aPos, size_t aLen) {
+        if (!direct)
+            posix_fadvise(fd, aPos, aLen, POSIX_FADV_DONTNEED);
+    }
+
+    static uint8_t* allocate(size_t aSize) {
+        void* p = NULL;
+        return posix_memalign(&p, ALIGNMENT, aSize) == 0 ? (uint8_t*)p : NULL;
+    }
+
+    static void deallocate(uint8_t* aBuf) { free(aBuf); }
+
+private:
+    enum Backend { URING, AIO, SYNC };
+
+    int fd;
+    bool direct;
+    Backend backend;
+
+    bool pending;
+    ssize_t syncResult;
+    int syncError;
+    uint8_t* pendingBuf;
+    size_t pendingLen;
+    int64_t pendingPos;
+
+    ssize_t readSync() {
+        ssize_t n;
+        do {
+            n = pread(fd, pendingBuf, pendingLen, pendingPos);
+        } while (n == -1 && errno == EINTR);
+        syncError = n < 0 ? errno : 0;
+        return n;
+    }
+
+#ifdef HAVE_AIO_H
+    struct aiocb cb;
+#endif
+
+#ifdef HASH_IO_URING
+    int ringFd;
+    bool ringFailed;
+    void* sqRing;
+    void* cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    io_uring_sqe* sqes;
+    size_t sqesSize;
+    io_uring_params params;
+    struct iovec iov;
+
+    template<typename T> T* sqField(uint32_t off) { return (T*)((char*)sqRing + off); }
+    template<typename T> T* cqField(uint32_t off) { return (T*)((char*)cqRing + off); }
+
+    bool setupRing() {
+        memset(&params, 0, sizeof(params));
+        ringFd = syscall(__NR_io_uring_setup, 2, &params);
+        if (ringFd < 0) {
+            ringFd = -1;
+            return false;
+        }
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        sqRing = mmap(0, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        cqRing = mmap(0, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)mmap(0, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+            closeRing();
+            return false;
+        }
+        return true;
+    }
+
+    void closeRing() {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqesSize);
+        if (cqRing != MAP_FAILED)
+            munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED)
+            munmap(sqRing, sqRingSize);
+        if (ringFd != -1)
+            ::close(ringFd);
+        ringFd = -1;
+        sqRing = cqRing = MAP_FAILED;
+        sqes = (io_uring_sqe*)MAP_FAILED;
+    }
+
+    bool submitRing() {
+        // READV is the oldest read opcode, available since io_uring itself
+        iov.iov_base = pendingBuf;
+        iov.iov_len = pendingLen;
+
+        uint32_t tail = *sqField<uint32_t>(params.sq_off.tail);
+        uint32_t index = tail & *sqField<uint32_t>(params.sq_off.ring_mask);
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = fd;
+        sqe->off = pendingPos;
+        sqe->addr = (uint64_t)(uintptr_t)&iov;
+        sqe->len = 1;
+        sqField<uint32_t>(params.sq_off.array)[index] = index;
+        __atomic_store_n(sqField<uint32_t>(params.sq_off.tail), tail + 1, __ATOMIC_RELEASE);
+
+        int ret;
+        do {
+            ret = syscall(__NR_io_uring_enter, ringFd, 1, 0, 0, NULL, 0);
+        } while (ret < 0 && errno == EINTR);
+        if (ret == 1)
+            return true;
+
+        // Take the entry back, the kernel didn't consume it
+        __atomic_store_n(sqField<uint32_t>(params.sq_off.tail), tail, __ATOMIC_RELEASE);
+        closeRing();
+        ringFailed = true;
+        return false;
+    }
+
+    ssize_t completeRing() {
+        uint32_t* head = cqField<uint32_t>(params.cq_off.head);
+        for (;;) {
+            uint32_t h = *head;
+            if (h != __atomic_load_n(cqField<uint32_t>(params.cq_off.tail), __ATOMIC_ACQUIRE)) {
+                io_uring_cqe* cqe = &cqField<io_uring_cqe>(params.cq_off.cqes)[h & *cqField<uint32_t>(params.cq_off.ring_mask)];
+                ssize_t res = cqe->res;
+                __atomic_store_n(head, h + 1, __ATOMIC_RELEASE);
+                return res;
+            }
+            if (syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+                return -errno;
+        }
+    }
+#endif
+};
+
+#endif // __linux__
+
 bool HashManager::Hasher::fastHash(const string& filename, uint8_t* , TigerTree& tth, int64_t size, CRC32Filter* xcrc32) {
     instantPause();
 
@@ -815,6 +1871,108 @@ bool HashManager::Hasher::fastHash(const string& filename, uint8_t* , TigerTree&
         return true;
     }
 
+#ifdef __linux__
+    bool ok = BOOLSETTING(HASH_DIRECT_IO) ? streamHash(filename, tth, size, xcrc32) : mapHash(filename, tth, size, xcrc32);
+#else
+    bool ok = mapHash(filename, tth, size, xcrc32);
+#endif
+
+    if (ok)
+        streamStore.saveTree(filename, tth);
+
+    return ok;
+}
+
+#ifdef __linux__
+bool HashManager::Hasher::streamHash(const string& filename, TigerTree& tth, int64_t size, CRC32Filter* xcrc32) {
+    static const int64_t BUF_BYTES = (SETTING(HASH_BUFFER_SIZE_MB) >= 1)? SETTING(HASH_BUFFER_SIZE_MB)*1024*1024 : 0x800000;
+    static const int64_t BUF_SIZE = BUF_BYTES - (BUF_BYTES % StreamReader::ALIGNMENT);
+
+    if (streamBuf == NULL) {
+        streamBuf = StreamReader::allocate(2 * BUF_SIZE);
+        if (streamBuf == NULL)
+            return false;
+    }
+    if (reader == NULL)
+        reader = new StreamReader;
+
+    if (!reader->open(filename)) {
+        dcdebug("Error opening file %s: %s\n", filename.c_str(), Util::translateError(errno).c_str());
+        return false;
+    }
+
+    // Hash one buffer while the kernel fills the other
+    uint8_t* hbuf = streamBuf;
+    uint8_t* rbuf = streamBuf + BUF_SIZE;
+
+    const int maxHashSpeed = SETTING(MAX_HASH_SPEED);
+    uint64_t lastRead = GET_TICK();
+    int64_t pos = 0;
+    bool ok = false;
+
+    ssize_t hn = reader->submit(hbuf, BUF_SIZE, 0) ? reader->complete() : -1;
+    while (hn >= 0 && !stop) {
+        // A different amount of data means the file changed while hashing
+        if (hn != min(size - pos, BUF_SIZE)) {
+            dcdebug("Unexpected read size for file %s\n", filename.c_str());
+            break;
+        }
+
+        int64_t next = pos + hn;
+        if (next < size) {
+            if (maxHashSpeed > 0) {
+                uint64_t now = GET_TICK();
+                uint64_t minTime = hn * 1000LL / (maxHashSpeed * 1024LL * 1024LL);
+                if (lastRead + minTime > now) {
+                    Thread::sleep(minTime - (now - lastRead));
+                }
+                lastRead = lastRead + minTime;
+            } else {
+                lastRead = GET_TICK();
+            }
+
+            if (!reader->submit(rbuf, BUF_SIZE, next)) {
+                dcdebug("Error reading file %s: %s\n", filename.c_str(), Util::translateError(errno).c_str());
+                break;
+            }
+        }
+
+        tth.update(hbuf, hn);
+        if (xcrc32)
+            (*xcrc32)(hbuf, hn);
+
+        addRead(hn);
+        reader->release(pos, hn);
+        pos = next;
+
+        if (pos == size) {
+            ok = true;
+            break;
+        }
+
+        instantPause();
+
+        hn = reader->complete();
+        swap(hbuf, rbuf);
+    }
+
+    // Waits for a read that may still be in flight before the buffers are used again
+    reader->close();
+
+    return ok;
+}
+#endif // __linux__
+
+void HashManager::Hasher::releaseStream() {
+#ifdef __linux__
+    delete reader;
+    reader = NULL;
+    StreamReader::deallocate(streamBuf);
+    streamBuf = NULL;
+#endif
+}
+
+bool HashManager::Hasher::mapHash(const string& filename, TigerTree& tth, int64_t size, CRC32Filter* xcrc32) {
     static const int64_t BUF_BYTES = (SETTING(HASH_BUFFER_SIZE_MB) >= 1)? SETTING(HASH_BUFFER_SIZE_MB)*1024*1024 : 0x800000;
     static const int64_t BUF_SIZE = BUF_BYTES - (BUF_BYTES % getpagesize());
 
@@ -830,24 +1988,7 @@ bool HashManager::Hasher::fastHash(const string& filename, uint8_t* , TigerTree&
     void *buf = NULL;
     bool ok = false;
 
-    // Prepare and setup a signal handler in case of SIGBUS during mmapped file reads.
-    // SIGBUS can be sent when the file is truncated or in case of read errors.
-    struct sigaction act, oldact;
-    sigset_t signalset;
-
-    sigemptyset(&signalset);
-
-    act.sa_handler = NULL;
-#ifndef __HAIKU__
-    act.sa_sigaction = sigbus_handler;
-#endif
-    act.sa_mask = signalset;
-#ifdef SA_SIGINFO
-    act.sa_flags = SA_SIGINFO | SA_RESETHAND;
-#else
-    act.sa_flags = NULL;
-#endif
-    if (sigaction(SIGBUS, &act, &oldact) == -1) {
+    if (!installSigbusHandler()) {
         dcdebug("Failed to set signal handler for fastHash\n");
         close(fd);
         return false;   // Better luck with the slow hash.
@@ -872,6 +2013,7 @@ bool HashManager::Hasher::fastHash(const string& filename, uint8_t* , TigerTree&
         }
 
         if (sigsetjmp(sb_env, 1)) {
+            sb_active = false;
             dcdebug("Caught SIGBUS for file %s\n", filename.c_str());
             break;
         }
@@ -895,14 +2037,13 @@ bool HashManager::Hasher::fastHash(const string& filename, uint8_t* , TigerTree&
             lastRead = GET_TICK();
         }
 
+        sb_active = true;
         tth.update(buf, size_read);
         if(xcrc32)
             (*xcrc32)(buf, size_read);
+        sb_active = false;
 
-        {
-            Lock l(cs);
-            currentSize = max(static_cast<uint64_t>(currentSize - size_read), static_cast<uint64_t>(0));
-        }
+        addRead(size_read);
 
         if (munmap(buf, size_read) == -1) {
             dcdebug("Error calling munmap for file %s: %s\n", filename.c_str(), Util::translateError(errno).c_str());
@@ -925,12 +2066,7 @@ bool HashManager::Hasher::fastHash(const string& filename, uint8_t* , TigerTree&
 
     close(fd);
 
-    if (sigaction(SIGBUS, &oldact, NULL) == -1) {
-        dcdebug("Failed to reset old signal handler for SIGBUS\n");
-    }
-
-    if (ok)
-        streamStore.saveTree(filename, tth);
+    removeSigbusHandler();
 
     return ok;
 }
@@ -943,7 +2079,6 @@ int HashManager::Hasher::run() {
     bool virtualBuf = true;
     string fname;
     bool last = false;
-    pause();
     for(;;) {
 
         if (w.empty()) {
@@ -963,6 +2098,8 @@ int HashManager::Hasher::run() {
             if(!w.empty()) {
                 currentFile = fname = w.begin()->first;
                 currentSize = w.begin()->second;
+                fileStart = GET_TICK();
+                fileRead = 0;
                 w.erase(w.begin());
                 last = w.empty();
             } else {
@@ -1032,10 +2169,7 @@ int HashManager::Hasher::run() {
                         if(xcrc32)
                             (*xcrc32)(buf, n);
 
-                        {
-                            Lock l(cs);
-                            currentSize = max(static_cast<uint64_t>(currentSize - n), static_cast<uint64_t>(0));
-                        }
+                        addRead(n);
 
                     instantPause();
                     } while (n> 0 && !stop);
@@ -1073,7 +2207,10 @@ int HashManager::Hasher::run() {
                 }
                 buf = NULL;
             }
+            if(last || stop)
+                releaseStream();
         }
+        releaseStream();
         return 0;
     }
 
@@ -1088,17 +2225,25 @@ HashManager::HashPauser::~HashPauser() {
 
 bool HashManager::pauseHashing() {
     Lock l(cs);
-    return hasher.pause();
+    bool wasPaused = paused;
+    paused = true;
+    for (HasherList::const_iterator i = hashers.begin(); i != hashers.end(); ++i) {
+        (*i)->pause();
+    }
+    return wasPaused;
 }
 
 void HashManager::resumeHashing() {
     Lock l(cs);
-    hasher.resume();
+    paused = false;
+    for (HasherList::const_iterator i = hashers.begin(); i != hashers.end(); ++i) {
+        (*i)->resume();
+    }
 }
 
 bool HashManager::isHashingPaused() const {
     Lock l(cs);
-    return hasher.isPaused();
+    return paused;
 }
 
 void HashManager::on(TimerManagerListener::Second, uint64_t tick) noexcept {
@@ -28,6 +28,7 @@
 #include "FastAlloc.h"
 #include "Text.h"
 #include "Streams.h"
+#include "File.h"
 #include "HashManagerListener.h"
 
 #ifdef USE_XATTR
@@ -39,10 +40,10 @@
 namespace dcpp {
 
 STANDARD_EXCEPTION(HashException);
-class File;
 
 class HashLoader;
 class FileException;
+class StreamReader;
 
 class HashManager : public Singleton<HashManager>, public Speaker<HashManagerListener>,
     private TimerManagerListener
@@ -52,12 +53,12 @@ public:
     /** We don't keep leaves for blocks smaller than this... */
     static const int64_t MIN_BLOCK_SIZE;
 
-    HashManager() {
+    HashManager() : paused(true) {
         TimerManager::getInstance()->addListener(this);
     }
     virtual ~HashManager() noexcept {
         TimerManager::getInstance()->removeListener(this);
-        hasher.join();
+        clearHashers();
     }
 
     /**
@@ -65,8 +66,12 @@ public:
      */
     bool checkTTH(const string& aFileName, int64_t aSize, uint32_t aTimeStamp);
 
-    void stopHashing(const string& baseDir) { hasher.stopHashing(baseDir); }
-    void setPriority(Thread::Priority p) { hasher.setThreadPriority(p); }
+    /** @return whether a file below baseDir was being or waiting to be hashed */
+    bool stopHashing(const string& baseDir);
+    void setPriority(Thread::Priority p);
+
+    /** Keep the hash of a file that was moved without changing it */
+    void renameFile(const string& aOldName, const string& aNewName);
 
     /** @return TTH root */
     TTHValue getTTH(const string& aFileName, int64_t aSize);
@@ -84,23 +89,20 @@ public:
     }
     void addTree(const TigerTree& tree) { Lock l(cs); store.addTree(tree); }
 
-    void getStats(string& curFile, int64_t& bytesLeft, size_t& filesLeft) {
-        hasher.getStats(curFile, bytesLeft, filesLeft);
-    }
+    void getStats(string& curFile, int64_t& bytesLeft, size_t& filesLeft);
+    /**
+     * @param bytesRead Total bytes read by the hashers since startup
+     * @param readSpeed Current read throughput of all hashers in bytes per second
+     */
+    void getStats(string& curFile, int64_t& bytesLeft, size_t& filesLeft, int64_t& bytesRead, int64_t& readSpeed);
 
     /**
      * Rebuild hash data file
      */
-    void rebuild() { hasher.scheduleRebuild(); }
-
-    void startup() { hasher.start(); store.load(); }
+    void rebuild();
 
-    void shutdown() {
-        hasher.shutdown();
-        hasher.join();
-        Lock l(cs);
-        store.save();
-    }
+    void startup();
+    void shutdown();
 
     struct HashPauser {
         HashPauser();
@@ -116,9 +118,15 @@ public:
     bool isHashingPaused() const;
 
 private:
+    /**
+     * A single hashing thread. Every storage device is served by exactly one
+     * Hasher so files on the same disk are still read one after another (in
+     * path order) while different disks are hashed in parallel.
+     */
     class Hasher : public Thread {
     public:
-        Hasher() : stop(false), running(false), paused(0), rebuild(false), currentSize(0) { }
+        Hasher(bool aPaused) : stop(false), running(false), paused(aPaused ? 1 : 0), rebuild(false), currentSize(0),
+            bytesRead(0), fileRead(0), fileStart(0), devices(0), reader(NULL), streamBuf(NULL) { }
 
         void hashFile(const string& fileName, int64_t size);
 
@@ -127,13 +135,17 @@ private:
         void resume();
         bool isPaused() const;
 
-        void stopHashing(const string& baseDir);
+        bool stopHashing(const string& baseDir);
         virtual int run();
         bool fastHash(const string& fname, uint8_t* buf, TigerTree& tth, int64_t size, CRC32Filter* xcrc32);
-        void getStats(string& curFile, int64_t& bytesLeft, size_t& filesLeft);
+        void getStats(string& curFile, int64_t& bytesLeft, size_t& filesLeft, int64_t& aBytesRead, int64_t& readSpeed);
         void shutdown() { stop = true; if(paused){ s.signal(); resume();} s.signal(); }
         void scheduleRebuild() { rebuild = true; if(paused) s.signal(); s.signal(); }
 
+        /** Number of devices assigned to this hasher, only touched under HashManager::cs */
+        size_t getDevices() const { return devices; }
+        void addDevice() { ++devices; }
+
     private:
         // Case-sensitive (faster), it is rather unlikely that case changes, and if it does it's harmless.
         // map because it's sorted (to avoid random hash order that would create quite strange shares while hashing)
@@ -150,25 +162,72 @@ private:
         bool rebuild;
         string currentFile;
         int64_t currentSize;
+        int64_t bytesRead;
+        int64_t fileRead;
+        uint64_t fileStart;
+        size_t devices;
+
+        /** Reader and buffers of streamHash, kept while there are files to hash as setting them up costs more than reading a small file */
+        StreamReader* reader;
+        uint8_t* streamBuf;
 
         void instantPause();
+        /** Account n bytes of the current file as read and hashed */
+        void addRead(int64_t n);
+#ifndef _WIN32
+        bool mapHash(const string& fname, TigerTree& tth, int64_t size, CRC32Filter* xcrc32);
+#ifdef __linux__
+        bool streamHash(const string& fname, TigerTree& tth, int64_t size, CRC32Filter* xcrc32);
+#endif
+        void releaseStream();
+#endif
     };
 
     friend class Hasher;
 
+    typedef vector<Hasher*> HasherList;
+    typedef unordered_map<string, Hasher*> DeviceMap;
+
+    /** The first hasher is created on startup and also runs database rebuilds */
+    HasherList hashers;
+    /** Device id -> hasher serving it */
+    DeviceMap devices;
+    bool paused;
+
+    Hasher* getHasher(const string& aFileName);
+    Hasher* addHasher();
+    void clearHashers();
+
+    /**
+     * File and tree index of the hash database.
+     *
+     * The index lives in HashIndex.bin, a read-only memory mapped image with
+     * the tree records sorted by root, the file records sorted by path and a
+     * table holding the path strings. Changes made since the image was written
+     * are kept in memory and appended to the HashIndex.log journal as they
+     * happen; the journal is replayed on load and folded into a new image
+     * once it grows large enough. HashIndex.xml is only read once to import
+     * the index of older versions.
+     *
+     * A new image is written in three steps so that the lock doesn't have to
+     * be held while the file is written: prepareImage() takes a copy of the
+     * changes, writeImage() merges them with the mapped image and
+     * commitImage() switches over, replaying what was journaled meanwhile.
+     */
     class HashStore {
     public:
         HashStore();
         void addFile(const string& aFileName, uint32_t aTimeStamp, const TigerTree& tth, bool aUsed);
 
         void load();
-        void save();
 
         void rebuild();
 
         bool checkTTH(const string& aFileName, int64_t aSize, uint32_t aTimeStamp);
+        void renameFile(const string& aOldName, const string& aNewName);
 
         void addTree(const TigerTree& tt) noexcept;
+        /** The returned pointer is valid until the next commitImage() */
         const TTHValue* getTTH(const string& aFileName);
         bool getTree(const TTHValue& root, TigerTree& tth);
         size_t getBlockSize(const TTHValue& root) const;
@@ -209,11 +268,100 @@ private:
         typedef unordered_map<TTHValue, TreeInfo> TreeMap;
         typedef TreeMap::iterator TreeIter;
 
+    public:
+        struct ImageJob {
+            ImageJob() : newTrees(NULL), journalSize(-1) { }
+
+            /** Without a journal the changes made while writing couldn't be carried over */
+            bool hasJournal() const { return journalSize >= 0; }
+
+            /** Trees and files changed since the image was written, sorted the way the image wants them */
+            vector<pair<TTHValue, TreeInfo> > trees;
+            vector<pair<string, FileInfo> > files;
+            const TreeMap* newTrees;
+            /** Flags of the file records in the current image */
+            vector<uint8_t> imageFlags;
+            /** Records beyond this point were journaled after the job was prepared */
+            int64_t journalSize;
+            string tmpName;
+        };
+
+        /**
+         * @param force Write the image even if the journal is still short
+         * @param newTrees If set, replaces the tree index and only files pointing to these trees are kept.
+         * @return false if there's nothing to write yet
+         */
+        bool prepareImage(ImageJob& job, bool force, const TreeMap* newTrees = NULL);
+        /**
+         * Write the image of a prepared job. Doesn't need the lock: it only reads the
+         * job and the mapped image, which stays as it is until commitImage().
+         */
+        bool writeImage(ImageJob& job);
+        /** Map the written image, carrying over the changes made since prepareImage() */
+        void commitImage(ImageJob& job);
+
+    private:
+
+        /** HashIndex.bin layout: header, TreeRecord[trees], FileRecord[files], path table */
+        struct IndexHeader {
+            uint32_t magic;
+            uint32_t version;
+            uint64_t trees;
+            uint64_t files;
+            uint64_t pathBytes;
+        };
+
+        struct TreeRecord {
+            uint8_t root[TTHValue::BYTES];
+            int64_t size;
+            int64_t index;
+            int64_t blockSize;
+        };
+
+        struct FileRecord {
+            uint8_t root[TTHValue::BYTES];
+            uint64_t pathOffset;
+            uint32_t pathLength;
+            uint32_t timeStamp;
+            uint32_t flags;
+            uint32_t reserved;
+        };
+
+        /** HashIndex.log entry, followed by pathLength bytes of path for file entries */
+        struct JournalRecord {
+            /** USED records the first use of a file, so that rebuild() keeps its tree after a crash as well */
+            enum { TREE, FILE, REMOVE, USED };
+
+            uint32_t type;
+            uint32_t pathLength;
+            uint8_t root[TTHValue::BYTES];
+            int64_t size;
+            int64_t index;
+            int64_t blockSize;
+            uint32_t timeStamp;
+            uint32_t flags;
+        };
+
+        /** State of the file records; only FLAG_USED is stored in the image and the journal */
+        enum { FLAG_USED = 0x01, FLAG_REMOVED = 0x02 };
+
         friend class HashLoader;
 
+        /** Entries added since the image was written */
         DirMap fileIndex;
         TreeMap treeIndex;
 
+        std::unique_ptr<MappedFile> image;
+        const TreeRecord* imageTrees;
+        size_t imageTreeCount;
+        const FileRecord* imageFiles;
+        size_t imageFileCount;
+        const char* imagePaths;
+        vector<uint8_t> imageFlags;
+
+        std::unique_ptr<File> journal;
+        size_t journalRecords;
+
         bool dirty;
 
         void createDataFile(const string& name);
@@ -221,13 +369,42 @@ private:
         bool loadTree(File& dataFile, const TreeInfo& ti, const TTHValue& root, TigerTree& tt);
         int64_t saveTree(File& dataFile, const TigerTree& tt);
 
-        string getIndexFile() { return Util::getPath(Util::PATH_USER_CONFIG) + "HashIndex.xml"; }
+        bool findTree(const TTHValue& root, TreeInfo& ti) const;
+        const TreeRecord* findImageTree(const TTHValue& root) const;
+        /** @return index of the file in the image or -1 if it isn't there (or was removed) */
+        int64_t findImageFile(const string& aFileName) const;
+        string getImagePath(const FileRecord& fr) const { return string(imagePaths + fr.pathOffset, fr.pathLength); }
+
+        bool findFile(const string& aFileName, TTHValue& aRoot, uint32_t& aTimeStamp) const;
+        void insertFile(const string& aFileName, const TTHValue& aRoot, uint32_t aTimeStamp, bool aUsed);
+        bool removeFile(const string& aFileName);
+        /** @return the root of the file, NULL if it isn't known; wasUsed tells whether it was marked before */
+        const TTHValue* setUsed(const string& aFileName, bool& wasUsed);
+
+        /** Write a new image right away, with the lock held all the time */
+        void save(const TreeMap* newTrees);
+
+        /** The current image is only replaced if the new one is valid */
+        bool mapImage(const string& aFileName);
+        void closeImage();
+        /** @return size of the valid part of the journal, -1 if there is none */
+        int64_t replayJournal();
+        /** Apply the records in data from start on; @return bytes taken up by complete records */
+        size_t replayRecords(const string& data, size_t pos);
+        /** Open the journal for appending, starting a new one unless validSize is positive */
+        void openJournal(int64_t validSize);
+        /** Start a new journal holding the given records */
+        void rewriteJournal(const string& aRecords);
+        void appendJournal(const JournalRecord& jr, const string& aFileName);
+
+        string getIndexFile() { return Util::getPath(Util::PATH_USER_CONFIG) + "HashIndex.bin"; }
+        string getJournalFile() { return Util::getPath(Util::PATH_USER_CONFIG) + "HashIndex.log"; }
+        string getXmlIndexFile() { return Util::getPath(Util::PATH_USER_CONFIG) + "HashIndex.xml"; }
         string getDataFile() { return Util::getPath(Util::PATH_USER_CONFIG) + "HashData.dat"; }
     };
 
     friend class HashLoader;
 
-    Hasher hasher;
     HashStore store;
 
     class StreamStore
@@ -263,14 +440,20 @@ private:
 
     void hashDone(const string& aFileName, uint32_t aTimeStamp, const TigerTree& tth, int64_t speed, int64_t size);
 
+    /** Held while a new index image is written, so that there's only one at a time; taken before cs */
+    CriticalSection saveCs;
+
     void doRebuild() {
+        Lock s(saveCs);
         Lock l(cs);
         store.rebuild();
     }
 
+    /** Write a new index image if enough changes piled up in the journal (or any, if forced) */
+    void saveStore(bool force);
+
     virtual void on(TimerManagerListener::Minute, uint64_t) noexcept {
-        Lock l(cs);
-        store.save();
+        saveStore(false);
     }
     void on(TimerManagerListener::Second, uint64_t) noexcept;
 };
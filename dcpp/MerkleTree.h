@@ -98,17 +98,22 @@ public:
             return;
 
         do {
-            size_t n = min(baseBlockSize, len-i);
-            Hasher h;
-            h.update(&zero, 1);
-            h.update(buf + i, n);
-            if((int64_t)baseBlockSize < blockSize) {
-                blocks.push_back(make_pair(MerkleValue(h.finalize()), baseBlockSize));
-                reduceBlocks();
+            // Full leaves are hashed in batches so the hasher can work on several at once
+            size_t n = min((len - i) / baseBlockSize, (size_t)LEAF_BATCH);
+            if(n > 1) {
+                uint8_t hashes[LEAF_BATCH * Hasher::BYTES];
+                Hasher::hashLeaves(buf + i, baseBlockSize, n, hashes);
+                for(size_t j = 0; j < n; ++j)
+                    addLeaf(MerkleValue(hashes + j * Hasher::BYTES));
+                i += n * baseBlockSize;
             } else {
-                leaves.push_back(MerkleValue(h.finalize()));
+                n = min(baseBlockSize, len-i);
+                Hasher h;
+                h.update(&zero, 1);
+                h.update(buf + i, n);
+                addLeaf(MerkleValue(h.finalize()));
+                i += n;
             }
-            i += n;
         } while(i < len);
         fileSize += len;
     }
@@ -161,6 +166,9 @@ public:
     }
 
 private:
+    /** Number of leaves handed to Hasher::hashLeaves at a time */
+    enum { LEAF_BATCH = 16 };
+
     typedef pair<MerkleValue, int64_t> MerkleBlock;
     typedef vector<MerkleBlock> MBList;
 
@@ -187,6 +195,15 @@ private:
         }
     }
 
+    void addLeaf(const MerkleValue& leaf) {
+        if((int64_t)baseBlockSize < blockSize) {
+            blocks.push_back(make_pair(leaf, baseBlockSize));
+            reduceBlocks();
+        } else {
+            leaves.push_back(leaf);
+        }
+    }
+
     MerkleValue combine(const MerkleValue& a, const MerkleValue& b) {
         uint8_t one = 1;
         Hasher h;
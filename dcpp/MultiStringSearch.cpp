@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "stdinc.h"
+#include "MultiStringSearch.h"
+
+#include "Text.h"
+#include "debug.h"
+
+namespace dcpp {
+
+size_t MultiStringSearch::add(const string& aPattern) {
+    dcassert(!compiled);
+    string tmp;
+    return patterns.insert(make_pair(Text::toLower(aPattern, tmp), patterns.size())).first->second;
+}
+
+void MultiStringSearch::compile() {
+    // The trie first, with 0 standing for "no edge" as nothing leads back to the root
+    next.assign(ASIZE, 0);
+    out.assign(1, vector<size_t>());
+
+    for(auto i = patterns.begin(); i != patterns.end(); ++i) {
+        const string& p = i->first;
+        if(p.empty())
+            continue;
+
+        uint32_t s = 0;
+        for(auto c = p.begin(); c != p.end(); ++c) {
+            uint32_t& t = next[s * ASIZE + (uint8_t)*c];
+            if(t == 0) {
+                t = (uint32_t)out.size();
+                out.push_back(vector<size_t>());
+                next.resize(next.size() + ASIZE, 0);
+            }
+            s = next[s * ASIZE + (uint8_t)*c];
+        }
+        out[s].push_back(i->second);
+    }
+
+    // Then fill in the missing edges breadth first, so that every state knows where to go for each byte
+    vector<uint32_t> fail(out.size(), 0);
+    deque<uint32_t> queue;
+    for(int c = 0; c < ASIZE; ++c) {
+        if(next[c] != 0)
+            queue.push_back(next[c]);
+    }
+
+    while(!queue.empty()) {
+        uint32_t s = queue.front();
+        queue.pop_front();
+
+        const vector<size_t>& inherited = out[fail[s]];
+        out[s].insert(out[s].end(), inherited.begin(), inherited.end());
+
+        for(int c = 0; c < ASIZE; ++c) {
+            uint32_t& t = next[s * ASIZE + c];
+            uint32_t f = next[fail[s] * ASIZE + c];
+            if(t == 0) {
+                t = f;
+            } else {
+                fail[t] = f;
+                queue.push_back(t);
+            }
+        }
+    }
+
+    for(auto i = out.begin(); i != out.end(); ++i)
+        sort(i->begin(), i->end());
+
+    compiled = true;
+}
+
+void MultiStringSearch::match(const string& aText, vector<size_t>& aFound) const noexcept {
+    dcassert(compiled);
+    aFound.clear();
+
+    string tmp;
+    const string& lower = Text::toLower(aText, tmp);
+
+    uint32_t s = 0;
+    for(auto c = lower.begin(); c != lower.end(); ++c) {
+        s = next[s * ASIZE + (uint8_t)*c];
+        const vector<size_t>& o = out[s];
+        aFound.insert(aFound.end(), o.begin(), o.end());
+    }
+
+    sort(aFound.begin(), aFound.end());
+    aFound.erase(unique(aFound.begin(), aFound.end()), aFound.end());
+}
+
+} // namespace dcpp
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "noexcept.h"
+
+namespace dcpp {
+
+/**
+ * Finds which of many substrings occur in a text with a single pass over it
+ * (Aho-Corasick). Like StringSearch, matching ignores case.
+ *
+ * Add all the patterns, compile() and then match() as much as needed; match()
+ * doesn't change anything, so several threads may use it at once.
+ */
+class MultiStringSearch {
+public:
+    MultiStringSearch() : compiled(false) { }
+
+    /** @return The id of the pattern; adding the same one again gives the same id */
+    size_t add(const string& aPattern);
+    void compile();
+
+    /**
+     * @param aFound Set to the ids of the patterns found in the text, in
+     *               ascending order and each only once
+     */
+    void match(const string& aText, vector<size_t>& aFound) const noexcept;
+
+    size_t size() const { return patterns.size(); }
+    bool empty() const { return patterns.empty(); }
+
+private:
+    enum { ASIZE = 256 };
+
+    unordered_map<string, size_t> patterns;
+
+    /** States are rows of ASIZE transitions; state 0 is the root */
+    vector<uint32_t> next;
+    /** Patterns ending at a state, including those of its suffixes */
+    vector<vector<size_t> > out;
+    bool compiled;
+};
+
+} // namespace dcpp
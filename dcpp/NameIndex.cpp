@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "stdinc.h"
+#include "NameIndex.h"
+
+#include "debug.h"
+
+namespace dcpp {
+
+namespace {
+
+inline void putVarInt(ByteVector& v, uint32_t x) {
+    while(x >= 0x80) {
+        v.push_back((uint8_t)(x | 0x80));
+        x >>= 7;
+    }
+    v.push_back((uint8_t)x);
+}
+
+inline uint32_t getVarInt(const uint8_t*& p) {
+    uint32_t x = 0;
+    for(int shift = 0; ; shift += 7) {
+        uint8_t b = *p++;
+        x |= (uint32_t)(b & 0x7f) << shift;
+        if(!(b & 0x80))
+            return x;
+    }
+}
+
+/** Walks a delta encoded posting list */
+class PostingReader {
+public:
+    PostingReader(const ByteVector& v) : p(v.empty() ? NULL : &v[0]), end(p + v.size()), id(0) { }
+
+    bool next(uint32_t& aId) {
+        if(p == end)
+            return false;
+        id += getVarInt(p);
+        aId = id;
+        return true;
+    }
+
+private:
+    const uint8_t* p;
+    const uint8_t* end;
+    uint32_t id;
+};
+
+}
+
+struct NameIndex::ShorterList {
+    bool operator()(const Postings* a, const Postings* b) const { return a->count < b->count; }
+};
+
+void NameIndex::add(uint32_t id, const string& aName) {
+    for(size_t i = 0; i + 3 <= aName.size(); ++i) {
+        Postings& p = grams[gram(aName, i)];
+        // The same trigram may show up more than once in a name
+        if(p.count > 0 && p.last == id)
+            continue;
+
+        dcassert(p.count == 0 || id > p.last);
+        putVarInt(p.data, id - p.last);
+        p.last = id;
+        p.count++;
+    }
+}
+
+size_t NameIndex::count(const string& aPattern) const {
+    vector<const Postings*> lists;
+    getPostings(aPattern, lists);
+    return lists.empty() ? 0 : lists.front()->count;
+}
+
+void NameIndex::find(const string& aPattern, vector<uint32_t>& aIds) const {
+    aIds.clear();
+
+    vector<const Postings*> lists;
+    getPostings(aPattern, lists);
+    if(lists.empty())
+        return;
+
+    // Start with the shortest list and drop whatever the others don't contain
+    aIds.reserve(lists.front()->count);
+    PostingReader first(lists.front()->data);
+    for(uint32_t id; first.next(id); )
+        aIds.push_back(id);
+
+    for(auto i = lists.begin() + 1; i != lists.end() && !aIds.empty(); ++i) {
+        PostingReader r((*i)->data);
+        auto out = aIds.begin();
+        uint32_t id;
+        bool more = r.next(id);
+        for(auto j = aIds.begin(); j != aIds.end() && more; ++j) {
+            while(more && id < *j)
+                more = r.next(id);
+            if(more && id == *j)
+                *out++ = *j;
+        }
+        aIds.erase(out, aIds.end());
+    }
+}
+
+void NameIndex::getPostings(const string& aPattern, vector<const Postings*>& aLists) const {
+    aLists.clear();
+    for(size_t i = 0; i + 3 <= aPattern.size(); ++i) {
+        auto j = grams.find(gram(aPattern, i));
+        if(j == grams.end()) {
+            aLists.clear();
+            return;
+        }
+        if(std::find(aLists.begin(), aLists.end(), &j->second) == aLists.end())
+            aLists.push_back(&j->second);
+    }
+
+    sort(aLists.begin(), aLists.end(), ShorterList());
+}
+
+} // namespace dcpp
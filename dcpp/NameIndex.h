@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "typedefs.h"
+
+namespace dcpp {
+
+/**
+ * Inverted index from the three byte substrings (trigrams) of lower case
+ * names to the ids of the names containing them. Any name that contains a
+ * pattern also contains all of its trigrams, so intersecting their posting
+ * lists narrows a substring search down to a few candidates that only have
+ * to be verified. Patterns shorter than a trigram can't be looked up.
+ *
+ * Posting lists are kept sorted and delta encoded as variable length
+ * integers, which is why ids have to be added in increasing order. There's
+ * no removal; callers ignore ids they've dropped and rebuild the index once
+ * too many of them pile up.
+ */
+class NameIndex {
+public:
+    /** @param aName Lower case name */
+    void add(uint32_t id, const string& aName);
+    void clear() { grams.clear(); }
+
+    /** @return whether aPattern is long enough to be looked up */
+    static bool isIndexed(const string& aPattern) { return aPattern.size() >= 3; }
+
+    /** @return an upper bound of the names containing aPattern */
+    size_t count(const string& aPattern) const;
+
+    /**
+     * Ids of the names that may contain aPattern, in increasing order.
+     * @param aPattern Lower case pattern, must be isIndexed()
+     */
+    void find(const string& aPattern, vector<uint32_t>& aIds) const;
+
+private:
+    struct Postings {
+        Postings() : last(0), count(0) { }
+
+        ByteVector data;
+        uint32_t last;
+        uint32_t count;
+    };
+    typedef unordered_map<uint32_t, Postings> GramMap;
+    struct ShorterList;
+
+    GramMap grams;
+
+    static uint32_t gram(const string& s, size_t i) {
+        return ((uint32_t)(uint8_t)s[i] << 16) | ((uint32_t)(uint8_t)s[i + 1] << 8) | (uint8_t)s[i + 2];
+    }
+
+    /** Lists of the pattern's trigrams, shortest first; empty if one of them is missing */
+    void getPostings(const string& aPattern, vector<const Postings*>& aLists) const;
+};
+
+} // namespace dcpp
@@ -178,6 +178,10 @@ void NmdcHub::onLine(const string& aLine) noexcept {
     if(aLine.length() == 0)
         return;
 
+    // Whatever else comes may refer to the users of the batch
+    if(aLine.compare(0, 8, "$MyINFO ") != 0)
+        flushUpdates();
+
     if(aLine[0] != '$') {
         // Check if we're being banned...
         if(state != STATE_NORMAL) {
@@ -416,7 +420,7 @@ void NmdcHub::onLine(const string& aLine) noexcept {
             setMyIdentity(u.getIdentity());
         }
 
-        fire(ClientListener::UserUpdated(), this, u);
+        userUpdated(u);
     } else if(cmd == "$Quit") {
         if(!param.empty()) {
             const string& nick = param;
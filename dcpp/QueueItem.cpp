@@ -142,17 +142,24 @@ Segment QueueItem::getNextSegment(int64_t blockSize, int64_t wantedSize, int64_t
 
 
     /* added for PFS */
-    vector<int64_t> posArray;
+    SegmentSet parts;
     vector<Segment> neededParts;
 
     if(partialSource) {
-        posArray.reserve(partialSource->getPartialInfo().size());
-
         // Convert block index to file position
-        for(PartsInfo::const_iterator i = partialSource->getPartialInfo().begin(); i != partialSource->getPartialInfo().end(); ++i)
-            posArray.push_back(min(getSize(), (int64_t)(*i) * blockSize));
+        const PartsInfo& pi = partialSource->getPartialInfo();
+        for(PartsInfo::const_iterator i = pi.begin(); i + 1 < pi.end(); i += 2) {
+            int64_t b = min(getSize(), (int64_t)(*i) * blockSize);
+            int64_t e = min(getSize(), (int64_t)(*(i + 1)) * blockSize);
+            if(b < e)
+                parts.add(Segment(b, e - b));
+        }
     }
 
+    SegmentSet running;
+    for(auto i = downloads.begin(); i != downloads.end(); ++i)
+        running.add((*i)->getSegment());
+
     /***************************/
 
     double donePart = static_cast<double>(getDownloadedBytes()) / getSize();
@@ -173,50 +180,35 @@ Segment QueueItem::getNextSegment(int64_t blockSize, int64_t wantedSize, int64_t
     while(start < getSize()) {
         int64_t end = std::min(getSize(), start + curSize);
         Segment block(start, end - start);
-        bool overlaps = false;
-        for(auto i = done.begin(); !overlaps && i != done.end(); ++i) {
-            if(curSize <= blockSize) {
-                int64_t dstart = i->getStart();
-                int64_t dend = i->getEnd();
-                // We accept partial overlaps, only consider the block done if it is fully consumed by the done block
-                if(dstart <= start && dend >= end) {
-                    overlaps = true;
-                }
-            } else {
-                overlaps = block.overlaps(*i);
-            }
-        }
-
-        for(auto i = downloads.begin(); !overlaps && i !=downloads.end(); ++i) {
-            overlaps = block.overlaps((*i)->getSegment());
-        }
+        // We accept partial overlaps, only consider a single block done if it is fully consumed by a done segment
+        bool overlaps = (curSize <= blockSize) ? done.covers(block) : done.overlaps(block);
+        if(!overlaps)
+            overlaps = running.overlaps(block);
 
         if(!overlaps) {
             if(partialSource) {
                 // store all chunks we could need
-                for(vector<int64_t>::const_iterator j = posArray.begin(); j < posArray.end(); j += 2){
-                    if( (*j <= start && start < *(j+1)) || (start <= *j && *j < end) ) {
-                        int64_t b = max(start, *j);
-                        int64_t e = min(end, *(j+1));
-
-                        // segment must be blockSize aligned
-                        dcassert(b % blockSize == 0);
-                        dcassert(e % blockSize == 0 || e == getSize());
-
-                        bool merged = false;
-                        if(!neededParts.empty())
+                for(auto j = parts.after(start); j != parts.end() && j->getStart() < end; ++j) {
+                    int64_t b = max(start, j->getStart());
+                    int64_t e = min(end, j->getEnd());
+
+                    // segment must be blockSize aligned
+                    dcassert(b % blockSize == 0);
+                    dcassert(e % blockSize == 0 || e == getSize());
+
+                    bool merged = false;
+                    if(!neededParts.empty())
+                    {
+                        Segment& prev = neededParts.back();
+                        if(b == prev.getEnd() && e > prev.getEnd())
                         {
-                            Segment& prev = neededParts.back();
-                            if(b == prev.getEnd() && e > prev.getEnd())
-                            {
-                                 prev.setSize(prev.getSize() + (e - b));
-                                 merged = true;
-                            }
+                             prev.setSize(prev.getSize() + (e - b));
+                             merged = true;
                         }
-
-                        if(!merged)
-                            neededParts.push_back(Segment(b, e - b));
                     }
+
+                    if(!merged)
+                        neededParts.push_back(Segment(b, e - b));
                 }
             } else {
                 return block;
@@ -276,46 +268,18 @@ Segment QueueItem::getNextSegment(int64_t blockSize, int64_t wantedSize, int64_t
     return Segment(0, 0);
 }
 
-int64_t QueueItem::getDownloadedBytes() const {
-    int64_t total = 0;
-    for(auto i = done.begin(); i != done.end(); ++i) {
-        total += i->getSize();
-    }
-    return total;
-}
-
 void QueueItem::addSegment(const Segment& segment) {
-    done.insert(segment);
-
-    // Consolidate segments
-    if(done.size() == 1)
-        return;
-
-    for(auto i = ++done.begin() ; i != done.end(); ) {
-        auto prev = i;
-        --prev;
-        if(prev->getEnd() >= i->getStart()) {
-            Segment big(prev->getStart(), i->getEnd() - prev->getStart());
-            done.erase(prev);
-            done.erase(i++);
-            done.insert(big);
-        } else {
-            ++i;
-        }
-    }
+    done.add(segment);
 }
 //Partial
 bool QueueItem::isNeededPart(const PartsInfo& partsInfo, int64_t blockSize)
 {
     dcassert(partsInfo.size() % 2 == 0);
 
-    SegmentConstIter i  = done.begin();
     for(PartsInfo::const_iterator j = partsInfo.begin(); j != partsInfo.end(); j+=2) {
-        while(i != done.end() && (*i).getEnd() <= (*j) * blockSize)
-            ++i;
-
-        if(i == done.end() || !((*i).getStart() <= (*j) * blockSize && (*i).getEnd() >= (*(j+1)) * blockSize))
-                return true;
+        int64_t start = (int64_t)(*j) * blockSize;
+        if(!done.covers(Segment(start, (int64_t)(*(j+1)) * blockSize - start)))
+            return true;
     }
 
     return false;
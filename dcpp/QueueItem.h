@@ -131,8 +131,8 @@ public:
     typedef SourceList::iterator SourceIter;
     typedef SourceList::const_iterator SourceConstIter;
 
-    typedef set<Segment> SegmentSet;
-    typedef SegmentSet::iterator SegmentIter;
+    typedef dcpp::SegmentSet SegmentSet;
+    typedef SegmentSet::const_iterator SegmentIter;
     typedef SegmentSet::const_iterator SegmentConstIter;
 
     QueueItem(const string& aTarget, int64_t aSize, Priority aPriority, int aFlag,
@@ -176,7 +176,7 @@ public:
         return false;
     }
 
-    int64_t getDownloadedBytes() const;
+    int64_t getDownloadedBytes() const { return done.getBytes(); }
     double getDownloadedFraction() const { return static_cast<double>(getDownloadedBytes()) / getSize(); }
 
     DownloadList& getDownloads() { return downloads; }
@@ -184,17 +184,12 @@ public:
     bool isChunkDownloaded(int64_t startPos, int64_t& len) const {
         if(len <= 0) return false;
 
-        for(SegmentSet::const_iterator i = done.begin(); i != done.end(); ++i) {
-            int64_t first  = (*i).getStart();
-            int64_t second = (*i).getEnd();
+        SegmentConstIter i = done.find(startPos);
+        if(i == done.end())
+            return false;
 
-            if(first <= startPos && startPos < second){
-                len = min(len, second - startPos);
-                return true;
-            }
-        }
-
-        return false;
+        len = min(len, i->getEnd() - startPos);
+        return true;
     }
 
     /** Next segment that is not done and not being downloaded, zero-sized segment returned if there is none is found */
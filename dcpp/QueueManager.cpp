@@ -91,6 +91,7 @@ QueueItem* QueueManager::FileQueue::add(const string& aTarget, int64_t aSize,
 }
 
 void QueueManager::FileQueue::add(QueueItem* qi) {
+    setChanged(qi->getTarget());
     if(lastInsert == queue.end())
         lastInsert = queue.insert(make_pair(const_cast<string*>(&qi->getTarget()), qi)).first;
     else
@@ -98,6 +99,7 @@ void QueueManager::FileQueue::add(QueueItem* qi) {
 }
 
 void QueueManager::FileQueue::remove(QueueItem* qi) {
+    setChanged(qi->getTarget());
     if(lastInsert != queue.end() && Util::stricmp(*lastInsert->first, qi->getTarget()) == 0)
         ++lastInsert;
     queue.erase(const_cast<string*>(&qi->getTarget()));
@@ -184,6 +186,7 @@ QueueItem* QueueManager::FileQueue::findAutoSearch(StringList& recent) {
 void QueueManager::FileQueue::move(QueueItem* qi, const string& aTarget) {
     if(lastInsert != queue.end() && Util::stricmp(*lastInsert->first, qi->getTarget()) == 0)
         lastInsert = queue.end();
+    setChanged(qi->getTarget());
     queue.erase(const_cast<string*>(&qi->getTarget()));
     qi->setTarget(aTarget);
     add(qi);
@@ -209,13 +212,60 @@ void QueueManager::UserQueue::add(QueueItem* qi) {
 }
 
 void QueueManager::UserQueue::add(QueueItem* qi, const UserPtr& aUser) {
-    QueueItem::List& l = userQueue[qi->getPriority()][aUser];
-
-    if(qi->getDownloadedBytes() > 0) {
-        l.push_front(qi);
+    auto r = ranks.find(qi);
+    if(r == ranks.end()) {
+        Rank& rank = ranks[qi];
+        rank.qi = qi;
+        rank.started = qi->getDownloadedBytes() > 0 || !qi->getDownloads().empty();
+        rank.online = qi->countOnlineUsers();
+        rank.seq = nextSeq++;
+        r = ranks.find(qi);
     } else {
-        l.push_back(qi);
+        setOnline(r->second, qi->countOnlineUsers());
     }
+
+    Rank& rank = r->second;
+    dcassert(find(rank.users.begin(), rank.users.end(), aUser) == rank.users.end());
+    rank.users.push_back(aUser);
+    userQueue[qi->getPriority()][aUser].insert(&rank);
+}
+
+void QueueManager::UserQueue::setOnline(Rank& rank, int online) {
+    if(rank.online != online)
+        reorder(rank, rank.started, online);
+}
+
+void QueueManager::UserQueue::updateStarted(QueueItem* qi) {
+    auto r = ranks.find(qi);
+    if(r == ranks.end())
+        return;
+
+    bool started = qi->getDownloadedBytes() > 0 || !qi->getDownloads().empty();
+    if(r->second.started != started)
+        reorder(r->second, started, r->second.online);
+}
+
+void QueueManager::UserQueue::reorder(Rank& rank, bool started, int online) {
+    // The sets are ordered by the rank, so it can't change while they hold it
+    UserRankMap& urm = userQueue[rank.qi->getPriority()];
+    for(auto i = rank.users.begin(); i != rank.users.end(); ++i)
+        urm[*i].erase(&rank);
+    rank.started = started;
+    rank.online = online;
+    for(auto i = rank.users.begin(); i != rank.users.end(); ++i)
+        urm[*i].insert(&rank);
+}
+
+void QueueManager::UserQueue::updateAvailability(const UserPtr& aUser) {
+    vector<Rank*> changed;
+    for(int p = 0; p < QueueItem::LAST; ++p) {
+        auto i = userQueue[p].find(aUser);
+        if(i != userQueue[p].end())
+            changed.insert(changed.end(), i->second.begin(), i->second.end());
+    }
+
+    for(auto i = changed.begin(); i != changed.end(); ++i)
+        setOnline(**i, (*i)->qi->countOnlineUsers());
 }
 
 QueueItem* QueueManager::UserQueue::getNext(const UserPtr& aUser, QueueItem::Priority minPrio, int64_t wantedSize,int64_t lastSpeed,bool allowRemove) {
@@ -223,11 +273,11 @@ QueueItem* QueueManager::UserQueue::getNext(const UserPtr& aUser, QueueItem::Pri
         string lastError = Util::emptyString;
 
     do {
-        QueueItem::UserListIter i = userQueue[p].find(aUser);
+        auto i = userQueue[p].find(aUser);
         if(i != userQueue[p].end()) {
             dcassert(!i->second.empty());
-            for(QueueItem::Iter j = i->second.begin(); j != i->second.end(); ++j) {
-                QueueItem* qi = *j;
+            for(auto j = i->second.begin(); j != i->second.end(); ++j) {
+                QueueItem* qi = (*j)->qi;
                 QueueItem::SourceConstIter source = qi->getSource(aUser);
                 if(source->isSet(QueueItem::Source::FLAG_PARTIAL)) {
                     // check partial source
@@ -279,6 +329,7 @@ void QueueManager::UserQueue::addDownload(QueueItem* qi, Download* d) {
     // Only one download per user...
     dcassert(running.find(d->getUser()) == running.end());
     running[d->getUser()] = qi;
+    updateStarted(qi);
 }
 
 void QueueManager::UserQueue::removeDownload(QueueItem* qi, const UserPtr& user) {
@@ -290,6 +341,7 @@ void QueueManager::UserQueue::removeDownload(QueueItem* qi, const UserPtr& user)
             break;
         }
     }
+    updateStarted(qi);
 }
 
 void QueueManager::UserQueue::setPriority(QueueItem* qi, QueueItem::Priority p) {
@@ -301,14 +353,14 @@ void QueueManager::UserQueue::setPriority(QueueItem* qi, QueueItem::Priority p)
 int64_t QueueManager::UserQueue::getQueued(const UserPtr& aUser) const {
     int64_t total = 0;
     for(size_t i = QueueItem::LOWEST; i < QueueItem::LAST; ++i) {
-        const QueueItem::UserListMap& ulm = userQueue[i];
-        QueueItem::UserListMap::const_iterator iulm = ulm.find(aUser);
-        if(iulm == ulm.end()) {
+        const UserRankMap& urm = userQueue[i];
+        auto iurm = urm.find(aUser);
+        if(iurm == urm.end()) {
             continue;
         }
 
-        for(QueueItem::List::const_iterator j = iulm->second.begin(); j != iulm->second.end(); ++j) {
-            const QueueItem::Ptr qi = *j;
+        for(auto j = iurm->second.begin(); j != iurm->second.end(); ++j) {
+            const QueueItem::Ptr qi = (*j)->qi;
             if(qi->getSize() != -1) {
                 total += qi->getSize() - qi->getDownloadedBytes();
             }
@@ -334,16 +386,24 @@ void QueueManager::UserQueue::remove(QueueItem* qi, const UserPtr& aUser, bool r
     }
 
     dcassert(qi->isSource(aUser));
-    QueueItem::UserListMap& ulm = userQueue[qi->getPriority()];
-    QueueItem::UserListIter j = ulm.find(aUser);
-    dcassert(j != ulm.end());
-    QueueItem::List& l = j->second;
-    QueueItem::Iter i = find(l.begin(), l.end(), qi);
-    dcassert(i != l.end());
-    l.erase(i);
+    auto r = ranks.find(qi);
+    dcassert(r != ranks.end());
+    Rank& rank = r->second;
 
-    if(l.empty()) {
-        ulm.erase(j);
+    UserRankMap& urm = userQueue[qi->getPriority()];
+    auto j = urm.find(aUser);
+    dcassert(j != urm.end());
+    j->second.erase(&rank);
+    if(j->second.empty()) {
+        urm.erase(j);
+    }
+
+    rank.users.erase(find(rank.users.begin(), rank.users.end(), aUser));
+    if(rank.users.empty()) {
+        ranks.erase(r);
+    } else {
+        // The user is still a source until the caller removes it
+        setOnline(rank, qi->countOnlineUsers() - (aUser->isOnline() ? 1 : 0));
     }
 }
 
@@ -455,6 +515,7 @@ int QueueManager::Rechecker::run() {
 
             //Clear segments
             q->resetDownloaded();
+            qm->setDirty(q);
 
             tempTarget = q->getTempTarget();
         }
@@ -528,6 +589,8 @@ lastSave(0),
 queueFile(Util::getPath(Util::PATH_USER_CONFIG) + "Queue.xml"),
 rechecker(this),
 dirty(true),
+journalRecords(0),
+journalGeneration(0),
 nextSearch(0)
 {
     TimerManager::getInstance()->addListener(this);
@@ -830,6 +893,11 @@ void QueueManager::readd(const string& target, const HintedUser& aUser) {
         ConnectionManager::getInstance()->getDownloadConnection(aUser);
 }
 
+void QueueManager::setDirty(QueueItem* qi) {
+    fileQueue.setChanged(qi->getTarget());
+    setDirty();
+}
+
 void QueueManager::setDirty() {
     if(!dirty) {
         dirty = true;
@@ -893,7 +961,7 @@ bool QueueManager::addSource(QueueItem* qi, const HintedUser& aUser, Flags::Mask
     }
 
     fire(QueueManagerListener::SourcesUpdated(), qi);
-    setDirty();
+    setDirty(qi);
 
     return wantConnection;
 }
@@ -1087,6 +1155,7 @@ Download* QueueManager::getDownload(UserConnection& aSource, bool supportsTrees)
                 } else {
                     // Temp target gone?
                     q->resetDownloaded();
+                    setDirty(q);
                 }
             }
         }
@@ -1226,6 +1295,7 @@ void QueueManager::moveStuckFile(QueueItem* qi) {
     } else {
         qi->addSegment(Segment(0, qi->getSize()));
         fire(QueueManagerListener::StatusUpdated(), qi);
+        setDirty(qi);
     }
 
     fire(QueueManagerListener::RecheckAlreadyFinished(), target);
@@ -1235,7 +1305,7 @@ void QueueManager::rechecked(QueueItem* qi) {
     fire(QueueManagerListener::RecheckDone(), qi->getTarget());
     fire(QueueManagerListener::StatusUpdated(), qi);
 
-    setDirty();
+    setDirty(qi);
 }
 
 void QueueManager::putDownload(Download* aDownload, bool finished) noexcept {
@@ -1319,6 +1389,7 @@ void QueueManager::putDownload(Download* aDownload, bool finished) noexcept {
                         } else if(aDownload->getType() == Transfer::TYPE_FILE) {
                             q->addSegment(aDownload->getSegment());
                         }
+                        setDirty(q);
 
                         if (q->isFinished() && BOOLSETTING(SFV_CHECK)) {
                                 crcError = checkSfv(q, aDownload);
@@ -1365,7 +1436,7 @@ void QueueManager::putDownload(Download* aDownload, bool finished) noexcept {
 
                             if(downloaded > 0) {
                                 q->addSegment(Segment(aDownload->getStartPos(), downloaded));
-                                setDirty();
+                                setDirty(q);
                             }
                         }
                     }
@@ -1508,7 +1579,7 @@ void QueueManager::removeSource(const string& aTarget, const UserPtr& aUser, int
         q->removeSource(aUser, reason);
 
         fire(QueueManagerListener::SourcesUpdated(), q);
-        setDirty();
+        setDirty(q);
     }
 endCheck:
     if(isRunning && removeConn) {
@@ -1538,7 +1609,7 @@ void QueueManager::removeSource(const UserPtr& aUser, int reason) noexcept {
                 userQueue.remove(qi, aUser);
                 qi->removeSource(aUser, reason);
                 fire(QueueManagerListener::SourcesUpdated(), qi);
-                setDirty();
+                setDirty(qi);
             }
         }
 
@@ -1553,7 +1624,7 @@ void QueueManager::removeSource(const UserPtr& aUser, int reason) noexcept {
                 qi->removeSource(aUser, reason);
                 fire(QueueManagerListener::StatusUpdated(), qi);
                 fire(QueueManagerListener::SourcesUpdated(), qi);
-                setDirty();
+                setDirty(qi);
             }
         }
     }
@@ -1579,7 +1650,7 @@ void QueueManager::setPriority(const string& aTarget, QueueItem::Priority p) noe
                                 q->getOnlineUsers(getConn);
             }
             userQueue.setPriority(q, p);
-            setDirty();
+            setDirty(q);
             fire(QueueManagerListener::StatusUpdated(), q);
         }
     }
@@ -1589,27 +1660,131 @@ void QueueManager::setPriority(const string& aTarget, QueueItem::Priority p) noe
     }
 }
 
+static const uint32_t QUEUE_JOURNAL_MAGIC = 0x4c455551; // "QUEL"
+static const uint32_t QUEUE_JOURNAL_VERSION = 1;
+/** Journal entries tolerated before Queue.xml is rewritten */
+static const size_t QUEUE_JOURNAL_MIN_RECORDS = 1024;
+
+namespace {
+
+/** A journal entry, followed by its payload */
+struct QueueJournalRecord {
+    enum { ITEM, REMOVE };
+
+    uint32_t type;
+    uint32_t length;
+    /** crc32 of the payload, so that a half written record isn't mistaken for a good one */
+    uint32_t crc;
+};
+
+template<typename T>
+inline void putValue(string& buf, T x) {
+    buf.append(reinterpret_cast<const char*>(&x), sizeof(x));
+}
+
+inline void putString(string& buf, const string& s) {
+    putValue(buf, (uint32_t)s.size());
+    buf += s;
+}
+
+/** Reads back what putValue/putString wrote; any overrun makes the whole record invalid */
+class JournalReader {
+public:
+    JournalReader(const char* aData, size_t aSize) : p(aData), end(aData + aSize), ok(true) { }
+
+    template<typename T>
+    T get() {
+        T x = T();
+        if(static_cast<size_t>(end - p) < sizeof(x)) {
+            ok = false;
+            return x;
+        }
+        memcpy(&x, p, sizeof(x));
+        p += sizeof(x);
+        return x;
+    }
+
+    string getString() {
+        uint32_t n = get<uint32_t>();
+        if(!ok || static_cast<size_t>(end - p) < n) {
+            ok = false;
+            return Util::emptyString;
+        }
+        string s(p, n);
+        p += n;
+        return s;
+    }
+
+    void getBytes(uint8_t* aBuf, size_t n) {
+        if(static_cast<size_t>(end - p) < n) {
+            ok = false;
+            return;
+        }
+        memcpy(aBuf, p, n);
+        p += n;
+    }
+
+    bool failed() const { return !ok; }
+    /** Whether the record was read in full and nothing more */
+    bool isOk() const { return ok && p == end; }
+
+private:
+    const char* p;
+    const char* end;
+    bool ok;
+};
+
+inline bool isPersistent(const QueueItem* qi) {
+    return !qi->isSet(QueueItem::FLAG_USER_LIST) || BOOLSETTING(KEEP_LISTS);
+}
+
+}
+
 void QueueManager::saveQueue(bool force) noexcept {
     if(!dirty && !force)
     return;
 
     std::vector<CID> cids;
 
-    try {
+    {
         Lock l(cs);
 
+        // Changes only go to the journal until it has grown about as big as the queue itself
+        if(force || !journal || journalRecords >= max(QUEUE_JOURNAL_MIN_RECORDS, fileQueue.getSize()) || !appendJournal(cids)) {
+            writeQueue(cids);
+        } else {
+            dirty = false;
+        }
+    }
+    // Put this here to avoid very many saves tries when disk is full...
+    lastSave = GET_TICK();
+
+    //NOTE: freedcpp, save user cids and nicks to Users.xml see dcplusplus revision 1771
+    ClientManager* cm = ClientManager::getInstance();
+//#ifdef _WIN32
+//        std::for_each(cids.begin(), cids.end(), std::bind(&ClientManager::saveUser, cm, std::placeholders::_1));
+//#else
+    for (vector<CID>::const_iterator it = cids.begin(); it != cids.end(); ++it)
+    {
+        cm->saveUser(*it);
+    }
+//#endif
+}
+
+void QueueManager::writeQueue(vector<CID>& cids) {
+    try {
         File ff(getQueueFile() + ".tmp", File::WRITE, File::CREATE | File::TRUNCATE);
         BufferedOutputStream<false> f(&ff);
 
         f.write(SimpleXML::utf8Header);
-        f.write(LIT("<Downloads Version=\"" VERSIONSTRING "\">\r\n"));
+        f.write(LIT("<Downloads Version=\"" VERSIONSTRING "\" Generation=\""));
+        f.write(Util::toString(journalGeneration + 1));
+        f.write(LIT("\">\r\n"));
         string tmp;
         string b32tmp;
         for(QueueItem::StringIter i = fileQueue.getQueue().begin(); i != fileQueue.getQueue().end(); ++i) {
             QueueItem* qi = i->second;
-            if(!qi->isSet(QueueItem::FLAG_USER_LIST)
-                || (qi->isSet(QueueItem::FLAG_USER_LIST)
-                    && SETTING(KEEP_LISTS))) {
+            if(isPersistent(qi)) {
                 f.write(LIT("\t<Download Target=\""));
                 f.write(SimpleXML::escape(qi->getTarget(), tmp, true));
                 f.write(LIT("\" Size=\""));
@@ -1666,23 +1841,204 @@ void QueueManager::saveQueue(bool force) noexcept {
         File::deleteFile(getQueueFile());
         File::renameFile(getQueueFile() + ".tmp", getQueueFile());
 
+        // The old journal is part of the new Queue.xml now
+        journalGeneration++;
+        openJournal(-1);
+        fileQueue.getChanged().clear();
         dirty = false;
     } catch(const FileException&) {
         // ...
     }
-    // Put this here to avoid very many saves tries when disk is full...
-    lastSave = GET_TICK();
+}
 
-    //NOTE: freedcpp, save user cids and nicks to Users.xml see dcplusplus revision 1771
-    ClientManager* cm = ClientManager::getInstance();
-//#ifdef _WIN32
-//        std::for_each(cids.begin(), cids.end(), std::bind(&ClientManager::saveUser, cm, std::placeholders::_1));
-//#else
-    for (vector<CID>::const_iterator it = cids.begin(); it != cids.end(); ++it)
-    {
-        cm->saveUser(*it);
+bool QueueManager::appendJournal(vector<CID>& cids) {
+    StringSet& changed = fileQueue.getChanged();
+    if(changed.empty())
+        return true;
+
+    // Each changed item is written as a whole, no matter how many times it changed
+    string buf;
+    string payload;
+    size_t records = 0;
+    for(StringSet::const_iterator i = changed.begin(); i != changed.end(); ++i) {
+        QueueJournalRecord jr;
+        QueueItem* qi = fileQueue.find(*i);
+
+        payload.clear();
+        if(qi && isPersistent(qi)) {
+            jr.type = QueueJournalRecord::ITEM;
+            putString(payload, qi->getTarget());
+            putValue(payload, qi->getSize());
+            putValue(payload, (int32_t)qi->getPriority());
+            putValue(payload, (int64_t)qi->getAdded());
+            payload.append(reinterpret_cast<const char*>(qi->getTTH().data), TTHValue::BYTES);
+            putString(payload, qi->getDone().empty() ? Util::emptyString : qi->getTempTarget());
+
+            putValue(payload, (uint32_t)qi->getDone().size());
+            for(QueueItem::SegmentSet::const_iterator j = qi->getDone().begin(); j != qi->getDone().end(); ++j) {
+                putValue(payload, j->getStart());
+                putValue(payload, j->getSize());
+            }
+
+            string sources;
+            uint32_t sourceCount = 0;
+            for(QueueItem::SourceConstIter j = qi->sources.begin(); j != qi->sources.end(); ++j) {
+                if(j->isSet(QueueItem::Source::FLAG_PARTIAL)
+#ifdef WITH_DHT
+                                                            || j->getUser().hint == "DHT"
+#endif
+                                                                                          ) continue;
+
+                const CID& cid = j->getUser().user->getCID();
+                sources.append(reinterpret_cast<const char*>(cid.data()), CID::SIZE);
+                putString(sources, j->getUser().hint);
+                sourceCount++;
+
+                cids.push_back(cid);
+            }
+            putValue(payload, sourceCount);
+            payload += sources;
+        } else {
+            jr.type = QueueJournalRecord::REMOVE;
+            putString(payload, *i);
+        }
+
+        jr.length = payload.size();
+        jr.crc = crc32(0, reinterpret_cast<const Bytef*>(payload.data()), payload.size());
+        buf.append(reinterpret_cast<const char*>(&jr), sizeof(jr));
+        buf += payload;
+        records++;
+    }
+
+    try {
+        journal->write(buf);
+    } catch(const FileException& e) {
+        // Falls back to writing the whole queue
+        journal.reset();
+        LogManager::getInstance()->message(str(F_("Error saving the download queue: %1%") % e.getError()));
+        return false;
+    }
+
+    journalRecords += records;
+    changed.clear();
+    return true;
+}
+
+int64_t QueueManager::replayJournal() {
+    string data;
+    try {
+        File f(getJournalFile(), File::READ, File::OPEN);
+        data = f.read();
+    } catch(const FileException&) {
+        return -1;
+    }
+
+    uint32_t header[3];
+    if(data.size() < sizeof(header))
+        return -1;
+    memcpy(header, data.data(), sizeof(header));
+    // A journal older than Queue.xml has already been written to it
+    if(header[0] != QUEUE_JOURNAL_MAGIC || header[1] != QUEUE_JOURNAL_VERSION || header[2] != journalGeneration)
+        return -1;
+
+    // A crash may have left a partial record at the end, everything before it is good
+    size_t pos = sizeof(header);
+    journalRecords = 0;
+    while(data.size() - pos >= sizeof(QueueJournalRecord)) {
+        QueueJournalRecord jr;
+        memcpy(&jr, data.data() + pos, sizeof(jr));
+        if(jr.type > QueueJournalRecord::REMOVE || jr.length > data.size() - pos - sizeof(jr))
+            break;
+
+        const char* payload = data.data() + pos + sizeof(jr);
+        if(crc32(0, reinterpret_cast<const Bytef*>(payload), jr.length) != jr.crc)
+            break;
+
+        JournalReader r(payload, jr.length);
+        string target = r.getString();
+        if(jr.type == QueueJournalRecord::REMOVE) {
+            if(!r.isOk())
+                break;
+
+            if(QueueItem* qi = fileQueue.find(target)) {
+                fire(QueueManagerListener::Removed(), qi);
+                if(!qi->isFinished())
+                    userQueue.remove(qi);
+                fileQueue.remove(qi);
+            }
+        } else {
+            int64_t size = r.get<int64_t>();
+            QueueItem::Priority p = (QueueItem::Priority)r.get<int32_t>();
+            time_t added = static_cast<time_t>(r.get<int64_t>());
+            uint8_t tth[TTHValue::BYTES];
+            r.getBytes(tth, sizeof(tth));
+            string tempTarget = r.getString();
+
+            QueueItem::SegmentSet done;
+            uint32_t segments = r.get<uint32_t>();
+            for(uint32_t i = 0; i < segments && !r.failed(); ++i) {
+                int64_t start = r.get<int64_t>();
+                int64_t len = r.get<int64_t>();
+                if(len > 0 && start >= 0 && start + len <= size)
+                    done.add(Segment(start, len));
+            }
+
+            vector<pair<CID, string> > sources;
+            uint32_t sourceCount = r.get<uint32_t>();
+            for(uint32_t i = 0; i < sourceCount && !r.failed(); ++i) {
+                uint8_t cid[CID::SIZE];
+                r.getBytes(cid, sizeof(cid));
+                sources.push_back(make_pair(CID(cid), r.getString()));
+            }
+
+            if(!r.isOk())
+                break;
+
+            if(QueueItem* old = fileQueue.find(target)) {
+                fire(QueueManagerListener::Removed(), old);
+                if(!old->isFinished())
+                    userQueue.remove(old);
+                fileQueue.remove(old);
+            }
+
+            QueueItem* qi = fileQueue.add(target, size, 0, p, tempTarget, added, TTHValue(tth));
+            for(QueueItem::SegmentSet::const_iterator i = done.begin(); i != done.end(); ++i)
+                qi->addSegment(*i);
+            fire(QueueManagerListener::Added(), qi);
+
+            for(auto i = sources.begin(); i != sources.end(); ++i) {
+                try {
+                    addSource(qi, HintedUser(ClientManager::getInstance()->getUser(i->first), i->second), 0);
+                } catch(const Exception&) {
+                    // ...
+                }
+            }
+        }
+
+        pos += sizeof(jr) + jr.length;
+        journalRecords++;
+    }
+
+    return pos;
+}
+
+void QueueManager::openJournal(int64_t validSize) {
+    try {
+        journal.reset(new File(getJournalFile(), File::READ | File::WRITE, File::OPEN | File::CREATE));
+        if(validSize > 0) {
+            journal->setPos(validSize);
+            journal->setEOF();
+        } else {
+            journal->setPos(0);
+            journal->setEOF();
+            uint32_t header[3] = { QUEUE_JOURNAL_MAGIC, QUEUE_JOURNAL_VERSION, journalGeneration };
+            journal->write(header, sizeof(header));
+            journalRecords = 0;
+        }
+    } catch(const FileException& e) {
+        journal.reset();
+        LogManager::getInstance()->message(str(F_("Error saving the download queue: %1%") % e.getError()));
     }
-//#endif
 }
 
 class QueueLoader : public SimpleXMLReader::CallBack {
@@ -1705,10 +2061,16 @@ void QueueManager::loadQueue() noexcept {
 
         File f(getQueueFile(), File::READ, File::OPEN);
         SimpleXMLReader(&l).parse(f);
-        dirty = false;
     } catch(const Exception&) {
         // ...
     }
+
+    Util::migrate(getJournalFile());
+
+    Lock l(cs);
+    openJournal(replayJournal());
+    fileQueue.getChanged().clear();
+    dirty = false;
 }
 
 int QueueManager::countOnlineSources(const string& aTarget) {
@@ -1745,6 +2107,7 @@ void QueueLoader::startTag(const string& name, StringPairList& attribs, bool sim
     QueueManager* qm = QueueManager::getInstance();
     if(!inDownloads && name == "Downloads") {
         inDownloads = true;
+        qm->journalGeneration = Util::toUInt32(getAttrib(attribs, "Generation", 1));
     } else if(inDownloads) {
         if(cur == NULL && name == sDownload) {
             int64_t size = Util::toInt64(getAttrib(attribs, sSize, 1));
@@ -1876,11 +2239,12 @@ void QueueManager::on(ClientManagerListener::UserConnected, const UserPtr& aUser
     bool hasDown = false;
     {
         Lock l(cs);
+        userQueue.updateAvailability(aUser);
         for(int i = 0; i < QueueItem::LAST; ++i) {
-            QueueItem::UserListIter j = userQueue.getList(i).find(aUser);
+            auto j = userQueue.getList(i).find(aUser);
             if(j != userQueue.getList(i).end()) {
-                for(QueueItem::Iter m = j->second.begin(); m != j->second.end(); ++m)
-                    fire(QueueManagerListener::StatusUpdated(), *m);
+                for(auto m = j->second.begin(); m != j->second.end(); ++m)
+                    fire(QueueManagerListener::StatusUpdated(), (*m)->qi);
                 if(i != QueueItem::PAUSED)
                     hasDown = true;
             }
@@ -1895,11 +2259,12 @@ void QueueManager::on(ClientManagerListener::UserConnected, const UserPtr& aUser
 
 void QueueManager::on(ClientManagerListener::UserDisconnected, const UserPtr& aUser) noexcept {
     Lock l(cs);
+    userQueue.updateAvailability(aUser);
     for(int i = 0; i < QueueItem::LAST; ++i) {
-        QueueItem::UserListIter j = userQueue.getList(i).find(aUser);
+        auto j = userQueue.getList(i).find(aUser);
         if(j != userQueue.getList(i).end()) {
-            for(QueueItem::Iter m = j->second.begin(); m != j->second.end(); ++m)
-                fire(QueueManagerListener::StatusUpdated(), *m);
+            for(auto m = j->second.begin(); m != j->second.end(); ++m)
+                fire(QueueManagerListener::StatusUpdated(), (*m)->qi);
         }
     }
 }
@@ -2031,6 +2396,7 @@ bool QueueManager::checkSfv(QueueItem* qi, Download* d) {
 
             File::deleteFile(qi->getTempTarget());
             qi->resetDownloaded();
+            setDirty(qi);
             dcdebug("QueueManager: CRC32 mismatch for %s\n", qi->getTarget().c_str());
             LogManager::getInstance()->message(_("CRC32 inconsistency (SFV-Check)") + ' ' + Util::addBrackets(qi->getTarget()));
 
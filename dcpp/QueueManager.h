@@ -216,8 +216,14 @@ private:
         QueueItem::StringMap& getQueue() { return queue; }
         void move(QueueItem* qi, const string& aTarget);
         void remove(QueueItem* qi);
+
+        /** Remember that the item needs to go to the journal */
+        void setChanged(const string& aTarget) { changed.insert(aTarget); }
+        StringSet& getChanged() { return changed; }
     private:
         QueueItem::StringMap queue;
+        /** Targets added, changed or removed since the journal was last written */
+        StringSet changed;
         /** A hint where to insert an item... */
         QueueItem::StringIter lastInsert;
     };
@@ -225,16 +231,46 @@ private:
     /** All queue items indexed by user (this is a cache for the FileQueue really...) */
     class UserQueue {
     public:
+        /**
+         * Where an item goes in the download order: started items first, then
+         * those with the fewest online sources, then the oldest.
+         */
+        struct Rank {
+            Rank() : qi(0), started(false), online(0), seq(0) { }
+
+            QueueItem* qi;
+            bool started;
+            int online;
+            uint64_t seq;
+            /** Users whose queues have the item */
+            UserList users;
+        };
+        struct RankLess {
+            bool operator()(const Rank* a, const Rank* b) const {
+                if(a->started != b->started)
+                    return a->started;
+                if(a->online != b->online)
+                    return a->online < b->online;
+                return a->seq < b->seq;
+            }
+        };
+        typedef set<Rank*, RankLess> RankSet;
+        typedef unordered_map<UserPtr, RankSet, User::Hash> UserRankMap;
+
+        UserQueue() : nextSeq(0) { }
+
         void add(QueueItem* qi);
         void add(QueueItem* qi, const UserPtr& aUser);
         QueueItem* getNext(const UserPtr& aUser, QueueItem::Priority minPrio = QueueItem::LOWEST, int64_t wantedSize = 0,int64_t lastSpeed =0 ,bool allowRemove = true);
         QueueItem* getRunning(const UserPtr& aUser);
         void addDownload(QueueItem* qi, Download* d);
         void removeDownload(QueueItem* qi, const UserPtr& d);
-        QueueItem::UserListMap& getList(int p) { return userQueue[p]; }
+        UserRankMap& getList(int p) { return userQueue[p]; }
         void remove(QueueItem* qi, bool removeRunning = true);
         void remove(QueueItem* qi, const UserPtr& aUser, bool removeRunning = true);
         void setPriority(QueueItem* qi, QueueItem::Priority p);
+        /** The user went on- or offline, which changes how available its items are */
+        void updateAvailability(const UserPtr& aUser);
 
         QueueItem::UserMap& getRunning() { return running; }
         bool isRunning(const UserPtr& aUser) const {
@@ -243,9 +279,18 @@ private:
         int64_t getQueued(const UserPtr& aUser) const;
     private:
         /** QueueItems by priority and user (this is where the download order is determined) */
-        QueueItem::UserListMap userQueue[QueueItem::LAST];
+        UserRankMap userQueue[QueueItem::LAST];
+        /** Ranks of all queued items; the sets above point here */
+        unordered_map<QueueItem*, Rank> ranks;
+        uint64_t nextSeq;
         /** Currently running downloads, a QueueItem is always either here or in the userQueue */
         QueueItem::UserMap running;
+
+        void setOnline(Rank& rank, int online);
+        /** A download of the item started or ended, which may make it count as started */
+        void updateStarted(QueueItem* qi);
+        /** Moves the item to its new place in all of its users' queues */
+        void reorder(Rank& rank, bool started, int online);
     };
 
     friend class QueueLoader;
@@ -266,6 +311,11 @@ private:
     StringList recent;
     /** The queue needs to be saved */
     bool dirty;
+    /** Queue.log, the changes made since Queue.xml was written */
+    std::unique_ptr<File> journal;
+    size_t journalRecords;
+    /** Tells whether the journal belongs to the Queue.xml at hand */
+    uint32_t journalGeneration;
     /** Next search */
     uint64_t nextSearch;
     /** File lists not to delete */
@@ -284,6 +334,19 @@ private:
     void rechecked(QueueItem* qi);
 
     void setDirty();
+    /** The item changed and has to be written to the journal */
+    void setDirty(QueueItem* qi);
+
+    /** Queue.log next to Queue.xml */
+    string getJournalFile() const { return queueFile.substr(0, queueFile.rfind('.')) + ".log"; }
+    /** Write the whole queue to Queue.xml and start a new journal */
+    void writeQueue(vector<CID>& cids);
+    /** @return false if the journal couldn't be written */
+    bool appendJournal(vector<CID>& cids);
+    /** @return size of the valid part of the journal, -1 if there is none */
+    int64_t replayJournal();
+    /** Open the journal for appending, starting a new one unless validSize is positive */
+    void openJournal(int64_t validSize);
 
     string getListPath(const HintedUser& user);
 
@@ -21,13 +21,28 @@
 #include "SSLSocket.h"
 #include "LogManager.h"
 #include "SettingsManager.h"
+#include "File.h"
 #include "format.h"
 
 #include <openssl/err.h>
 
+// Kernel TLS came with OpenSSL 3.0; only Linux and FreeBSD implement it
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS) && !defined(_WIN32)
+#define HAVE_KTLS
+#endif
+
+#if OPENSSL_VERSION_NUMBER < 0x10002000L
+// Before 1.0.2 there was no accessor, and the struct was still open
+#define SSL_is_server(ssl) ((ssl)->server)
+#endif
+
 namespace dcpp {
 
-SSLSocket::SSLSocket(SSL_CTX* context) : ctx(context), ssl(0) {
+SSLSocket::atomic_counter_t SSLSocket::connections(0);
+SSLSocket::atomic_counter_t SSLSocket::ktlsSendConnections(0);
+SSLSocket::atomic_counter_t SSLSocket::ktlsRecvConnections(0);
+
+SSLSocket::SSLSocket(SSL_CTX* context) : ctx(context), ssl(0), counted(false), ktlsSend(false), ktlsRecv(false) {
 
 }
 
@@ -42,21 +57,19 @@ bool SSLSocket::waitConnected(uint32_t millis) {
         if(!Socket::waitConnected(millis)) {
             return false;
         }
-        ssl.reset(SSL_new(ctx));
-        if(!ssl)
-            checkSSL(-1);
-
-        checkSSL(SSL_set_fd(ssl, sock));
+        newSSL();
     }
 
     if(SSL_is_init_finished(ssl)) {
+        handshakeDone();
         return true;
     }
 
     while(true) {
-        int ret = ssl->server?SSL_accept(ssl):SSL_connect(ssl);
+        int ret = SSL_is_server(ssl) ? SSL_accept(ssl) : SSL_connect(ssl);
         if(ret == 1) {
-            dcdebug("Connected to SSL server using %s as %s\n", SSL_get_cipher(ssl), ssl->server?"server":"client");
+            dcdebug("Connected to SSL server using %s as %s\n", SSL_get_cipher(ssl), SSL_is_server(ssl) ? "server" : "client");
+            handshakeDone();
             return true;
         }
         if(!waitWant(ret, millis)) {
@@ -76,14 +89,11 @@ bool SSLSocket::waitAccepted(uint32_t millis) {
         if(!Socket::waitAccepted(millis)) {
             return false;
         }
-        ssl.reset(SSL_new(ctx));
-        if(!ssl)
-            checkSSL(-1);
-
-        checkSSL(SSL_set_fd(ssl, sock));
+        newSSL();
     }
 
     if(SSL_is_init_finished(ssl)) {
+        handshakeDone();
         return true;
     }
 
@@ -91,6 +101,7 @@ bool SSLSocket::waitAccepted(uint32_t millis) {
         int ret = SSL_accept(ssl);
         if(ret == 1) {
             dcdebug("Connected to SSL client using %s\n", SSL_get_cipher(ssl));
+            handshakeDone();
             return true;
         }
         if(!waitWant(ret, millis)) {
@@ -99,6 +110,59 @@ bool SSLSocket::waitAccepted(uint32_t millis) {
     }
 }
 
+void SSLSocket::newSSL() {
+    ssl.reset(SSL_new(ctx));
+    if(!ssl)
+        checkSSL(-1);
+
+#ifdef HAVE_KTLS
+    // OpenSSL keeps using its own record layer when the kernel can't take over
+    if(BOOLSETTING(TLS_KERNEL_OFFLOAD))
+        SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+#endif
+
+    checkSSL(SSL_set_fd(ssl, sock));
+}
+
+void SSLSocket::handshakeDone() {
+    if(counted)
+        return;
+    counted = true;
+    connections.inc();
+
+#ifdef HAVE_KTLS
+    ktlsSend = BIO_get_ktls_send(SSL_get_wbio(ssl));
+    ktlsRecv = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+    if(ktlsSend)
+        ktlsSendConnections.inc();
+    if(ktlsRecv)
+        ktlsRecvConnections.inc();
+    dcdebug("Kernel TLS: send %d, receive %d\n", ktlsSend, ktlsRecv);
+#endif
+}
+
+void SSLSocket::uncount() {
+    if(!counted)
+        return;
+    counted = false;
+    connections.dec();
+
+    if(ktlsSend)
+        ktlsSendConnections.dec();
+    if(ktlsRecv)
+        ktlsRecvConnections.dec();
+    ktlsSend = ktlsRecv = false;
+}
+
+bool SSLSocket::isKernelTLSAvailable() {
+#ifdef HAVE_KTLS
+    // Built against 3.0 headers but maybe running with an older library
+    return OpenSSL_version_num() >= 0x30000000L;
+#else
+    return false;
+#endif
+}
+
 bool SSLSocket::waitWant(int ret, uint32_t millis) {
     int err = SSL_get_error(ssl, ret);
     switch(err) {
@@ -139,6 +203,30 @@ int SSLSocket::write(const void* aBuffer, int aLen) {
     return ret;
 }
 
+int SSLSocket::sendFile(File& aFile, int aLen) {
+#ifdef HAVE_KTLS
+    if(!ssl || !ktlsSend) {
+        return -2;
+    }
+
+    int64_t pos = aFile.getPos();
+    ossl_ssize_t sent = SSL_sendfile(ssl, aFile.getHandle(), pos, aLen, 0);
+    // Nothing left means the file shrunk
+    if(sent == 0 && aLen > 0) {
+        return -2;
+    }
+
+    int ret = checkSSL(static_cast<int>(sent));
+    if(ret > 0) {
+        aFile.setPos(pos + ret);
+        stats.totalUp += ret;
+    }
+    return ret;
+#else
+    return -2;
+#endif
+}
+
 int SSLSocket::checkSSL(int ret) {
     if(!ssl) {
         return -1;
@@ -214,6 +302,7 @@ void SSLSocket::shutdown() noexcept {
 }
 
 void SSLSocket::close() noexcept {
+    uncount();
     if(ssl) {
         ssl.reset();
     }
@@ -21,6 +21,7 @@
 #include "Socket.h"
 #include "Singleton.h"
 #include "SSL.h"
+#include "Atomic.h"
 
 #ifndef SSL_SUCCESS
 #define SSL_SUCCESS 1
@@ -43,12 +44,14 @@ class CryptoManager;
 
 class SSLSocket : public Socket {
 public:
-    virtual ~SSLSocket() { }
+    virtual ~SSLSocket() { uncount(); }
 
     virtual void accept(const Socket& listeningSocket);
     virtual void connect(const string& aIp, uint16_t aPort);
     virtual int read(void* aBuffer, int aBufLen);
     virtual int write(const void* aBuffer, int aLen);
+    /** Only possible when the kernel encrypts the connection (kTLS) */
+    virtual int sendFile(File& aFile, int aLen);
     virtual int wait(uint32_t millis, int waitFor);
     virtual void shutdown() noexcept;
     virtual void close() noexcept;
@@ -61,6 +64,13 @@ public:
     virtual bool waitConnected(uint32_t millis);
     virtual bool waitAccepted(uint32_t millis);
 
+    /** @return whether OpenSSL was built with kernel TLS support */
+    static bool isKernelTLSAvailable();
+    /** Established TLS connections */
+    static uint32_t getConnections() { return connections; }
+    /** Connections the kernel encrypts (sending) and decrypts (receiving) for */
+    static uint32_t getKernelSendConnections() { return ktlsSendConnections; }
+    static uint32_t getKernelRecvConnections() { return ktlsRecvConnections; }
 
 private:
     friend class CryptoManager;
@@ -72,6 +82,20 @@ private:
     SSL_CTX* ctx;
     ssl::SSL ssl;
 
+    bool counted;
+    bool ktlsSend;
+    bool ktlsRecv;
+
+    typedef Atomic<boost::uint32_t, memory_ordering_weak> atomic_counter_t;
+    static atomic_counter_t connections;
+    static atomic_counter_t ktlsSendConnections;
+    static atomic_counter_t ktlsRecvConnections;
+
+    void newSSL();
+    /** Sees whether OpenSSL handed the keys to the kernel once the handshake is done */
+    void handshakeDone();
+    void uncount();
+
     int checkSSL(int ret);
     bool waitWant(int ret, uint32_t millis);
 };
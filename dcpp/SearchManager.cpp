@@ -48,11 +48,26 @@ const char* SearchManager::getTypeStr(int type) {
     return _(types[type]);
 }
 
+namespace {
+/** Datagrams an address may get in a row */
+const double UDP_BURST = 100;
+/** Datagrams per second an address gets after that */
+const double UDP_RATE = 20;
+/** Datagrams waiting to be sent before new ones are dropped */
+const size_t UDP_MAX_PENDING = 4096;
+/** Datagrams read with one system call */
+const int UDP_READ_BATCH = 32;
+/** How long the same search from the same seeker is ignored */
+const uint64_t SEARCH_REPEAT_TIME = 10 * 1000;
+}
+
 SearchManager::SearchManager() :
+    lastSearchPrune(0),
     port(0),
     stop(false)
 {
     queue.start();
+    sender.start();
 }
 
 SearchManager::~SearchManager() {
@@ -103,7 +118,6 @@ void SearchManager::listen() {
 void SearchManager::disconnect() noexcept {
     if(socket.get()) {
         stop = true;
-        queue.shutdown();
         socket->disconnect();
         port = 0;
 
@@ -118,9 +132,9 @@ void SearchManager::disconnect() noexcept {
 #define BUFSIZE 8192
 int SearchManager::run() {
     setThreadName("SearchManager");
-    boost::scoped_array<uint8_t> buf(new uint8_t[BUFSIZE]);
-    int len;
-    sockaddr_in remoteAddr = { 0 };
+    boost::scoped_array<uint8_t> buf(new uint8_t[BUFSIZE * UDP_READ_BATCH]);
+    int n;
+    Socket::DatagramList packets;
 
     while(!stop) {
         try {
@@ -130,8 +144,10 @@ int SearchManager::run() {
             if(socket->wait(400, Socket::WAIT_READ) != Socket::WAIT_READ) {
                 continue;
             }
-            if ((len = socket->read(&buf[0], BUFSIZE, remoteAddr)) > 0) {
-                onData(&buf[0], len, inet_ntoa(remoteAddr.sin_addr));
+            packets.clear();
+            if ((n = socket->read(&buf[0], BUFSIZE * UDP_READ_BATCH, UDP_READ_BATCH, packets)) != 0) {
+                if(n > 0)
+                    queue.addResults(packets);
                 continue;
             }
         } catch(const SocketException& e) {
@@ -168,27 +184,183 @@ int SearchManager::run() {
     return 0;
 }
 
-int SearchManager::UdpQueue::run() {
-    setThreadName("UdpQueue");
-    string x = Util::emptyString;
-    string remoteIp = Util::emptyString;
-    stop = false;
-;
-    while(true) {
-        if (resultList.empty())
-            s.wait();
+void SearchManager::UdpSender::send(const string& aIp, uint16_t aPort, const string& aData) {
+    {
+        Lock l(cs);
+        uint64_t now = GET_TICK();
+
+        // Buckets that have been full for a while are just like new ones
+        if(now - lastPrune > 60 * 1000) {
+            for(auto i = limits.begin(); i != limits.end(); ) {
+                if(now - i->second.last > (uint64_t)(UDP_BURST / UDP_RATE * 1000))
+                    limits.erase(i++);
+                else
+                    ++i;
+            }
+            lastPrune = now;
+        }
+
+        auto i = limits.find(aIp);
+        if(i == limits.end()) {
+            i = limits.insert(make_pair(aIp, Limit())).first;
+            i->second.tokens = UDP_BURST;
+        } else {
+            i->second.tokens = min(UDP_BURST, i->second.tokens + (now - i->second.last) * UDP_RATE / 1000);
+        }
+
+        Limit& limit = i->second;
+        limit.last = now;
+
+        if(limit.tokens < 1 || packets.size() >= UDP_MAX_PENDING) {
+            dcdebug("SearchManager: dropping datagram to %s\n", aIp.c_str());
+            return;
+        }
+        limit.tokens -= 1;
 
+        packets.push_back(Socket::Datagram(aIp, aPort, aData));
+    }
+    s.signal();
+}
+
+int SearchManager::UdpSender::run() {
+    setThreadName("UdpSender");
+    Socket::DatagramList batch;
+
+    while(true) {
+        s.wait();
         if(stop)
             break;
 
         {
-            Lock l(csudp);
-            if(resultList.empty()) continue;
+            Lock l(cs);
+            batch.swap(packets);
+        }
+
+        if(!batch.empty()) {
+            socket.writeTo(batch);
+            batch.clear();
+        }
+    }
+    return 0;
+}
 
-            x = resultList.front().first;
-            remoteIp = resultList.front().second;
-            resultList.pop_front();
+bool SearchManager::isRepeatedSearch(const string& aSeeker, const string& aQuery) {
+    string key = aSeeker + '\n' + aQuery;
+    uint64_t now = GET_TICK();
+
+    Lock l(cs);
+    if(now - lastSearchPrune > SEARCH_REPEAT_TIME) {
+        for(auto i = recentSearches.begin(); i != recentSearches.end(); ) {
+            if(now - i->second > SEARCH_REPEAT_TIME)
+                recentSearches.erase(i++);
+            else
+                ++i;
         }
+        lastSearchPrune = now;
+    }
+
+    auto i = recentSearches.find(key);
+    if(i != recentSearches.end() && now - i->second <= SEARCH_REPEAT_TIME)
+        return true;
+
+    recentSearches[key] = now;
+    return false;
+}
+
+/** Results waiting for one thread before new ones are dropped */
+static const size_t UDP_QUEUE_MAX = 8192;
+
+SearchManager::UdpQueue::~UdpQueue() noexcept {
+    shutdown();
+    for(int i = 0; i < WORKERS; ++i)
+        workers[i].join();
+}
+
+void SearchManager::UdpQueue::start() {
+    for(int i = 0; i < WORKERS; ++i)
+        workers[i].start();
+}
+
+void SearchManager::UdpQueue::shutdown() {
+    for(int i = 0; i < WORKERS; ++i) {
+        workers[i].stop = true;
+        workers[i].s.signal();
+    }
+}
+
+SearchManager::UdpQueue::Worker& SearchManager::UdpQueue::getWorker(const string& ip) {
+    return workers[std::hash<string>()(ip) % WORKERS];
+}
+
+void SearchManager::UdpQueue::addResult(const string& buf, const string& ip) {
+    Worker& w = getWorker(ip);
+    if(w.add(buf, ip))
+        w.s.signal();
+}
+
+void SearchManager::UdpQueue::addResults(const Socket::DatagramList& packets) {
+    bool added[WORKERS] = { false };
+    for(auto i = packets.begin(); i != packets.end(); ++i) {
+        Worker& w = getWorker(i->ip);
+        added[&w - workers] |= w.add(i->data, i->ip);
+    }
+    for(int i = 0; i < WORKERS; ++i) {
+        if(added[i])
+            workers[i].s.signal();
+    }
+}
+
+uint64_t SearchManager::UdpQueue::getDropped() {
+    uint64_t dropped = 0;
+    for(int i = 0; i < WORKERS; ++i) {
+        Lock l(workers[i].csudp);
+        dropped += workers[i].dropped;
+    }
+    return dropped;
+}
+
+bool SearchManager::UdpQueue::Worker::add(const string& buf, const string& ip) {
+    Lock l(csudp);
+    if(resultList.size() >= UDP_QUEUE_MAX) {
+        // Better to lose some results than to stop reading the socket
+        if(dropped++ == 0)
+            dcdebug("SearchManager: result queue full, dropping results\n");
+        return false;
+    }
+    resultList.push_back(make_pair(buf, ip));
+    return true;
+}
+
+int SearchManager::UdpQueue::Worker::run() {
+    setThreadName("UdpQueue");
+    string x;
+    string remoteIp;
+
+    while(true) {
+        s.wait();
+        if(stop)
+            break;
+
+        while(!stop) {
+            {
+                Lock l(csudp);
+                if(resultList.empty())
+                    break;
+
+                x.swap(resultList.front().first);
+                remoteIp.swap(resultList.front().second);
+                resultList.pop_front();
+            }
+
+            process(x, remoteIp);
+        }
+    }
+    return 0;
+}
+
+void SearchManager::UdpQueue::process(const string& x, const string& remoteIp) {
+    if(x.empty())
+        return;
 
     if(x.compare(0, 4, "$SR ") == 0) {
         string::size_type i, j;
@@ -196,7 +368,7 @@ int SearchManager::UdpQueue::run() {
         // Files:       $SR <nick><0x20><filename><0x05><filesize><0x20><free slots>/<total slots><0x05><Hubname><0x20>(<Hubip:port>)
         i = 4;
         if( (j = x.find(' ', i)) == string::npos) {
-            continue;
+            return;
         }
         string nick = x.substr(i, j-i);
         i = j + 1;
@@ -214,46 +386,46 @@ int SearchManager::UdpQueue::run() {
             type = SearchResult::TYPE_DIRECTORY;
             // Get past the hubname that might contain spaces
             if((j = x.rfind(0x05)) == string::npos) {
-                continue;
+                return;
             }
             // Find the end of the directory info
             if((j = x.rfind(' ', j-1)) == string::npos) {
-                continue;
+                return;
             }
             if(j < i + 1) {
-                continue;
+                return;
             }
             file = x.substr(i, j-i) + '\\';
         } else if(cnt == 2) {
             if( (j = x.find((char)5, i)) == string::npos) {
-                continue;
+                return;
             }
             file = x.substr(i, j-i);
             i = j + 1;
             if( (j = x.find(' ', i)) == string::npos) {
-                continue;
+                return;
             }
             size = Util::toInt64(x.substr(i, j-i));
         }
         i = j + 1;
 
         if( (j = x.find('/', i)) == string::npos) {
-            continue;
+            return;
         }
         uint8_t freeSlots = (uint8_t)Util::toInt(x.substr(i, j-i));
         i = j + 1;
         if( (j = x.find((char)5, i)) == string::npos) {
-            continue;
+            return;
         }
         uint8_t slots = (uint8_t)Util::toInt(x.substr(i, j-i));
         i = j + 1;
         if( (j = x.rfind(" (")) == string::npos) {
-            continue;
+            return;
         }
         string hubName = x.substr(i, j-i);
         i = j + 2;
         if( (j = x.rfind(')')) == string::npos) {
-            continue;
+            return;
         }
 
         string hubIpPort = x.substr(i, j-i);
@@ -269,7 +441,7 @@ int SearchManager::UdpQueue::run() {
             // Could happen if hub has multiple URLs / IPs
             user = ClientManager::getInstance()->findLegacyUser(nick);
             if(!user)
-                continue;
+                return;
         }
 
         ClientManager::getInstance()->setIPUser(user, remoteIp);
@@ -282,7 +454,7 @@ int SearchManager::UdpQueue::run() {
         }
 
         if(tth.empty() && type == SearchResult::TYPE_FILE) {
-            continue;
+            return;
         }
 
         SearchResultPtr sr(new SearchResult(user, type, slots, freeSlots, size,
@@ -291,15 +463,15 @@ int SearchManager::UdpQueue::run() {
 
     } else if(x.compare(1, 4, "RES ") == 0 && x[x.length() - 1] == 0x0a) {
         AdcCommand c(x.substr(0, x.length()-1));
-        if(c.getParameters().empty())
-            continue;
+        if(c.getParamCount() == 0)
+            return;
         string cid = c.getParam(0);
         if(cid.size() != 39)
-            continue;
+            return;
 
         UserPtr user = ClientManager::getInstance()->findUser(CID(cid));
         if(!user)
-            continue;
+            return;
 
         // This should be handled by AdcCommand really...
         c.getParameters().erase(c.getParameters().begin());
@@ -308,11 +480,11 @@ int SearchManager::UdpQueue::run() {
 
     } if(x.compare(1, 4, "PSR ") == 0 && x[x.length() - 1] == 0x0a) {
             AdcCommand c(x.substr(0, x.length()-1));
-            if(c.getParameters().empty())
-                    continue;
+            if(c.getParamCount() == 0)
+                    return;
             string cid = c.getParam(0);
             if(cid.size() != 39)
-                    continue;
+                    return;
 
             UserPtr user = ClientManager::getInstance()->findUser(CID(cid));
             // when user == NULL then it is probably NMDC user, check it later
@@ -327,11 +499,6 @@ int SearchManager::UdpQueue::run() {
         } catch(ParseException& ) {
         }
     }*/ // Needs further DoS investigation
-
-
-                Thread::sleep(10);
-        }
-        return 0;
 }
 
 void SearchManager::onData(const uint8_t* buf, size_t aLen, const string& remoteIp) {
@@ -346,8 +513,9 @@ void SearchManager::onRES(const AdcCommand& cmd, const UserPtr& from, const stri
     string tth;
     string token;
 
-    for(StringIterC i = cmd.getParameters().begin(); i != cmd.getParameters().end(); ++i) {
-        const string& str = *i;
+    string str;
+    for(size_t i = 0, n = cmd.getParamCount(); i < n; ++i) {
+        cmd.getParam(i, str);
         if(str.compare(0, 2, "FN") == 0) {
             file = Util::toNmdcFile(str.substr(2));
         } else if(str.compare(0, 2, "SL") == 0) {
@@ -389,8 +557,9 @@ void SearchManager::onPSR(const AdcCommand& cmd, UserPtr from, const string& rem
     string nick;
     PartsInfo partialInfo;
 
-    for(StringIterC i = cmd.getParameters().begin(); i != cmd.getParameters().end(); ++i) {
-        const string& str = *i;
+    string str;
+    for(size_t i = 0, n = cmd.getParamCount(); i < n; ++i) {
+        cmd.getParam(i, str);
         if(str.compare(0, 2, "U4") == 0) {
             udpPort = static_cast<uint16_t>(Util::toInt(str.substr(2)));
         } else if(str.compare(0, 2, "NI") == 0) {
@@ -461,6 +630,10 @@ void SearchManager::respond(const AdcCommand& adc, const CID& from,  bool isUdpA
     if(!p)
         return;
 
+    // Results sent over UDP reach the seeker once, no matter which hub they were asked through
+    if(isUdpActive && isRepeatedSearch(from.toBase32(), Util::toString(" ", adc.getParameters())))
+        return;
+
     SearchResultList results;
     ShareManager::getInstance()->search(results, adc.getParameters(), isUdpActive ? 10 : 5);
 
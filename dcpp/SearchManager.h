@@ -73,6 +73,13 @@ public:
     }
 
     void respond(const AdcCommand& cmd, const CID& cid,  bool isUdpActive, const string& hubIpPort);
+    /** Incoming results that were dropped because they came in faster than they could be handled */
+    uint64_t getDroppedResults() { return queue.getDropped(); }
+
+    /** Queue a datagram for sending; each address only gets a limited number per second */
+    void sendUdp(const string& aIp, uint16_t aPort, const string& aData) { sender.send(aIp, aPort, aData); }
+    /** Whether the seeker sent the same search a moment ago, usually through another hub */
+    bool isRepeatedSearch(const string& aSeeker, const string& aQuery);
 
     uint16_t getPort() const
     {
@@ -90,34 +97,85 @@ public:
     AdcCommand toPSR(bool wantResponse, const string& myNick, const string& hubIpPort, const string& tth, const vector<uint16_t>& partialInfo) const;
 
 private:
-    class UdpQueue: public Thread {
+    /**
+     * Parses incoming results on a few threads. Results from one address always
+     * go to the same thread, so they are still handled in the order they came in.
+     */
+    class UdpQueue {
+    public:
+        UdpQueue() { }
+        ~UdpQueue() noexcept;
+
+        void start();
+        void shutdown();
+        void addResult(const string& buf, const string& ip);
+        void addResults(const Socket::DatagramList& packets);
+
+        /** Results dropped because their thread was too far behind */
+        uint64_t getDropped();
+
+    private:
+        enum { WORKERS = 4 };
+
+        class Worker: public Thread {
+        public:
+            Worker() : dropped(0), stop(false) {}
+
+            int run();
+            /** @return false if the result was dropped */
+            bool add(const string& buf, const string& ip);
+
+            CriticalSection csudp;
+            Semaphore s;
+
+            deque<pair<string, string> > resultList;
+            uint64_t dropped;
+
+            bool stop;
+        };
+
+        Worker workers[WORKERS];
+
+        Worker& getWorker(const string& ip);
+        static void process(const string& x, const string& remoteIp);
+    } queue;
+
+    /** Sends the outgoing datagrams in batches */
+    class UdpSender: public Thread {
     public:
-        UdpQueue() : stop(false) {}
-        ~UdpQueue() noexcept { shutdown(); }
+        UdpSender() : lastPrune(0), stop(false) {}
+        ~UdpSender() noexcept { shutdown(); join(); }
 
         int run();
         void shutdown() {
             stop = true;
             s.signal();
         }
-        void addResult(const string& buf, const string& ip) {
-            {
-                Lock l(csudp);
-                resultList.push_back(make_pair(buf, ip));
-            }
-            s.signal();
-        }
+        void send(const string& aIp, uint16_t aPort, const string& aData);
 
     private:
-        CriticalSection csudp;
+        /** Token bucket of one address */
+        struct Limit {
+            Limit() : tokens(0), last(0) { }
+            double tokens;
+            uint64_t last;
+        };
+
+        CriticalSection cs;
         Semaphore s;
 
-        deque<pair<string, string> > resultList;
+        Socket::DatagramList packets;
+        unordered_map<string, Limit> limits;
+        uint64_t lastPrune;
+        Socket socket;
 
         bool stop;
-    } queue;
+    } sender;
 
     CriticalSection cs;
+    /** When searches were last answered, by seeker and query */
+    unordered_map<string, uint64_t> recentSearches;
+    uint64_t lastSearchPrune;
     std::unique_ptr<Socket> socket;
     uint16_t port;
     bool stop;
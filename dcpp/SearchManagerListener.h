@@ -30,6 +30,10 @@ public:
     virtual ~SearchManagerListener() { }
     template<int I> struct X { enum { TYPE = I }; };
 
+    /**
+     * Called by the threads that parse the results, so possibly by several at
+     * once; results from one source come from one thread, in order.
+     */
     typedef X<0> SR;
     virtual void on(SR, const SearchResultPtr&) noexcept = 0;
 };
@@ -74,4 +74,81 @@ private:
     GETSET(bool, overlapped, Overlapped);
 };
 
+/**
+ * Sorted set of disjoint byte ranges. Added segments are merged with the ones
+ * they overlap or touch, so lookups are a single tree search and the number
+ * of bytes covered is always at hand.
+ */
+class SegmentSet {
+public:
+    typedef std::set<Segment>::const_iterator const_iterator;
+
+    SegmentSet() : bytes(0) { }
+
+    const_iterator begin() const { return segments.begin(); }
+    const_iterator end() const { return segments.end(); }
+    size_t size() const { return segments.size(); }
+    bool empty() const { return segments.empty(); }
+    void clear() { segments.clear(); bytes = 0; }
+
+    /** Total size of all segments */
+    int64_t getBytes() const { return bytes; }
+
+    void add(const Segment& segment) {
+        int64_t start = segment.getStart();
+        int64_t end = segment.getEnd();
+
+        auto i = first(start);
+        if(i != segments.end() && i->getEnd() < start)
+            ++i;
+
+        while(i != segments.end() && i->getStart() <= end) {
+            start = std::min(start, i->getStart());
+            end = std::max(end, i->getEnd());
+            bytes -= i->getSize();
+            segments.erase(i++);
+        }
+
+        segments.insert(i, Segment(start, end - start));
+        bytes += end - start;
+    }
+
+    /** The segment that contains pos, end() if there is none */
+    const_iterator find(int64_t pos) const {
+        auto i = first(pos);
+        return (i != segments.end() && i->getStart() <= pos && pos < i->getEnd()) ? i : segments.end();
+    }
+
+    /** Whether a single segment contains all of rhs */
+    bool covers(const Segment& rhs) const {
+        auto i = first(rhs.getStart());
+        return i != segments.end() && i->getStart() <= rhs.getStart() && i->getEnd() >= rhs.getEnd();
+    }
+
+    bool overlaps(const Segment& rhs) const {
+        auto i = after(rhs.getStart());
+        return i != segments.end() && i->overlaps(rhs);
+    }
+
+    /** The first segment that ends after pos */
+    const_iterator after(int64_t pos) const {
+        auto i = first(pos);
+        if(i != segments.end() && i->getEnd() <= pos)
+            ++i;
+        return i;
+    }
+
+private:
+    std::set<Segment> segments;
+    int64_t bytes;
+
+    /** The last segment starting at or before pos, or the first one if there is none */
+    const_iterator first(int64_t pos) const {
+        auto i = segments.upper_bound(Segment(pos, std::numeric_limits<int64_t>::max()));
+        if(i != segments.begin())
+            --i;
+        return i;
+    }
+};
+
 } //dcpp namespace
@@ -96,7 +96,8 @@ const string SettingsManager::settingTags[] =
     "IpFilter", "TextColor", "UseLua", "AllowNatt", "IpTOSValue", "SegmentSize",
     "BindIface", "MinimumSearchInterval", "EnableDynDNS", "AllowUploadOverMultiHubs",
     "UseADLOnlyOnOwnList", "AllowSimUploads", "CheckTargetsPathsOnStart", "NmdcDebug",
-    "ShareSkipZeroByte", "RequireTLS", "LogSpy", "AppUnitBase",
+    "ShareSkipZeroByte", "RequireTLS", "LogSpy", "AppUnitBase", "HashThreads", "HashDirectIO", "ShareWatch", "TLSKernelOffload",
+    "ThrottleFavoriteShare",
     "SENTRY",
     // Int64
     "TotalUpload", "TotalDownload",
@@ -268,6 +269,11 @@ SettingsManager::SettingsManager()
     setDefault(HASH_BUFFER_POPULATE, true);
     setDefault(HASH_BUFFER_NORESERVE, true);
     setDefault(HASH_BUFFER_PRIVATE, true);
+    setDefault(HASH_THREADS, 0); // one hasher per device
+    setDefault(HASH_DIRECT_IO, true);
+    setDefault(SHARE_WATCH, true);
+    setDefault(TLS_KERNEL_OFFLOAD, true);
+    setDefault(THROTTLE_FAVORITE_SHARE, 0);
     setDefault(RECONNECT_DELAY, 15);
     setDefault(DHT_PORT, 6250);
     setDefault(USE_DHT, false);
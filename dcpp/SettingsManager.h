@@ -115,7 +115,8 @@ public:
         BIND_IFACE, MINIMUM_SEARCH_INTERVAL, DYNDNS_ENABLE, ALLOW_UPLOAD_MULTI_HUB,
         USE_ADL_ONLY_OWN_LIST, ALLOW_SIM_UPLOADS, CHECK_TARGETS_PATHS_ON_START,
         NMDC_DEBUG, SHARE_SKIP_ZERO_BYTE, REQUIRE_TLS, LOG_SPY,
-        APP_UNIT_BASE,
+        APP_UNIT_BASE, HASH_THREADS, HASH_DIRECT_IO, SHARE_WATCH, TLS_KERNEL_OFFLOAD,
+        THROTTLE_FAVORITE_SHARE,
         INT_LAST };
 
     enum Int64Setting { INT64_FIRST = INT_LAST + 1,
@@ -55,12 +55,13 @@ namespace dcpp {
 
 ShareManager::ShareManager() : hits(0), xmlListLen(0), bzXmlListLen(0),
     xmlDirty(true), forceXmlRefresh(false), refreshDirs(false), update(false), initial(true), listN(0), refreshing(false),
-    lastXmlUpdate(0), lastFullUpdate(GET_TICK()), bloom(1<<20)
+    watchOverflow(false), lastXmlUpdate(0), lastFullUpdate(GET_TICK()), bloom(1<<20), nameHoles(0)
 {
     SettingsManager::getInstance()->addListener(this);
     TimerManager::getInstance()->addListener(this);
     QueueManager::getInstance()->addListener(this);
     HashManager::getInstance()->addListener(this);
+    watcher.addListener(this);
 }
 
 ShareManager::~ShareManager() {
@@ -69,6 +70,9 @@ ShareManager::~ShareManager() {
     QueueManager::getInstance()->removeListener(this);
     HashManager::getInstance()->removeListener(this);
 
+    watcher.removeListener(this);
+    watcher.close();
+
     join();
 
     if(bzXmlRef.get()) {
@@ -81,6 +85,7 @@ ShareManager::Directory::Directory(const string& aName, const ShareManager::Dire
     size(0),
     name(aName),
     parent(aParent.get()),
+    nameId(0),
     fileTypes(1 << SearchManager::TYPE_DIRECTORY)
 {
 }
@@ -485,9 +490,10 @@ void ShareManager::addDirectory(const string& realPath, const string& virtualNam
         Lock l(cs);
 
         shares.insert(std::make_pair(realPath, vName));
-        updateIndices(*merge(dp));
+        Directory::Ptr root = merge(dp);
+        updateIndices(*root);
 
-        setDirty();
+        setDirty(*root);
     }
 }
 
@@ -546,6 +552,7 @@ void ShareManager::removeDirectory(const string& realPath) {
         return;
 
     HashManager::getInstance()->stopHashing(realPath);
+    watcher.removeWatch(realPath);
 
     Lock l(cs);
 
@@ -625,10 +632,12 @@ size_t ShareManager::getSharedFiles() const noexcept {
 ShareManager::Directory::Ptr ShareManager::buildTree(const string& aName, const Directory::Ptr& aParent) {
     auto dir = Directory::create(Util::getLastDir(aName), aParent);
 
+    // Watch before listing so nothing created meanwhile slips through
+    watcher.addWatch(aName);
+
     auto lastFileIter = dir->files.begin();
 
     FileFindIter end;
-    const string l_skip_list = SETTING(SKIPLIST_SHARE);
 #ifdef _WIN32
     for(FileFindIter i(aName + "*"); i != end; ++i) {
 #else
@@ -654,45 +663,19 @@ ShareManager::Directory::Ptr ShareManager::buildTree(const string& aName, const
 
         string fileName = aName + name;
 
-        if (l_skip_list.size())
-        {
-            if (Wildcard::patternMatch(fileName , l_skip_list, '|'))
-            {
-                LogManager::getInstance()->message(str(F_("Skip share file: %1% (Size: %2%)")
-                % Util::addBrackets(fileName) % Util::formatBytes(size)));
-                continue;
-            }
-        }
+        if(!checkSkipList(fileName, size))
+            continue;
+
         if(i->isDirectory()) {
             string newName = aName + name + PATH_SEPARATOR;
-            if((::strcmp(newName.c_str(), SETTING(TEMP_DOWNLOAD_DIRECTORY).c_str()) != 0)
-                    && (::strcmp(newName.c_str(), Util::getPath(Util::PATH_USER_CONFIG).c_str()) != 0)
-                    && (::strcmp(newName.c_str(), SETTING(LOG_DIRECTORY).c_str()) != 0)) {
+            if(checkDirectory(newName)) {
                 dir->directories[name] = buildTree(newName, dir);
             }
-        } else {
-            // Not a directory, assume it's a file...make sure we're not sharing the settings file...
-            const string l_ext = Util::getFileExt(name);
-            if ((name != "Thumbs.db") &&
-                (name != "desktop.ini") &&
-                (name != "folder.htt")
-                ) {
-                if (!BOOLSETTING(SHARE_TEMP_FILES) &&
-                    (::strcmp(l_ext.c_str(), ".dctmp") == 0)) {
-                    LogManager::getInstance()->message(str(F_("Skip share temp file: %1% (Size: %2%)")
-                    % Util::addBrackets(fileName) % Util::formatBytes(size)));
-                    continue;
-                }
-                if (BOOLSETTING(SHARE_SKIP_ZERO_BYTE) && size == 0)
-                    continue;
-                if(Util::stricmp(fileName, SETTING(TLS_PRIVATE_KEY_FILE)) == 0) {
-                    continue;
-                }
-                try {
-                    if(HashManager::getInstance()->checkTTH(fileName, size, i->getLastWriteTime()))
-                        lastFileIter = dir->files.insert(lastFileIter, Directory::File(name, size, dir, HashManager::getInstance()->getTTH(fileName, size)));
-                } catch(const HashException&) {
-                }
+        } else if(checkFile(name, fileName, size)) {
+            try {
+                if(HashManager::getInstance()->checkTTH(fileName, size, i->getLastWriteTime()))
+                    lastFileIter = dir->files.insert(lastFileIter, Directory::File(name, size, dir, HashManager::getInstance()->getTTH(fileName, size)));
+            } catch(const HashException&) {
             }
         }
     }
@@ -700,6 +683,39 @@ ShareManager::Directory::Ptr ShareManager::buildTree(const string& aName, const
     return dir;
 }
 
+bool ShareManager::checkSkipList(const string& aPath, int64_t aSize) const {
+    const string& skipList = SETTING(SKIPLIST_SHARE);
+    if(!skipList.empty() && Wildcard::patternMatch(aPath, skipList, '|')) {
+        LogManager::getInstance()->message(str(F_("Skip share file: %1% (Size: %2%)")
+        % Util::addBrackets(aPath) % Util::formatBytes(aSize)));
+        return false;
+    }
+    return true;
+}
+
+bool ShareManager::checkDirectory(const string& aPath) const {
+    return (::strcmp(aPath.c_str(), SETTING(TEMP_DOWNLOAD_DIRECTORY).c_str()) != 0)
+        && (::strcmp(aPath.c_str(), Util::getPath(Util::PATH_USER_CONFIG).c_str()) != 0)
+        && (::strcmp(aPath.c_str(), SETTING(LOG_DIRECTORY).c_str()) != 0);
+}
+
+bool ShareManager::checkFile(const string& aName, const string& aFileName, int64_t aSize) const {
+    // Make sure we're not sharing the settings file...
+    if((aName == "Thumbs.db") || (aName == "desktop.ini") || (aName == "folder.htt"))
+        return false;
+
+    if(!BOOLSETTING(SHARE_TEMP_FILES) && (::strcmp(Util::getFileExt(aName).c_str(), ".dctmp") == 0)) {
+        LogManager::getInstance()->message(str(F_("Skip share temp file: %1% (Size: %2%)")
+        % Util::addBrackets(aFileName) % Util::formatBytes(aSize)));
+        return false;
+    }
+    if(BOOLSETTING(SHARE_SKIP_ZERO_BYTE) && aSize == 0)
+        return false;
+    if(Util::stricmp(aFileName, SETTING(TLS_PRIVATE_KEY_FILE)) == 0)
+        return false;
+    return true;
+}
+
 //NOTE: freedcpp [+
 #ifdef _WIN32
 bool ShareManager::checkHidden(const string& aName) const {
@@ -739,6 +755,7 @@ bool ShareManager::checkHidden(const string& aName) const
 
 void ShareManager::updateIndices(Directory& dir) {
     bloom.add(Text::toLower(dir.getName()));
+    addName(dir);
 
     for(auto i = dir.directories.begin(); i != dir.directories.end(); ++i) {
         updateIndices(*i->second);
@@ -753,7 +770,13 @@ void ShareManager::updateIndices(Directory& dir) {
 
 void ShareManager::rebuildIndices() {
     tthIndex.clear();
+    tthDupes.clear();
     bloom.clear();
+    nameIndex.clear();
+    nameEntries.clear();
+    nameHoles = 0;
+    // The roots may have been replaced
+    xmlFragments.clear();
 
     for(auto i = directories.begin(); i != directories.end(); ++i) {
         updateIndices(**i);
@@ -766,21 +789,32 @@ void ShareManager::updateIndices(Directory& dir, const Directory::File::Set::ite
     auto j = tthIndex.find(f.getTTH());
     if(j == tthIndex.end()) {
         dir.size+=f.getSize();
+        tthIndex.insert(make_pair(f.getTTH(), i));
     } else {
         if(!SETTING(LIST_DUPES)) {
             try {
                 LogManager::getInstance()->message(str(F_("Duplicate file will not be shared: %1% (Size: %2% B) Dupe matched against: %3%")
                 % Util::addBrackets(dir.getRealPath(f.getName())) % Util::toString(f.getSize()) % Util::addBrackets(j->second->getParent()->getRealPath(j->second->getName()))));
+            removeName(f);
             dir.files.erase(i);
             } catch (const ShareException&) { }
             return;
         }
+
+        if(j->second != i) {
+            auto range = tthDupes.equal_range(f.getTTH());
+            auto k = range.first;
+            for(; k != range.second && k->second != i; ++k)
+                ;   // Empty
+            if(k == range.second)
+                tthDupes.insert(make_pair(f.getTTH(), i));
+        }
     }
 
     dir.addType(getType(f.getName()));
 
-    tthIndex.insert(make_pair(f.getTTH(), i));
     bloom.add(Text::toLower(f.getName()));
+    addName(dir, f);
 #ifdef WITH_DHT
     dht::IndexManager* im = dht::IndexManager::getInstance();
     if(im && im->isTimeForPublishing())
@@ -838,6 +872,16 @@ int ShareManager::run() {
 
         lastFullUpdate = GET_TICK();
 
+        // Reopening drops the watches of a share that didn't fit the watch limit before
+        if(BOOLSETTING(SHARE_WATCH)) {
+            if(!watcher.isWatching()) {
+                watcher.close();
+                watcher.open();
+            }
+        } else {
+            watcher.close();
+        }
+
         DirList newDirs;
         for(auto i = dirs.begin(); i != dirs.end(); ++i) {
             if (checkHidden(i->second)) {
@@ -893,32 +937,45 @@ void ShareManager::generateXmlList() {
         listN++;
 
         try {
-            string tmp2;
-            string indent;
+            // Only the roots that changed are generated again, the rest comes from xmlFragments
+            XmlFragment header, footer;
+            generateXmlFragment(NULL, SimpleXML::utf8Header + "<FileListing Version=\"1\" CID=\"" + ClientManager::getInstance()->getMe()->getCID().toBase32() + "\" Base=\"/\" Generator=\"" APPNAME " " VERSIONSTRING "\">\r\n", header, true);
+            generateXmlFragment(NULL, "</FileListing>", footer, false);
+
+            XmlFragmentMap fragments;
+            BZBlocks bz = header.bz;
+            ByteVector leaves = header.leaves;
+            int64_t size = header.size;
+            for(auto i = directories.begin(); i != directories.end(); ++i) {
+                XmlFragment& f = fragments[i->get()];
+                auto j = xmlFragments.find(i->get());
+                if(j != xmlFragments.end()) {
+                    swap(f, j->second);
+                } else {
+                    generateXmlFragment(i->get(), Util::emptyString, f, true);
+                }
+                bz.append(f.bz);
+                leaves.insert(leaves.end(), f.leaves.begin(), f.leaves.end());
+                size += f.size;
+            }
+            bz.append(footer.bz);
+            leaves.insert(leaves.end(), footer.leaves.begin(), footer.leaves.end());
+            size += footer.size;
+            // Leaves out the fragments of roots that are gone
+            xmlFragments.swap(fragments);
+
+            xmlListLen = size;
+            xmlRoot = TigerTree(size, TigerTree::BASE_BLOCK_SIZE, &leaves[0]).getRoot();
 
             string newXmlName = Util::getPath(Util::PATH_USER_CONFIG) + "files" + Util::toString(listN) + ".xml.bz2";
             {
                 File f(newXmlName, File::WRITE, File::TRUNCATE | File::CREATE);
                 // We don't care about the leaves...
                 CalcOutputStream<TTFilter<1024*1024*1024>, false> bzTree(&f);
-                FilteredOutputStream<BZFilter, false> bzipper(&bzTree);
-                CountOutputStream<false> count(&bzipper);
-                CalcOutputStream<TTFilter<1024*1024*1024>, false> newXmlFile(&count);
-
-                newXmlFile.write(SimpleXML::utf8Header);
-                newXmlFile.write("<FileListing Version=\"1\" CID=\"" + ClientManager::getInstance()->getMe()->getCID().toBase32() + "\" Base=\"/\" Generator=\"" APPNAME " " VERSIONSTRING "\">\r\n");
-                for(auto i = directories.begin(); i != directories.end(); ++i) {
-                    (*i)->toXml(newXmlFile, indent, tmp2, true);
-                }
-                newXmlFile.write("</FileListing>");
-                newXmlFile.flush();
-
-                xmlListLen = count.getCount();
+                bz.write(bzTree);
+                bzTree.flush();
 
-                newXmlFile.getFilter().getTree().finalize();
                 bzTree.getFilter().getTree().finalize();
-
-                xmlRoot = newXmlFile.getFilter().getTree().getRoot();
                 bzXmlRoot = bzTree.getFilter().getTree().getRoot();
             }
             const string XmlListFileName = Util::getPath(Util::PATH_USER_CONFIG) + "files.xml.bz2";
@@ -944,6 +1001,7 @@ void ShareManager::generateXmlList() {
             LogManager::getInstance()->message(str(F_("File list %1% generated") % Util::addBrackets(bzXmlFile)));
         } catch(const Exception&) {
             // No new file lists...
+            xmlFragments.clear();
         }
 
         xmlDirty = false;
@@ -952,6 +1010,78 @@ void ShareManager::generateXmlList() {
     }
 }
 
+namespace {
+
+/** Hands XML to a fragment a block's worth at a time */
+class FragmentOutputStream : public OutputStream {
+public:
+    FragmentOutputStream(BZBlocks& aBz, TigerTree& aTree) : bz(aBz), tree(aTree), size(0) { }
+    virtual ~FragmentOutputStream() { }
+    using OutputStream::write;
+
+    virtual size_t write(const void* buf, size_t len) {
+        buffer.append((const char*)buf, len);
+        size += len;
+        // A few blocks at a time, so that they're compressed side by side
+        if(buffer.size() >= BATCH) {
+            // BLOCK_INPUT is a multiple of the leaf size, so only the end may hold a partial leaf
+            size_t n = buffer.size() - buffer.size() % BZBlocks::BLOCK_INPUT;
+            bz.compress(buffer.data(), n);
+            tree.update(buffer.data(), n);
+            buffer.erase(0, n);
+        }
+        return len;
+    }
+
+    virtual size_t flush() {
+        bz.compress(buffer.data(), buffer.size());
+        tree.update(buffer.data(), buffer.size());
+        buffer.clear();
+        return 0;
+    }
+
+    int64_t getSize() const { return size; }
+
+private:
+    enum { BATCH = 4 * BZBlocks::BLOCK_INPUT };
+
+    BZBlocks& bz;
+    TigerTree& tree;
+    string buffer;
+    int64_t size;
+};
+
+}
+
+void ShareManager::generateXmlFragment(const Directory* dir, const string& text, XmlFragment& fragment, bool pad) {
+    TigerTree tree(TigerTree::BASE_BLOCK_SIZE);
+    FragmentOutputStream xmlFile(fragment.bz, tree);
+
+    xmlFile.write(text);
+    if(dir) {
+        string indent, tmp;
+        dir->toXml(xmlFile, indent, tmp, true);
+    }
+
+    // Whitespace between elements doesn't matter
+    if(pad && xmlFile.getSize() % TigerTree::BASE_BLOCK_SIZE != 0)
+        xmlFile.write(string(TigerTree::BASE_BLOCK_SIZE - xmlFile.getSize() % TigerTree::BASE_BLOCK_SIZE, ' '));
+    xmlFile.flush();
+
+    tree.finalize();
+    fragment.leaves = tree.getLeafData();
+    fragment.size = xmlFile.getSize();
+}
+
+void ShareManager::setDirty(const Directory& dir) {
+    const Directory* root = &dir;
+    while(root->getParent())
+        root = root->getParent();
+
+    xmlFragments.erase(root);
+    xmlDirty = true;
+}
+
 MemoryInputStream* ShareManager::generatePartialList(const string& dir, bool recurse) const {
     if(dir[0] != '/' || dir[dir.size()-1] != '/')
         return 0;
@@ -1216,29 +1346,8 @@ void ShareManager::Directory::search(SearchResultList& aResults, StringSearch::L
     }
 
     if(aFileType != SearchManager::TYPE_DIRECTORY) {
-        for(auto i = files.begin(); i != files.end(); ++i) {
-
-            if(aSearchType == SearchManager::SIZE_ATLEAST && aSize > i->getSize()) {
-                continue;
-            } else if(aSearchType == SearchManager::SIZE_ATMOST && aSize < i->getSize()) {
-                continue;
-            }
-            auto j = cur->begin();
-            for(; j != cur->end() && j->match(i->getName()); ++j)
-                ;   // Empty
-
-            if(j != cur->end())
-                continue;
-
-            // Check file type...
-            if(checkType(i->getName(), aFileType)) {
-                SearchResultPtr sr(new SearchResult(SearchResult::TYPE_FILE, i->getSize(), getFullName() + i->getName(), i->getTTH()));
-                aResults.push_back(sr);
-                ShareManager::getInstance()->setHits(ShareManager::getInstance()->getHits()+1);
-                if(aResults.size() >= maxResults) {
-                    break;
-                }
-            }
+        for(auto i = files.begin(); i != files.end() && aResults.size() < maxResults; ++i) {
+            searchFile(aResults, *i, *cur, aSearchType, aSize, aFileType);
         }
     }
 
@@ -1247,6 +1356,27 @@ void ShareManager::Directory::search(SearchResultList& aResults, StringSearch::L
     }
 }
 
+void ShareManager::Directory::searchFile(SearchResultList& aResults, const File& f, const StringSearch::List& aStrings, int aSearchType, int64_t aSize, int aFileType) const noexcept {
+    if(aSearchType == SearchManager::SIZE_ATLEAST && aSize > f.getSize()) {
+        return;
+    } else if(aSearchType == SearchManager::SIZE_ATMOST && aSize < f.getSize()) {
+        return;
+    }
+    auto j = aStrings.begin();
+    for(; j != aStrings.end() && j->match(f.getName()); ++j)
+        ;   // Empty
+
+    if(j != aStrings.end())
+        return;
+
+    // Check file type...
+    if(checkType(f.getName(), aFileType)) {
+        SearchResultPtr sr(new SearchResult(SearchResult::TYPE_FILE, f.getSize(), getFullName() + f.getName(), f.getTTH()));
+        aResults.push_back(sr);
+        ShareManager::getInstance()->setHits(ShareManager::getInstance()->getHits()+1);
+    }
+}
+
 void ShareManager::search(SearchResultList& results, const string& aString, int aSearchType, int64_t aSize, int aFileType, Client* aClient, StringList::size_type maxResults) noexcept {
     Lock l(cs);
     if(aFileType == SearchManager::TYPE_TTH) {
@@ -1277,11 +1407,126 @@ void ShareManager::search(SearchResultList& results, const string& aString, int
     if(ssl.empty())
         return;
 
+    vector<NameEntry> names;
+    if(findNames(ssl, maxResults, names)) {
+        for(auto i = names.begin(); i != names.end() && results.size() < maxResults; ++i) {
+            // Leave out what the directories above have matched already
+            StringSearch::List left;
+            for(auto j = ssl.begin(); j != ssl.end(); ++j) {
+                Directory* d = i->file ? i->dir : i->dir->getParent();
+                for(; d && !j->match(d->getName()); d = d->getParent())
+                    ;   // Empty
+                if(!d)
+                    left.push_back(*j);
+            }
+
+            if(!i->file) {
+                i->dir->search(results, left, aSearchType, aSize, aFileType, aClient, maxResults);
+            } else if(aFileType != SearchManager::TYPE_DIRECTORY && i->dir->hasType(aFileType)) {
+                i->dir->searchFile(results, *i->file, left, aSearchType, aSize, aFileType);
+            }
+        }
+        return;
+    }
+
     for(auto j = directories.begin(); (j != directories.end()) && (results.size() < maxResults); ++j) {
         (*j)->search(results, ssl, aSearchType, aSize, aFileType, aClient, maxResults);
     }
 }
 
+const StringSearch* ShareManager::findNames(const StringSearch::List& aStrings, StringList::size_type maxResults, vector<NameEntry>& aEntries) {
+    const StringSearch* best = NULL;
+    size_t bestCount = 0;
+    for(auto i = aStrings.begin(); i != aStrings.end(); ++i) {
+        if(!NameIndex::isIndexed(i->getPattern()))
+            continue;
+        size_t n = nameIndex.count(i->getPattern());
+        if(!best || n < bestCount) {
+            best = &*i;
+            bestCount = n;
+        }
+    }
+    if(!best)
+        return NULL;
+
+    // Don't let removed names slow down every search
+    if(nameHoles > 1024 && nameHoles > nameEntries.size() / 2)
+        rebuildNames();
+
+    vector<uint32_t> ids;
+    nameIndex.find(best->getPattern(), ids);
+
+    // With that many candidates the walk is likely to have found enough long before
+    // every one of them has been checked; at worst it takes as long as it always did
+    if((double)ids.size() * ids.size() > (double)maxResults * (nameEntries.size() - nameHoles))
+        return NULL;
+    for(auto i = ids.begin(); i != ids.end(); ++i) {
+        const NameEntry& e = nameEntries[*i];
+        if(!e.dir || !best->match(e.file ? e.file->getName() : e.dir->getName()))
+            continue;
+
+        Directory* d = e.file ? e.dir : e.dir->getParent();
+        for(; d && !best->match(d->getName()); d = d->getParent())
+            ;   // Empty
+        if(!d)
+            aEntries.push_back(e);
+    }
+
+    sortNames(aEntries);
+    return best;
+}
+
+bool ShareManager::WalkKey::operator<(const WalkKey& rhs) const {
+    if(path != rhs.path)
+        return path < rhs.path;
+    // Files of the same directory, as its set has them
+    return file && rhs.file && Directory::File::FileLess()(*file, *rhs.file);
+}
+
+void ShareManager::sortNames(vector<NameEntry>& aEntries) const {
+    if(aEntries.size() < 2)
+        return;
+
+    // Position of each directory among its siblings
+    unordered_map<const Directory*, uint32_t> ranks;
+    uint32_t n = 0;
+    for(auto i = directories.begin(); i != directories.end(); ++i)
+        ranks[i->get()] = n++;
+
+    vector<WalkKey> keys(aEntries.size());
+    for(size_t i = 0; i < aEntries.size(); ++i) {
+        const NameEntry& e = aEntries[i];
+        WalkKey& k = keys[i];
+        k.file = e.file;
+        k.entry = i;
+
+        // A directory's files come before its subdirectories
+        if(e.file)
+            k.path.push_back(0);
+
+        for(const Directory* d = e.dir; d; d = d->getParent()) {
+            auto r = ranks.find(d);
+            if(r == ranks.end() && d->getParent()) {
+                n = 0;
+                const Directory::Map& siblings = d->getParent()->directories;
+                for(auto j = siblings.begin(); j != siblings.end(); ++j)
+                    ranks[j->second.get()] = n++;
+                r = ranks.find(d);
+            }
+            k.path.push_back(r != ranks.end() ? r->second + 1 : 0);
+        }
+        reverse(k.path.begin(), k.path.end());
+    }
+
+    sort(keys.begin(), keys.end());
+
+    vector<NameEntry> sorted;
+    sorted.reserve(aEntries.size());
+    for(auto i = keys.begin(); i != keys.end(); ++i)
+        sorted.push_back(aEntries[i->entry]);
+    aEntries.swap(sorted);
+}
+
 namespace {
     inline uint16_t toCode(char a, char b) { return (uint16_t)a | ((uint16_t)b)<<8; }
 }
@@ -1374,43 +1619,48 @@ void ShareManager::Directory::search(SearchResultList& aResults, AdcSearch& aStr
 
     if(!aStrings.isDirectory) {
         for(auto i = files.begin(); i != files.end(); ++i) {
-
-            if(!(i->getSize() >= aStrings.gt)) {
-                continue;
-            } else if(!(i->getSize() <= aStrings.lt)) {
-                continue;
-            }
-
-            if(aStrings.isExcluded(i->getName()))
-                continue;
-
-            auto j = cur->begin();
-            for(; j != cur->end() && j->match(i->getName()); ++j)
-                ;   // Empty
-
-            if(j != cur->end())
-                continue;
-
-            // Check file type...
-            if(aStrings.hasExt(i->getName())) {
-
-                SearchResultPtr sr(new SearchResult(SearchResult::TYPE_FILE,
-                    i->getSize(), getFullName() + i->getName(), i->getTTH()));
-                aResults.push_back(sr);
-                ShareManager::getInstance()->addHits(1);
-                if(aResults.size() >= maxResults) {
-                    return;
-                }
+            searchFile(aResults, *i, aStrings, *cur);
+            if(aResults.size() >= maxResults) {
+                return;
             }
         }
     }
 
+    // Descendants only need to match what's left
+    aStrings.include = cur;
     for(auto l = directories.begin(); (l != directories.end()) && (aResults.size() < maxResults); ++l) {
         l->second->search(aResults, aStrings, maxResults);
     }
     aStrings.include = old;
 }
 
+void ShareManager::Directory::searchFile(SearchResultList& aResults, const File& f, AdcSearch& aStrings, const StringSearch::List& cur) const noexcept {
+    if(!(f.getSize() >= aStrings.gt)) {
+        return;
+    } else if(!(f.getSize() <= aStrings.lt)) {
+        return;
+    }
+
+    if(aStrings.isExcluded(f.getName()))
+        return;
+
+    auto j = cur.begin();
+    for(; j != cur.end() && j->match(f.getName()); ++j)
+        ;   // Empty
+
+    if(j != cur.end())
+        return;
+
+    // Check file type...
+    if(aStrings.hasExt(f.getName())) {
+
+        SearchResultPtr sr(new SearchResult(SearchResult::TYPE_FILE,
+            f.getSize(), getFullName() + f.getName(), f.getTTH()));
+        aResults.push_back(sr);
+        ShareManager::getInstance()->addHits(1);
+    }
+}
+
 void ShareManager::search(SearchResultList& results, const StringList& params, StringList::size_type maxResults) noexcept {
     AdcSearch srch(params);
 
@@ -1433,6 +1683,29 @@ void ShareManager::search(SearchResultList& results, const StringList& params, S
             return;
     }
 
+    vector<NameEntry> names;
+    if(findNames(srch.includeX, maxResults, names)) {
+        for(auto i = names.begin(); i != names.end() && results.size() < maxResults; ++i) {
+            StringSearch::List left;
+            for(auto j = srch.includeX.begin(); j != srch.includeX.end(); ++j) {
+                Directory* d = i->file ? i->dir : i->dir->getParent();
+                for(; d && !(j->match(d->getName()) && !srch.isExcluded(d->getName())); d = d->getParent())
+                    ;   // Empty
+                if(!d)
+                    left.push_back(*j);
+            }
+
+            if(!i->file) {
+                srch.include = &left;
+                i->dir->search(results, srch, maxResults);
+                srch.include = &srch.includeX;
+            } else if(!srch.isDirectory) {
+                i->dir->searchFile(results, *i->file, srch, left);
+            }
+        }
+        return;
+    }
+
     for(auto j = directories.begin(); (j != directories.end()) && (results.size() < maxResults); ++j) {
         (*j)->search(results, srch, maxResults);
     }
@@ -1491,25 +1764,367 @@ void ShareManager::on(HashManagerListener::TTHDone, const string& fname, const T
     if(d) {
         auto i = d->findFile(Util::getFileName(fname));
         if(i != d->files.end()) {
-            if(root != i->getTTH())
-                tthIndex.erase(i->getTTH());
-            // Get rid of false constness...
-            auto f = const_cast<Directory::File*>(&(*i));
-            f->setTTH(root);
-            tthIndex.insert(make_pair(f->getTTH(), i));
+            if(root != i->getTTH()) {
+                removeTTH(*d, i);
+                // Get rid of false constness...
+                auto f = const_cast<Directory::File*>(&(*i));
+                f->setTTH(root);
+                updateIndices(*d, i);
+            }
         } else {
             string name = Util::getFileName(fname);
             int64_t size = File::getSize(fname);
             auto it = d->files.insert(Directory::File(name, size, d, root)).first;
             updateIndices(*d, it);
         }
-        setDirty();
+        setDirty(*d);
         forceXmlRefresh = true;
     }
 }
 
+void ShareManager::removeFile(Directory& dir, const Directory::File::Set::iterator& i) {
+    removeTTH(dir, i);
+    removeName(*i);
+    dir.files.erase(i);
+}
+
+void ShareManager::removeTTH(Directory& dir, const Directory::File::Set::iterator& i) {
+    auto j = tthIndex.find(i->getTTH());
+    if(j != tthIndex.end() && j->second == i) {
+        tthIndex.erase(j);
+        dir.size -= i->getSize();
+
+        // Still shared elsewhere, so it can still be found and downloaded
+        auto k = tthDupes.find(i->getTTH());
+        if(k != tthDupes.end()) {
+            k->second->getParent()->size += k->second->getSize();
+            tthIndex.insert(*k);
+            tthDupes.erase(k);
+        }
+        return;
+    }
+
+    auto range = tthDupes.equal_range(i->getTTH());
+    for(auto k = range.first; k != range.second; ++k) {
+        if(k->second == i) {
+            tthDupes.erase(k);
+            break;
+        }
+    }
+}
+
+void ShareManager::removeIndices(Directory& dir) {
+    for(auto i = dir.directories.begin(); i != dir.directories.end(); ++i) {
+        removeIndices(*i->second);
+    }
+
+    removeName(dir);
+    for(auto i = dir.files.begin(); i != dir.files.end(); ++i) {
+        removeTTH(dir, i);
+        removeName(*i);
+    }
+}
+
+void ShareManager::addName(Directory& dir) {
+    if(dir.nameId < nameEntries.size() && nameEntries[dir.nameId].dir == &dir && !nameEntries[dir.nameId].file)
+        return;
+
+    dir.nameId = nameEntries.size();
+    nameEntries.push_back(NameEntry(&dir, NULL));
+    nameIndex.add(dir.nameId, Text::toLower(dir.getName()));
+}
+
+void ShareManager::addName(Directory& dir, const Directory::File& f) {
+    if(f.nameId < nameEntries.size() && nameEntries[f.nameId].file == &f)
+        return;
+
+    f.nameId = nameEntries.size();
+    nameEntries.push_back(NameEntry(&dir, &f));
+    nameIndex.add(f.nameId, Text::toLower(f.getName()));
+}
+
+void ShareManager::removeName(Directory& dir) {
+    if(dir.nameId < nameEntries.size() && nameEntries[dir.nameId].dir == &dir && !nameEntries[dir.nameId].file) {
+        nameEntries[dir.nameId] = NameEntry(NULL, NULL);
+        nameHoles++;
+    }
+}
+
+void ShareManager::removeName(const Directory::File& f) {
+    if(f.nameId < nameEntries.size() && nameEntries[f.nameId].file == &f) {
+        nameEntries[f.nameId] = NameEntry(NULL, NULL);
+        nameHoles++;
+    }
+}
+
+void ShareManager::addNames(Directory& dir) {
+    addName(dir);
+    for(auto i = dir.files.begin(); i != dir.files.end(); ++i) {
+        addName(dir, *i);
+    }
+    for(auto i = dir.directories.begin(); i != dir.directories.end(); ++i) {
+        addNames(*i->second);
+    }
+}
+
+void ShareManager::rebuildNames() {
+    nameIndex.clear();
+    nameEntries.clear();
+    nameHoles = 0;
+
+    for(auto i = directories.begin(); i != directories.end(); ++i) {
+        addNames(**i);
+    }
+}
+
+// The watcher handlers only hold cs while touching the tree; HashManager may
+// fire TTHDone (which takes cs) while holding its own lock.
+
+void ShareManager::on(ShareWatcherListener::FileChanged, const string& aPath) noexcept {
+    {
+        Lock l(cs);
+        if(!getDirectory(aPath))
+            return;
+    }
+
+    string name = Util::getFileName(aPath);
+    if(!BOOLSETTING(SHARE_HIDDEN) && name[0] == '.')
+        return;
+
+    int64_t size = 0;
+    uint32_t timeStamp = 0;
+    try {
+        File f(aPath, File::READ, File::OPEN);
+        size = f.getSize();
+        timeStamp = f.getLastModified();
+    } catch(const FileException&) {
+        return;
+    }
+
+    bool hashed = false;
+    TTHValue root;
+    if(checkSkipList(aPath, size) && checkFile(name, aPath, size)) {
+        try {
+            // Unknown files are added by TTHDone once they're hashed
+            if(HashManager::getInstance()->checkTTH(aPath, size, timeStamp)) {
+                root = HashManager::getInstance()->getTTH(aPath, size);
+                hashed = true;
+            }
+        } catch(const HashException&) {
+        }
+    }
+
+    Lock l(cs);
+    Directory::Ptr d = getDirectory(aPath);
+    if(!d)
+        return;
+
+    auto i = d->findFile(name);
+    if(i != d->files.end())
+        removeFile(*d, i);
+
+    if(hashed && d->directories.find(name) == d->directories.end()) {
+        updateIndices(*d, d->files.insert(Directory::File(name, size, d, root)).first);
+    }
+    setDirty(*d);
+}
+
+void ShareManager::on(ShareWatcherListener::FileRemoved, const string& aPath) noexcept {
+    Lock l(cs);
+    Directory::Ptr d = getDirectory(aPath);
+    if(!d)
+        return;
+
+    auto i = d->findFile(Util::getFileName(aPath));
+    if(i != d->files.end()) {
+        removeFile(*d, i);
+        setDirty(*d);
+    }
+}
+
+void ShareManager::on(ShareWatcherListener::DirectoryAdded, const string& aPath) noexcept {
+    string parentPath = Util::getFilePath(aPath.substr(0, aPath.size() - 1));
+    {
+        Lock l(cs);
+        if(!getDirectory(parentPath))
+            return;
+    }
+
+    if(!checkHidden(aPath) || !checkSkipList(aPath.substr(0, aPath.size() - 1), 0) || !checkDirectory(aPath))
+        return;
+
+    Directory::Ptr dp = buildTree(aPath, Directory::Ptr());
+
+    Lock l(cs);
+    Directory::Ptr parent = getDirectory(parentPath);
+    if(!parent || parent->findFile(dp->getName()) != parent->files.end())
+        return;
+
+    auto i = parent->directories.find(dp->getName());
+    if(i != parent->directories.end()) {
+        removeIndices(*i->second);
+        parent->directories.erase(i);
+    }
+
+    dp->setParent(parent.get());
+    parent->directories.insert(make_pair(dp->getName(), dp));
+    updateIndices(*dp);
+    setDirty(*parent);
+}
+
+void ShareManager::on(ShareWatcherListener::DirectoryRemoved, const string& aPath) noexcept {
+    // Nothing left in there to hash
+    HashManager::getInstance()->stopHashing(aPath);
+
+    Lock l(cs);
+    Directory::Ptr d = getDirectory(aPath);
+    // Roots of the share stay until they're removed from the settings
+    if(!d || !d->getParent())
+        return;
+
+    removeIndices(*d);
+    setDirty(*d);
+    d->getParent()->directories.erase(d->getName());
+}
+
+void ShareManager::on(ShareWatcherListener::Renamed, const string& aOldPath, const string& aNewPath) noexcept {
+    bool isDir = aOldPath[aOldPath.size() - 1] == PATH_SEPARATOR;
+    // Files still waiting to be hashed under the old name have to be found again under the new one
+    bool unhashed = isDir && HashManager::getInstance()->stopHashing(aOldPath);
+    // getDirectory() of a file path is the directory holding it
+    string newParentPath = isDir ? Util::getFilePath(aNewPath.substr(0, aNewPath.size() - 1)) : aNewPath;
+    string newName = isDir ? Util::getLastDir(aNewPath) : Util::getFileName(aNewPath);
+
+    bool known = false;
+    bool inShare = false;
+    int64_t size = 0;
+    // Shared files moving along, relative to the renamed path
+    StringList moved;
+    {
+        Lock l(cs);
+        Directory::Ptr d = getDirectory(aOldPath);
+        if(d && isDir) {
+            known = d->getParent() != NULL;
+        } else if(d) {
+            auto i = d->findFile(Util::getFileName(aOldPath));
+            known = i != d->files.end();
+            if(known)
+                size = i->getSize();
+        }
+        inShare = getDirectory(newParentPath) != NULL;
+
+        if(known && inShare) {
+            if(isDir) {
+                vector<pair<Directory*, string> > dirs(1, make_pair(d.get(), string()));
+                while(!dirs.empty()) {
+                    auto cur = dirs.back();
+                    dirs.pop_back();
+                    for(auto i = cur.first->files.begin(); i != cur.first->files.end(); ++i)
+                        moved.push_back(cur.second + i->getName());
+                    for(auto i = cur.first->directories.begin(); i != cur.first->directories.end(); ++i)
+                        dirs.push_back(make_pair(i->second.get(), cur.second + i->second->getName() + PATH_SEPARATOR));
+                }
+            } else {
+                moved.push_back(Util::emptyString);
+            }
+        }
+    }
+
+    if(!known) {
+        // Moved in from a place outside the share
+        if(isDir)
+            on(ShareWatcherListener::DirectoryAdded(), aNewPath);
+        else
+            on(ShareWatcherListener::FileChanged(), aNewPath);
+        return;
+    }
+
+    bool shared = inShare && (BOOLSETTING(SHARE_HIDDEN) || newName[0] != '.');
+    if(shared && isDir)
+        shared = checkSkipList(aNewPath.substr(0, aNewPath.size() - 1), 0) && checkDirectory(aNewPath);
+    else if(shared)
+        shared = checkSkipList(aNewPath, size) && checkFile(newName, aNewPath, size);
+
+    if(!shared) {
+        if(isDir) {
+            watcher.removeWatch(aNewPath);
+            on(ShareWatcherListener::DirectoryRemoved(), aOldPath);
+        } else {
+            on(ShareWatcherListener::FileRemoved(), aOldPath);
+        }
+        return;
+    }
+
+    // Same content, no need to hash it again
+    for(auto i = moved.begin(); i != moved.end(); ++i) {
+        HashManager::getInstance()->renameFile(aOldPath + *i, aNewPath + *i);
+    }
+
+    if(unhashed) {
+        // Built again from the disk; the files already shared keep their hashes as renamed above
+        on(ShareWatcherListener::DirectoryAdded(), aNewPath);
+        on(ShareWatcherListener::DirectoryRemoved(), aOldPath);
+        return;
+    }
+
+    Lock l(cs);
+    Directory::Ptr d = getDirectory(aOldPath);
+    Directory::Ptr target = getDirectory(newParentPath);
+    if(!d || !target)
+        return;
+
+    setDirty(*d);
+    setDirty(*target);
+
+    if(isDir) {
+        if(!d->getParent() || target->findFile(newName) != target->files.end())
+            return;
+
+        d->getParent()->directories.erase(d->getName());
+
+        auto i = target->directories.find(newName);
+        if(i != target->directories.end()) {
+            removeIndices(*i->second);
+            target->directories.erase(i);
+        }
+
+        removeName(*d);
+        d->setName(newName);
+        addName(*d);
+        bloom.add(Text::toLower(newName));
+        d->setParent(target.get());
+        target->directories.insert(make_pair(newName, d));
+    } else {
+        auto i = d->findFile(Util::getFileName(aOldPath));
+        if(i == d->files.end())
+            return;
+
+        Directory::File f(newName, i->getSize(), target, i->getTTH());
+        removeFile(*d, i);
+
+        auto j = target->findFile(newName);
+        if(j != target->files.end())
+            removeFile(*target, j);
+
+        if(target->directories.find(newName) == target->directories.end())
+            updateIndices(*target, target->files.insert(f).first);
+    }
+}
+
+void ShareManager::on(ShareWatcherListener::Overflow) noexcept {
+    LogManager::getInstance()->message(_("Too many changes in the share to follow, it will be refreshed"));
+    watchOverflow = true;
+}
+
 void ShareManager::on(TimerManagerListener::Minute, uint64_t tick) noexcept {
-    if (SETTING(AUTO_REFRESH_TIME) > 0) {
+    if (watchOverflow && !refreshing) {
+        watchOverflow = false;
+        refresh(true, true);
+        return;
+    }
+
+    // A fully watched share is kept up to date as changes happen
+    if (SETTING(AUTO_REFRESH_TIME) > 0 && !watcher.isWatching()) {
         if (lastFullUpdate + SETTING(AUTO_REFRESH_TIME) * 60 * 1000 < tick) {
             refresh(true, true);
         }
@@ -23,11 +23,14 @@
 #include "SettingsManager.h"
 #include "HashManagerListener.h"
 #include "QueueManagerListener.h"
+#include "ShareWatcher.h"
 #include "Exception.h"
 #include "CriticalSection.h"
 #include "StringSearch.h"
 #include "Singleton.h"
 #include "BloomFilter.h"
+#include "BZUtils.h"
+#include "NameIndex.h"
 #include "FastAlloc.h"
 #include "MerkleTree.h"
 #include "Pointer.h"
@@ -51,7 +54,7 @@ class MemoryInputStream;
 
 struct ShareLoader;
 class ShareManager : public Singleton<ShareManager>, private SettingsManagerListener, private Thread, private TimerManagerListener,
-    private HashManagerListener, private QueueManagerListener
+    private HashManagerListener, private QueueManagerListener, private ShareWatcherListener
 {
 public:
     /**
@@ -145,11 +148,11 @@ private:
             };
             typedef set<File, FileLess> Set;
 
-            File() : size(0), parent(0) { }
+            File() : size(0), parent(0), nameId(0) { }
             File(const string& aName, int64_t aSize, const Directory::Ptr& aParent, const TTHValue& aRoot) :
-            name(aName), tth(aRoot), size(aSize), parent(aParent.get()) { }
+            name(aName), tth(aRoot), size(aSize), parent(aParent.get()), nameId(0) { }
             File(const File& rhs) :
-            name(rhs.getName()), tth(rhs.getTTH()), size(rhs.getSize()), parent(rhs.getParent()) { }
+            name(rhs.getName()), tth(rhs.getTTH()), size(rhs.getSize()), parent(rhs.getParent()), nameId(0) { }
 
             ~File() { }
 
@@ -173,6 +176,9 @@ private:
             GETSET(TTHValue, tth, TTH);
             GETSET(int64_t, size, Size);
             GETSET(Directory*, parent, Parent);
+
+            /** Id in ShareManager::nameIndex, only valid while the entry there points back here */
+            mutable uint32_t nameId;
         };
 
         int64_t size;
@@ -194,6 +200,9 @@ private:
 
         void search(SearchResultList& aResults, StringSearch::List& aStrings, int aSearchType, int64_t aSize, int aFileType, Client* aClient, StringList::size_type maxResults) const noexcept;
         void search(SearchResultList& aResults, AdcSearch& aStrings, StringList::size_type maxResults) const noexcept;
+        /** Add f to aResults if it matches, aStrings being what's left after matches in the directory names */
+        void searchFile(SearchResultList& aResults, const File& f, const StringSearch::List& aStrings, int aSearchType, int64_t aSize, int aFileType) const noexcept;
+        void searchFile(SearchResultList& aResults, const File& f, AdcSearch& aStrings, const StringSearch::List& cur) const noexcept;
 
         void toXml(OutputStream& xmlFile, string& indent, string& tmp2, bool fullList) const;
         void filesToXml(OutputStream& xmlFile, string& indent, string& tmp2) const;
@@ -204,6 +213,9 @@ private:
 
         GETSET(string, name, Name);
         GETSET(Directory*, parent, Parent);
+
+        /** @see File::nameId */
+        uint32_t nameId;
     private:
         friend void intrusive_ptr_release(intrusive_ptr_base<Directory>*);
 
@@ -251,6 +263,20 @@ private:
 
     bool xmlDirty;
     bool forceXmlRefresh; /// bypass the 15-minutes guard
+
+    /** The file list part of a shared root, compressed and hashed on its own */
+    struct XmlFragment {
+        XmlFragment() : size(0) { }
+
+        BZBlocks bz;
+        /** Tiger tree leaves of the XML, which is padded to whole leaves so they don't depend on the position */
+        ByteVector leaves;
+        int64_t size;
+    };
+    typedef unordered_map<const Directory*, XmlFragment> XmlFragmentMap;
+
+    /** Fragments of roots that haven't changed since the list was last generated */
+    XmlFragmentMap xmlFragments;
     bool refreshDirs;
     bool update;
     bool initial;
@@ -259,6 +285,11 @@ private:
 
     Atomic<bool,memory_ordering_strong> refreshing;
 
+    /** Follows changes in the shared directories between full refreshes */
+    ShareWatcher watcher;
+    /** The watcher lost events, the next minute tick rescans everything */
+    bool watchOverflow;
+
     uint64_t lastXmlUpdate;
     uint64_t lastFullUpdate;
 
@@ -279,22 +310,74 @@ private:
     typedef HashFileMap::iterator HashFileIter;
 
     HashFileMap tthIndex;
+    /** Copies of files in tthIndex listed because of LIST_DUPES; one of them takes over when the indexed one goes */
+    unordered_multimap<TTHValue, Directory::File::Set::const_iterator> tthDupes;
 
     BloomFilter<5> bloom;
 
+    /** What an id of nameIndex stands for; file is NULL for directory names */
+    struct NameEntry {
+        NameEntry(Directory* aDir, const Directory::File* aFile) : dir(aDir), file(aFile) { }
+
+        Directory* dir;
+        const Directory::File* file;
+    };
+
+    /** Where the tree walk comes across a NameEntry: the directory ranks from the root down, then the file */
+    struct WalkKey {
+        bool operator<(const WalkKey& rhs) const;
+
+        vector<uint32_t> path;
+        const Directory::File* file;
+        size_t entry;
+    };
+
+    /** Finds file and directory names by substring without walking the whole tree */
+    NameIndex nameIndex;
+    /** Indexed by id; removed names are left as holes (dir == NULL) until the index is rebuilt */
+    vector<NameEntry> nameEntries;
+    size_t nameHoles;
+
     Directory::File::Set::const_iterator findFile(const string& virtualFile) const;
 
     Directory::Ptr buildTree(const string& aName, const Directory::Ptr& aParent);
     bool checkHidden(const string& aName) const;
+    bool checkSkipList(const string& aPath, int64_t aSize) const;
+    /** @param aPath Directory path ending with PATH_SEPARATOR */
+    bool checkDirectory(const string& aPath) const;
+    bool checkFile(const string& aName, const string& aFileName, int64_t aSize) const;
 
     void rebuildIndices();
 
     void updateIndices(Directory& aDirectory);
     void updateIndices(Directory& dir, const Directory::File::Set::iterator& i);
+    void removeFile(Directory& dir, const Directory::File::Set::iterator& i);
+    /** Takes the file out of tthIndex or tthDupes, leaving the TTH indexed if another copy is listed */
+    void removeTTH(Directory& dir, const Directory::File::Set::iterator& i);
+    void removeIndices(Directory& dir);
+
+    void addName(Directory& dir);
+    void addName(Directory& dir, const Directory::File& f);
+    void removeName(Directory& dir);
+    void removeName(const Directory::File& f);
+    void addNames(Directory& dir);
+    void rebuildNames();
+    /**
+     * Looks up the pattern of aStrings with the fewest candidates, leaving out names
+     * below a directory that matches it as well since searching that directory finds them.
+     * @return The pattern looked up, or NULL if none is long enough or the names are so common
+     * that the tree is better walked
+     */
+    const StringSearch* findNames(const StringSearch::List& aStrings, StringList::size_type maxResults, vector<NameEntry>& aEntries);
+    /** Puts the entries in the order the tree walk comes across them, so that maxResults cuts off the same results */
+    void sortNames(vector<NameEntry>& aEntries) const;
 
     Directory::Ptr merge(const Directory::Ptr& directory);
 
     void generateXmlList();
+    void generateXmlFragment(const Directory* dir, const string& text, XmlFragment& fragment, bool pad);
+    /** The file list part of dir's root has to be generated again */
+    void setDirty(const Directory& dir);
     bool loadCache() noexcept;
     DirList::const_iterator getByVirtual(const string& virtualName) const noexcept;
     pair<Directory::Ptr, string> splitVirtual(const string& virtualPath) const;
@@ -310,6 +393,14 @@ private:
     // HashManagerListener
     virtual void on(HashManagerListener::TTHDone, const string& fname, const TTHValue& root) noexcept;
 
+    // ShareWatcherListener
+    virtual void on(ShareWatcherListener::FileChanged, const string& aPath) noexcept;
+    virtual void on(ShareWatcherListener::FileRemoved, const string& aPath) noexcept;
+    virtual void on(ShareWatcherListener::DirectoryAdded, const string& aPath) noexcept;
+    virtual void on(ShareWatcherListener::DirectoryRemoved, const string& aPath) noexcept;
+    virtual void on(ShareWatcherListener::Renamed, const string& aOldPath, const string& aNewPath) noexcept;
+    virtual void on(ShareWatcherListener::Overflow) noexcept;
+
     // SettingsManagerListener
     virtual void on(SettingsManagerListener::Save, SimpleXML& xml) noexcept {
         save(xml);
@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "stdinc.h"
+#include "ShareWatcher.h"
+
+#include "LogManager.h"
+#include "Text.h"
+#include "Util.h"
+#include "format.h"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+namespace dcpp {
+
+ShareWatcher::ShareWatcher() : fd(-1), stop(false), complete(false), moveCookie(0) {
+}
+
+ShareWatcher::~ShareWatcher() {
+    close();
+}
+
+#ifdef __linux__
+
+// Files are picked up once they are closed after writing; a bare IN_CREATE
+// would have us hash files that are still being written.
+static const uint32_t WATCH_MASK = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+
+bool ShareWatcher::open() {
+    if (fd != -1)
+        return true;
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd == -1) {
+        dcdebug("inotify_init1 failed: %s\n", Util::translateError(errno).c_str());
+        return false;
+    }
+
+    stop = false;
+    complete = true;
+    try {
+        start();
+    } catch(const ThreadException&) {
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void ShareWatcher::close() {
+    if (fd == -1)
+        return;
+
+    stop = true;
+    join();
+
+    ::close(fd);
+    fd = -1;
+    moveCookie = 0;
+
+    Lock l(cs);
+    watches.clear();
+    paths.clear();
+}
+
+void ShareWatcher::addWatch(const string& aPath) {
+    if (fd == -1)
+        return;
+
+    int wd = inotify_add_watch(fd, Text::fromUtf8(aPath).c_str(), WATCH_MASK);
+    if (wd == -1) {
+        if ((errno == ENOSPC || errno == ENOMEM) && complete) {
+            complete = false;
+            LogManager::getInstance()->message(_("Not enough inotify watches to follow the whole share, falling back to periodic refreshes (see fs.inotify.max_user_watches)"));
+        }
+        return;
+    }
+
+    Lock l(cs);
+    // A directory reached through a link keeps the same watch, remember the latest path
+    auto i = watches.find(wd);
+    if (i != watches.end() && i->second != aPath)
+        paths.erase(i->second);
+    watches[wd] = aPath;
+    paths[aPath] = wd;
+}
+
+void ShareWatcher::removeWatch(const string& aPath) {
+    Lock l(cs);
+    for (auto i = paths.lower_bound(aPath); i != paths.end() && i->first.compare(0, aPath.size(), aPath) == 0; ) {
+        inotify_rm_watch(fd, i->second);
+        watches.erase(i->second);
+        paths.erase(i++);
+    }
+}
+
+void ShareWatcher::renameWatches(const string& aOldPath, const string& aNewPath) {
+    Lock l(cs);
+    vector<pair<string, int> > moved;
+    for (auto i = paths.lower_bound(aOldPath); i != paths.end() && i->first.compare(0, aOldPath.size(), aOldPath) == 0; ) {
+        moved.push_back(make_pair(aNewPath + i->first.substr(aOldPath.size()), i->second));
+        paths.erase(i++);
+    }
+    for (auto i = moved.begin(); i != moved.end(); ++i) {
+        watches[i->second] = i->first;
+        paths[i->first] = i->second;
+    }
+}
+
+int ShareWatcher::run() {
+    setThreadName("ShareWatcher");
+
+    // inotify_event needs to be aligned, hence the uint64_t storage
+    vector<uint64_t> buf(64 * 1024 / sizeof(uint64_t));
+    char* data = reinterpret_cast<char*>(&buf[0]);
+
+    while (!stop) {
+        pollfd p = { fd, POLLIN, 0 };
+        // The two halves of a rename are normally read together, don't hold a lone one for long
+        int ret = poll(&p, 1, moveCookie != 0 ? 10 : 500);
+        if (ret == 0) {
+            flushMove();
+            continue;
+        } else if (ret < 0) {
+            continue;
+        }
+
+        ssize_t len = read(fd, data, buf.size() * sizeof(uint64_t));
+        if (len <= 0)
+            continue;
+
+        for (char* ptr = data; ptr < data + len; ) {
+            const inotify_event* ev = reinterpret_cast<const inotify_event*>(ptr);
+            handle(ev->wd, ev->mask, ev->cookie, ev->len > 0 ? Text::toUtf8(ev->name) : Util::emptyString);
+            ptr += sizeof(inotify_event) + ev->len;
+        }
+    }
+    return 0;
+}
+
+void ShareWatcher::handle(int wd, uint32_t mask, uint32_t cookie, const string& name) {
+    if (mask & IN_Q_OVERFLOW) {
+        flushMove();
+        fire(ShareWatcherListener::Overflow());
+        return;
+    }
+
+    string dir;
+    {
+        Lock l(cs);
+        auto i = watches.find(wd);
+        if (i == watches.end())
+            return;
+        dir = i->second;
+
+        if (mask & IN_IGNORED) {
+            // The directory is gone, its parent reports the deletion
+            auto j = paths.find(dir);
+            if (j != paths.end() && j->second == wd)
+                paths.erase(j);
+            watches.erase(i);
+            return;
+        }
+    }
+
+    bool isDir = (mask & IN_ISDIR) != 0;
+    string path = dir + name;
+    if (isDir)
+        path += PATH_SEPARATOR;
+
+    if (moveCookie != 0 && !((mask & IN_MOVED_TO) && cookie == moveCookie))
+        flushMove();
+
+    if (mask & IN_MOVED_FROM) {
+        moveCookie = cookie;
+        movePath = path;
+    } else if (mask & IN_MOVED_TO) {
+        if (moveCookie != 0) {
+            string oldPath;
+            swap(oldPath, movePath);
+            moveCookie = 0;
+            if (isDir)
+                renameWatches(oldPath, path);
+            fire(ShareWatcherListener::Renamed(), oldPath, path);
+        } else if (isDir) {
+            fire(ShareWatcherListener::DirectoryAdded(), path);
+        } else {
+            fire(ShareWatcherListener::FileChanged(), path);
+        }
+    } else if (mask & IN_CREATE) {
+        if (isDir)
+            fire(ShareWatcherListener::DirectoryAdded(), path);
+    } else if (mask & IN_CLOSE_WRITE) {
+        fire(ShareWatcherListener::FileChanged(), path);
+    } else if (mask & IN_DELETE) {
+        if (isDir)
+            fire(ShareWatcherListener::DirectoryRemoved(), path);
+        else
+            fire(ShareWatcherListener::FileRemoved(), path);
+    }
+}
+
+void ShareWatcher::flushMove() {
+    if (moveCookie == 0)
+        return;
+
+    // Moved somewhere we don't watch
+    string path;
+    swap(path, movePath);
+    moveCookie = 0;
+
+    if (path[path.size() - 1] == PATH_SEPARATOR) {
+        removeWatch(path);
+        fire(ShareWatcherListener::DirectoryRemoved(), path);
+    } else {
+        fire(ShareWatcherListener::FileRemoved(), path);
+    }
+}
+
+#else // __linux__
+
+bool ShareWatcher::open() {
+    return false;
+}
+
+void ShareWatcher::close() {
+}
+
+void ShareWatcher::addWatch(const string&) {
+}
+
+void ShareWatcher::removeWatch(const string&) {
+}
+
+void ShareWatcher::renameWatches(const string&, const string&) {
+}
+
+int ShareWatcher::run() {
+    return 0;
+}
+
+void ShareWatcher::handle(int, uint32_t, uint32_t, const string&) {
+}
+
+void ShareWatcher::flushMove() {
+}
+
+#endif // __linux__
+
+} // namespace dcpp
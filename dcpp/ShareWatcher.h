@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "Speaker.h"
+#include "Thread.h"
+#include "CriticalSection.h"
+#include "ShareWatcherListener.h"
+
+namespace dcpp {
+
+/**
+ * Reports changes in shared directories as they happen so the share can be
+ * updated without walking all of it again. Only available with inotify
+ * (Linux); elsewhere open() fails and the share falls back to periodic
+ * refreshes.
+ *
+ * Watches are not recursive: every directory of the share is added on its
+ * own while the tree is built. Events are fired from the watcher thread.
+ */
+class ShareWatcher : public Speaker<ShareWatcherListener>, private Thread {
+public:
+    ShareWatcher();
+    virtual ~ShareWatcher();
+
+    /** @return whether change notification could be started */
+    bool open();
+    void close();
+    /** @return whether every directory handed to addWatch() is being watched */
+    bool isWatching() const { return fd != -1 && complete; }
+
+    /**
+     * Watch a single directory. When the system runs out of watches the
+     * watcher stays open but isWatching() turns false, since changes in the
+     * unwatched part of the share would go unnoticed.
+     */
+    void addWatch(const string& aPath);
+    /** Stop watching aPath and every directory below it */
+    void removeWatch(const string& aPath);
+
+private:
+    typedef unordered_map<int, string> WatchMap;
+    typedef map<string, int> PathMap;
+
+    WatchMap watches;
+    PathMap paths;
+    mutable CriticalSection cs;
+
+    int fd;
+    volatile bool stop;
+    volatile bool complete;
+
+    /** First half of a rename waiting for its IN_MOVED_TO */
+    uint32_t moveCookie;
+    string movePath;
+
+    virtual int run();
+
+    void handle(int wd, uint32_t mask, uint32_t cookie, const string& name);
+    void flushMove();
+    void renameWatches(const string& aOldPath, const string& aNewPath);
+};
+
+} // namespace dcpp
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "noexcept.h"
+
+namespace dcpp {
+
+/**
+ * Changes seen in watched directories. Directory paths end with
+ * PATH_SEPARATOR, file paths don't.
+ */
+class ShareWatcherListener {
+public:
+    virtual ~ShareWatcherListener() { }
+    template<int I> struct X { enum { TYPE = I }; };
+
+    typedef X<0> FileChanged;
+    typedef X<1> FileRemoved;
+    typedef X<2> DirectoryAdded;
+    typedef X<3> DirectoryRemoved;
+    typedef X<4> Renamed;
+    typedef X<5> Overflow;
+
+    /** A file was written and closed, or moved in from an unwatched place */
+    virtual void on(FileChanged, const string&) noexcept { }
+    virtual void on(FileRemoved, const string&) noexcept { }
+    virtual void on(DirectoryAdded, const string&) noexcept { }
+    virtual void on(DirectoryRemoved, const string&) noexcept { }
+    /** A file or directory was moved between two watched places */
+    virtual void on(Renamed, const string& /*oldPath*/, const string& /*newPath*/) noexcept { }
+    /** Events were lost, the watched trees have to be scanned again */
+    virtual void on(Overflow) noexcept { }
+};
+
+} // namespace dcpp
@@ -23,6 +23,7 @@
 #include "SettingsManager.h"
 #include "TimerManager.h"
 #include "LogManager.h"
+#include "File.h"
 
 #ifdef __MINGW32__
 #ifndef EADDRNOTAVAIL
@@ -50,12 +51,17 @@
 #include <net/if.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <poll.h>
 #endif
 
 #ifdef __HAIKU__
 #include <sys/sockio.h>
 #endif
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
 namespace dcpp {
 
 string Socket::udpServer;
@@ -391,6 +397,51 @@ int Socket::read(void* aBuffer, int aBufLen, sockaddr_in &remote) {
     return len;
 }
 
+int Socket::read(void* aBuffer, int aBufLen, int aCount, DatagramList& aPackets) {
+    dcassert(type == TYPE_UDP && aCount > 0);
+
+    uint8_t* buf = (uint8_t*)aBuffer;
+    int size = aBufLen / aCount;
+
+#ifdef __linux__
+    vector<mmsghdr> msgs(aCount);
+    vector<iovec> iov(aCount);
+    vector<sockaddr_in> addrs(aCount);
+    for(int i = 0; i < aCount; ++i) {
+        iov[i].iov_base = buf + i * size;
+        iov[i].iov_len = size;
+        memset(&msgs[i], 0, sizeof(mmsghdr));
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+    }
+
+    int n;
+    do {
+        n = ::recvmmsg(sock, &msgs[0], aCount, MSG_DONTWAIT, NULL);
+    } while (n < 0 && getLastError() == EINTR);
+
+    if(check(n, true) < 0)
+        return -1;
+
+    for(int i = 0; i < n; ++i) {
+        int len = msgs[i].msg_len;
+        stats.totalDown += len;
+        aPackets.push_back(Datagram(inet_ntoa(addrs[i].sin_addr), ntohs(addrs[i].sin_port), string((char*)iov[i].iov_base, len)));
+    }
+    return n;
+#else
+    sockaddr_in remote;
+    int len = read(buf, size, remote);
+    if(len < 0)
+        return -1;
+
+    aPackets.push_back(Datagram(inet_ntoa(remote.sin_addr), ntohs(remote.sin_port), string((char*)buf, len)));
+    return 1;
+#endif
+}
+
 int Socket::readAll(void* aBuffer, int aBufLen, uint32_t timeout) {
     uint8_t* buf = (uint8_t*)aBuffer;
     int i = 0;
@@ -440,6 +491,27 @@ int Socket::write(const void* aBuffer, int aLen) {
     return sent;
 }
 
+int Socket::sendFile(File& aFile, int aLen) {
+#ifdef __linux__
+    ssize_t sent;
+    do {
+        sent = ::sendfile(sock, aFile.getHandle(), NULL, aLen);
+    } while (sent < 0 && getLastError() == EINTR);
+
+    // Some file systems don't support it (EINVAL); nothing left means the file shrunk
+    if((sent < 0 && (getLastError() == EINVAL || getLastError() == ENOSYS)) || (sent == 0 && aLen > 0))
+        return -2;
+
+    check(sent, true);
+    if(sent > 0) {
+        stats.totalUp += sent;
+    }
+    return sent;
+#else
+    return -2;
+#endif
+}
+
 /**
 * Sends data, will block until all data has been sent or an exception occurs
 * @param aBuffer Buffer with data
@@ -512,6 +584,113 @@ void Socket::writeTo(const string& aAddr, uint16_t aPort, const void* aBuffer, i
     stats.totalUp += sent;
 }
 
+// How long, and how often in a row, a full send buffer is waited for
+#define STALL_TIMEOUT 1000
+#define MAX_STALLS 10
+
+size_t Socket::writeTo(const DatagramList& aPackets, bool proxy) {
+    size_t sent = 0;
+
+#ifdef __linux__
+    if(!(SETTING(OUTGOING_CONNECTIONS) == SettingsManager::OUTGOING_SOCKS5 && proxy)) {
+        if(sock == INVALID_SOCKET) {
+            create(TYPE_UDP);
+        }
+
+        dcassert(type == TYPE_UDP);
+
+        const size_t BATCH = 64;
+        mmsghdr msgs[BATCH];
+        iovec iov[BATCH];
+        sockaddr_in addrs[BATCH];
+
+        for(auto i = aPackets.begin(); i != aPackets.end(); ) {
+            size_t n = 0;
+            for(; n < BATCH && i != aPackets.end(); ++i) {
+                if(i->ip.empty() || i->port == 0 || i->data.empty())
+                    continue;
+
+                in_addr_t addr = inet_addr(resolve(i->ip).c_str());
+                if(addr == INADDR_NONE)
+                    continue;
+
+                memset(&addrs[n], 0, sizeof(sockaddr_in));
+                addrs[n].sin_family = AF_INET;
+                addrs[n].sin_port = htons(i->port);
+                addrs[n].sin_addr.s_addr = addr;
+
+                iov[n].iov_base = const_cast<char*>(i->data.data());
+                iov[n].iov_len = i->data.size();
+
+                memset(&msgs[n], 0, sizeof(mmsghdr));
+                msgs[n].msg_hdr.msg_iov = &iov[n];
+                msgs[n].msg_hdr.msg_iovlen = 1;
+                msgs[n].msg_hdr.msg_name = &addrs[n];
+                msgs[n].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+                n++;
+            }
+
+            int stalls = 0;
+            for(size_t done = 0; done < n; ) {
+                int ret = ::sendmmsg(sock, msgs + done, n - done, 0);
+                if(ret < 0) {
+                    int error = getLastError();
+                    switch(error) {
+                    case EINTR:
+                        break;
+                    case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+                    case EWOULDBLOCK:
+#endif
+                    case ENOBUFS:
+                        // Out of buffer space; nothing of the datagram at hand went out, so it goes again
+                        if(++stalls > MAX_STALLS || wait(STALL_TIMEOUT, WAIT_WRITE) == WAIT_NONE) {
+                            dcdebug("Socket::writeTo: %s, dropping %u datagrams\n", SocketException(error).getError().c_str(), (unsigned)(n - done));
+                            return sent;
+                        }
+                        break;
+                    case EMSGSIZE:
+                    case EACCES:
+                    case EPERM:
+                    case EINVAL:
+                    case EHOSTUNREACH:
+                    case ENETUNREACH:
+                    case EHOSTDOWN:
+                    case ECONNREFUSED:
+                        // Only the datagram at hand is at fault, go on with the rest
+                        dcdebug("Socket::writeTo: %s\n", SocketException(error).getError().c_str());
+                        done++;
+                        break;
+                    default:
+                        // The socket itself is broken
+                        dcdebug("Socket::writeTo: %s\n", SocketException(error).getError().c_str());
+                        return sent;
+                    }
+                    continue;
+                }
+
+                for(int j = 0; j < ret; ++j)
+                    stats.totalUp += msgs[done + j].msg_len;
+                sent += ret;
+                done += ret;
+                stalls = 0;
+            }
+        }
+        return sent;
+    }
+#endif
+
+    for(auto i = aPackets.begin(); i != aPackets.end(); ++i) {
+        try {
+            writeTo(i->ip, i->port, i->data.data(), (int)i->data.size(), proxy);
+            sent++;
+        } catch(const SocketException& e) {
+            dcdebug("Socket::writeTo: %s\n", e.getError().c_str());
+        }
+    }
+    return sent;
+}
+
 /**
  * Blocks until timeout is reached one of the specified conditions have been fulfilled
  * @param millis Max milliseconds to block.
@@ -520,6 +699,7 @@ void Socket::writeTo(const string& aAddr, uint16_t aPort, const void* aBuffer, i
  * @return WAIT_*** ored together of the current state.
  * @throw SocketException Select or the connection attempt failed.
  */
+#ifdef _WIN32
 int Socket::wait(uint32_t millis, int waitFor) {
     timeval tv;
     fd_set rfd, wfd, efd;
@@ -597,6 +777,53 @@ int Socket::wait(uint32_t millis, int waitFor) {
     return waitFor;
 }
 
+#else
+
+// poll() rather than select(), descriptors may well be above FD_SETSIZE with many connections
+int Socket::wait(uint32_t millis, int waitFor) {
+    pollfd p;
+    p.fd = sock;
+    p.revents = 0;
+    if(waitFor & WAIT_CONNECT) {
+        dcassert(!(waitFor & WAIT_READ) && !(waitFor & WAIT_WRITE));
+        p.events = POLLOUT;
+    } else {
+        p.events = ((waitFor & WAIT_READ) ? POLLIN : 0) | ((waitFor & WAIT_WRITE) ? POLLOUT : 0);
+    }
+
+    int result;
+    do {
+        result = poll(&p, 1, millis);
+    } while (result < 0 && getLastError() == EINTR);
+    check(result);
+
+    // fix buffer overflow during shutdown
+    if(sock == INVALID_SOCKET)
+        return WAIT_NONE;
+
+    if(waitFor & WAIT_CONNECT) {
+        if(p.revents & (POLLERR | POLLHUP)) {
+            int y = 0;
+            socklen_t z = sizeof(y);
+            check(getsockopt(sock, SOL_SOCKET, SO_ERROR, (char*)&y, &z));
+
+            if(y != 0)
+                throw SocketException(y);
+            // No errors! We're connected (?)...
+            return WAIT_CONNECT;
+        }
+        return (p.revents & POLLOUT) ? WAIT_CONNECT : WAIT_NONE;
+    }
+
+    // Errors and hangups show up in the next read or write
+    waitFor &= WAIT_READ | WAIT_WRITE;
+    if(p.revents & (POLLERR | POLLHUP))
+        return waitFor;
+
+    return ((p.revents & POLLIN) ? WAIT_READ : WAIT_NONE) | ((p.revents & POLLOUT) ? WAIT_WRITE : WAIT_NONE);
+}
+#endif
+
 bool Socket::waitConnected(uint32_t millis) {
     return wait(millis, Socket::WAIT_CONNECT) == WAIT_CONNECT;
 }
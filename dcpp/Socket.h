@@ -57,6 +57,17 @@ private:
 class Socket
 {
 public:
+    /** A datagram to send, or one that was received */
+    struct Datagram {
+        Datagram() : port(0) { }
+        Datagram(const string& aIp, uint16_t aPort, const string& aData) : ip(aIp), port(aPort), data(aData) { }
+
+        string ip;
+        uint16_t port;
+        string data;
+    };
+    typedef vector<Datagram> DatagramList;
+
     enum {
         WAIT_NONE = 0x00,
         WAIT_CONNECT = 0x01,
@@ -98,6 +109,20 @@ public:
     int write(const string& aData) { return write(aData.data(), (int)aData.length()); }
     virtual void writeTo(const string& aIp, uint16_t aPort, const void* aBuffer, int aLen, bool proxy = true);
     void writeTo(const string& aIp, uint16_t aPort, const string& aData) { writeTo(aIp, aPort, aData.data(), (int)aData.length()); }
+    /**
+     * Sends several datagrams with as few system calls as possible (sendmmsg on Linux).
+     * A full send buffer is waited for; datagrams that can't be sent at all are skipped.
+     * @return Number of datagrams sent
+     */
+    size_t writeTo(const DatagramList& aPackets, bool proxy = true);
+    /**
+     * Sends up to aLen bytes of a file, starting at its current position, without
+     * copying them through user space (sendfile, Linux only).
+     * @return Number of bytes sent, -1 if the call would block and -2 if the file
+     *         can't be sent this way or has ended; nothing was sent then.
+     * @throw SocketException On any other failure.
+     */
+    virtual int sendFile(File& aFile, int aLen);
     virtual void shutdown() noexcept;
     virtual void close() noexcept;
     void disconnect() noexcept;
@@ -122,6 +147,14 @@ public:
      * @throw SocketException On any failure.
      */
     virtual int read(void* aBuffer, int aBufLen, sockaddr_in& remote);
+    /**
+     * Reads the datagrams that are waiting without blocking, at most aCount of them
+     * (recvmmsg on Linux, one at a time elsewhere). Each gets aBufLen / aCount bytes
+     * of the buffer.
+     * @return Number of datagrams appended to aPackets, -1 if the call would block.
+     * @throw SocketException On any failure.
+     */
+    int read(void* aBuffer, int aBufLen, int aCount, DatagramList& aPackets);
     /**
      * Reads data until aBufLen bytes have been read or an error occurs.
      * If the socket is closed, or the timeout is reached, the number of bytes read
@@ -0,0 +1,377 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "stdinc.h"
+#include "SocketReactor.h"
+
+#include "BufferedSocket.h"
+#include "TimerManager.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
+namespace dcpp {
+
+// How often socket timers are looked at
+static const uint32_t TIMER_RESOLUTION = 100;
+// Lookups beyond this many at once wait for each other
+static const size_t MAX_CONNECTORS = 8;
+
+void SocketReactor::resolve(BufferedSocket* aSock) {
+    Lock l(cs);
+    connects.push_back(aSock);
+    if(idleConnectors < connects.size() && connectors.size() < MAX_CONNECTORS) {
+        Connector* c = new Connector(*this);
+        try {
+            c->start();
+            connectors.push_back(c);
+            idleConnectors++;
+        } catch(const ThreadException&) {
+            // The ones already running will get to it
+            delete c;
+        }
+    }
+    connectSem.signal();
+}
+
+void SocketReactor::stopConnectors() {
+    for(auto i = connectors.begin(); i != connectors.end(); ++i)
+        connectSem.signal();
+    for(auto i = connectors.begin(); i != connectors.end(); ++i) {
+        (*i)->join();
+        delete *i;
+    }
+    connectors.clear();
+}
+
+int SocketReactor::Connector::run() {
+    setThreadName("SocketConnector");
+
+    while(true) {
+        reactor.connectSem.wait();
+
+        BufferedSocket* s;
+        {
+            Lock l(reactor.cs);
+            if(reactor.connects.empty()) {
+                if(reactor.stop)
+                    break;
+                continue;
+            }
+            s = reactor.connects.front();
+            reactor.connects.pop_front();
+            reactor.idleConnectors--;
+        }
+
+        s->threadResolve();
+
+        Lock l(reactor.cs);
+        reactor.idleConnectors++;
+    }
+    return 0;
+}
+
+#ifdef __linux__
+
+SocketReactor::SocketReactor() : stop(false), idleConnectors(0), epollFd(-1) {
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if(epollFd == -1)
+        throw ThreadException(Util::translateError(errno));
+
+    // Listeners may block on the disk for a while, so have a few more threads than cores
+    long threads = max(4L, min(sysconf(_SC_NPROCESSORS_ONLN), 16L));
+    for(long i = 0; i < threads; ++i) {
+        workers.push_back(new Worker(*this));
+        workers.back()->start();
+    }
+
+    start();
+}
+
+SocketReactor::~SocketReactor() {
+    stop = true;
+    join();
+    stopConnectors();
+
+    for(auto i = workers.begin(); i != workers.end(); ++i)
+        readySem.signal();
+    for(auto i = workers.begin(); i != workers.end(); ++i) {
+        (*i)->join();
+        delete *i;
+    }
+
+    for(auto i = removed.begin(); i != removed.end(); ++i)
+        delete *i;
+    ::close(epollFd);
+}
+
+void SocketReactor::add(BufferedSocket* aSock) {
+    Lock l(cs);
+    sockets.insert(aSock);
+}
+
+void SocketReactor::wake(BufferedSocket* aSock) {
+    Lock l(cs);
+    schedule(aSock, EV_WAKE);
+}
+
+void SocketReactor::unwatch(BufferedSocket* aSock) {
+    Lock l(cs);
+    if(aSock->pollFd != -1) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, aSock->pollFd, NULL);
+        aSock->pollFd = -1;
+    }
+}
+
+void SocketReactor::remove(BufferedSocket* aSock) {
+    Lock l(cs);
+    unwatch(aSock);
+    aSock->dead = true;
+}
+
+void SocketReactor::schedule(BufferedSocket* aSock, int events) {
+    if(aSock->dead)
+        return;
+
+    aSock->pendingEvents |= events;
+    if(!aSock->scheduled) {
+        aSock->scheduled = true;
+        ready.push_back(aSock);
+        readySem.signal();
+    }
+}
+
+void SocketReactor::arm(BufferedSocket* aSock) {
+    socket_t fd = aSock->sock.get() ? aSock->sock->sock : INVALID_SOCKET;
+    int events = aSock->waitEvents & (EV_READ | EV_WRITE);
+
+    if(events == 0 || fd == INVALID_SOCKET) {
+        // Hangups would be reported even without any events asked for
+        unwatch(aSock);
+        return;
+    }
+
+    // One shot, so that nobody else picks the socket up before it has been processed
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLONESHOT | ((events & EV_READ) ? static_cast<uint32_t>(EPOLLIN | EPOLLRDHUP) : 0u) |
+        ((events & EV_WRITE) ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+    ev.data.ptr = aSock;
+
+    bool added = aSock->pollFd == -1;
+    if(epoll_ctl(epollFd, added ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev) == 0) {
+        aSock->pollFd = fd;
+    } else {
+        // Nobody would ever wake the socket up; let it run into the error and disconnect
+        dcdebug("SocketReactor: epoll_ctl failed: %s\n", Util::translateError(errno).c_str());
+        schedule(aSock, EV_READ | EV_WRITE);
+    }
+}
+
+int SocketReactor::run() {
+    setThreadName("SocketReactor");
+
+    epoll_event events[64];
+    vector<BufferedSocket*> done;
+    while(!stop) {
+        int n = epoll_wait(epollFd, events, 64, TIMER_RESOLUTION);
+
+        {
+            Lock l(cs);
+            for(int i = 0; i < n; ++i) {
+                uint32_t e = events[i].events;
+                int ev = 0;
+                if(e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    ev |= EV_READ;
+                if(e & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                    ev |= EV_WRITE;
+                schedule(static_cast<BufferedSocket*>(events[i].data.ptr), ev);
+            }
+
+            // The timer belongs to whoever processes the socket while it's scheduled
+            uint64_t now = GET_TICK();
+            for(auto i = sockets.begin(); i != sockets.end(); ++i) {
+                BufferedSocket* s = *i;
+                if(!s->scheduled && s->waitTimer != 0 && s->waitTimer <= now) {
+                    s->waitTimer = 0;
+                    schedule(s, EV_TIMER);
+                }
+            }
+
+            // Events fetched before a socket was removed have all been dealt with by now
+            done.swap(removed);
+        }
+
+        for(auto i = done.begin(); i != done.end(); ++i)
+            delete *i;
+        done.clear();
+    }
+    return 0;
+}
+
+int SocketReactor::Worker::run() {
+    setThreadName("SocketWorker");
+
+    while(true) {
+        reactor.readySem.wait();
+
+        BufferedSocket* s;
+        int events;
+        {
+            Lock l(reactor.cs);
+            if(reactor.ready.empty()) {
+                if(reactor.stop)
+                    break;
+                continue;
+            }
+            s = reactor.ready.front();
+            reactor.ready.pop_front();
+            events = s->pendingEvents;
+            s->pendingEvents = 0;
+        }
+
+        int again = s->process(events);
+
+        Lock l(reactor.cs);
+        if(s->dead) {
+            reactor.sockets.erase(s);
+            reactor.removed.push_back(s);
+        } else if((s->pendingEvents |= again) != 0) {
+            // Give the others a turn first
+            reactor.ready.push_back(s);
+            reactor.readySem.signal();
+        } else {
+            s->scheduled = false;
+            reactor.arm(s);
+        }
+    }
+    return 0;
+}
+
+#else // __linux__
+
+SocketReactor::SocketReactor() : stop(false), idleConnectors(0) {
+}
+
+SocketReactor::~SocketReactor() {
+    stop = true;
+    stopConnectors();
+}
+
+void SocketReactor::add(BufferedSocket* aSock) {
+    Worker* w = new Worker(*this, aSock);
+    Lock l(cs);
+    workers[aSock] = w;
+    try {
+        w->start();
+    } catch(const ThreadException&) {
+        workers.erase(aSock);
+        delete w;
+        throw;
+    }
+}
+
+void SocketReactor::wake(BufferedSocket* aSock) {
+    Lock l(cs);
+    aSock->pendingEvents |= EV_WAKE;
+    auto i = workers.find(aSock);
+    if(i != workers.end())
+        i->second->sem.signal();
+}
+
+void SocketReactor::unwatch(BufferedSocket*) {
+}
+
+void SocketReactor::remove(BufferedSocket* aSock) {
+    Lock l(cs);
+    aSock->dead = true;
+}
+
+void SocketReactor::runSocket(Worker& aWorker, BufferedSocket* aSock) {
+    while(true) {
+        int events;
+        {
+            Lock l(cs);
+            events = aSock->pendingEvents;
+            aSock->pendingEvents = 0;
+        }
+
+        if(events == 0) {
+            uint32_t millis = TIMER_RESOLUTION;
+            if(aSock->waitTimer != 0) {
+                uint64_t now = GET_TICK();
+                millis = aSock->waitTimer > now ? static_cast<uint32_t>(min(aSock->waitTimer - now, (uint64_t)millis)) : 0;
+            }
+
+            int waitFor = ((aSock->waitEvents & EV_READ) ? Socket::WAIT_READ : 0) | ((aSock->waitEvents & EV_WRITE) ? Socket::WAIT_WRITE : 0);
+            if(waitFor != 0 && aSock->sock.get() && aSock->sock->sock != INVALID_SOCKET) {
+                try {
+                    int w = aSock->sock->wait(millis, waitFor);
+                    if(w & Socket::WAIT_READ)
+                        events |= EV_READ;
+                    if(w & Socket::WAIT_WRITE)
+                        events |= EV_WRITE;
+                } catch(const Exception&) {
+                    // Let the socket run into the error itself
+                    events |= EV_READ | EV_WRITE;
+                }
+            } else {
+                aWorker.sem.wait(millis);
+            }
+
+            if(aSock->waitTimer != 0 && GET_TICK() >= aSock->waitTimer) {
+                aSock->waitTimer = 0;
+                events |= EV_TIMER;
+            }
+
+            Lock l(cs);
+            events |= aSock->pendingEvents;
+            aSock->pendingEvents = 0;
+            if(events == 0)
+                continue;
+        }
+
+        int again = aSock->process(events);
+
+        Lock l(cs);
+        aSock->pendingEvents |= again;
+        if(aSock->dead) {
+            workers.erase(aSock);
+            break;
+        }
+    }
+
+    delete aSock;
+}
+
+int SocketReactor::run() {
+    return 0;
+}
+
+int SocketReactor::Worker::run() {
+    setThreadName("BufferedSocket");
+    reactor.runSocket(*this, sock);
+    delete this;
+    return 0;
+}
+
+#endif // __linux__
+
+} // namespace dcpp
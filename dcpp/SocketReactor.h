@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "Singleton.h"
+#include "Thread.h"
+#include "Semaphore.h"
+#include "CriticalSection.h"
+
+namespace dcpp {
+
+class BufferedSocket;
+
+/**
+ * Runs the BufferedSocket state machines. On Linux one thread waits on all
+ * sockets with epoll and hands the ready ones to a small pool of I/O
+ * threads. Elsewhere every socket still gets a thread of its own that waits
+ * with select().
+ *
+ * Either way a socket is only ever processed by one thread at a time, so
+ * its listeners are never called concurrently.
+ */
+class SocketReactor : public Singleton<SocketReactor>, private Thread {
+public:
+    enum {
+        EV_READ = 0x01,
+        EV_WRITE = 0x02,
+        /** Tasks were queued */
+        EV_WAKE = 0x04,
+        /** The socket's timer ran out */
+        EV_TIMER = 0x08
+    };
+
+    void add(BufferedSocket* aSock);
+    /** Makes the socket look at its tasks */
+    void wake(BufferedSocket* aSock);
+    /** Stop waiting for the socket's events; has to be done before it's closed */
+    void unwatch(BufferedSocket* aSock);
+    /** The socket is done with, it is deleted once no thread uses it anymore */
+    void remove(BufferedSocket* aSock);
+    /** Runs the blocking part of the socket's connect (name lookup, SOCKS) on a connector thread */
+    void resolve(BufferedSocket* aSock);
+
+private:
+    friend class Singleton<SocketReactor>;
+
+    /** An I/O thread; without epoll there's one for each socket */
+    class Worker : public Thread {
+    public:
+        Worker(SocketReactor& aReactor, BufferedSocket* aSock = 0) : reactor(aReactor), sock(aSock) { }
+
+        Semaphore sem;
+    private:
+        SocketReactor& reactor;
+        BufferedSocket* sock;
+        virtual int run();
+    };
+
+    /** Does the name lookups and SOCKS handshakes so that the I/O threads never block on them */
+    class Connector : public Thread {
+    public:
+        Connector(SocketReactor& aReactor) : reactor(aReactor) { }
+    private:
+        SocketReactor& reactor;
+        virtual int run();
+    };
+
+    SocketReactor();
+    virtual ~SocketReactor();
+
+    CriticalSection cs;
+    volatile bool stop;
+
+    vector<Connector*> connectors;
+    /** Sockets waiting for a connector */
+    deque<BufferedSocket*> connects;
+    Semaphore connectSem;
+    size_t idleConnectors;
+
+    void stopConnectors();
+
+#ifdef __linux__
+    int epollFd;
+    vector<Worker*> workers;
+
+    unordered_set<BufferedSocket*> sockets;
+    /** Sockets waiting for an I/O thread */
+    deque<BufferedSocket*> ready;
+    Semaphore readySem;
+    /** Removed sockets, deleted by the epoll thread between two waits */
+    vector<BufferedSocket*> removed;
+
+    void schedule(BufferedSocket* aSock, int events);
+    void arm(BufferedSocket* aSock);
+#else
+    unordered_map<BufferedSocket*, Worker*> workers;
+
+    void runSocket(Worker& aWorker, BufferedSocket* aSock);
+#endif
+
+    virtual int run();
+};
+
+} // namespace dcpp
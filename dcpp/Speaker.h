@@ -22,7 +22,10 @@
 #include <vector>
 #include <algorithm>
 #include <iterator>
+#include <atomic>
+#include "compiler.h"
 #include "CriticalSection.h"
+#include "Thread.h"
 #include "noexcept.h"
 
 namespace dcpp {
@@ -31,45 +34,160 @@ using std::forward;
 using std::vector;
 using std::find;
 
+/**
+ * Calls its listeners from whatever thread fires an event. The listener list
+ * is an immutable snapshot that add/removeListener replace, so fire() only
+ * loads a pointer and never takes a lock.
+ *
+ * Once removeListener() returns the listener isn't called anymore, unless the
+ * removal came from one of this speaker's callbacks: that one doesn't wait
+ * for events fired by other threads, as waiting might deadlock.
+ */
 template<typename Listener>
 class Speaker {
     typedef vector<Listener*> ListenerList;
 
 public:
-    Speaker() noexcept { }
-    virtual ~Speaker() { }
+    Speaker() noexcept : listeners(new ListenerList), epoch(0) {
+        readers[0] = readers[1] = 0;
+    }
+    virtual ~Speaker() {
+        delete listeners.load();
+        for(auto i = retired.begin(); i != retired.end(); ++i)
+            delete *i;
+    }
 
     template<typename... T>
     void fire(T&&... type) noexcept {
-        Lock l(listenerCS);
-        tmp = listeners;
-        for(auto i = tmp.begin(); i != tmp.end(); ++i) {
+        Reader r(this);
+        const ListenerList* l = listeners.load();
+        for(auto i = l->begin(); i != l->end(); ++i) {
             (*i)->on(std::forward<T>(type)...);
         }
     }
 
     void addListener(Listener* aListener) {
-        Lock l(listenerCS);
-        if(find(listeners.begin(), listeners.end(), aListener) == listeners.end())
-            listeners.push_back(aListener);
+        vector<ListenerList*> old;
+        {
+            Lock l(listenerCS);
+            const ListenerList* cur = listeners.load();
+            if(find(cur->begin(), cur->end(), aListener) != cur->end())
+                return;
+
+            ListenerList* next = new ListenerList(*cur);
+            next->push_back(aListener);
+            retired.push_back(listeners.exchange(next));
+            release(old);
+        }
+        reclaim(old);
     }
 
     void removeListener(Listener* aListener) {
-        Lock l(listenerCS);
-        auto it = find(listeners.begin(), listeners.end(), aListener);
-        if(it != listeners.end())
-            listeners.erase(it);
+        vector<ListenerList*> old;
+        {
+            Lock l(listenerCS);
+            const ListenerList* cur = listeners.load();
+            auto it = find(cur->begin(), cur->end(), aListener);
+            if(it == cur->end())
+                return;
+
+            ListenerList* next = new ListenerList(cur->begin(), it);
+            next->insert(next->end(), it + 1, cur->end());
+            retired.push_back(listeners.exchange(next));
+            release(old);
+        }
+        reclaim(old);
     }
 
     void removeListeners() {
-        Lock l(listenerCS);
-        listeners.clear();
+        vector<ListenerList*> old;
+        {
+            Lock l(listenerCS);
+            retired.push_back(listeners.exchange(new ListenerList));
+            release(old);
+        }
+        reclaim(old);
     }
 
 protected:
-    ListenerList listeners;
-    ListenerList tmp;
+    /** Current listeners; only to be replaced as a whole */
+    std::atomic<ListenerList*> listeners;
     CriticalSection listenerCS;
+
+private:
+    /** Snapshots that readers may still be walking */
+    vector<ListenerList*> retired;
+
+    /**
+     * Readers count themselves in the current epoch. A change switches
+     * epochs and waits for the old one to empty, twice, so that readers that
+     * read the epoch before the switch are waited for as well; readers that
+     * come in meanwhile don't keep it waiting.
+     */
+    std::atomic<int> epoch;
+    std::atomic<int> readers[2];
+    FastCriticalSection syncCS;
+
+    /** The speakers whose events the current thread is calling listeners for */
+    struct Firing {
+        const Speaker* speaker;
+        Firing* prev;
+    };
+    static DCPP_THREAD_LOCAL Firing* firing;
+
+    class Reader {
+    public:
+        Reader(Speaker* aSpeaker) : s(aSpeaker), n(aSpeaker->epoch.load()) {
+            f.speaker = s;
+            f.prev = firing;
+            firing = &f;
+            s->readers[n]++;
+        }
+        ~Reader() {
+            s->readers[n]--;
+            firing = f.prev;
+        }
+    private:
+        Speaker* s;
+        int n;
+        Firing f;
+    };
+
+    /** Takes the snapshots to be freed, unless our own fire() may still walk one of them */
+    void release(vector<ListenerList*>& aOld) {
+        if(!isFiring())
+            aOld.swap(retired);
+    }
+
+    /** Waits for the readers of the old snapshots and frees them */
+    void reclaim(vector<ListenerList*>& aOld) {
+        if(aOld.empty())
+            return;
+
+        {
+            FastLock l(syncCS);
+            for(int i = 0; i < 2; ++i) {
+                int n = epoch.load();
+                epoch = 1 - n;
+                while(readers[n].load() != 0)
+                    Thread::yield();
+            }
+        }
+
+        for(auto i = aOld.begin(); i != aOld.end(); ++i)
+            delete *i;
+    }
+
+    bool isFiring() const {
+        for(Firing* f = firing; f; f = f->prev) {
+            if(f->speaker == this)
+                return true;
+        }
+        return false;
+    }
 };
 
+template<typename Listener>
+DCPP_THREAD_LOCAL typename Speaker<Listener>::Firing* Speaker<Listener>::firing = 0;
+
 } // namespace dcpp
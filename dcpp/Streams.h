@@ -73,6 +73,12 @@ public:
      *         actually read from the stream source in this call.
      */
     virtual size_t read(void* buf, size_t& len) = 0;
+    /**
+     * The file the rest of the stream comes from unchanged, if any, so it can
+     * be sent without being read (sendfile).
+     * @param aBytes Set to the number of bytes left, starting at the file's current position
+     */
+    virtual File* getSourceFile(int64_t& /*aBytes*/) { return 0; }
 private:
     InputStream(const InputStream&);
     InputStream& operator=(const InputStream&);
@@ -124,6 +130,12 @@ public:
         return x;
     }
 
+    File* getSourceFile(int64_t& aBytes) {
+        File* f = s->getSourceFile(aBytes);
+        aBytes = min(aBytes, (int64_t)maxBytes);
+        return f;
+    }
+
 private:
     InputStream* s;
     uint64_t maxBytes;
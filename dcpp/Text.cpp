@@ -25,6 +25,7 @@
 #include <errno.h>
 #include <iconv.h>
 #include <langinfo.h>
+#include <pthread.h>
 
 #ifndef ICONV_CONST
  #define ICONV_CONST
@@ -63,6 +64,118 @@ bool isAscii(const char* str) noexcept {
     return true;
 }
 
+bool isAscii(const char* str, size_t len) noexcept {
+    const char* end = str + len;
+
+    // A word at a time; the compiler turns this into vector instructions where it can
+    for(; end - str >= 32; str += 32) {
+        uint64_t w[4];
+        memcpy(w, str, sizeof(w));
+        if((w[0] | w[1] | w[2] | w[3]) & _ULL(0x8080808080808080))
+            return false;
+    }
+    for(; end - str >= 8; str += 8) {
+        uint64_t w;
+        memcpy(&w, str, sizeof(w));
+        if(w & _ULL(0x8080808080808080))
+            return false;
+    }
+    for(; str != end; ++str) {
+        if(*str & 0x80)
+            return false;
+    }
+    return true;
+}
+
+#ifndef _WIN32
+
+namespace {
+
+/**
+ * An open iconv descriptor. Descriptors keep a shift state so they can't be
+ * shared between threads; every thread caches its own.
+ */
+struct Converter {
+    string fromCharset;
+    string toCharset;
+    iconv_t cd;
+    /** Whether ASCII text comes out unchanged, so it doesn't have to be converted at all */
+    bool asciiSafe;
+};
+
+typedef vector<Converter> ConverterList;
+
+// Hubs and users only ever use a handful of charsets
+const size_t MAX_CONVERTERS = 8;
+
+pthread_key_t convertersKey;
+pthread_once_t convertersOnce = PTHREAD_ONCE_INIT;
+
+void freeConverters(void* p) {
+    ConverterList* l = static_cast<ConverterList*>(p);
+    for(auto i = l->begin(); i != l->end(); ++i)
+        iconv_close(i->cd);
+    delete l;
+}
+
+void initConverters() {
+    pthread_key_create(&convertersKey, freeConverters);
+}
+
+/** Runs all of ASCII through the descriptor; charsets such as UTF-16, UTF-7 or HZ change it */
+bool isAsciiSafe(iconv_t cd) {
+    char in[127];
+    for(size_t i = 0; i < sizeof(in); ++i)
+        in[i] = (char)(i + 1);
+
+    char out[sizeof(in) * 4];
+    const char* inbuf = in;
+    char* outbuf = out;
+    size_t inleft = sizeof(in);
+    size_t outleft = sizeof(out);
+
+    bool safe = iconv(cd, (ICONV_CONST char **)&inbuf, &inleft, &outbuf, &outleft) != (size_t)-1 &&
+        inleft == 0 && outbuf - out == (ptrdiff_t)sizeof(in) && memcmp(in, out, sizeof(in)) == 0;
+
+    iconv(cd, NULL, NULL, NULL, NULL);
+    return safe;
+}
+
+/** @return the calling thread's converter, in its initial state, or NULL if iconv doesn't know the charsets */
+Converter* getConverter(const string& fromCharset, const string& toCharset) {
+    pthread_once(&convertersOnce, initConverters);
+
+    ConverterList* l = static_cast<ConverterList*>(pthread_getspecific(convertersKey));
+    if(!l) {
+        l = new ConverterList;
+        pthread_setspecific(convertersKey, l);
+    }
+
+    for(auto i = l->begin(); i != l->end(); ++i) {
+        if(i->fromCharset == fromCharset && i->toCharset == toCharset) {
+            iconv(i->cd, NULL, NULL, NULL, NULL);
+            return &*i;
+        }
+    }
+
+    iconv_t cd = iconv_open(toCharset.c_str(), fromCharset.c_str());
+    if(cd == (iconv_t)-1)
+        return NULL;
+
+    if(l->size() >= MAX_CONVERTERS) {
+        iconv_close(l->front().cd);
+        l->erase(l->begin());
+    }
+
+    Converter c = { fromCharset, toCharset, cd, isAsciiSafe(cd) };
+    l->push_back(c);
+    return &l->back();
+}
+
+}
+
+#endif
+
 int utf8ToWc(const char* str, wchar_t& c) {
     uint8_t c0 = (uint8_t)str[0];
     if(c0 & 0x80) {                                 // 1xxx xxxx
@@ -355,11 +468,16 @@ const string& convert(const string& str, string& tmp, const string& fromCharset,
     return str;
 #else
 
-    // Initialize the converter
-    iconv_t cd = iconv_open(toCharset.c_str(), fromCharset.c_str());
-    if(cd == (iconv_t)-1)
+    Converter* c = getConverter(fromCharset, toCharset);
+    if(!c)
         return str;
 
+    // Most protocol traffic is plain ASCII
+    if(c->asciiSafe && isAscii(str.data(), str.size()))
+        return str;
+
+    iconv_t cd = c->cd;
+
     size_t rv;
     size_t len = str.length() * 2; // optimization
     size_t inleft = str.length();
@@ -387,7 +505,6 @@ const string& convert(const string& str, string& tmp, const string& fromCharset,
             }
         }
     }
-    iconv_close(cd);
     if(outleft > 0) {
         tmp.resize(len - outleft);
     }
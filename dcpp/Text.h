@@ -108,8 +108,9 @@ namespace Text {
         return tmp;
     }
 
-    inline bool isAscii(const string& str) noexcept { return isAscii(str.c_str()); }
     bool isAscii(const char* str) noexcept;
+    bool isAscii(const char* str, size_t len) noexcept;
+    inline bool isAscii(const string& str) noexcept { return isAscii(str.data(), str.size()); }
 
     bool validateUtf8(const string& str) noexcept;
 
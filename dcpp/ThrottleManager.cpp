@@ -29,84 +29,191 @@
 #include "ClientManager.h"
 
 namespace dcpp {
-/**
- * Manager for throttling traffic flow.
- * Inspired by Token Bucket algorithm: http://en.wikipedia.org/wiki/Token_bucket
- */
+
+/** How much a class may save up, in milliseconds of its rate */
+static const double BURST_MS = 250;
+/** Smallest bucket, so that slow limits still allow reasonably sized packets */
+static const double MIN_BURST = 4096;
 
 /*
  * Throttles traffic and reads a packet from the network
  */
-int ThrottleManager::read(Socket* sock, void* buffer, size_t len)
+int ThrottleManager::read(Socket* sock, void* buffer, size_t len, Flow& flow)
 {
-    int64_t readSize = -1;
     size_t downs = DownloadManager::getInstance()->getDownloadCount();
     auto downLimit = getDownLimit(); // avoid even intra-function races
-    if(!BOOLSETTING(THROTTLE_ENABLE) || !getCurThrottling() || downLimit == 0 || downs == 0)
+    if(!BOOLSETTING(THROTTLE_ENABLE) || halt || downLimit == 0 || downs == 0)
         return sock->read(buffer, len);
 
-    {
-        Lock l(downCS);
-
-        if(downTokens > 0)
-        {
-            int64_t slice = (downLimit * 1024) / downs;
-            readSize = min(slice, min(static_cast<int64_t>(len), downTokens));
-
-            // read from socket
-            readSize = sock->read(buffer, static_cast<size_t>(readSize));
+    size_t readSize = getTokens(DOWN, downLimit, len, flow);
+    if(readSize == 0)
+        return -2;  // from BufferedSocket: -1 = retry, -2 = retry later, 0 = connection close
 
-            if(readSize > 0)
-                downTokens -= readSize;
-        }
-    }
-
-    if(readSize != -1)
-    {
-        Thread::yield(); // give a chance to other transfers to get a token
-        return readSize;
+    int ret;
+    try {
+        ret = sock->read(buffer, readSize);
+    } catch(const Exception&) {
+        putTokens(DOWN, readSize, flow);
+        throw;
     }
 
-    waitToken();
-    return -1;  // from BufferedSocket: -1 = retry, 0 = connection close
+    putTokens(DOWN, readSize - max(ret, 0), flow);
+    return ret;
 }
 
 /*
  * Throttles traffic and writes a packet to the network
  * Handle this a little bit differently than downloads due to OpenSSL stupidity
  */
-int ThrottleManager::write(Socket* sock, void* buffer, size_t& len)
+int ThrottleManager::write(Socket* sock, void* buffer, size_t& len, Flow& flow)
 {
-    bool gotToken = false;
     size_t ups = UploadManager::getInstance()->getUploadCount();
-    auto upLimit = getUpLimit(); // avoid even intra-function races
-    if(!BOOLSETTING(THROTTLE_ENABLE) || !getCurThrottling() || upLimit == 0 || ups == 0)
+    auto upLimit = getUpLimit();
+    if(!BOOLSETTING(THROTTLE_ENABLE) || halt || upLimit == 0 || ups == 0)
         return sock->write(buffer, len);
 
-    {
-        Lock l(upCS);
+    len = getTokens(UP, upLimit, len, flow);
+    if(len == 0)
+        return 0;   // from BufferedSocket: -1 = failed, 0 = retry
+
+    // write to socket
+    int sent;
+    try {
+        sent = sock->write(buffer, len);
+    } catch(const Exception&) {
+        putTokens(UP, len, flow);
+        throw;
+    }
 
-        if(upTokens > 0)
-        {
-            size_t slice = (upLimit * 1024) / ups;
-            len = min(slice, min(len, static_cast<size_t>(upTokens)));
-            upTokens -= len;
+    // A write that would block is retried with the same size straight on the socket (see BufferedSocket),
+    // so its tokens stay spent
+    if(sent != -1)
+        putTokens(UP, len - max(sent, 0), flow);
+    return sent;
+}
+
+/*
+ * Throttles traffic and sends a part of a file to the network
+ */
+int ThrottleManager::sendFile(Socket* sock, File& f, size_t& len, Flow& flow)
+{
+    size_t ups = UploadManager::getInstance()->getUploadCount();
+    auto upLimit = getUpLimit();
+    if(!BOOLSETTING(THROTTLE_ENABLE) || halt || upLimit == 0 || ups == 0)
+        return sock->sendFile(f, (int)len);
+
+    len = getTokens(UP, upLimit, len, flow);
+    if(len == 0)
+        return 0;
+
+    int sent;
+    try {
+        sent = sock->sendFile(f, (int)len);
+    } catch(const Exception&) {
+        putTokens(UP, len, flow);
+        throw;
+    }
+
+    putTokens(UP, len - max(sent, 0), flow);
+    return sent;
+}
 
-            gotToken = true; // token successfuly assigned
+void ThrottleManager::refill(Direction& d, int limit)
+{
+    // The share of the favorites is taken from the current limit every time, so changes apply at once
+    int share = SETTING(THROTTLE_FAVORITE_SHARE);
+    double rate = limit * 1024 / 1000.0;
+    double favoriteRate = rate * min(max(share, 0), 100) / 100;
+
+    d.classes[CLASS_FAVORITE].rate = favoriteRate;
+    d.classes[CLASS_NORMAL].rate = rate - favoriteRate;
+
+    uint64_t now = GET_TICK();
+    double elapsed = (double)(now - d.last);
+    d.last = now;
+
+    d.spareBurst = max(rate * BURST_MS, MIN_BURST);
+    for(int i = 0; i < CLASS_LAST; ++i) {
+        Bucket& b = d.classes[i];
+        b.burst = max(b.rate * BURST_MS, b.rate > 0 ? MIN_BURST : 0.);
+        b.tokens += b.rate * elapsed;
+        if(b.tokens > b.burst) {
+            d.spare += b.tokens - b.burst;
+            b.tokens = b.burst;
         }
     }
+    d.spare = min(d.spare, d.spareBurst);
+}
+
+size_t ThrottleManager::getTokens(int dir, int limit, size_t len, Flow& flow)
+{
+    Direction& d = directions[dir];
+    Lock l(d.cs);
+
+    refill(d, limit);
+
+    // Without a share of their own, favorites are just like everybody else
+    int cls = (flow.getClass() == CLASS_FAVORITE && d.classes[CLASS_FAVORITE].rate > 0) ? CLASS_FAVORITE : CLASS_NORMAL;
+    Bucket& b = d.classes[cls];
+
+    if(flow.epoch[dir] != d.epoch) {
+        flow.epoch[dir] = d.epoch;
+        b.seen++;
+    }
+
+    double available = max(b.tokens, 0.) + d.spare;
+    if(available < 1) {
+        return 0;
+    }
+
+    // A connection that got more than its fair share lets the others go first, unless nobody else wants the tokens
+    double quantum = max(b.burst, MIN_BURST) / 4;
+    double start = max(b.vtime, flow.finish[dir]);
+    if(start > b.vtime + quantum && b.tokens < b.burst) {
+        return 0;
+    }
+
+    size_t granted = (size_t)min((double)len, min(available, quantum));
+    if(granted == 0) {
+        return 0;
+    }
+
+    double fromClass = min(max(b.tokens, 0.), (double)granted);
+    b.tokens -= fromClass;
+    d.spare -= granted - fromClass;
+    flow.borrowed[dir] = granted - fromClass;
+
+    b.vtime += (double)granted / max(max(b.active, b.seen), 1u);
+    flow.finish[dir] = start + granted;
+    return granted;
+}
+
+void ThrottleManager::putTokens(int dir, size_t len, Flow& flow)
+{
+    if(len == 0)
+        return;
+
+    Direction& d = directions[dir];
+    Lock l(d.cs);
+
+    int cls = (flow.getClass() == CLASS_FAVORITE && d.classes[CLASS_FAVORITE].rate > 0) ? CLASS_FAVORITE : CLASS_NORMAL;
+    Bucket& b = d.classes[cls];
 
-    if(gotToken)
-    {
-        // write to socket
-        int sent = sock->write(buffer, len);
+    // What was borrowed is given back first, the rest was the class' own
+    double toSpare = min((double)len, flow.borrowed[dir]);
+    flow.borrowed[dir] = 0;
+    d.spare += toSpare;
+    b.tokens += len - toSpare;
 
-        Thread::yield(); // give a chance to other transfers get a token
-        return sent;
+    // Neither may save up more than refill() lets them
+    if(b.tokens > b.burst) {
+        d.spare += b.tokens - b.burst;
+        b.tokens = b.burst;
     }
+    d.spare = min(d.spare, d.spareBurst);
 
-    waitToken();
-    return 0;   // from BufferedSocket: -1 = failed, 0 = retry
+    b.vtime -= (double)len / max(max(b.active, b.seen), 1u);
+    flow.finish[dir] -= len;
 }
 
 SettingsManager::IntSetting ThrottleManager::getCurSetting(SettingsManager::IntSetting setting) {
@@ -154,65 +261,16 @@ void ThrottleManager::setSetting(SettingsManager::IntSetting setting, int value)
         ClientManager::getInstance()->infoUpdated();
 }
 
-bool ThrottleManager::getCurThrottling() {
-    Lock l(stateCS);
-    return activeWaiter != -1;
-}
-
-void ThrottleManager::waitToken() {
-    // no tokens, wait for them, so long as throttling still active
-    // avoid keeping stateCS lock on whole function
-    CriticalSection *curCS = 0;
-    {
-        Lock l(stateCS);
-        if (activeWaiter != -1)
-            curCS = &waitCS[activeWaiter];
-    }
-    // possible post-CS aW shifts: 0->1/1->0: lock lands in wrong place, will
-    // either fall through immediately or wait depending on whether in
-    // stateCS-protected transition elsewhere; 0/1-> -1: falls through. Both harmless.
-    if (curCS)
-        Lock l(*curCS);
-}
-
 ThrottleManager::~ThrottleManager(void)
 {
     shutdown();
     TimerManager::getInstance()->removeListener(this);
 }
 
-#ifdef _WIN32
-
 void ThrottleManager::shutdown() {
-    Lock l(stateCS);
-    if (activeWaiter != -1) {
-        waitCS[activeWaiter].unlock();
-        activeWaiter = -1;
-    }
+    // Nobody waits for tokens, everything just goes through unthrottled from now on
+    halt = true;
 }
-#else //*nix
-
-void ThrottleManager::shutdown()
-{
-    bool wait = false;
-    {
-        Lock l(stateCS);
-        if (activeWaiter != -1)
-        {
-            n_lock = activeWaiter;
-            activeWaiter = -1;
-            halt = 1;
-            wait = true;
-        }
-    }
-
-    // wait shutdown...
-    if (wait)
-    {
-        Lock l(shutdownCS);
-    }
-}
-#endif //*nix
 
 // TimerManagerListener
 void ThrottleManager::on(TimerManagerListener::Second, uint64_t /* aTick */) noexcept
@@ -222,65 +280,14 @@ void ThrottleManager::on(TimerManagerListener::Second, uint64_t /* aTick */) noe
         setSetting(SettingsManager::SLOTS, newSlots);
     }
 
-    {
-        Lock l(stateCS);
-
-#ifndef _WIN32 //*nix
-
-        if (halt == 1)
-        {
-            halt = -1;
-
-            // unlock shutdown and token wait
-            dcassert(n_lock == 0 || n_lock == 1);
-            waitCS[n_lock].unlock();
-            shutdownCS.unlock();
-
-            return;
-        }
-        else if (halt == -1)
-        {
-            return;
-        }
-#endif
-        if (activeWaiter == -1)
-        {
-            // This will create slight weirdness for the read/write calls between
-            // here and the first activeWaiter-toggle below.
-            waitCS[activeWaiter = 0].lock();
-
-#ifndef _WIN32 //*nix
-
-            // lock shutdown
-            shutdownCS.lock();
-#endif
+    for(int i = 0; i < 2; ++i) {
+        Direction& d = directions[i];
+        Lock l(d.cs);
+        for(int j = 0; j < CLASS_LAST; ++j) {
+            d.classes[j].active = d.classes[j].seen;
+            d.classes[j].seen = 0;
         }
-    }
-
-    int downLimit = getDownLimit();
-    int upLimit   = getUpLimit();
-
-    // readd tokens
-    {
-        Lock l(downCS);
-        downTokens = downLimit * 1024;
-    }
-
-    {
-        Lock l(upCS);
-        upTokens = upLimit * 1024;
-    }
-
-    // let existing events drain out (fairness).
-    // www.cse.wustl.edu/~schmidt/win32-cv-1.html documents various
-    // fairer strategies, but when only broadcasting, irrelevant
-    {
-        Lock l(stateCS);
-
-        dcassert(activeWaiter == 0 || activeWaiter == 1);
-        waitCS[1-activeWaiter].lock();
-        activeWaiter = 1-activeWaiter;
-        waitCS[1-activeWaiter].unlock();
+        d.epoch++;
     }
 }
 
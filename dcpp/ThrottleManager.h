@@ -28,22 +28,56 @@ namespace dcpp
 /**
  * Manager for throttling traffic flow.
  * Inspired by Token Bucket algorithm: http://en.wikipedia.org/wiki/Token_bucket
+ *
+ * The limit of each direction is split between two classes of connections,
+ * favorite users get the share set with THROTTLE_FAVORITE_SHARE. Buckets are
+ * refilled every millisecond; tokens a class can't use (its bucket is full)
+ * go to a spare pool the other class may borrow from. Within a class,
+ * connections take turns in the order of how much they've been given
+ * (start-time fair queuing).
  */
 class ThrottleManager :
     public Singleton<ThrottleManager>, private TimerManagerListener
 {
 public:
+    enum Class {
+        CLASS_NORMAL,
+        CLASS_FAVORITE,
+        CLASS_LAST
+    };
+
+    /** Throttling state of one connection */
+    class Flow {
+    public:
+        Flow() : cls(CLASS_NORMAL) { finish[0] = finish[1] = 0; epoch[0] = epoch[1] = 0; borrowed[0] = borrowed[1] = 0; }
+
+        GETSET(int, cls, Class);
+    private:
+        friend class ThrottleManager;
+        /** Virtual time at which what was granted so far is done, by direction */
+        double finish[2];
+        /** Last second the connection was counted as active in */
+        uint32_t epoch[2];
+        /** Part of the last grant that came from the spare pool, by direction */
+        double borrowed[2];
+    };
 
     /*
      * Throttles traffic and reads a packet from the network
+     * Returns -2 when there are no tokens; these calls never wait for them
      */
-    int read(Socket* sock, void* buffer, size_t len);
+    int read(Socket* sock, void* buffer, size_t len, Flow& flow);
 
     /*
      * Throttles traffic and writes a packet to the network
      * Handle this a little bit differently than downloads due to OpenSSL stupidity
      */
-    int write(Socket* sock, void* buffer, size_t& len);
+    int write(Socket* sock, void* buffer, size_t& len, Flow& flow);
+
+    /*
+     * Throttles traffic and sends a part of a file without reading it, see Socket::sendFile
+     */
+    int sendFile(Socket* sock, File& f, size_t& len, Flow& flow);
 
     static SettingsManager::IntSetting getCurSetting(SettingsManager::IntSetting setting);
 
@@ -54,39 +88,49 @@ public:
 
     void shutdown();
 private:
-    // stack up throttled read & write threads
-    CriticalSection stateCS;
-    CriticalSection waitCS[2];
-    long activeWaiter;
-
-#ifndef _WIN32 //*nix
-
-    // shutdown wait
-    CriticalSection shutdownCS;
-    long n_lock, halt;
-#endif
-    // download limiter
-    CriticalSection downCS;
-    int64_t         downTokens;
-
-    // upload limiter
-    CriticalSection upCS;
-    int64_t         upTokens;
+    enum { DOWN, UP };
+
+    struct Bucket {
+        Bucket() : tokens(0), rate(0), burst(0), vtime(0), active(0), seen(0) { }
+        double tokens;
+        /** Bytes per millisecond */
+        double rate;
+        double burst;
+        /** Bytes each active connection would have got if they had been served evenly */
+        double vtime;
+        /** Connections that asked for tokens during the last second */
+        uint32_t active;
+        uint32_t seen;
+    };
+
+    struct Direction {
+        Direction() : spare(0), spareBurst(0), last(0), epoch(1) { }
+        CriticalSection cs;
+        Bucket classes[CLASS_LAST];
+        /** Tokens that overflowed full class buckets */
+        double spare;
+        double spareBurst;
+        uint64_t last;
+        uint32_t epoch;
+    } directions[2];
+
+    volatile bool halt;
 
     friend class Singleton<ThrottleManager>;
 
-    ThrottleManager(void) : activeWaiter(-1), downTokens(0), upTokens(0)
+    ThrottleManager(void) : halt(false)
     {
-#ifndef _WIN32 //*nix
-        n_lock = halt = 0;
-#endif
+        directions[DOWN].last = directions[UP].last = GET_TICK();
         TimerManager::getInstance()->addListener(this);
     }
 
     ~ThrottleManager(void);
 
-    bool getCurThrottling();
-    void waitToken();
+    /** @return number of bytes that may be moved, 0 if the connection has to wait */
+    size_t getTokens(int dir, int limit, size_t len, Flow& flow);
+    /** Give back what was granted but not used to where it was taken from */
+    void putTokens(int dir, size_t len, Flow& flow);
+    void refill(Direction& d, int limit);
 
     // TimerManagerListener
     void on(TimerManagerListener::Second, uint64_t /* aTick */) noexcept;
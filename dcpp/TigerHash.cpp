@@ -44,6 +44,13 @@
 #define TIGER_ARCH64
 #endif
 
+// The multi-buffer kernel needs gathers and per-function target attributes
+#if (defined(__x86_64__) || defined(__amd64__)) && !defined(TIGER_BIG_ENDIAN) && \
+	(defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define TIGER_AVX2
+#include <immintrin.h>
+#endif
+
 namespace dcpp {
 
 using std::min;
@@ -265,6 +272,168 @@ uint8_t* TigerHash::finalize() {
 	return getResult();
 }
 
+void TigerHash::hashLeaves(const void* data, size_t leafSize, size_t count, uint8_t* out) {
+	const uint8_t* leaf = (const uint8_t*)data;
+#ifdef TIGER_AVX2
+	static const bool avx2 = __builtin_cpu_supports("avx2");
+	if(avx2) {
+		while(count >= 4) {
+			hashLeavesAVX2(leaf, leafSize, out);
+			leaf += 4 * leafSize;
+			out += 4 * BYTES;
+			count -= 4;
+		}
+	}
+#endif
+	uint8_t zero = 0;
+	for(; count > 0; --count) {
+		TigerHash h;
+		h.update(&zero, 1);
+		h.update(leaf, leafSize);
+		memcpy(out, h.finalize(), BYTES);
+		leaf += leafSize;
+		out += BYTES;
+	}
+}
+
+#ifdef TIGER_AVX2
+
+#define avx2_sbox(t, c, shift) \
+	_mm256_i64gather_epi64((const long long*)(t), _mm256_and_si256(_mm256_srli_epi64(c, shift), mask), 8)
+
+// b * mul for the three multipliers used by the passes
+#define avx2_mul(b, mul) \
+	((mul) == 5 ? _mm256_add_epi64(_mm256_slli_epi64(b, 2), b) : \
+	 (mul) == 7 ? _mm256_sub_epi64(_mm256_slli_epi64(b, 3), b) : \
+	 _mm256_add_epi64(_mm256_slli_epi64(b, 3), b))
+
+#define avx2_round(a,b,c,x,mul) \
+	c = _mm256_xor_si256(c, x); \
+	a = _mm256_sub_epi64(a, _mm256_xor_si256(_mm256_xor_si256(avx2_sbox(t1, c, 0*8), avx2_sbox(t2, c, 2*8)), \
+		_mm256_xor_si256(avx2_sbox(t3, c, 4*8), avx2_sbox(t4, c, 6*8)))); \
+	b = _mm256_add_epi64(b, _mm256_xor_si256(_mm256_xor_si256(avx2_sbox(t4, c, 1*8), avx2_sbox(t3, c, 3*8)), \
+		_mm256_xor_si256(avx2_sbox(t2, c, 5*8), avx2_sbox(t1, c, 7*8)))); \
+	b = avx2_mul(b, mul);
+
+#define avx2_pass(a,b,c,mul) \
+	avx2_round(a,b,c,x0,mul) \
+	avx2_round(b,c,a,x1,mul) \
+	avx2_round(c,a,b,x2,mul) \
+	avx2_round(a,b,c,x3,mul) \
+	avx2_round(b,c,a,x4,mul) \
+	avx2_round(c,a,b,x5,mul) \
+	avx2_round(a,b,c,x6,mul) \
+	avx2_round(b,c,a,x7,mul)
+
+#define avx2_not(x) _mm256_xor_si256(x, ones)
+
+#define avx2_key_schedule \
+	x0 = _mm256_sub_epi64(x0, _mm256_xor_si256(x7, _mm256_set1_epi64x(_ULL(0xA5A5A5A5A5A5A5A5)))); \
+	x1 = _mm256_xor_si256(x1, x0); \
+	x2 = _mm256_add_epi64(x2, x1); \
+	x3 = _mm256_sub_epi64(x3, _mm256_xor_si256(x2, _mm256_slli_epi64(avx2_not(x1), 19))); \
+	x4 = _mm256_xor_si256(x4, x3); \
+	x5 = _mm256_add_epi64(x5, x4); \
+	x6 = _mm256_sub_epi64(x6, _mm256_xor_si256(x5, _mm256_srli_epi64(avx2_not(x4), 23))); \
+	x7 = _mm256_xor_si256(x7, x6); \
+	x0 = _mm256_add_epi64(x0, x7); \
+	x1 = _mm256_sub_epi64(x1, _mm256_xor_si256(x0, _mm256_slli_epi64(avx2_not(x7), 19))); \
+	x2 = _mm256_xor_si256(x2, x1); \
+	x3 = _mm256_add_epi64(x3, x2); \
+	x4 = _mm256_sub_epi64(x4, _mm256_xor_si256(x3, _mm256_srli_epi64(avx2_not(x2), 23))); \
+	x5 = _mm256_xor_si256(x5, x4); \
+	x6 = _mm256_add_epi64(x6, x5); \
+	x7 = _mm256_sub_epi64(x7, _mm256_xor_si256(x6, _mm256_set1_epi64x(_ULL(0x0123456789ABCDEF))));
+
+/** Compresses one 64 byte block of four independent messages, block[lane] points to each lane's data */
+__attribute__((target("avx2"), always_inline))
+static inline void tigerCompressAVX2(const uint8_t* const block[4], __m256i& a, __m256i& b, __m256i& c, const uint64_t* table) {
+	const __m256i mask = _mm256_set1_epi64x(0xFF);
+	const __m256i ones = _mm256_set1_epi64x(-1);
+	__m256i x[8];
+	for(int i = 0; i < 8; ++i) {
+		uint64_t w[4];
+		for(int lane = 0; lane < 4; ++lane)
+			memcpy(&w[lane], block[lane] + i * sizeof(uint64_t), sizeof(uint64_t));
+		x[i] = _mm256_set_epi64x(w[3], w[2], w[1], w[0]);
+	}
+	__m256i x0 = x[0], x1 = x[1], x2 = x[2], x3 = x[3], x4 = x[4], x5 = x[5], x6 = x[6], x7 = x[7];
+	const __m256i aa = a, bb = b, cc = c;
+
+	avx2_pass(a,b,c,5)
+	avx2_key_schedule
+	avx2_pass(c,a,b,7)
+	avx2_key_schedule
+	avx2_pass(b,c,a,9)
+
+	a = _mm256_xor_si256(a, aa);
+	b = _mm256_sub_epi64(b, bb);
+	c = _mm256_add_epi64(c, cc);
+}
+
+__attribute__((target("avx2")))
+void TigerHash::hashLeavesAVX2(const uint8_t* leaf, size_t leafSize, uint8_t* out) {
+	__m256i a = _mm256_set1_epi64x(_ULL(0x0123456789ABCDEF));
+	__m256i b = _mm256_set1_epi64x(_ULL(0xFEDCBA9876543210));
+	__m256i c = _mm256_set1_epi64x(_ULL(0xF096A5B4C3B2E187));
+
+	// Each lane hashes the message 0x00 | leaf, so block k starts at leaf + 64 * k - 1
+	const size_t msgSize = leafSize + 1;
+	const size_t fullBlocks = msgSize / BLOCK_SIZE;
+	const uint8_t* block[4];
+	uint8_t first[4][BLOCK_SIZE];
+
+	for(size_t k = 0; k < fullBlocks; ++k) {
+		for(int lane = 0; lane < 4; ++lane) {
+			const uint8_t* l = leaf + lane * leafSize;
+			if(k == 0) {
+				first[lane][0] = 0;
+				memcpy(first[lane] + 1, l, BLOCK_SIZE - 1);
+				block[lane] = first[lane];
+			} else {
+				block[lane] = l + k * BLOCK_SIZE - 1;
+			}
+		}
+		tigerCompressAVX2(block, a, b, c, table);
+	}
+
+	// Padding is the same as in finalize(), all lanes have the same length
+	const size_t rest = msgSize - fullBlocks * BLOCK_SIZE;
+	const size_t tailBlocks = (rest + 1 > BLOCK_SIZE - sizeof(uint64_t)) ? 2 : 1;
+	uint8_t tail[4][2 * BLOCK_SIZE];
+	for(int lane = 0; lane < 4; ++lane) {
+		uint8_t* t = tail[lane];
+		memset(t, 0, sizeof(tail[lane]));
+		if(rest > 0) {
+			if(fullBlocks == 0) {
+				t[0] = 0;
+				memcpy(t + 1, leaf + lane * leafSize, rest - 1);
+			} else {
+				memcpy(t, leaf + lane * leafSize + fullBlocks * BLOCK_SIZE - 1, rest);
+			}
+		}
+		t[rest] = 0x01;
+		uint64_t bits = (uint64_t)msgSize << 3;
+		memcpy(t + tailBlocks * BLOCK_SIZE - sizeof(uint64_t), &bits, sizeof(bits));
+	}
+	for(size_t k = 0; k < tailBlocks; ++k) {
+		for(int lane = 0; lane < 4; ++lane)
+			block[lane] = tail[lane] + k * BLOCK_SIZE;
+		tigerCompressAVX2(block, a, b, c, table);
+	}
+
+	uint64_t res[3][4];
+	_mm256_storeu_si256((__m256i*)res[0], a);
+	_mm256_storeu_si256((__m256i*)res[1], b);
+	_mm256_storeu_si256((__m256i*)res[2], c);
+	for(int lane = 0; lane < 4; ++lane) {
+		for(int i = 0; i < 3; ++i)
+			memcpy(out + lane * BYTES + i * sizeof(uint64_t), &res[i][lane], sizeof(uint64_t));
+	}
+}
+
+#endif // TIGER_AVX2
+
 uint64_t TigerHash::table[4*256] = {
 	_ULL(0x02AAB17CF7E90C5E)   /*    0 */,    _ULL(0xAC424B03E243A8EC)   /*    1 */,
 		_ULL(0x72CD5BE30DD5FCD3)   /*    2 */,    _ULL(0x6D019B93F6F97F3A)   /*    3 */,
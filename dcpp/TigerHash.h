@@ -55,6 +55,13 @@ public:
 	uint8_t* finalize();
 
 	uint8_t* getResult() { return (uint8_t*) res; }
+
+	/**
+	 * Calculates the Tiger hash of 0x00 | leaf for count consecutive leaves of
+	 * leafSize bytes each (the leaf hash of a Tiger tree), writing count hashes
+	 * to out. Uses the multi-buffer AVX2 kernel when the CPU supports it.
+	 */
+	static void hashLeaves(const void* data, size_t leafSize, size_t count, uint8_t* out);
 private:
 	enum { BLOCK_SIZE = 512/8 };
 	/** 512 bit blocks for the compress function */
@@ -67,6 +74,8 @@ private:
 	static uint64_t table[];
 
 	void tigerCompress(const uint64_t* data, uint64_t state[3]);
+	/** Hashes four leaves at once, one per AVX2 lane */
+	static void hashLeavesAVX2(const uint8_t* leaf, size_t leafSize, uint8_t* out);
 };
 
 } // namespace dcpp
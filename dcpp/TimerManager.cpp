@@ -41,7 +41,7 @@ TimerManager::TimerManager() {
 }
 
 TimerManager::~TimerManager() {
-    dcassert(listeners.empty());
+    dcassert(listeners.load()->empty());
 }
 
 void TimerManager::shutdown() {
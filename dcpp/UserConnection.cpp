@@ -20,6 +20,7 @@
 
 #include "UserConnection.h"
 #include "ClientManager.h"
+#include "FavoriteManager.h"
 
 #include "StringTokenizer.h"
 #include "AdcCommand.h"
@@ -170,6 +171,14 @@ void UserConnection::accept(const Socket& aServer) throw(SocketException, Thread
     socket->accept(aServer, isSet(FLAG_SECURE), BOOLSETTING(ALLOW_UNTRUSTED_CLIENTS));
 }
 
+void UserConnection::setUser(const UserPtr& aUser) {
+    user = aUser;
+    if(socket && user) {
+        socket->setThrottleClass(FavoriteManager::getInstance()->isFavoriteUser(user) ?
+            ThrottleManager::CLASS_FAVORITE : ThrottleManager::CLASS_NORMAL);
+    }
+}
+
 void UserConnection::inf(bool withToken) {
     AdcCommand c(AdcCommand::CMD_INF);
     c.addParam("ID", ClientManager::getInstance()->getMyCID().toBase32());
@@ -192,7 +201,7 @@ void UserConnection::supports(const StringList& feat) {
 }
 
 void UserConnection::handle(AdcCommand::STA t, const AdcCommand& c) {
-    if(c.getParameters().size() >= 2) {
+    if(c.getParamCount() >= 2) {
         const string& code = c.getParam(0);
         if(!code.empty() && code[0] - '0' == AdcCommand::SEV_FATAL) {
             fire(UserConnectionListener::ProtocolError(), this, c.getParam(1));
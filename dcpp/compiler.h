@@ -64,3 +64,9 @@
 #ifndef _REENTRANT
 # define _REENTRANT 1
 #endif
+
+#ifdef _MSC_VER
+#define DCPP_THREAD_LOCAL __declspec(thread)
+#else
+#define DCPP_THREAD_LOCAL __thread
+#endif
@@ -505,7 +505,7 @@ namespace dht
     // status message
     void DHT::handle(AdcCommand::STA, const Node::Ptr& node, AdcCommand& c) throw()
     {
-        if(c.getParameters().size() < 3)
+        if(c.getParamCount() < 3)
             return;
 
         string fromIP = node->getIdentity().getIp();
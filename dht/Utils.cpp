@@ -67,7 +67,7 @@ namespace dht
     bool Utils::checkFlood(const string& ip, const AdcCommand& cmd)
     {
         // ignore empty commands
-        if(cmd.getParameters().empty())
+        if(cmd.getParamCount() == 0)
             return false;
 
         // there maximum allowed request packets from one IP per minute
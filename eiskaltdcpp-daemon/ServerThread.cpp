@@ -457,6 +457,7 @@ void ServerThread::on(SearchManagerListener::SR, const SearchResultPtr& result)
     if (!result) {
         return;
     }
+    Lock l(searchcs);
     for (const auto& client : clientsMap) {
         if (clientsMap[client.first].curclient && client.first == result->getHubURL()) {
             clientsMap[client.first].cursearchresult.push_back(result);
@@ -707,6 +708,7 @@ bool ServerThread::sendSearchonHubs(const string& search, const int& searchtype,
 }
 
 void ServerThread::returnSearchResults(vector<StringMap>& resultarray, const string& huburl) {
+    Lock l(searchcs);
     for (const auto& client : clientsMap) {
         if (!huburl.empty() && client.first != huburl)
             continue;
@@ -719,6 +721,7 @@ void ServerThread::returnSearchResults(vector<StringMap>& resultarray, const str
 }
 
 bool ServerThread::clearSearchResults(const string& huburl) {
+    Lock l(searchcs);
     for (const auto& client : clientsMap) {
         if (!huburl.empty() && client.first != huburl)
             continue;
@@ -1326,10 +1329,11 @@ void ServerThread::lsDirInList(DirectoryListing::Directory *dir, unordered_map<s
         map["Size"] = Util::toString(file->getSize());
         map["Size preformatted"] = Util::formatBytes(file->getSize());
         map["TTH"] = file->getTTH().toBase32();
-        map["Bitrate"] = file->mediaInfo.bitrate ? (Util::toString(file->mediaInfo.bitrate)) : Util::emptyString;
-        map["Resolution"] = !file->mediaInfo.video_info.empty() ? file->mediaInfo.resolution : Util::emptyString;
-        map["Video"] = file->mediaInfo.video_info;
-        map["Audio"] = file->mediaInfo.audio_info;
+        const MediaInfo& mi = file->getMediaInfo();
+        map["Bitrate"] = mi.bitrate ? (Util::toString(mi.bitrate)) : Util::emptyString;
+        map["Resolution"] = !mi.video_info.empty() ? mi.resolution : Util::emptyString;
+        map["Video"] = mi.video_info;
+        map["Audio"] = mi.audio_info;
         map["Downloaded"] = Util::toString(file->getHit());
         map["Shared"] = Util::formatTime("%Y-%m-%d %H:%M", file->getTS());
         ret[file->getName()] = map;
@@ -154,6 +154,8 @@ private:
 
     dcpp::Socket sock;
     CriticalSection shutcs;
+    /** Search results come in on several threads at once */
+    CriticalSection searchcs;
     static const unsigned int maxLines = 50;
 
     void getQueueParams(QueueItem* item, StringMap& params);
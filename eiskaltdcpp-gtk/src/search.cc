@@ -1963,8 +1963,8 @@ void Search::on(SearchManagerListener::SR, const SearchResultPtr& result) noexce
     {
         if (result->getType() != SearchResult::TYPE_FILE || TTHValue(searchlist[0]) != result->getTTH())
         {
-            ++droppedResult;
-            F2 *func = new F2(this, &Search::setStatus_gui, "statusbar3", _("Filtered: ") + Util::toString(droppedResult));
+            int dropped = ++droppedResult;
+            F2 *func = new F2(this, &Search::setStatus_gui, "statusbar3", _("Filtered: ") + Util::toString(dropped));
             WulforManager::get()->dispatchGuiFunc(func);
             return;
         }
@@ -1976,8 +1976,8 @@ void Search::on(SearchManagerListener::SR, const SearchResultPtr& result) noexce
             if ((*i->begin() != '-' && Util::findSubString(result->getFile(), *i) == (string::size_type)-1) ||
                 (*i->begin() == '-' && i->size() != 1 && Util::findSubString(result->getFile(), i->substr(1)) != (string::size_type)-1))
             {
-                ++droppedResult;
-                F2 *func = new F2(this, &Search::setStatus_gui, "statusbar3", _("Dropped: ") + Util::toString(droppedResult));
+                int dropped = ++droppedResult;
+                F2 *func = new F2(this, &Search::setStatus_gui, "statusbar3", _("Dropped: ") + Util::toString(dropped));
                 WulforManager::get()->dispatchGuiFunc(func);
                 return;
             }
@@ -21,6 +21,8 @@
 
 #pragma once
 
+#include <atomic>
+
 #include <dcpp/stdinc.h>
 #include <dcpp/ClientManager.h>
 #include <dcpp/SearchManager.h>
@@ -140,7 +142,7 @@ class Search:
         GtkWidget *searchEntry;
         dcpp::TStringList searchlist;
         static GtkTreeModel *searchEntriesModel;
-        int droppedResult;
+        std::atomic<int> droppedResult;
         int searchHits;
         bool isHash;
         bool onlyFree;
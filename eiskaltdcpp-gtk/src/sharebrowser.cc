@@ -364,10 +364,10 @@ void ShareBrowser::updateFiles_gui(DirectoryListing::Directory *dir)
             fileView.col("Size Order"), size,
             fileView.col("DL File"), (gpointer)(*it_file),
             fileView.col(_("TTH")), (*it_file)->getTTH().toBase32().c_str(),
-            fileView.col(_("Bitrate")), ((*it_file)->mediaInfo.bitrate) ? (Util::toString((*it_file)->mediaInfo.bitrate)).c_str() : Util::emptyString.c_str(),
-            fileView.col(_("Resolution")), !(*it_file)->mediaInfo.video_info.empty() ? (*it_file)->mediaInfo.resolution.c_str() : Util::emptyString.c_str(),
-            fileView.col(_("Video")), (*it_file)->mediaInfo.video_info.c_str(),
-            fileView.col(_("Audio")), (*it_file)->mediaInfo.audio_info.c_str(),
+            fileView.col(_("Bitrate")), ((*it_file)->getMediaInfo().bitrate) ? (Util::toString((*it_file)->getMediaInfo().bitrate)).c_str() : Util::emptyString.c_str(),
+            fileView.col(_("Resolution")), !(*it_file)->getMediaInfo().video_info.empty() ? (*it_file)->getMediaInfo().resolution.c_str() : Util::emptyString.c_str(),
+            fileView.col(_("Video")), (*it_file)->getMediaInfo().video_info.c_str(),
+            fileView.col(_("Audio")), (*it_file)->getMediaInfo().audio_info.c_str(),
             fileView.col(_("Downloaded")), (Util::toString((*it_file)->getHit())).c_str(),
             fileView.col(_("Shared")), (Util::formatTime("%Y-%m-%d %H:%M", (*it_file)->getTS())).c_str(),
             fileView.col("Shared Order"), (*it_file)->getTS(),
@@ -184,17 +184,17 @@ QVariant FileBrowserModel::data(const QModelIndex &index, int role) const
             if (item->file){
                 DirectoryListing::File *f = item->file;
                 
-                if (!f->mediaInfo.video_info.empty() || !f->mediaInfo.audio_info.empty()){
-                    MediaInfo &mi = f->mediaInfo;
+                const MediaInfo &mi = f->getMediaInfo();
 
+                if (!mi.video_info.empty() || !mi.audio_info.empty()){
                     tooltip = tr("<b>Media Info:</b><br/>");
-                    if (!f->mediaInfo.video_info.empty())
+                    if (!mi.video_info.empty())
                         tooltip += tr("&nbsp;&nbsp;<b>Video:</b> %1<br/>").arg(_q(mi.video_info));
-                    if (!f->mediaInfo.audio_info.empty())
+                    if (!mi.audio_info.empty())
                         tooltip += tr("&nbsp;&nbsp;<b>Audio:</b> %1<br/>").arg(_q(mi.audio_info));
-                    if (f->mediaInfo.bitrate > 0)
+                    if (mi.bitrate > 0)
                         tooltip += tr("&nbsp;&nbsp;<b>Bitrate:</b> %1<br/>").arg(mi.bitrate);
-                    if (!f->mediaInfo.resolution.empty())
+                    if (!mi.resolution.empty())
                         tooltip += tr("&nbsp;&nbsp;<b>Resolution:</b> %1<br/><br/>").arg(_q(mi.resolution));
                 }
             }
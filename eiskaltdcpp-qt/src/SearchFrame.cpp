@@ -26,6 +26,7 @@
 #include <QCompleter>
 #include <QListWidget>
 #include <QListWidgetItem>
+#include <atomic>
 
 #include "SearchFrame.h"
 #include "MainWindow.h"
@@ -60,7 +61,7 @@ public:
 
     TStringList currentSearch;
 
-    qulonglong dropped;
+    std::atomic<qulonglong> dropped;
     qulonglong results;
     SearchFrame::AlreadySharedAction filterShared;
     bool withFreeSlots;
@@ -1577,7 +1578,7 @@ void SearchFrame::slotTimer(){
         if (!frame_PROGRESS->isVisible())
             frame_PROGRESS->show();
 
-        QString text = QString(tr("Found: <b>%1</b>  Dropped: <b>%2</b>")).arg(d->results).arg(d->dropped);
+        QString text = QString(tr("Found: <b>%1</b>  Dropped: <b>%2</b>")).arg(d->results).arg(d->dropped.load());
 
         status->setText(text);
     }
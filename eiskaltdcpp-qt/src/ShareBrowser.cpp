@@ -606,10 +606,10 @@ void ShareBrowser::changeRoot(dcpp::DirectoryListing::Directory *root){
              << WulforUtil::formatBytes(size)
              << size
              << _q(file->getTTH().toBase32())
-             << file->mediaInfo.bitrate
-             << _q(file->mediaInfo.resolution)
-             << _q(file->mediaInfo.video_info)
-             << _q(file->mediaInfo.audio_info)
+             << file->getMediaInfo().bitrate
+             << _q(file->getMediaInfo().resolution)
+             << _q(file->getMediaInfo().video_info)
+             << _q(file->getMediaInfo().audio_info)
              << (quint64)file->getHit()
              << QDateTime::fromTime_t(file->getTS()).toString("yyyy-MM-dd hh:mm");
 
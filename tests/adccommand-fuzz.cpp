@@ -0,0 +1,225 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Differential fuzzing of AdcCommand::parse() against the old parser in
+ * adccommand-ref.h. Random, mostly well formed lines go through both; the
+ * same lines have to be rejected, and for the others the type, command,
+ * SIDs, parameters, named lookups, flags and toString() have to match.
+ * One AdcCommand is parsed into over and over, as CommandHandler does, and
+ * the accessors are called in random order so that both the packed and the
+ * unpacked parameters are compared.
+ *
+ * Usage: adccommand-fuzz [lines] [seed]
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/AdcCommand.h"
+#include "adccommand-ref.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+using namespace dcpp;
+
+namespace {
+
+uint32_t seed = 1;
+int failures = 0;
+
+uint32_t rnd(uint32_t aMax) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % aMax;
+}
+
+const char* const names[] = { "NI", "SS", "I4", "SU", "TO", "TR", "AN", "ID" };
+const size_t NAMES = sizeof(names) / sizeof(names[0]);
+
+/** Parameter text, with valid and broken escapes now and then */
+void addText(string& aLine, size_t aLen, bool nmdc) {
+    static const char chars[] = "ABCDNIS01x";
+    for(size_t i = 0; i < aLen; ++i) {
+        switch(rnd(16)) {
+        case 0: aLine += "\\s"; break;
+        case 1: aLine += "\\n"; break;
+        case 2: aLine += "\\\\"; break;
+        case 3: aLine += (nmdc || rnd(8) == 0) ? "\\ " : "\\s"; break;
+        case 4: if(rnd(16) == 0) aLine += "\\x"; break;
+        case 5: aLine += '\n'; break;
+        default: aLine += chars[rnd(sizeof(chars) - 1)];
+        }
+    }
+}
+
+/** A SID, now and then a wrong one */
+void addSid(string& aLine) {
+    size_t len = rnd(10) == 0 ? rnd(6) : 4;
+    if(rnd(10) == 0 && len >= 2) {
+        aLine += "\\s";
+        len -= 1;
+    }
+    for(size_t i = 0; i < len; ++i)
+        aLine += (char)('A' + rnd(26));
+}
+
+string randomLine(bool& nmdc) {
+    string line;
+    nmdc = rnd(8) == 0;
+
+    // Now and then something that isn't a command at all
+    if(rnd(32) == 0) {
+        size_t len = rnd(24);
+        for(size_t i = 0; i < len; ++i)
+            line += (char)(rnd(4) == 0 ? ' ' : rnd(8) == 0 ? '\\' : 32 + rnd(96));
+        return line;
+    }
+
+    char type;
+    if(nmdc) {
+        line = "$ADC";
+        type = AdcCommand::TYPE_CLIENT;
+    } else {
+        static const char types[] = "BCDEFIHUBBDX";
+        type = types[rnd(sizeof(types) - 1)];
+        line += type;
+    }
+    static const char* const cmds[] = { "INF", "RES", "SCH", "GET", "STA", "SUP", "MSG" };
+    line += cmds[rnd(sizeof(cmds) / sizeof(cmds[0]))];
+
+    if(type == 'B' || type == 'D' || type == 'E' || type == 'F') {
+        line += ' ';
+        addSid(line);
+    }
+    if(type == 'D' || type == 'E') {
+        line += ' ';
+        addSid(line);
+    }
+    if(type == 'F') {
+        line += ' ';
+        size_t len = rnd(8) == 0 ? rnd(12) : 5 * (1 + rnd(3));
+        for(size_t i = 0; i < len; ++i)
+            line += (i % 5 == 0) ? (rnd(2) ? '+' : '-') : (char)('A' + rnd(26));
+    }
+
+    size_t params = rnd(12);
+    for(size_t i = 0; i < params; ++i) {
+        line += rnd(16) == 0 ? "  " : " ";
+        if(rnd(4) != 0)
+            line += names[rnd(NAMES)];
+        if(rnd(8) == 0)
+            line += '1';
+        else
+            addText(line, rnd(10), nmdc);
+    }
+    if(rnd(16) == 0)
+        line += ' ';
+    if(rnd(64) == 0)
+        line += '\\';
+    return line;
+}
+
+void fail(const string& aLine, const string& aWhat) {
+    if(failures++ < 20)
+        printf("FAIL: %s on \"%s\"\n", aWhat.c_str(), AdcCommand::escape(aLine, false).c_str());
+}
+
+void compareLookups(const AdcCommand& c, const RefAdcCommand& ref, const string& aLine) {
+    for(size_t i = 0; i < NAMES; ++i) {
+        size_t start = rnd(3);
+        string got, expected;
+        bool found = c.getParam(names[i], start, got);
+        if(found != ref.getParam(names[i], start, expected) || got != (found ? expected : string()))
+            fail(aLine, string("getParam ") + names[i]);
+        if(c.hasFlag(names[i], start) != ref.hasFlag(names[i], start))
+            fail(aLine, string("hasFlag ") + names[i]);
+    }
+}
+
+void compare(AdcCommand& c, const RefAdcCommand& ref, const string& aLine, bool nmdc) {
+    if(c.getType() != ref.type || c.getCommand() != ref.cmdInt)
+        fail(aLine, "type or command");
+    if((ref.hasFrom() || ref.type == AdcCommand::TYPE_INFO) && c.getFrom() != ref.from)
+        fail(aLine, "from");
+    if(ref.hasTo() && c.getTo() != ref.to)
+        fail(aLine, "to");
+
+    // Still packed
+    if(rnd(2))
+        compareLookups(c, ref, aLine);
+    if(c.getParamCount() != ref.parameters.size())
+        fail(aLine, "getParamCount");
+    for(size_t i = 0; i < ref.parameters.size(); ++i) {
+        string p;
+        c.getParam(i, p);
+        if(p != ref.parameters[i])
+            fail(aLine, "getParam n");
+    }
+
+    // Unpacked
+    if(c.getParameters() != ref.parameters)
+        fail(aLine, "getParameters");
+    compareLookups(c, ref, aLine);
+    for(size_t i = 0; i <= ref.parameters.size(); ++i) {
+        if(c.getParam(i) != (i < ref.parameters.size() ? ref.parameters[i] : Util::emptyString))
+            fail(aLine, "getParam n, unpacked");
+    }
+
+    AdcCommand out(ref.cmdInt, ref.to, ref.type);
+    for(auto i = ref.parameters.begin(); i != ref.parameters.end(); ++i)
+        out.addParam(*i);
+    if(c.toString(0x41424344, nmdc) != out.toString(0x41424344, nmdc))
+        fail(aLine, "toString");
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    long lines = argc > 1 ? atol(argv[1]) : 200000;
+    seed = argc > 2 ? (uint32_t)atoi(argv[2]) : 1;
+
+    AdcCommand c(0);
+    RefAdcCommand ref;
+    long parsed = 0;
+
+    for(long n = 0; n < lines; ++n) {
+        bool nmdc;
+        string line = randomLine(nmdc);
+
+        string error, refError;
+        try {
+            c.parse(line, nmdc);
+        } catch(const ParseException& e) {
+            error = e.getError();
+        }
+        try {
+            ref.parse(line, nmdc);
+        } catch(const ParseException& e) {
+            refError = e.getError();
+        }
+
+        if(error != refError) {
+            fail(line, "error \"" + error + "\", expected \"" + refError + "\"");
+            continue;
+        }
+        if(error.empty()) {
+            compare(c, ref, line, nmdc);
+            parsed++;
+        }
+    }
+
+    printf("%ld lines, %ld parsed, %d mismatches\n", lines, parsed, failures);
+    return failures == 0 ? 0 : 1;
+}
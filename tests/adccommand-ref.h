@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2001-2012 Jacek Sieka, arnetheduck on gmail point com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#pragma once
+
+#include "dcpp/AdcCommand.h"
+
+namespace dcpp {
+
+/**
+ * AdcCommand::parse() as it was before the parameters were kept as offsets
+ * into the line: every parameter is unescaped into its own string right away.
+ * The reference for adccommand-fuzz and adccommand-bench.
+ */
+class RefAdcCommand {
+public:
+    RefAdcCommand() : cmdInt(0), from(0), to(0), type(0) { }
+
+    void parse(const string& aLine, bool nmdc = false) {
+        string::size_type i = 5;
+
+        parameters.clear();
+        from = to = 0;
+
+        if(nmdc) {
+            // "$ADCxxx ..."
+            if(aLine.length() < 7)
+                throw ParseException("Too short");
+            type = AdcCommand::TYPE_CLIENT;
+            cmd[0] = aLine[4];
+            cmd[1] = aLine[5];
+            cmd[2] = aLine[6];
+            cmd[3] = 0;
+            i += 3;
+        } else {
+            // "yxxx ..."
+            if(aLine.length() < 4)
+                throw ParseException("Too short");
+            type = aLine[0];
+            cmd[0] = aLine[1];
+            cmd[1] = aLine[2];
+            cmd[2] = aLine[3];
+            cmd[3] = 0;
+        }
+
+        if(type != AdcCommand::TYPE_BROADCAST && type != AdcCommand::TYPE_CLIENT && type != AdcCommand::TYPE_DIRECT &&
+            type != AdcCommand::TYPE_ECHO && type != AdcCommand::TYPE_FEATURE && type != AdcCommand::TYPE_INFO &&
+            type != AdcCommand::TYPE_HUB && type != AdcCommand::TYPE_UDP)
+        {
+            throw ParseException("Invalid type");
+        }
+
+        if(type == AdcCommand::TYPE_INFO) {
+            from = AdcCommand::HUB_SID;
+        }
+
+        string::size_type len = aLine.length();
+        const char* buf = aLine.c_str();
+        string cur;
+        cur.reserve(128);
+
+        bool toSet = false;
+        bool featureSet = false;
+        bool fromSet = nmdc; // $ADCxxx never have a from CID...
+
+        while(i < len) {
+            switch(buf[i]) {
+            case '\\':
+                ++i;
+                if(i == len)
+                    throw ParseException("Escape at eol");
+                if(buf[i] == 's')
+                    cur += ' ';
+                else if(buf[i] == 'n')
+                    cur += '\n';
+                else if(buf[i] == '\\')
+                    cur += '\\';
+                else if(buf[i] == ' ' && nmdc)  // $ADCGET escaping, leftover from old specs
+                    cur += ' ';
+                else
+                    throw ParseException("Unknown escape");
+                break;
+            case ' ':
+                // New parameter...
+                addParam(cur, fromSet, toSet, featureSet);
+                cur.clear();
+                break;
+            default:
+                cur += buf[i];
+            }
+            ++i;
+        }
+        if(!cur.empty()) {
+            addParam(cur, fromSet, toSet, featureSet);
+        }
+
+        if(hasFrom() && !fromSet) {
+            throw ParseException("Missing from_sid");
+        }
+
+        if(type == AdcCommand::TYPE_FEATURE && !featureSet) {
+            throw ParseException("Missing feature");
+        }
+
+        if(hasTo() && !toSet) {
+            throw ParseException("Missing to_sid");
+        }
+    }
+
+    bool getParam(const char* name, size_t start, string& ret) const {
+        for(auto i = start; i < parameters.size(); ++i) {
+            if(parameters[i].size() >= 2 && parameters[i][0] == name[0] && parameters[i][1] == name[1]) {
+                ret = parameters[i].substr(2);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool hasFlag(const char* name, size_t start) const {
+        for(auto i = start; i < parameters.size(); ++i) {
+            if(parameters[i].size() == 3 && parameters[i][0] == name[0] && parameters[i][1] == name[1] &&
+                parameters[i][2] == '1')
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool hasFrom() const {
+        return type == AdcCommand::TYPE_BROADCAST || type == AdcCommand::TYPE_DIRECT ||
+            type == AdcCommand::TYPE_ECHO || type == AdcCommand::TYPE_FEATURE;
+    }
+    bool hasTo() const { return type == AdcCommand::TYPE_DIRECT || type == AdcCommand::TYPE_ECHO; }
+
+    StringList parameters;
+    union {
+        char cmdChar[4];
+        uint8_t cmd[4];
+        uint32_t cmdInt;
+    };
+    uint32_t from;
+    uint32_t to;
+    char type;
+
+private:
+    void addParam(const string& cur, bool& fromSet, bool& toSet, bool& featureSet) {
+        if(hasFrom() && !fromSet) {
+            if(cur.length() != 4) {
+                throw ParseException("Invalid SID length");
+            }
+            from = AdcCommand::toSID(cur);
+            fromSet = true;
+        } else if(hasTo() && !toSet) {
+            if(cur.length() != 4) {
+                throw ParseException("Invalid SID length");
+            }
+            to = AdcCommand::toSID(cur);
+            toSet = true;
+        } else if(type == AdcCommand::TYPE_FEATURE && !featureSet) {
+            if(cur.length() % 5 != 0) {
+                throw ParseException("Invalid feature length");
+            }
+            // Skip...
+            featureSet = true;
+        } else {
+            parameters.push_back(cur);
+        }
+    }
+};
+
+} // namespace dcpp
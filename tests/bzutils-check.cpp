@@ -0,0 +1,402 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Checks of BZFilter, BZBlocks and UnBZFilter against libbz2. What they
+ * compress has to come out of libbz2 the same, and UnBZFilter has to read
+ * what libbz2 makes, in pieces of random size. Also:
+ * - several streams one after another, some of them empty;
+ * - no input at all;
+ * - a block signature inside the compressed bits of a block, which is made
+ *   up to be there, and signatures in the data and after the last stream;
+ * - truncated and corrupted streams, which have to fail where libbz2 does;
+ * - a stream of zeros that expands a lot, where memory has to stay bounded.
+ *
+ * Usage: bzutils-check [seed]
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/BZUtils.h"
+#include "dcpp/Exception.h"
+#include "dcpp/FilteredFile.h"
+#include "dcpp/Streams.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace dcpp;
+
+namespace {
+
+uint32_t seed = 1;
+int failures = 0;
+
+uint32_t rnd(uint32_t aMax) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % aMax;
+}
+
+void check(bool aOk, const string& aWhat) {
+    if(!aOk) {
+        failures++;
+        printf("FAIL: %s\n", aWhat.c_str());
+    }
+}
+
+enum Kind { RANDOM, TEXT, RUNS, KINDS };
+const char* const kindNames[] = { "random", "text", "runs" };
+
+string makeData(Kind aKind, size_t aSize) {
+    string s;
+    s.reserve(aSize);
+    while(s.size() < aSize) {
+        switch(aKind) {
+        case RANDOM: s += (char)rnd(256); break;
+        case TEXT: {
+            static const char* const words[] = { "<File Name=\"", "\" Size=\"", "\" TTH=\"", "\"/>\n", "music", "01 - ", ".flac", "a", "e", "x" };
+            s += words[rnd(10)];
+            if(rnd(4) == 0)
+                s += Util::toString(rnd(100000));
+            break;
+        }
+        case RUNS: s.append(1 + rnd(rnd(8) == 0 ? 2000 : 6), (char)rnd(4)); break;
+        default: break;
+        }
+    }
+    s.resize(aSize);
+    return s;
+}
+
+string libCompress(const string& aData, int aLevel) {
+    unsigned int len = (unsigned int)(aData.size() + aData.size() / 100 + 600);
+    string out(len, 0);
+    int ret = BZ2_bzBuffToBuffCompress(&out[0], &len, const_cast<char*>(aData.data()), (unsigned int)aData.size(), aLevel, 0, 0);
+    check(ret == BZ_OK, "libbz2 compresses");
+    out.resize(len);
+    return out;
+}
+
+/** Streams one after another until there's something that doesn't start like one, as bzip2 does */
+bool libDecompress(const string& aIn, string& aOut) {
+    aOut.clear();
+    size_t pos = 0;
+    do {
+        bz_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if(BZ2_bzDecompressInit(&zs, 0, 0) != BZ_OK)
+            return false;
+
+        zs.next_in = const_cast<char*>(aIn.data()) + pos;
+        zs.avail_in = (unsigned int)(aIn.size() - pos);
+        int ret;
+        char buf[64 * 1024];
+        do {
+            zs.next_out = buf;
+            zs.avail_out = sizeof(buf);
+            ret = BZ2_bzDecompress(&zs);
+            aOut.append(buf, sizeof(buf) - zs.avail_out);
+        } while(ret == BZ_OK && (zs.avail_in > 0 || zs.avail_out == 0));
+
+        pos = aIn.size() - zs.avail_in;
+        BZ2_bzDecompressEnd(&zs);
+        if(ret != BZ_STREAM_END)
+            return false;
+    } while(aIn.size() - pos >= 4 && aIn.compare(pos, 3, "BZh") == 0);
+    return true;
+}
+
+/** Fed and read in pieces of random size */
+bool unbz(const string& aIn, string& aOut, size_t aMaxOut = string::npos) {
+    aOut.clear();
+    try {
+        UnBZFilter f;
+        size_t pos = 0;
+        for(;;) {
+            // Nothing left means the end to it
+            size_t insize = min((size_t)(1 + (rnd(4) == 0 ? rnd(16) : rnd(100000))), aIn.size() - pos);
+            char buf[70000];
+            size_t outsize = 1 + rnd(sizeof(buf) - 1);
+            bool more = f(aIn.data() + pos, insize, buf, outsize);
+            pos += insize;
+            aOut.append(buf, outsize);
+            if(!more || aOut.size() > aMaxOut)
+                break;
+        }
+        return pos == aIn.size();
+    } catch(const Exception&) {
+        return false;
+    }
+}
+
+string bz(const string& aData) {
+    string out;
+    StringOutputStream sos(out);
+    FilteredOutputStream<BZFilter, false> f(&sos);
+    for(size_t pos = 0; pos < aData.size(); ) {
+        size_t n = min((size_t)(1 + rnd(300000)), aData.size() - pos);
+        f.write(aData.data() + pos, n);
+        pos += n;
+    }
+    f.flush();
+    return out;
+}
+
+/** Made of up to three parts, compressed apart and put together */
+string bzBlocks(const string& aData) {
+    size_t a = rnd((uint32_t)aData.size() + 1), b = a + rnd((uint32_t)(aData.size() - a) + 1);
+    BZBlocks all, part;
+    all.compress(aData.data(), a);
+    part.compress(aData.data() + a, b - a);
+    all.append(part);
+    part.clear();
+    part.compress(aData.data() + b, aData.size() - b);
+    all.append(part);
+
+    string out;
+    StringOutputStream sos(out);
+    all.write(sos);
+    return out;
+}
+
+/** Both have to fail, or both have to give the data */
+void checkDecompress(const string& aIn, const string& aWhat) {
+    string expected, got;
+    bool ok = libDecompress(aIn, expected);
+    bool ours = unbz(aIn, got);
+    check(ok == ours, aWhat + (ok ? ": fails where libbz2 doesn't" : ": doesn't fail where libbz2 does"));
+    check(!ok || !ours || got == expected, aWhat + ": decompresses differently from libbz2");
+}
+
+void checkRoundTrips() {
+    static const size_t sizes[] = { 0, 1, 100, 50000, 899000, 2500000 };
+    for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        for(int k = 0; k < KINDS; ++k) {
+            string data = makeData((Kind)k, sizes[i]);
+            string what = string(kindNames[k]) + " " + Util::toString(sizes[i]);
+            string out;
+
+            check(libDecompress(bz(data), out) && out == data, what + ": BZFilter to libbz2");
+            check(libDecompress(bzBlocks(data), out) && out == data, what + ": BZBlocks to libbz2");
+            check(unbz(bz(data), out) && out == data, what + ": BZFilter to UnBZFilter");
+            check(unbz(libCompress(data, 1), out) && out == data, what + ": libbz2 -1 to UnBZFilter");
+            check(unbz(libCompress(data, 9), out) && out == data, what + ": libbz2 -9 to UnBZFilter");
+        }
+    }
+}
+
+void checkStreams() {
+    string a = makeData(TEXT, 300000), b = makeData(RANDOM, 1000000), c = makeData(RUNS, 50000);
+    string in = libCompress(a, 1) + bz(b) + libCompress(string(), 9) + bzBlocks(string()) + libCompress(c, 9);
+
+    string out;
+    check(unbz(in, out) && out == a + b + c, "streams one after another");
+    checkDecompress(in, "streams one after another");
+
+    // Signatures in the data, and in what comes after the last stream
+    string magic = "\x31\x41\x59\x26\x53\x59\x17\x72\x45\x38\x50\x90";
+    string data = a.substr(0, 1000) + magic + a.substr(1000, 1000) + magic;
+    check(unbz(libCompress(data, 9) + "garbage" + magic + magic, out) && out == data, "signatures in the data and after the end");
+
+    // Nothing at all, an empty stream, and not a stream
+    check(!unbz(string(), out), "no input at all");
+    check(unbz(libCompress(string(), 9), out) && out.empty(), "empty stream");
+    check(unbz(bz(string()), out) && out.empty(), "empty stream from BZFilter");
+    check(!unbz("BZh9 this isn't bzip2 at all", out), "not bzip2");
+}
+
+/** The stream CRC of bzip2: big endian CRC-32 */
+uint32_t crcUpdate(uint32_t aCrc, uint8_t aByte) {
+    static uint32_t table[256];
+    if(table[1] == 0) {
+        for(uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i << 24;
+            for(int j = 0; j < 8; ++j)
+                c = (c & 0x80000000) ? (c << 1) ^ 0x04c11db7 : c << 1;
+            table[i] = c;
+        }
+    }
+    return (aCrc << 8) ^ table[(aCrc >> 24) ^ aByte];
+}
+
+size_t countSignatures(const string& aIn) {
+    size_t n = 0;
+    for(size_t bit = 0; bit + 48 <= aIn.size() * 8; ++bit) {
+        uint64_t v = 0;
+        for(size_t i = 0; i < 48; ++i)
+            v = (v << 1) | (((uint8_t)aIn[(bit + i) / 8] >> (7 - (bit + i) % 8)) & 1);
+        n += (v == 0x314159265359ULL);
+    }
+    return n;
+}
+
+/**
+ * A block with a second signature starting 22 bits into its CRC. The bits that follow the CRC
+ * are a zero, where the BWT starts and which bytes the block has, in groups of 16. Rotation 0
+ * starts with the only 0x80, so it comes after the 706866 rotations that start with a smaller
+ * byte: that's the middle of the signature. Which groups of bytes are used makes the rest of
+ * it, the CRC the start; the last two bytes are tried until the CRC fits.
+ */
+string falseSignatureData() {
+    // Groups 0, 3, 4 and 6 below 0x80; 0x3e-0x42 unused so that the BWT start the signature
+    // seems to have is a possible one. Any of groups 8, 9, 12 and 13 above.
+    static const uint8_t low[] = { 0x01, 0x02, 0x03, 0x30, 0x31, 0x33, 0x48, 0x49, 0x4a, 0x61, 0x62, 0x63 };
+    string high;
+    for(int c = 0x81; c < 0xa0; ++c)
+        high += (char)c;
+    for(int c = 0xc0; c < 0xe0; ++c)
+        high += (char)c;
+    const size_t LOW = 706866, HIGH = 1000;
+
+    string data;
+    data += (char)0x80;
+    // No runs, which would be shortened before the BWT
+    for(size_t i = 0; i < LOW; ++i)
+        data += (char)low[i % sizeof(low)];
+    for(size_t i = 0; i < HIGH - 2; ++i)
+        data += high[i % high.size()];
+
+    uint32_t crc = 0xffffffff;
+    for(size_t i = 0; i < data.size(); ++i)
+        crc = crcUpdate(crc, (uint8_t)data[i]);
+
+    for(size_t a = 0; a < high.size(); ++a) {
+        for(size_t b = 0; b < high.size(); ++b) {
+            uint32_t c = ~crcUpdate(crcUpdate(crc, (uint8_t)high[a]), (uint8_t)high[b]);
+            if((c & 0x3ff) == 0xc5)
+                return data + high[a] + high[b];
+        }
+    }
+    return data;
+}
+
+void checkFalseSignature() {
+    string data = falseSignatureData();
+    string in = libCompress(data, 9);
+    check(countSignatures(in) == 2, "a block signature in the middle of a block is made up");
+
+    string out;
+    check(unbz(in, out) && out == data, "block signature in the middle of a block");
+    check(unbz(bz(data), out) && out == data, "block signature in the middle of a block from BZFilter");
+}
+
+void checkCorrupt(int aRounds) {
+    string data = makeData(TEXT, 400000);
+    string in = libCompress(data, 1);
+
+    for(int i = 0; i < aRounds; ++i) {
+        size_t len = rnd(4) == 0 ? in.size() - 1 - rnd(20) : rnd((uint32_t)in.size());
+        checkDecompress(in.substr(0, len), "truncated to " + Util::toString(len));
+    }
+
+    // Not the last byte; bits after the end may be anything to libbz2
+    for(int i = 0; i < aRounds; ++i) {
+        string bad = in;
+        size_t bit = rnd((uint32_t)(bad.size() - 1) * 8);
+        bad[bit / 8] ^= (char)(0x80 >> (bit % 8));
+        checkDecompress(bad, "bit " + Util::toString(bit) + " flipped");
+    }
+}
+
+#ifdef __linux__
+/** Peak resident memory in KiB */
+size_t peakMemory() {
+    size_t kb = 0;
+    FILE* f = fopen("/proc/self/status", "r");
+    if(f) {
+        char line[256];
+        while(fgets(line, sizeof(line), f)) {
+            if(strncmp(line, "VmHWM:", 6) == 0)
+                kb = (size_t)atol(line + 6);
+        }
+        fclose(f);
+    }
+    return kb;
+}
+#endif
+
+/** 512 MiB of zeros come from a few kB; they mustn't all be held at once */
+void checkBomb() {
+    const uint64_t SIZE = 512 * 1024 * 1024;
+    string in;
+    {
+        bz_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        BZ2_bzCompressInit(&zs, 9, 0, 0);
+        string zeros(1024 * 1024, 0);
+        char buf[64 * 1024];
+        uint64_t left = SIZE;
+        int ret;
+        do {
+            zs.next_in = &zeros[0];
+            zs.avail_in = (unsigned int)min(left, (uint64_t)zeros.size());
+            left -= zs.avail_in;
+            do {
+                zs.next_out = buf;
+                zs.avail_out = sizeof(buf);
+                ret = BZ2_bzCompress(&zs, left == 0 ? BZ_FINISH : BZ_RUN);
+                in.append(buf, sizeof(buf) - zs.avail_out);
+            } while(zs.avail_in > 0 || (left == 0 && ret != BZ_STREAM_END));
+        } while(left > 0);
+        BZ2_bzCompressEnd(&zs);
+    }
+
+#ifdef __linux__
+    size_t before = peakMemory();
+#endif
+    uint64_t total = 0;
+    bool zeros = true;
+    try {
+        UnBZFilter f;
+        size_t pos = 0;
+        for(;;) {
+            char buf[64 * 1024];
+            size_t insize = min((size_t)4096, in.size() - pos), outsize = sizeof(buf);
+            bool more = f(in.data() + pos, insize, buf, outsize);
+            pos += insize;
+            total += outsize;
+            for(size_t i = 0; i < outsize; ++i)
+                zeros &= buf[i] == 0;
+            if(!more)
+                break;
+        }
+    } catch(const Exception& e) {
+        check(false, "zeros: " + e.getError());
+    }
+    check(total == SIZE && zeros, "zeros decompress");
+
+#ifdef __linux__
+    size_t grown = (peakMemory() - before) / 1024;
+    check(grown < 128, "zeros decompress in bounded memory, not " + Util::toString(grown) + " MiB");
+    printf("%u bytes of compressed zeros: peak memory grew by %u MiB\n", (unsigned)in.size(), (unsigned)grown);
+#endif
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    seed = argc > 1 ? (uint32_t)atoi(argv[1]) : 1;
+
+    checkBomb();
+    checkRoundTrips();
+    checkStreams();
+    checkFalseSignature();
+    checkCorrupt(100);
+
+    if(failures == 0)
+        printf("All bzip2 checks passed\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,255 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Load time and peak memory of DirectoryListing::loadFile() on a bzip2 file
+ * list, against decompressing it inline as the parser reads, which is what
+ * loadFile() did before UnBZPipe. Both have to come up with the same number
+ * of files and the same total size.
+ *
+ * The list is read from a file, as downloaded from another user. Without one
+ * a list of the given number of files is made up in the temp directory, in
+ * directories of a few dozen files each, named and sized about as in a
+ * share of music and video.
+ *
+ * Each load is done in a process of its own, so that what the one before it
+ * left in the allocator pools doesn't hide what the next one needs. Peak
+ * memory is how far it got above the memory in use before the load; it's
+ * only measured on Linux.
+ *
+ * Usage: dirlisting-bench [files] [list]
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/BZUtils.h"
+#include "dcpp/DirectoryListing.h"
+#include "dcpp/File.h"
+#include "dcpp/FilteredFile.h"
+#include "dcpp/SettingsManager.h"
+#include "dcpp/SimpleXML.h"
+#include "dcpp/TigerHash.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef __linux__
+ #include <sys/wait.h>
+ #include <unistd.h>
+#endif
+
+using namespace dcpp;
+
+namespace {
+
+uint32_t seed = 1;
+int failures = 0;
+
+uint32_t rnd(uint32_t aMax) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % aMax;
+}
+
+string name(size_t aWords) {
+    static const char* const words[] = { "the", "movie", "album", "live", "remix", "season", "final", "ubuntu",
+        "flac", "mp3", "hello", "anyone", "have", "new", "best", "of", "2012", "hd", "rip", "part" };
+    string s;
+    for(size_t i = 0; i < aWords; ++i) {
+        if(i > 0)
+            s += rnd(2) ? ' ' : '.';
+        s += words[rnd(sizeof(words) / sizeof(words[0]))];
+    }
+    return s + Util::toString(rnd(1000));
+}
+
+string tth(uint32_t aN) {
+    TigerHash h;
+    h.update(&aN, sizeof(aN));
+    return TTHValue(h.finalize()).toBase32();
+}
+
+void makeList(const string& aPath, size_t aFiles) {
+    FilteredOutputStream<BZFilter, true> f(new File(aPath, File::WRITE, File::CREATE | File::TRUNCATE));
+
+    string s = SimpleXML::utf8Header;
+    s += "<FileListing Version=\"1\" CID=\"LWPNACQDBZRYXW3VHJVCJ64QBZNGHOHHHZWCLNQ\" Base=\"/\" Generator=\"dirlisting-bench\">\r\n";
+
+    for(size_t files = 0; files < aFiles; ) {
+        s += "<Directory Name=\"" + name(1 + rnd(3)) + "\">\r\n";
+        for(uint32_t d = 1 + rnd(8); d > 0 && files < aFiles; --d) {
+            s += "<Directory Name=\"" + name(2 + rnd(4)) + "\">\r\n";
+            for(uint32_t n = 1 + rnd(40); n > 0 && files < aFiles; --n, ++files) {
+                s += "<File Name=\"" + name(2 + rnd(6)) + (rnd(4) ? ".mp3" : ".avi") + "\" Size=\"" +
+                    Util::toString((uint64_t)rnd(1000000) * (1 + rnd(1000))) + "\" TTH=\"" + tth((uint32_t)files) + "\"/>\r\n";
+            }
+            s += "</Directory>\r\n";
+        }
+        s += "</Directory>\r\n";
+
+        if(s.size() > 1024 * 1024) {
+            f.write(s.data(), s.size());
+            s.clear();
+        }
+    }
+
+    s += "</FileListing>\r\n";
+    f.write(s.data(), s.size());
+    f.flush();
+}
+
+#ifdef __linux__
+/** Memory in use (VmRSS) or its peak (VmHWM) in KiB */
+size_t memory(const char* aWhat) {
+    size_t kb = 0;
+    size_t len = strlen(aWhat);
+    FILE* f = fopen("/proc/self/status", "r");
+    if(f) {
+        char line[256];
+        while(fgets(line, sizeof(line), f)) {
+            if(strncmp(line, aWhat, len) == 0)
+                kb = (size_t)atol(line + len);
+        }
+        fclose(f);
+    }
+    return kb;
+}
+
+/** Makes the peak the memory in use now */
+bool resetPeak() {
+    FILE* f = fopen("/proc/self/clear_refs", "w");
+    if(!f)
+        return false;
+    bool ok = fputs("5", f) >= 0;
+    return fclose(f) == 0 && ok;
+}
+#endif
+
+struct Result {
+    Result() : seconds(0), peak(0), files(0), size(0) { }
+
+    double seconds;
+    size_t peak;
+    size_t files;
+    int64_t size;
+};
+
+Result loadHere(const string& aPath, bool aPipe) {
+    Result r;
+#ifdef __linux__
+    bool reset = resetPeak();
+    size_t before = memory("VmRSS:");
+#endif
+
+    auto start = std::chrono::steady_clock::now();
+    {
+        DirectoryListing dl(HintedUser(UserPtr(), Util::emptyString));
+        if(aPipe) {
+            dl.loadFile(aPath);
+        } else {
+            File ff(aPath, File::READ, File::OPEN);
+            FilteredInputStream<UnBZFilter, false> f(&ff);
+            dl.loadXML(f, false);
+        }
+        r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        r.files = dl.getTotalFileCount();
+        r.size = dl.getTotalSize();
+
+#ifdef __linux__
+        if(reset)
+            r.peak = (memory("VmHWM:") - before) / 1024;
+#endif
+    }
+    return r;
+}
+
+Result load(const string& aPath, bool aPipe) {
+#ifdef __linux__
+    int fds[2];
+    if(pipe(fds) == 0) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if(pid == 0) {
+            close(fds[0]);
+            Result r;
+            bool ok = true;
+            try {
+                r = loadHere(aPath, aPipe);
+            } catch(const Exception& e) {
+                printf("FAIL: %s\n", e.getError().c_str());
+                ok = false;
+            }
+            ok = ok && write(fds[1], &r, sizeof(r)) == (ssize_t)sizeof(r);
+            fflush(stdout);
+            _exit(ok ? 0 : 1);
+        }
+
+        close(fds[1]);
+        Result r;
+        bool ok = pid > 0 && read(fds[0], &r, sizeof(r)) == (ssize_t)sizeof(r);
+        close(fds[0]);
+        if(pid > 0)
+            waitpid(pid, NULL, 0);
+        if(!ok)
+            throw Exception("Loading " + aPath + " failed");
+        return r;
+    }
+#endif
+    return loadHere(aPath, aPipe);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    size_t files = argc > 1 ? (size_t)atol(argv[1]) : 500000;
+
+    Util::initialize();
+    SettingsManager::newInstance();
+    SettingsManager::getInstance()->set(SettingsManager::MAX_FILELIST_SIZE, 0);
+
+    string path;
+    if(argc > 2) {
+        path = argv[2];
+    } else {
+        path = Util::getTempPath() + "dirlisting-bench.xml.bz2";
+        auto start = std::chrono::steady_clock::now();
+        makeList(path, files);
+        printf("Made up a list of %llu files in %.1f s\n", (unsigned long long)files,
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    try {
+        printf("%-7s %10s %10s %10s\n", "", "files", "seconds", "peak MiB");
+        Result inline_ = load(path, false);
+        printf("%-7s %10llu %10.2f %10llu\n", "inline", (unsigned long long)inline_.files, inline_.seconds, (unsigned long long)inline_.peak);
+        Result pipe = load(path, true);
+        printf("%-7s %10llu %10.2f %10llu\n", "pipe", (unsigned long long)pipe.files, pipe.seconds, (unsigned long long)pipe.peak);
+
+        if(pipe.files != inline_.files || pipe.size != inline_.size) {
+            printf("FAIL: the lists loaded differ\n");
+            failures++;
+        }
+    } catch(const Exception& e) {
+        printf("FAIL: %s\n", e.getError().c_str());
+        failures++;
+    }
+
+    if(argc <= 2)
+        File::deleteFile(path);
+
+    SettingsManager::deleteInstance();
+    return failures == 0 ? 0 : 1;
+}
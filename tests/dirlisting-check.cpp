@@ -0,0 +1,162 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Checks of DirectoryListing::Directory::findDirectory() and findFile()
+ * against a plain walk through the children, with enough of them for the
+ * index to be used. Between lookups children are added, renamed, given
+ * another TTH, taken out (followed by childrenChanged(), as filterList does)
+ * and the lists are sorted, all in random order.
+ *
+ * Usage: dirlisting-check [rounds] [seed]
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/DirectoryListing.h"
+#include "dcpp/TigerHash.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+using namespace dcpp;
+
+namespace {
+
+uint32_t seed = 1;
+int failures = 0;
+
+uint32_t rnd(uint32_t aMax) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % aMax;
+}
+
+typedef DirectoryListing::Directory Directory;
+typedef DirectoryListing::File ListFile;
+
+/** Few enough names that lookups hit now and then, with the case mixed up */
+string randomName() {
+    string name = "n" + Util::toString(rnd(200));
+    if(rnd(4) == 0)
+        name[0] = 'N';
+    return name;
+}
+
+TTHValue randomTTH() {
+    uint32_t n = rnd(200);
+    TigerHash h;
+    h.update(&n, sizeof(n));
+    return TTHValue(h.finalize());
+}
+
+Directory* walkDirectory(Directory* d, const string& aName) {
+    for(auto i = d->directories.begin(); i != d->directories.end(); ++i) {
+        if(Util::stricmp((*i)->getName(), aName) == 0)
+            return *i;
+    }
+    return NULL;
+}
+
+/** Any file with the name or the TTH; the index may well find another one than the first */
+bool isMatch(const ListFile* f, const string& aName, const TTHValue& aTTH) {
+    return f->getTTH() == aTTH || Util::stricmp(f->getName(), aName) == 0;
+}
+
+bool hasFile(Directory* d, const string& aName, const TTHValue& aTTH) {
+    for(auto i = d->files.begin(); i != d->files.end(); ++i) {
+        if(isMatch(*i, aName, aTTH))
+            return true;
+    }
+    return false;
+}
+
+void fail(long aRound, const char* aWhat) {
+    if(failures++ < 20)
+        printf("FAIL: round %ld: %s\n", aRound, aWhat);
+}
+
+void change(Directory* d) {
+    switch(rnd(10)) {
+    case 0: case 1: case 2:
+        d->directories.push_back(new Directory(d, randomName(), false, true));
+        d->files.push_back(new ListFile(d, randomName(), rnd(1000), randomTTH()));
+        break;
+    case 3:
+        if(!d->directories.empty())
+            d->directories[rnd(d->directories.size())]->setName(randomName());
+        break;
+    case 4:
+        if(!d->files.empty())
+            d->files[rnd(d->files.size())]->setName(randomName());
+        break;
+    case 5:
+        if(!d->files.empty())
+            d->files[rnd(d->files.size())]->setTTH(randomTTH());
+        break;
+    case 6:
+        // Taken out and something else put in, so that the count doesn't give it away
+        if(d->directories.size() > 1 && d->files.size() > 1) {
+            size_t i = rnd(d->directories.size());
+            delete d->directories[i];
+            d->directories.erase(d->directories.begin() + i);
+            i = rnd(d->files.size());
+            delete d->files[i];
+            d->files.erase(d->files.begin() + i);
+            d->childrenChanged();
+            d->directories.push_back(new Directory(d, randomName(), false, true));
+            d->files.push_back(new ListFile(d, randomName(), rnd(1000), randomTTH()));
+        }
+        break;
+    case 7:
+        sort(d->directories.begin(), d->directories.end(), Directory::DirSort());
+        sort(d->files.begin(), d->files.end(), ListFile::FileSort());
+        break;
+    default:
+        break;
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    long rounds = argc > 1 ? atol(argv[1]) : 200000;
+    seed = argc > 2 ? (uint32_t)atoi(argv[2]) : 1;
+
+    Directory root(NULL, "root", false, true);
+    for(int i = 0; i < 100; ++i)
+        change(&root);
+
+    long hits = 0;
+    for(long n = 0; n < rounds; ++n) {
+        if(rnd(4) == 0)
+            change(&root);
+
+        string name = randomName();
+        Directory* expected = walkDirectory(&root, name);
+        Directory* d = root.findDirectory(name);
+        if((d == NULL) != (expected == NULL) || (d && Util::stricmp(d->getName(), name) != 0))
+            fail(n, "findDirectory");
+
+        TTHValue tth = randomTTH();
+        ListFile* f = root.findFile(name, tth);
+        if((f == NULL) == hasFile(&root, name, tth) || (f && !isMatch(f, name, tth)))
+            fail(n, "findFile");
+
+        hits += (d != NULL) + (f != NULL);
+    }
+
+    printf("%ld rounds, %ld hits, %d mismatches\n", rounds, hits, failures);
+    return failures == 0 ? 0 : 1;
+}
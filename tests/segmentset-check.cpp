@@ -0,0 +1,145 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Property checks of SegmentSet: random segments are added to a set and to
+ * a plain byte map, and after every addition the set has to be sorted,
+ * disjoint and fully merged, cover exactly the marked bytes and answer
+ * find(), covers(), overlaps(), after() and getBytes() like the map does.
+ *
+ * Usage: segmentset-check [seed]
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/Util.h"
+#include "dcpp/Segment.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+using namespace dcpp;
+
+namespace {
+
+const int64_t SPACE = 512;
+
+int failures = 0;
+uint32_t seed = 1;
+
+uint32_t rnd(uint32_t aMax) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % aMax;
+}
+
+void check(bool aOk, const char* aWhat, int64_t aStart, int64_t aSize) {
+    if(!aOk && failures++ < 20)
+        printf("FAIL: %s (%lld, %lld)\n", aWhat, (long long)aStart, (long long)aSize);
+}
+
+/** A random segment inside the space; short ones are more interesting */
+Segment randomSegment() {
+    int64_t size = 1 + rnd(rnd(4) == 0 ? (uint32_t)SPACE / 2 : 16);
+    int64_t start = rnd((uint32_t)(SPACE - size + 1));
+    return Segment(start, size);
+}
+
+void checkSet(const SegmentSet& s, const vector<bool>& map) {
+    // Sorted, not overlapping or touching, and summing up to getBytes()
+    int64_t bytes = 0, lastEnd = -1;
+    for(auto i = s.begin(); i != s.end(); ++i) {
+        check(i->getSize() > 0, "empty segment", i->getStart(), i->getSize());
+        check(i->getStart() > lastEnd, "segments not merged", i->getStart(), i->getSize());
+        lastEnd = i->getEnd();
+        bytes += i->getSize();
+    }
+    check(bytes == s.getBytes(), "getBytes", bytes, s.getBytes());
+
+    int64_t marked = 0;
+    for(int64_t pos = 0; pos < SPACE; ++pos) {
+        if(map[pos])
+            marked++;
+
+        auto i = s.find(pos);
+        check((i != s.end()) == map[pos], "find", pos, 1);
+        if(i != s.end())
+            check(i->getStart() <= pos && pos < i->getEnd(), "find range", pos, 1);
+
+        // The first segment ending after pos
+        auto a = s.after(pos);
+        auto e = s.begin();
+        while(e != s.end() && e->getEnd() <= pos)
+            ++e;
+        check(a == e, "after", pos, 0);
+    }
+    check(marked == s.getBytes(), "bytes covered", marked, s.getBytes());
+
+    for(int n = 0; n < 64; ++n) {
+        Segment seg = randomSegment();
+        bool all = true, any = false;
+        for(int64_t pos = seg.getStart(); pos < seg.getEnd(); ++pos) {
+            all = all && map[pos];
+            any = any || map[pos];
+        }
+        check(s.covers(seg) == all, "covers", seg.getStart(), seg.getSize());
+        check(s.overlaps(seg) == any, "overlaps", seg.getStart(), seg.getSize());
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    seed = argc > 1 ? (uint32_t)atoi(argv[1]) : 1;
+
+    for(int round = 0; round < 200; ++round) {
+        SegmentSet s;
+        vector<bool> map(SPACE);
+        checkSet(s, map);
+
+        int adds = 1 + rnd(64);
+        for(int n = 0; n < adds; ++n) {
+            Segment seg = randomSegment();
+            s.add(seg);
+            for(int64_t pos = seg.getStart(); pos < seg.getEnd(); ++pos)
+                map[pos] = true;
+            checkSet(s, map);
+        }
+
+        s.clear();
+        check(s.empty() && s.getBytes() == 0, "clear", 0, 0);
+    }
+
+    // Segments that touch end to start are joined, from either side
+    SegmentSet s;
+    s.add(Segment(10, 10));
+    s.add(Segment(30, 10));
+    s.add(Segment(20, 10));
+    check(s.size() == 1 && s.begin()->getStart() == 10 && s.getBytes() == 30, "touching segments", 10, 30);
+
+    // A segment inside another one leaves it as it is
+    s.add(Segment(15, 5));
+    check(s.size() == 1 && s.begin()->getSize() == 30, "contained segment", 15, 5);
+
+    // Offsets past 4 GiB
+    const int64_t big = (int64_t)1 << 40;
+    s.clear();
+    s.add(Segment(big, 1 << 20));
+    s.add(Segment(big + (1 << 20), 1 << 20));
+    check(s.size() == 1 && s.getBytes() == 2 << 20 && s.covers(Segment(big + 5, 1 << 20)), "large offsets", big, 2 << 20);
+
+    if(failures == 0)
+        printf("All SegmentSet checks passed\n");
+    return failures == 0 ? 0 : 1;
+}
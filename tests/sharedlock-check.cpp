@@ -0,0 +1,276 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Checks of SharedCriticalSection: readers share it and writers have it to
+ * themselves, a waiting writer keeps new readers out, a reader that takes
+ * it again while a writer waits doesn't deadlock, and the owner may take
+ * it again either way. A stress run of readers and writers ends it.
+ *
+ * Usage: sharedlock-check [stress milliseconds]
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/CriticalSection.h"
+#include "dcpp/Thread.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace dcpp;
+
+namespace {
+
+int failures = 0;
+
+void check(bool aOk, const char* aWhat) {
+    if(!aOk) {
+        failures++;
+        printf("FAIL: %s\n", aWhat);
+    }
+}
+
+/** Waits for the flag for up to a second */
+bool waitFor(const std::atomic<bool>& aFlag) {
+    for(int i = 0; i < 1000 && !aFlag.load(); ++i)
+        Thread::sleep(1);
+    return aFlag.load();
+}
+
+/** Takes the lock one way or the other and holds it until told to let go */
+class Holder : public Thread {
+public:
+    Holder(SharedCriticalSection& aCs, bool aShared, std::atomic<int>& aOrder) :
+        cs(aCs), shared(aShared), order(aOrder), again(false), tookAgain(false), position(0), holding(false), release(false), done(false) { }
+
+    int run() {
+        if(shared)
+            cs.lockShared();
+        else
+            cs.lock();
+        position = ++order;
+        holding = true;
+
+        while(!release.load()) {
+            if(again.load()) {
+                // Taken once more while a writer waits for us
+                cs.lockShared();
+                tookAgain = true;
+                cs.unlockShared();
+                again = false;
+            }
+            Thread::sleep(1);
+        }
+
+        if(shared)
+            cs.unlockShared();
+        else
+            cs.unlock();
+        done = true;
+        return 0;
+    }
+
+    SharedCriticalSection& cs;
+    bool shared;
+    std::atomic<int>& order;
+    std::atomic<bool> again;
+    std::atomic<bool> tookAgain;
+    std::atomic<int> position;
+    std::atomic<bool> holding;
+    std::atomic<bool> release;
+    std::atomic<bool> done;
+};
+
+void checkSharing() {
+    SharedCriticalSection cs;
+    std::atomic<int> order(0);
+
+    Holder a(cs, true, order), b(cs, true, order);
+    a.start();
+    check(waitFor(a.holding), "first reader gets in");
+    b.start();
+    check(waitFor(b.holding), "second reader gets in alongside the first");
+
+    Holder w(cs, false, order);
+    w.start();
+    Thread::sleep(50);
+    check(!w.holding.load(), "writer waits for the readers");
+
+    a.release = true;
+    b.release = true;
+    check(waitFor(w.holding), "writer gets in once the readers are gone");
+    w.release = true;
+    a.join();
+    b.join();
+    w.join();
+}
+
+void checkWriterPreference() {
+    SharedCriticalSection cs;
+    std::atomic<int> order(0);
+
+    Holder r1(cs, true, order);
+    r1.start();
+    check(waitFor(r1.holding), "reader gets in");
+
+    Holder w(cs, false, order);
+    w.start();
+    Thread::sleep(50);
+
+    // Arrives after the writer, so it has to wait for it
+    Holder r2(cs, true, order);
+    r2.start();
+    Thread::sleep(50);
+    check(!r2.holding.load(), "new reader waits behind a waiting writer");
+
+    // The first reader takes it again; a reader already inside must not be kept out
+    r1.tookAgain = false;
+    r1.again = true;
+    check(waitFor(r1.tookAgain), "reader takes it again while a writer waits");
+
+    r1.release = true;
+    check(waitFor(w.holding), "writer gets in after the first reader");
+    Thread::sleep(20);
+    check(!r2.holding.load(), "new reader stays out while the writer holds it");
+    w.release = true;
+    check(waitFor(r2.holding), "new reader gets in after the writer");
+    check(w.position.load() < r2.position.load(), "writer went before the later reader");
+    r2.release = true;
+
+    r1.join();
+    w.join();
+    r2.join();
+}
+
+void checkRecursion() {
+    SharedCriticalSection cs;
+    std::atomic<int> order(0);
+
+    cs.lock();
+    cs.lock();
+    cs.lockShared();
+    cs.unlockShared();
+    cs.unlock();
+
+    Holder r(cs, true, order);
+    r.start();
+    Thread::sleep(20);
+    check(!r.holding.load(), "reader waits while the lock is still held once");
+    cs.unlock();
+    check(waitFor(r.holding), "reader gets in once the owner let go");
+    r.release = true;
+    r.join();
+
+    cs.lockShared();
+    cs.lockShared();
+    cs.unlockShared();
+    cs.unlockShared();
+
+    Holder w(cs, false, order);
+    w.start();
+    check(waitFor(w.holding), "writer gets in after recursive readers");
+    w.release = true;
+    w.join();
+}
+
+/** Writers keep two counters equal, readers check that they never see them differ */
+class Stress : public Thread {
+public:
+    Stress(SharedCriticalSection& aCs, bool aWriter, volatile bool& aStop, long& aA, long& aB, std::atomic<int>& aInside) :
+        cs(aCs), writer(aWriter), stop(aStop), a(aA), b(aB), inside(aInside), rounds(0), errors(0) { }
+
+    int run() {
+        while(!stop) {
+            if(writer) {
+                WLock l(cs);
+                if(inside++ != 0)
+                    errors++;
+                a++;
+                Thread::yield();
+                b++;
+                inside--;
+            } else {
+                RLock l(cs);
+                if(inside.load() != 0)
+                    errors++;
+                if(a != b)
+                    errors++;
+                // Now and then taken again, as ClientManager does
+                if((rounds & 7) == 0) {
+                    RLock l2(cs);
+                    if(a != b)
+                        errors++;
+                }
+            }
+            rounds++;
+        }
+        return 0;
+    }
+
+    SharedCriticalSection& cs;
+    bool writer;
+    volatile bool& stop;
+    long& a;
+    long& b;
+    std::atomic<int>& inside;
+    uint64_t rounds;
+    uint64_t errors;
+};
+
+void checkStress(uint32_t aMillis) {
+    SharedCriticalSection cs;
+    volatile bool stop = false;
+    long a = 0, b = 0;
+    std::atomic<int> inside(0);
+
+    vector<Stress*> threads;
+    for(int i = 0; i < 8; ++i)
+        threads.push_back(new Stress(cs, i < 2, stop, a, b, inside));
+    for(auto i = threads.begin(); i != threads.end(); ++i)
+        (*i)->start();
+
+    Thread::sleep(aMillis);
+    stop = true;
+
+    uint64_t errors = 0, writes = 0, reads = 0;
+    for(auto i = threads.begin(); i != threads.end(); ++i) {
+        (*i)->join();
+        errors += (*i)->errors;
+        ((*i)->writer ? writes : reads) += (*i)->rounds;
+        delete *i;
+    }
+
+    check(errors == 0, "readers never see a writer at work");
+    check(a == b && (uint64_t)a == writes, "writes are not lost");
+    check(writes > 0 && reads > 0, "both readers and writers get their turns");
+    printf("stress: %llu reads, %llu writes\n", (unsigned long long)reads, (unsigned long long)writes);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    uint32_t millis = argc > 1 ? (uint32_t)atoi(argv[1]) : 500;
+
+    checkSharing();
+    checkWriterPreference();
+    checkRecursion();
+    checkStress(millis);
+
+    if(failures == 0)
+        printf("All SharedCriticalSection checks passed\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,390 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Time per share search of the NameIndex lookup ShareManager does against
+ * the old walk through the whole tree, on a made up share. The share is
+ * built like ShareManager's: directories in a hash map, files in a set, and
+ * both searches follow ShareManager::search() (NMDC, by name only). Every
+ * search is also checked to find the same results in the same order as the
+ * walk, with and without a maxResults cut.
+ *
+ * Usage: sharesearch-bench [files] [iterations]
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/NameIndex.h"
+#include "dcpp/StringSearch.h"
+#include "dcpp/StringTokenizer.h"
+#include "dcpp/Text.h"
+#include "dcpp/Util.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace dcpp;
+
+namespace {
+
+uint32_t seed = 1;
+int failures = 0;
+
+/** Keeps the compiler from dropping the searches */
+volatile size_t sink;
+
+uint32_t rnd(uint32_t aMax) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % aMax;
+}
+
+struct NameLess {
+    bool operator()(const string& a, const string& b) const { return Util::stricmp(a, b) < 0; }
+};
+
+struct Dir {
+    typedef unordered_map<string, Dir*, CaseStringHash, CaseStringEq> Map;
+
+    Dir(const string& aName, Dir* aParent) : name(aName), parent(aParent) { }
+    ~Dir() {
+        for(auto i = directories.begin(); i != directories.end(); ++i)
+            delete i->second;
+    }
+
+    string getFullName() const { return (parent ? parent->getFullName() : string()) + name + '\\'; }
+
+    string name;
+    Dir* parent;
+    Map directories;
+    set<string, NameLess> files;
+};
+
+struct WalkKey {
+    bool operator<(const WalkKey& rhs) const {
+        if(path != rhs.path)
+            return path < rhs.path;
+        return file && rhs.file && NameLess()(*file, *rhs.file);
+    }
+
+    vector<uint32_t> path;
+    const string* file;
+    size_t entry;
+};
+
+/** What a name id stands for; file is NULL for directory names */
+struct Entry {
+    Entry(Dir* aDir, const string* aFile) : dir(aDir), file(aFile) { }
+
+    Dir* dir;
+    const string* file;
+};
+
+class Share {
+public:
+    ~Share() {
+        for(auto i = roots.begin(); i != roots.end(); ++i)
+            delete *i;
+    }
+
+    void index() {
+        for(auto i = roots.begin(); i != roots.end(); ++i)
+            add(*i);
+    }
+
+    /** The old search: everything is looked at */
+    void walk(const StringSearch::List& aStrings, StringList& aResults, size_t maxResults) const {
+        for(auto i = roots.begin(); i != roots.end() && aResults.size() < maxResults; ++i)
+            search(*i, aStrings, aResults, maxResults);
+    }
+
+    /** What ShareManager does now */
+    void lookup(const StringSearch::List& aStrings, StringList& aResults, size_t maxResults) const {
+        vector<Entry> found;
+        if(!findNames(aStrings, maxResults, found)) {
+            walk(aStrings, aResults, maxResults);
+            return;
+        }
+
+        for(auto i = found.begin(); i != found.end() && aResults.size() < maxResults; ++i) {
+            StringSearch::List left;
+            for(auto j = aStrings.begin(); j != aStrings.end(); ++j) {
+                Dir* d = i->file ? i->dir : i->dir->parent;
+                for(; d && !j->match(d->name); d = d->parent)
+                    ;   // Empty
+                if(!d)
+                    left.push_back(*j);
+            }
+
+            if(!i->file) {
+                search(i->dir, left, aResults, maxResults);
+            } else {
+                searchFile(i->dir, *i->file, left, aResults);
+            }
+        }
+    }
+
+    list<Dir*> roots;
+
+private:
+    NameIndex names;
+    vector<Entry> entries;
+
+    void add(Dir* d) {
+        names.add(entries.size(), Text::toLower(d->name));
+        entries.push_back(Entry(d, NULL));
+        for(auto i = d->files.begin(); i != d->files.end(); ++i) {
+            names.add(entries.size(), Text::toLower(*i));
+            entries.push_back(Entry(d, &*i));
+        }
+        for(auto i = d->directories.begin(); i != d->directories.end(); ++i)
+            add(i->second);
+    }
+
+    static void search(const Dir* d, const StringSearch::List& aStrings, StringList& aResults, size_t maxResults) {
+        const StringSearch::List* cur = &aStrings;
+        unique_ptr<StringSearch::List> newStr;
+        for(auto k = aStrings.begin(); k != aStrings.end(); ++k) {
+            if(k->match(d->name)) {
+                if(!newStr.get())
+                    newStr.reset(new StringSearch::List(aStrings));
+                newStr->erase(remove(newStr->begin(), newStr->end(), *k), newStr->end());
+            }
+        }
+        if(newStr.get())
+            cur = newStr.get();
+
+        if(cur->empty())
+            aResults.push_back(d->getFullName());
+
+        for(auto i = d->files.begin(); i != d->files.end() && aResults.size() < maxResults; ++i)
+            searchFile(d, *i, *cur, aResults);
+
+        for(auto l = d->directories.begin(); l != d->directories.end() && aResults.size() < maxResults; ++l)
+            search(l->second, *cur, aResults, maxResults);
+    }
+
+    static void searchFile(const Dir* d, const string& aFile, const StringSearch::List& aStrings, StringList& aResults) {
+        auto j = aStrings.begin();
+        for(; j != aStrings.end() && j->match(aFile); ++j)
+            ;   // Empty
+        if(j == aStrings.end())
+            aResults.push_back(d->getFullName() + aFile);
+    }
+
+    const StringSearch* findNames(const StringSearch::List& aStrings, size_t maxResults, vector<Entry>& aEntries) const {
+        const StringSearch* best = NULL;
+        size_t bestCount = 0;
+        for(auto i = aStrings.begin(); i != aStrings.end(); ++i) {
+            if(!NameIndex::isIndexed(i->getPattern()))
+                continue;
+            size_t n = names.count(i->getPattern());
+            if(!best || n < bestCount) {
+                best = &*i;
+                bestCount = n;
+            }
+        }
+        if(!best)
+            return NULL;
+
+        vector<uint32_t> ids;
+        names.find(best->getPattern(), ids);
+        if((double)ids.size() * ids.size() > (double)maxResults * entries.size())
+            return NULL;
+        for(auto i = ids.begin(); i != ids.end(); ++i) {
+            const Entry& e = entries[*i];
+            if(!best->match(e.file ? *e.file : e.dir->name))
+                continue;
+
+            Dir* d = e.file ? e.dir : e.dir->parent;
+            for(; d && !best->match(d->name); d = d->parent)
+                ;   // Empty
+            if(!d)
+                aEntries.push_back(e);
+        }
+
+        sortNames(aEntries);
+        return best;
+    }
+
+    void sortNames(vector<Entry>& aEntries) const {
+        if(aEntries.size() < 2)
+            return;
+
+        unordered_map<const Dir*, uint32_t> ranks;
+        uint32_t n = 0;
+        for(auto i = roots.begin(); i != roots.end(); ++i)
+            ranks[*i] = n++;
+
+        vector<WalkKey> keys(aEntries.size());
+        for(size_t i = 0; i < aEntries.size(); ++i) {
+            const Entry& e = aEntries[i];
+            WalkKey& k = keys[i];
+            k.file = e.file;
+            k.entry = i;
+
+            if(e.file)
+                k.path.push_back(0);
+
+            for(const Dir* d = e.dir; d; d = d->parent) {
+                auto r = ranks.find(d);
+                if(r == ranks.end() && d->parent) {
+                    n = 0;
+                    for(auto j = d->parent->directories.begin(); j != d->parent->directories.end(); ++j)
+                        ranks[j->second] = n++;
+                    r = ranks.find(d);
+                }
+                k.path.push_back(r != ranks.end() ? r->second + 1 : 0);
+            }
+            reverse(k.path.begin(), k.path.end());
+        }
+
+        sort(keys.begin(), keys.end());
+
+        vector<Entry> sorted;
+        sorted.reserve(aEntries.size());
+        for(auto i = keys.begin(); i != keys.end(); ++i)
+            sorted.push_back(aEntries[i->entry]);
+        aEntries.swap(sorted);
+    }
+};
+
+const char* const syllables[] = {
+    "ka", "ro", "mi", "sen", "tal", "ve", "dor", "lu", "pra", "ne", "quo", "zi", "bel", "fa", "gur", "ho",
+    "jin", "os", "ter", "wy"
+};
+const char* const extensions[] = { ".mp3", ".flac", ".avi", ".mkv", ".jpg", ".txt", ".iso", ".zip" };
+
+string randomWord() {
+    string w;
+    for(uint32_t n = 2 + rnd(3); n > 0; --n)
+        w += syllables[rnd(sizeof(syllables) / sizeof(syllables[0]))];
+    if(rnd(3) == 0)
+        w[0] = (char)toupper(w[0]);
+    return w;
+}
+
+string randomName(uint32_t aWords) {
+    string name = randomWord();
+    for(uint32_t n = rnd(aWords); n > 0; --n)
+        name += (rnd(2) ? " " : "_") + randomWord();
+    return name;
+}
+
+void fill(Dir* d, size_t& aFiles, int aDepth) {
+    for(uint32_t n = 5 + rnd(30); n > 0 && aFiles > 0; --n, --aFiles)
+        d->files.insert(randomName(4) + extensions[rnd(sizeof(extensions) / sizeof(extensions[0]))]);
+
+    if(aDepth == 0)
+        return;
+    for(uint32_t n = 1 + rnd(8); n > 0 && aFiles > 0; --n) {
+        Dir* sub = new Dir(randomName(2), d);
+        if(!d->directories.insert(make_pair(sub->name, sub)).second) {
+            delete sub;
+            continue;
+        }
+        fill(sub, aFiles, aDepth - 1);
+    }
+}
+
+/** Made up searches, from a single rare word to one that hits most of the share */
+StringList makeQueries() {
+    StringList queries;
+    for(int i = 0; i < 4; ++i)
+        queries.push_back(randomWord());
+    for(int i = 0; i < 2; ++i)
+        queries.push_back(string(syllables[rnd(20)]) + syllables[rnd(20)]);
+    queries.push_back(randomWord() + "$mp3");
+    queries.push_back(string(syllables[rnd(20)]) + syllables[rnd(20)] + "$" + syllables[rnd(20)] + "$.avi");
+    queries.push_back("mp3");
+    queries.push_back("zzzz");
+    return queries;
+}
+
+StringSearch::List toSearches(const string& aQuery) {
+    StringSearch::List ssl;
+    StringTokenizer<string> t(Text::toLower(aQuery), '$');
+    for(auto i = t.getTokens().begin(); i != t.getTokens().end(); ++i) {
+        if(!i->empty())
+            ssl.push_back(StringSearch(*i));
+    }
+    return ssl;
+}
+
+double microseconds(std::chrono::steady_clock::time_point aStart, size_t aCount) {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - aStart).count() / aCount;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    size_t files = argc > 1 ? (size_t)atol(argv[1]) : 200000;
+    size_t iterations = argc > 2 ? (size_t)atol(argv[2]) : 20;
+    if(iterations == 0)
+        iterations = 1;
+
+    Share share;
+    size_t left = files;
+    while(left > 0) {
+        Dir* root = new Dir(randomName(1) + Util::toString(share.roots.size()), NULL);
+        share.roots.push_back(root);
+        fill(root, left, 5);
+    }
+    share.index();
+
+    const size_t cuts[] = { 5, 10, 100, numeric_limits<size_t>::max() };
+    const StringList queries = makeQueries();
+
+    printf("%-24s %8s %12s %12s\n", "search", "results", "walk us", "index us");
+    for(auto q = queries.begin(); q != queries.end(); ++q) {
+        StringSearch::List ssl = toSearches(*q);
+
+        for(size_t c = 0; c < sizeof(cuts) / sizeof(cuts[0]); ++c) {
+            StringList expected, results;
+            share.walk(ssl, expected, cuts[c]);
+            share.lookup(ssl, results, cuts[c]);
+            if(results != expected) {
+                failures++;
+                printf("FAIL: %s, maxResults %llu: %llu results instead of %llu or in another order\n", q->c_str(),
+                    (unsigned long long)cuts[c], (unsigned long long)results.size(), (unsigned long long)expected.size());
+            }
+        }
+
+        // The usual cut for a search from a hub
+        const size_t maxResults = 10;
+        size_t count = 0;
+
+        auto start = std::chrono::steady_clock::now();
+        for(size_t n = 0; n < iterations; ++n) {
+            StringList results;
+            share.walk(ssl, results, maxResults);
+            sink = results.size();
+        }
+        double walked = microseconds(start, iterations);
+
+        start = std::chrono::steady_clock::now();
+        for(size_t n = 0; n < iterations; ++n) {
+            StringList results;
+            share.lookup(ssl, results, maxResults);
+            count = results.size();
+            sink = count;
+        }
+        double looked = microseconds(start, iterations);
+
+        printf("%-24s %8llu %12.0f %12.0f\n", q->c_str(), (unsigned long long)count, walked, looked);
+    }
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,179 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Speaker::fire() throughput with several threads firing at once, the way
+ * socket threads fire connection events, compared to the old fire() that
+ * copied the listener list under a lock. The "churn" runs have another
+ * thread adding and removing a listener all the time.
+ *
+ * Usage: speaker-bench [milliseconds per run]
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/Speaker.h"
+#include "dcpp/Thread.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+using namespace dcpp;
+
+namespace {
+
+class BenchListener {
+public:
+    template<int I> struct X { enum { TYPE = I }; };
+    typedef X<0> Event;
+
+    virtual ~BenchListener() { }
+
+    virtual void on(Event, int aValue) noexcept { calls += aValue; }
+
+    /** Calls made by the current thread, so that the firers don't share a counter */
+    static DCPP_THREAD_LOCAL uint64_t calls;
+};
+
+DCPP_THREAD_LOCAL uint64_t BenchListener::calls = 0;
+
+/** Speaker::fire() as it was before the snapshots */
+class LockedSpeaker {
+public:
+    void fire(BenchListener::Event e, int aValue) noexcept {
+        Lock l(listenerCS);
+        tmp = listeners;
+        for(auto i = tmp.begin(); i != tmp.end(); ++i)
+            (*i)->on(e, aValue);
+    }
+    void addListener(BenchListener* aListener) {
+        Lock l(listenerCS);
+        if(find(listeners.begin(), listeners.end(), aListener) == listeners.end())
+            listeners.push_back(aListener);
+    }
+    void removeListener(BenchListener* aListener) {
+        Lock l(listenerCS);
+        auto it = find(listeners.begin(), listeners.end(), aListener);
+        if(it != listeners.end())
+            listeners.erase(it);
+    }
+
+private:
+    vector<BenchListener*> listeners;
+    vector<BenchListener*> tmp;
+    CriticalSection listenerCS;
+};
+
+class SnapshotSpeaker : public Speaker<BenchListener> { };
+
+template<typename S>
+class Firer : public Thread {
+public:
+    Firer(S& aSpeaker, volatile bool& aStop) : speaker(aSpeaker), stop(aStop), events(0), calls(0) { }
+
+    int run() {
+        while(!stop) {
+            for(int i = 0; i < 64; ++i)
+                speaker.fire(BenchListener::Event(), 1);
+            events += 64;
+        }
+        calls = BenchListener::calls;
+        return 0;
+    }
+
+    S& speaker;
+    volatile bool& stop;
+    uint64_t events;
+    uint64_t calls;
+};
+
+template<typename S>
+class Churner : public Thread {
+public:
+    Churner(S& aSpeaker, volatile bool& aStop) : speaker(aSpeaker), stop(aStop) { }
+
+    int run() {
+        BenchListener l;
+        while(!stop) {
+            speaker.addListener(&l);
+            speaker.removeListener(&l);
+        }
+        return 0;
+    }
+
+    S& speaker;
+    volatile bool& stop;
+};
+
+template<typename S>
+double bench(size_t aThreads, bool aChurn, uint32_t aMillis) {
+    static const size_t LISTENERS = 4;
+
+    S speaker;
+    BenchListener listeners[LISTENERS];
+    for(size_t i = 0; i < LISTENERS; ++i)
+        speaker.addListener(&listeners[i]);
+
+    volatile bool stop = false;
+    vector<Firer<S>*> firers;
+    for(size_t i = 0; i < aThreads; ++i)
+        firers.push_back(new Firer<S>(speaker, stop));
+    Churner<S> churner(speaker, stop);
+
+    for(auto i = firers.begin(); i != firers.end(); ++i)
+        (*i)->start();
+    if(aChurn)
+        churner.start();
+
+    Thread::sleep(aMillis);
+    stop = true;
+
+    uint64_t events = 0, calls = 0;
+    for(auto i = firers.begin(); i != firers.end(); ++i) {
+        (*i)->join();
+        events += (*i)->events;
+        calls += (*i)->calls;
+        delete *i;
+    }
+    churner.join();
+
+    // The churned listener may or may not have been called, the others always
+    if(calls < events * LISTENERS || calls > events * (LISTENERS + 1)) {
+        printf("FAIL: %llu listener calls for %llu events\n", (unsigned long long)calls, (unsigned long long)events);
+        exit(1);
+    }
+
+    return events / (aMillis / 1000.0);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    uint32_t millis = argc > 1 ? (uint32_t)atoi(argv[1]) : 1000;
+    if(millis == 0)
+        millis = 1;
+
+    static const size_t threads[] = { 1, 2, 4, 8, 16 };
+
+    printf("%-8s %-6s %14s %14s\n", "threads", "churn", "locked ev/s", "snapshot ev/s");
+    for(int churn = 0; churn < 2; ++churn) {
+        for(size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); ++i) {
+            double locked = bench<LockedSpeaker>(threads[i], churn != 0, millis);
+            double snapshot = bench<SnapshotSpeaker>(threads[i], churn != 0, millis);
+            printf("%-8u %-6s %14.0f %14.0f\n", (unsigned)threads[i], churn ? "yes" : "no", locked, snapshot);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Time per NMDC command of Text::convert() against the old one, which opened
+ * an iconv descriptor for every call. Commands from the hub are converted as
+ * NmdcHub::toUtf8() does, only when they aren't valid UTF-8 already; "out"
+ * converts the UTF-8 version back into the hub charset, as everything sent
+ * is. Both versions have to come up with the same text.
+ *
+ * The traffic is read from a file, as captured from the hub connection (the
+ * commands separated by '|'). Without one a session is made up: the login,
+ * a burst of $MyINFO, then searches, chat and connection requests in about
+ * the proportions a busy hub sends them, with a third of the users writing
+ * in the charset.
+ *
+ * Usage: text-bench [iterations] [capture] [charset]
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/Text.h"
+#include "dcpp/Util.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iconv.h>
+#include <sstream>
+
+#ifndef ICONV_CONST
+ #define ICONV_CONST
+#endif
+
+using namespace dcpp;
+
+namespace {
+
+uint32_t seed = 1;
+int failures = 0;
+
+/** Keeps the compiler from dropping the conversions */
+volatile size_t sink;
+
+uint32_t rnd(uint32_t aMax) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % aMax;
+}
+
+/** Text::convert() as it was */
+const string& refConvert(const string& str, string& tmp, const string& fromCharset, const string& toCharset) {
+    if(str.empty())
+        return str;
+
+    iconv_t cd = iconv_open(toCharset.c_str(), fromCharset.c_str());
+    if(cd == (iconv_t)-1)
+        return str;
+
+    size_t rv;
+    size_t len = str.length() * 2; // optimization
+    size_t inleft = str.length();
+    size_t outleft = len;
+    tmp.resize(len);
+    const char *inbuf = str.data();
+    char *outbuf = (char *)tmp.data();
+
+    while(inleft > 0) {
+        rv = iconv(cd, (ICONV_CONST char **)&inbuf, &inleft, &outbuf, &outleft);
+        if(rv == (size_t)-1) {
+            size_t used = outbuf - tmp.data();
+            if(errno == E2BIG) {
+                len *= 2;
+                tmp.resize(len);
+                outbuf = (char *)tmp.data() + used;
+                outleft = len - used;
+            } else if(errno == EILSEQ) {
+                ++inbuf;
+                --inleft;
+                tmp[used] = '_';
+            } else {
+                tmp.replace(used, inleft, string(inleft, '_'));
+                inleft = 0;
+            }
+        }
+    }
+    iconv_close(cd);
+    if(outleft > 0) {
+        tmp.resize(len - outleft);
+    }
+    return tmp;
+}
+
+/** A word in the Cyrillic part of CP1251 and the like */
+string localWord() {
+    string w;
+    for(uint32_t n = 3 + rnd(6); n > 0; --n)
+        w += (char)(0xC0 + rnd(64));
+    return w;
+}
+
+string asciiWord() {
+    static const char* const words[] = { "the", "movie", "album", "live", "remix", "season", "final", "ubuntu",
+        "flac", "mp3", "hello", "anyone", "have", "new", "best", "of", "2012", "hd", "rip", "part" };
+    return words[rnd(sizeof(words) / sizeof(words[0]))];
+}
+
+string words(bool aLocal, uint32_t aCount) {
+    string s;
+    for(uint32_t i = 0; i < aCount; ++i) {
+        if(i > 0)
+            s += ' ';
+        s += (aLocal && rnd(3) != 0) ? localWord() : asciiWord();
+    }
+    return s;
+}
+
+string makeSession(size_t aUsers, size_t aCommands) {
+    vector<string> nicks;
+    vector<bool> local;
+    for(size_t i = 0; i < aUsers; ++i) {
+        local.push_back(rnd(3) == 0);
+        nicks.push_back((local.back() ? localWord() : asciiWord() + "_" + asciiWord()) + Util::toString(rnd(100)));
+    }
+
+    string s = "$Lock EXTENDEDPROTOCOL_verlihub Pk=version0.9.8e-r2|$HubName " + words(true, 3) +
+        "|$Supports UserCommand NoGetINFO NoHello UserIP2 TTHSearch ZPipe0 |$Hello " + nicks[0] + "|";
+
+    for(size_t i = 0; i < aUsers; ++i) {
+        s += "$MyINFO $ALL " + nicks[i] + " " + words(local[i], rnd(5)) + "<EiskaltDC++ V:2.2.6,M:A,H:" +
+            Util::toString(1 + rnd(5)) + "/0/0,S:" + Util::toString(1 + rnd(10)) + ">$ $100\x01$$" +
+            Util::toString((uint64_t)rnd(1000000) * 1000000) + "$|";
+    }
+
+    for(size_t i = 0; i < aCommands; ++i) {
+        size_t u = rnd(aUsers);
+        uint32_t kind = rnd(20);
+        if(kind < 12) {
+            s += "$Search " + Util::toString(rnd(256)) + ".1.2.3:412 F?T?0?1?" + words(local[u], 1 + rnd(3)) + "|";
+        } else if(kind < 15) {
+            s += "$Search Hub:" + nicks[u] + " F?T?0?9?TTH:LWPNACQDBZRYXW3VHJVCJ64QBZNGHOHHHZWCLNQ|";
+        } else if(kind < 18) {
+            s += "<" + nicks[u] + "> " + words(local[u], 2 + rnd(12)) + "|";
+        } else if(kind < 19) {
+            s += "$ConnectToMe " + nicks[0] + " 10.0.0." + Util::toString(rnd(256)) + ":" + Util::toString(1024 + rnd(60000)) + "|";
+        } else {
+            s += "$Quit " + nicks[u] + "|";
+        }
+    }
+    return s;
+}
+
+double nanoseconds(std::chrono::steady_clock::time_point aStart, size_t aCount) {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - aStart).count() / aCount;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    size_t iterations = argc > 1 ? (size_t)atol(argv[1]) : 5;
+    string charset = argc > 3 ? argv[3] : "CP1251";
+    if(iterations == 0)
+        iterations = 1;
+
+    string traffic;
+    if(argc > 2) {
+        std::ifstream f(argv[2], std::ios::binary);
+        std::stringstream ss;
+        ss << f.rdbuf();
+        traffic = ss.str();
+        if(traffic.empty()) {
+            printf("Can't read %s\n", argv[2]);
+            return 1;
+        }
+    } else {
+        traffic = makeSession(2000, 20000);
+    }
+
+    StringList in, out;
+    for(string::size_type i = 0, j; i < traffic.size(); i = j + 1) {
+        j = traffic.find('|', i);
+        if(j == string::npos)
+            j = traffic.size();
+        if(j > i)
+            in.push_back(traffic.substr(i, j - i));
+    }
+
+    size_t converted = 0;
+    string tmp, refTmp;
+    for(auto i = in.begin(); i != in.end(); ++i) {
+        const string& utf8 = Text::validateUtf8(*i) ? *i : Text::toUtf8(*i, charset, tmp);
+        if(&utf8 != &*i)
+            converted++;
+        if(utf8 != (Text::validateUtf8(*i) ? *i : refConvert(*i, refTmp, charset, Text::utf8)))
+            failures++;
+        out.push_back(utf8);
+
+        if(Text::fromUtf8(out.back(), charset, tmp) != refConvert(out.back(), refTmp, Text::utf8, charset))
+            failures++;
+    }
+
+    printf("%llu commands, %llu of them not UTF-8, %d mismatches\n", (unsigned long long)in.size(),
+        (unsigned long long)converted, failures);
+
+    printf("%-6s %10s %10s\n", "", "old ns", "new ns");
+    for(int dir = 0; dir < 2; ++dir) {
+        const StringList& lines = dir == 0 ? in : out;
+        const string& from = dir == 0 ? charset : Text::utf8;
+        const string& to = dir == 0 ? Text::utf8 : charset;
+
+        auto start = std::chrono::steady_clock::now();
+        for(size_t n = 0; n < iterations; ++n) {
+            for(auto i = lines.begin(); i != lines.end(); ++i) {
+                if(dir == 0 && Text::validateUtf8(*i))
+                    sink = i->size();
+                else
+                    sink = refConvert(*i, tmp, from, to).size();
+            }
+        }
+        double old = nanoseconds(start, iterations * lines.size());
+
+        start = std::chrono::steady_clock::now();
+        for(size_t n = 0; n < iterations; ++n) {
+            for(auto i = lines.begin(); i != lines.end(); ++i) {
+                if(dir == 0 && Text::validateUtf8(*i))
+                    sink = i->size();
+                else
+                    sink = Text::convert(*i, tmp, from, to).size();
+            }
+        }
+        double cur = nanoseconds(start, iterations * lines.size());
+
+        printf("%-6s %10.0f %10.0f\n", dir == 0 ? "in" : "out", old, cur);
+    }
+
+    return failures == 0 ? 0 : 1;
+}
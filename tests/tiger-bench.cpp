@@ -0,0 +1,86 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Leaf hashing throughput of TigerHash::hashLeaves() against hashing the
+ * same 1 KiB leaves one by one with the scalar TigerHash.
+ *
+ * Usage: tiger-bench [MiB]
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/TigerHash.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace dcpp;
+
+namespace {
+
+const size_t LEAF = 1024;
+
+/** Keeps the compiler from dropping the hashing */
+volatile uint8_t sink;
+
+double seconds(std::chrono::steady_clock::time_point aStart) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - aStart).count();
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    size_t mib = argc > 1 ? (size_t)atoi(argv[1]) : 256;
+    if(mib == 0)
+        mib = 1;
+
+    // Hashed a few times over so that it stays in memory but not in the cache
+    const size_t chunk = 16 * 1024 * 1024;
+    vector<uint8_t> data(chunk);
+    for(size_t i = 0; i < data.size(); ++i)
+        data[i] = (uint8_t)(i * 131 + (i >> 10));
+
+    const size_t leaves = chunk / LEAF;
+    const size_t rounds = (mib * 1024 * 1024 + chunk - 1) / chunk;
+    vector<uint8_t> out(leaves * TigerHash::BYTES);
+
+    auto start = std::chrono::steady_clock::now();
+    for(size_t r = 0; r < rounds; ++r) {
+        for(size_t i = 0; i < leaves; ++i) {
+            uint8_t zero = 0;
+            TigerHash h;
+            h.update(&zero, 1);
+            h.update(&data[i * LEAF], LEAF);
+            memcpy(&out[i * TigerHash::BYTES], h.finalize(), TigerHash::BYTES);
+        }
+        sink = out[r % out.size()];
+    }
+    double scalar = seconds(start);
+
+    start = std::chrono::steady_clock::now();
+    for(size_t r = 0; r < rounds; ++r) {
+        TigerHash::hashLeaves(&data[0], LEAF, leaves, &out[0]);
+        sink = out[r % out.size()];
+    }
+    double multi = seconds(start);
+
+    double total = (double)(rounds * chunk) / (1024 * 1024);
+    printf("scalar:     %8.1f MiB/s\n", total / scalar);
+    printf("hashLeaves: %8.1f MiB/s (%.2fx)\n", total / multi, scalar / multi);
+    return 0;
+}
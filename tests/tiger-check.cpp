@@ -0,0 +1,104 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Checks that TigerHash::hashLeaves() gives exactly the leaf hashes of the
+ * scalar TigerHash, for the leaf sizes and counts that take the different
+ * block, padding and lane paths of the multi-buffer kernel.
+ */
+
+#include "dcpp/stdinc.h"
+#include "dcpp/TigerHash.h"
+
+#include <cstdio>
+#include <cstring>
+
+using namespace dcpp;
+
+namespace {
+
+int failures = 0;
+
+void check(bool aOk, const char* aWhat, size_t aLeafSize, size_t aCount) {
+    if(!aOk) {
+        printf("FAIL: \"%s\" (leaf size %u, count %u)\n", aWhat, (unsigned)aLeafSize, (unsigned)aCount);
+        failures++;
+    }
+}
+
+/** Compares the digest with the reference values, given as hex bytes */
+void checkVector(const char* aData, const char* aHex) {
+    TigerHash h;
+    h.update(aData, strlen(aData));
+    const uint8_t* res = h.finalize();
+    char hex[TigerHash::BYTES * 2 + 1];
+    for(size_t i = 0; i < TigerHash::BYTES; ++i)
+        sprintf(hex + i * 2, "%02X", res[i]);
+    check(strcmp(hex, aHex) == 0, aData, strlen(aData), 1);
+}
+
+void scalarLeaf(const uint8_t* aLeaf, size_t aLeafSize, uint8_t* aOut) {
+    uint8_t zero = 0;
+    TigerHash h;
+    h.update(&zero, 1);
+    h.update(aLeaf, aLeafSize);
+    memcpy(aOut, h.finalize(), TigerHash::BYTES);
+}
+
+} // namespace
+
+int main() {
+    checkVector("", "3293AC630C13F0245F92BBB1766E16167A4E58492DDE73F3");
+    checkVector("abc", "2AAB1484E8C158F2BFB8C5FF41B57A525129131C957B5F93");
+
+#ifdef __x86_64__
+    printf("AVX2 kernel: %s\n", __builtin_cpu_supports("avx2") ? "yes" : "no");
+#endif
+
+    // Sizes around the block and padding edges, and the usual tree leaves
+    static const size_t sizes[] = { 0, 1, 54, 55, 56, 62, 63, 64, 65, 118, 119, 127, 128, 1000, 1024, 4096, 65536 };
+    static const size_t counts[] = { 1, 3, 4, 5, 8, 11 };
+
+    uint32_t seed = 12345;
+    for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        for(size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+            size_t leafSize = sizes[s], count = counts[c];
+
+            vector<uint8_t> data(leafSize * count + 1);
+            for(size_t i = 0; i < data.size(); ++i) {
+                seed = seed * 1103515245 + 12345;
+                data[i] = (uint8_t)(seed >> 16);
+            }
+
+            vector<uint8_t> expected(count * TigerHash::BYTES), got(count * TigerHash::BYTES);
+            for(size_t i = 0; i < count; ++i)
+                scalarLeaf(&data[i * leafSize], leafSize, &expected[i * TigerHash::BYTES]);
+
+            TigerHash::hashLeaves(&data[0], leafSize, count, &got[0]);
+            check(got == expected, "hashLeaves", leafSize, count);
+
+            // Unaligned input
+            TigerHash::hashLeaves(&data[1], leafSize, count, &got[0]);
+            for(size_t i = 0; i < count; ++i)
+                scalarLeaf(&data[1 + i * leafSize], leafSize, &expected[i * TigerHash::BYTES]);
+            check(got == expected, "hashLeaves, unaligned", leafSize, count);
+        }
+    }
+
+    if(failures == 0)
+        printf("All Tiger leaf hashes match\n");
+    return failures == 0 ? 0 : 1;
+}